@@ -0,0 +1,137 @@
+// bench_base64.cc
+// base64 codec microbenchmark: a per-character find()/append codec (the
+// previous WebServer implementation) against the nvjBase64.h scalar and
+// dispatched (AVX2 when available) versions. The versions are checked
+// against each other before being timed.
+#include "libnavajo/nvjBase64.h"
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+static const std::string chars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static std::string appendEncode(const unsigned char *src, size_t len)
+{
+    std::string ret;
+    size_t i = 0;
+    for (; i + 3 <= len; i += 3) {
+        ret += chars[src[i] >> 2];
+        ret += chars[((src[i] & 0x03) << 4) | (src[i+1] >> 4)];
+        ret += chars[((src[i+1] & 0x0f) << 2) | (src[i+2] >> 6)];
+        ret += chars[src[i+2] & 0x3f];
+    }
+    if (i < len) {
+        unsigned char b1 = i + 1 < len ? src[i+1] : 0;
+        ret += chars[src[i] >> 2];
+        ret += chars[((src[i] & 0x03) << 4) | (b1 >> 4)];
+        ret += i + 1 < len ? chars[(b1 & 0x0f) << 2] : '=';
+        ret += '=';
+    }
+    return ret;
+}
+
+static std::string appendDecode(const std::string& in)
+{
+    std::string ret;
+    unsigned v = 0, n = 0;
+    for (size_t i = 0; i < in.size() && in[i] != '='; i++) {
+        size_t c = chars.find(in[i]);
+        if (c == std::string::npos) break;
+        v = (v << 6) | (unsigned)c;
+        if (++n == 4) { ret += (char)(v >> 16); ret += (char)(v >> 8); ret += (char)v; v = 0; n = 0; }
+    }
+    if (n >= 2) { v <<= 6 * (4 - n); ret += (char)(v >> 16); if (n == 3) ret += (char)(v >> 8); }
+    return ret;
+}
+
+// the scalar, dispatched and AVX2 codecs give the same output, and the
+// decoding gives back the input
+static bool crossCheck(const std::vector<unsigned char>& data, bool url, bool pad)
+{
+    size_t size = data.size();
+    std::vector<char> scalar(nvj_base64_encoded_size(size, pad)), other(scalar.size());
+    size_t len = nvj_base64_encode_scalar(data.data(), size, scalar.data(), url, pad);
+    if (len != scalar.size()
+        || nvj_base64_encode(data.data(), size, other.data(), url, pad) != len
+        || memcmp(scalar.data(), other.data(), len) != 0)
+        return false;
+    if (!url && pad && std::string(scalar.begin(), scalar.end()) != appendEncode(data.data(), size))
+        return false;
+#ifdef NVJ_BASE64_X86
+    if (nvj_base64_has_avx2()
+        && (nvj_base64_encode_avx2(data.data(), size, other.data(), url, pad) != len
+            || memcmp(scalar.data(), other.data(), len) != 0))
+        return false;
+#endif
+    if (url)
+        return true; // the decoders take the standard alphabet only
+
+    std::vector<unsigned char> dec(nvj_base64_decoded_max_size(len));
+    if (nvj_base64_decode_scalar(scalar.data(), len, dec.data()) != size || memcmp(dec.data(), data.data(), size) != 0)
+        return false;
+    memset(dec.data(), 0, dec.size());
+    if (nvj_base64_decode(scalar.data(), len, dec.data()) != size || memcmp(dec.data(), data.data(), size) != 0)
+        return false;
+#ifdef NVJ_BASE64_X86
+    memset(dec.data(), 0, dec.size());
+    if (nvj_base64_has_avx2()
+        && (nvj_base64_decode_avx2(scalar.data(), len, dec.data()) != size || memcmp(dec.data(), data.data(), size) != 0))
+        return false;
+#endif
+    return true;
+}
+
+template <typename F>
+static void run(const char *name, size_t size, size_t iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t check = 0;
+    for (size_t i = 0; i < iterations; i++)
+        check += f();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << name << ": " << (size * iterations / s / 1e6) << " MB/s"
+              << " (" << (s * 1e9 / iterations) << " ns/op, check " << check << ")" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t total = argc > 1 ? atol(argv[1]) : 200000000; // bytes processed per test
+
+#ifdef NVJ_BASE64_X86
+    std::cout << "AVX2: " << (nvj_base64_has_avx2() ? "yes" : "no") << std::endl;
+#endif
+
+    for (size_t size = 0; size <= 1024; size++) {
+        std::vector<unsigned char> data(size);
+        for (size_t i = 0; i < size; i++) data[i] = (unsigned char)rand();
+        for (int variant = 0; variant < 4; variant++)
+            if (!crossCheck(data, variant & 1, variant & 2)) {
+                std::cerr << "codecs mismatch: " << size << " bytes, url=" << (variant & 1)
+                          << " pad=" << ((variant & 2) >> 1) << std::endl;
+                return 1;
+            }
+    }
+    std::cout << "codecs cross-check: ok" << std::endl;
+
+    // 20: WebSocket accept key, 48: Basic credentials, then larger payloads
+    const size_t sizes[] = { 20, 48, 256, 4096, 65536 };
+    for (size_t size : sizes) {
+        std::vector<unsigned char> data(size);
+        for (size_t i = 0; i < size; i++) data[i] = (unsigned char)rand();
+        std::string encoded = nvj_base64_encode(data.data(), size);
+        std::vector<char> out(nvj_base64_encoded_size(size));
+        std::vector<unsigned char> dec(nvj_base64_decoded_max_size(encoded.size()));
+        size_t iterations = total / size;
+
+        std::cout << size << " bytes" << std::endl;
+        run("encode append  ", size, iterations, [&] { return appendEncode(data.data(), size).size(); });
+        run("encode scalar  ", size, iterations, [&] { return nvj_base64_encode_scalar(data.data(), size, out.data()); });
+        run("encode dispatch", size, iterations, [&] { return nvj_base64_encode(data.data(), size, out.data()); });
+        run("decode append  ", size, iterations, [&] { return appendDecode(encoded).size(); });
+        run("decode scalar  ", size, iterations, [&] { return nvj_base64_decode_scalar(encoded.data(), encoded.size(), dec.data()); });
+        run("decode dispatch", size, iterations, [&] { return nvj_base64_decode(encoded.data(), encoded.size(), dec.data()); });
+    }
+    return 0;
+}
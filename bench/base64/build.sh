@@ -0,0 +1,2 @@
+#!/bin/sh
+g++ -O3 -DNDEBUG -std=c++17 -I../../include bench_base64.cc -o bench_base64
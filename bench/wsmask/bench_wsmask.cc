@@ -0,0 +1,77 @@
+// bench_wsmask.cc
+// WebSocket payload unmasking microbenchmark: the byte loop with a modulo
+// (the previous WebSocketClient implementation) against the
+// nvjWebSocketMask.h scalar and dispatched (SSE2/AVX2) versions. The
+// results are first checked against the byte loop for every alignment,
+// payload offset and length up to 300 bytes.
+#include "libnavajo/nvjWebSocketMask.h"
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+static void byteLoop(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char key[4], size_t offset)
+{
+    for (size_t i = 0; i < len; i++)
+        dst[i] = src[i] ^ key[(offset + i) % 4];
+}
+
+static bool check()
+{
+    const unsigned char key[4] = { 0x12, 0x34, 0x56, 0x78 };
+    std::vector<unsigned char> src(400), ref(400), out(400 + 64);
+    for (size_t i = 0; i < src.size(); i++) src[i] = (unsigned char)rand();
+    for (size_t align = 0; align < 32; align++)
+        for (size_t offset = 0; offset < 4; offset++)
+            for (size_t len = 0; len <= 300; len++) {
+                byteLoop(ref.data(), src.data(), len, key, offset);
+                nvj_ws_unmask(out.data() + align, src.data(), len, key, offset);
+                if (memcmp(ref.data(), out.data() + align, len) != 0) return false;
+                // in place
+                memcpy(out.data() + align, src.data(), len);
+                nvj_ws_unmask(out.data() + align, out.data() + align, len, key, offset);
+                if (memcmp(ref.data(), out.data() + align, len) != 0) return false;
+            }
+    return true;
+}
+
+template <typename F>
+static void run(const char *name, size_t size, size_t iterations, F f)
+{
+    auto start = std::chrono::steady_clock::now();
+    size_t check = 0;
+    for (size_t i = 0; i < iterations; i++)
+        check += f();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "  " << name << ": " << (size * iterations / s / 1e6) << " MB/s"
+              << " (" << (s * 1e9 / iterations) << " ns/op, check " << check << ")" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t total = argc > 1 ? atol(argv[1]) : 2000000000; // bytes processed per test
+
+    if (!check()) {
+        std::cout << "unmasking mismatch" << std::endl;
+        return 1;
+    }
+
+#ifdef NVJ_WEBSOCKET_MASK_X86
+    std::cout << "AVX2: " << (__builtin_cpu_supports("avx2") ? "yes" : "no") << std::endl;
+#endif
+
+    const unsigned char key[4] = { 0x37, 0xfa, 0x21, 0x3d };
+    // chat message, then sensor frames
+    const size_t sizes[] = { 64, 256, 1024, 65536, 1048576 };
+    for (size_t size : sizes) {
+        std::vector<unsigned char> data(size), out(size);
+        for (size_t i = 0; i < size; i++) data[i] = (unsigned char)rand();
+        size_t iterations = total / size;
+
+        std::cout << size << " bytes" << std::endl;
+        run("byte loop", size, iterations, [&] { byteLoop(out.data(), data.data(), size, key, 1); return out[size / 2]; });
+        run("scalar   ", size, iterations, [&] { nvj_ws_unmask_scalar(out.data(), data.data(), size, nvj_ws_mask_key(key, 1)); return out[size / 2]; });
+        run("dispatch ", size, iterations, [&] { nvj_ws_unmask(out.data(), data.data(), size, key, 1); return out[size / 2]; });
+    }
+    return 0;
+}
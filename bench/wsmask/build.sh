@@ -0,0 +1,2 @@
+#!/bin/sh
+g++ -O3 -DNDEBUG -std=c++17 -I../../include bench_wsmask.cc -o bench_wsmask
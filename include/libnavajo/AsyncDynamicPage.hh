@@ -0,0 +1,146 @@
+//********************************************************
+/**
+ * @file  AsyncDynamicPage.hh
+ *
+ * @brief Asynchronous dynamic page définition (abstract class)
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef ASYNCDYNAMICPAGE_HH_
+#define ASYNCDYNAMICPAGE_HH_
+
+#include <string>
+#include <pthread.h>
+
+#include "libnavajo/HttpRequest.hh"
+#include "libnavajo/HttpResponse.hh"
+#include "libnavajo/DynamicPage.hh"
+#include "libnavajo/AsyncExecutor.hh"
+
+class WebServer;
+
+/**
+* HttpAsyncCompletion - completion handle of an asynchronous request.
+* The worker thread which received the request is released as soon as
+* getPageAsync() returns; the response is sent when complete() is called,
+* from any thread, or when the timeout expires.
+*/
+class HttpAsyncCompletion
+{
+    friend class WebServer;
+    friend class AsyncDynamicPage;
+
+    pthread_mutex_t mutex;
+    unsigned refCount;
+    bool armed, completed, sent, timedOut;
+    WebServer *webServer;
+    ClientSockData *client;
+    bool keepAlive;
+    std::string sessionId;
+    HttpResponse response;
+    AsyncExecutor::TimerId timerId;
+    unsigned timeoutHttpCode;
+
+    HttpAsyncCompletion(ClientSockData *c, const HttpResponse& r): refCount(2), armed(false), completed(false), sent(false), timedOut(false),
+                                                                   webServer(NULL), client(c), keepAlive(false), response(r),
+                                                                   timerId(0), timeoutHttpCode(204)
+    {
+      pthread_mutex_init(&mutex, NULL);
+    };
+
+    ~HttpAsyncCompletion()
+    {
+      unsigned char *content=NULL; size_t length=0; bool zip=false;
+      response.getContent(&content, &length, &zip);
+      if (content != NULL)
+        ::free(content);
+      pthread_mutex_destroy(&mutex);
+    };
+
+    void retain()
+    {
+      pthread_mutex_lock(&mutex);
+      refCount++;
+      pthread_mutex_unlock(&mutex);
+    };
+
+    void release()
+    {
+      pthread_mutex_lock(&mutex);
+      bool last = --refCount == 0;
+      pthread_mutex_unlock(&mutex);
+      if (last) delete this;
+    };
+
+    void arm(WebServer *server, const bool keepAlive, const std::string& sessionId);
+    void onTimeout();
+
+  public:
+
+    /**
+    * get the response to fill before calling complete()
+    * @return the response which will be sent
+    */
+    inline HttpResponse *getResponse() { return &response; };
+
+    /**
+    * Send a status-only response if complete() has not been called before
+    * the delay. complete() must still be called afterwards to release the handle.
+    * @param ms: the delay in milliseconds
+    * @param httpCode: the http return code sent on timeout (Default value: 204)
+    */
+    void setTimeout(const unsigned ms, const unsigned httpCode=204);
+
+    /**
+    * Send the response and release the handle. Must be called exactly once,
+    * the handle can't be used afterwards.
+    */
+    void complete();
+};
+
+/**
+* AsyncDynamicPage - dynamic page whose response is produced later.
+* The request is only valid during the getPageAsync() call: copy the
+* parameters you need before handing the work to another thread.
+*/
+class AsyncDynamicPage : public DynamicPage
+{
+  public:
+    using DynamicPage::fromString;
+
+    /**
+    * Start processing the request
+    * @param request: the http request, valid during this call only
+    * @param response: the response to fill, the same as completion->getResponse()
+    * @param completion: the handle to complete once the response is ready
+    */
+    virtual void getPageAsync(HttpRequest* request, HttpResponse *response, HttpAsyncCompletion* completion) = 0;
+
+    /**
+    * Inherited from DynamicPage: create the completion handle and start the request
+    */
+    bool getPage(HttpRequest* request, HttpResponse *response)
+    {
+      HttpAsyncCompletion *completion = new HttpAsyncCompletion(request->getClientSockData(), *response);
+      response->setAsyncCompletion(completion);
+      getPageAsync(request, completion->getResponse(), completion);
+      return true;
+    };
+
+    /**
+    * Fill the response with a string, like fromString() does for synchronous pages
+    * @param resultat: the content
+    * @param completion: the completion handle
+    */
+    inline bool fromString( const std::string& resultat, HttpAsyncCompletion* completion )
+    {
+      return DynamicPage::fromString( resultat, completion->getResponse() );
+    }
+};
+
+#endif
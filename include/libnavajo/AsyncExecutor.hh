@@ -0,0 +1,135 @@
+//********************************************************
+/**
+ * @file  AsyncExecutor.hh
+ *
+ * @brief Shared executor and timer used to complete
+ *        asynchronous requests outside the WebServer pool
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef ASYNCEXECUTOR_HH_
+#define ASYNCEXECUTOR_HH_
+
+#include <functional>
+#include <map>
+#include <queue>
+#include <vector>
+#include <utility>
+
+#include "libnavajo/nvjThread.h"
+
+  /**
+  * AsyncExecutor - a small pool of threads plus a timer, shared by
+  * the whole process. Tasks must not block for long: they run on a
+  * handful of threads shared by every asynchronous page.
+  */
+  class AsyncExecutor
+  {
+    public:
+      typedef std::function<void()> Task;
+      typedef unsigned long long TimerId;
+
+      /**
+      * getInstance - return/create the static executor object
+      * \return theAsyncExecutor - the static executor
+      */
+      inline static AsyncExecutor *getInstance()
+      {
+        static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_mutex_lock(&init_mutex);
+        if (theAsyncExecutor == NULL)
+          theAsyncExecutor = new AsyncExecutor;
+        pthread_mutex_unlock(&init_mutex);
+        return theAsyncExecutor;
+      };
+
+      /**
+      * freeInstance - stop the threads and free the static executor object.
+      * Pending tasks and timers are dropped.
+      */
+      static void freeInstance()
+      {
+        if (theAsyncExecutor != NULL)
+          delete theAsyncExecutor;
+
+        theAsyncExecutor=NULL;
+      }
+
+      /**
+      * Set the number of worker threads. Ignored once the executor is started.
+      * @param nbThread: the number of threads (Default value: 4)
+      */
+      void setThreadsPoolSize(const size_t nbThread);
+
+      /**
+      * Run a task as soon as a worker thread is available
+      * @param task: the task to run
+      * \return false if the executor is exiting: the task won't run
+      */
+      bool post(const Task& task);
+
+      /**
+      * Run a task after a delay
+      * @param delayMs: the delay in milliseconds
+      * @param task: the task to run
+      * \return the timer id, to be used with cancel(), or 0 if the executor
+      *         is exiting: the task won't run
+      */
+      TimerId postDelayed(const unsigned delayMs, const Task& task);
+
+      /**
+      * Cancel a delayed task
+      * @param id: the timer id returned by postDelayed()
+      * \return true if the task has been cancelled before being run
+      */
+      bool cancel(const TimerId id);
+
+    protected:
+
+      AsyncExecutor();
+      ~AsyncExecutor();
+
+      static AsyncExecutor *theAsyncExecutor;
+
+    private:
+
+      typedef std::pair<unsigned long long, TimerId> TimerKey; // deadline (ms), id
+
+      pthread_mutex_t executor_mutex;
+      pthread_cond_t tasks_cond;
+      pthread_cond_t timers_cond;
+      std::queue<Task> tasks;
+      std::map<TimerKey, Task> timers;
+      std::map<TimerId, unsigned long long> timersDeadline;
+      TimerId lastTimerId;
+      size_t threadsPoolSize;
+      std::vector<pthread_t> workerThreads;
+      pthread_t timerThread;
+      bool started;
+      bool exiting;
+
+      void start();
+      void workerThreadProcessing();
+      void timerThreadProcessing();
+
+      inline static void *startWorkerThread(void *t)
+      {
+        static_cast<AsyncExecutor *>(t)->workerThreadProcessing();
+        pthread_exit(NULL);
+        return NULL;
+      };
+
+      inline static void *startTimerThread(void *t)
+      {
+        static_cast<AsyncExecutor *>(t)->timerThreadProcessing();
+        pthread_exit(NULL);
+        return NULL;
+      };
+  };
+
+#endif
@@ -0,0 +1,136 @@
+//********************************************************
+/**
+ * @file  BearerTokenCache.hh
+ *
+ * @brief Cache of the verified bearer tokens, sharded and
+ *        bounded, with coalesced verifications
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef BEARERTOKENCACHE_HH_
+#define BEARERTOKENCACHE_HH_
+
+#include <ctime>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+
+struct JwtClaims;
+
+#define BEARERTOKENCACHE_NB_SHARDS 16
+#define BEARERTOKENCACHE_DEFAULT_MAX_ENTRIES 65536
+
+/**
+* BearerTokenVerification - the result of a token verification
+*/
+struct BearerTokenVerification
+{
+  bool valid;
+  std::string decoded;      // the token decoded, given to the scopes check
+  std::shared_ptr<const JwtClaims> claims; // the claims, when verified by a JwtVerifier
+  time_t expiration;        // the token is kept in the cache until this time
+  std::string error;        // when invalid: the WWW-Authenticate error attributes
+  std::string logMessage;   // when invalid: why
+
+  BearerTokenVerification(): valid(false), expiration(0) { };
+};
+
+/***********************************************************************
+ * BearerTokenCache - the tokens successfully verified, until they
+ * expire. The tokens are spread over independently locked shards, each
+ * one bounded: the tokens expiring first are evicted first.
+ * The verification runs outside any lock, and the requests presenting
+ * a token while it is verified wait for that verification instead of
+ * running their own.
+ */
+
+class BearerTokenCache
+{
+  public:
+
+    typedef std::function<void (const std::string& token, BearerTokenVerification& result)> Verifier;
+
+    /**
+    * @param maxEntries: the maximum number of tokens kept
+    */
+    BearerTokenCache(const size_t maxEntries = BEARERTOKENCACHE_DEFAULT_MAX_ENTRIES);
+    ~BearerTokenCache();
+
+    /**
+    * Get the verification of a token, from the cache or by calling verify()
+    * @param token: the token
+    * @param now: the current time
+    * @param verify: the verification function, called without lock held
+    * @param result: set to the verification
+    * \return true if the result was found in the cache (or computed by a concurrent request)
+    */
+    bool get(const std::string& token, const time_t now, const Verifier& verify, BearerTokenVerification& result);
+
+    /**
+    * Remove a token (if found)
+    */
+    void remove(const std::string& token);
+
+    /**
+    * Remove every token
+    */
+    void clear();
+
+    /**
+    * Change the maximum number of tokens kept
+    */
+    void setCapacity(const size_t maxEntries);
+
+    /**
+    * The number of tokens kept
+    */
+    size_t size();
+
+  private:
+
+    struct Pending
+    {
+      bool done;
+      BearerTokenVerification result;
+      Pending(): done(false) { };
+    };
+
+    typedef std::multimap<time_t, std::string> ExpiryIndex;
+
+    struct Entry
+    {
+      std::shared_ptr<Pending> pending; // set while the token is verified
+      BearerTokenVerification result;
+      ExpiryIndex::iterator expiryIt;
+    };
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      pthread_cond_t verified;  // signaled when a pending verification completes
+      std::unordered_map<std::string, Entry> entries;
+      ExpiryIndex expiry;       // the cached tokens, earliest expiration first
+    };
+
+    std::vector<Shard> shards;
+    size_t maxEntriesPerShard;
+
+    BearerTokenCache(const BearerTokenCache&);
+    BearerTokenCache& operator=(const BearerTokenCache&);
+
+    inline Shard& shardOf(const std::string& token)
+      { return shards[std::hash<std::string>()(token) % shards.size()]; };
+
+    void evict(Shard& shard, const time_t now);
+};
+
+#endif
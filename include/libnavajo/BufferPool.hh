@@ -0,0 +1,70 @@
+//********************************************************
+/**
+ * @file  BufferPool.hh
+ *
+ * @brief Pool of memory blocks, by size class
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef BUFFERPOOL_HH_
+#define BUFFERPOOL_HH_
+
+#include <stddef.h>
+#include <vector>
+#include <pthread.h>
+
+#define BUFFERPOOL_DEFAULT_MAX_BYTES_PER_CLASS (4*1024*1024)
+
+/***********************************************************************
+ * BufferPool - the blocks released are kept in a free list per size
+ * class (256 bytes to 16KB, by powers of 4) and given back on the next
+ * allocations of that class, instead of going through malloc/free.
+ * A block may be released by another thread than the one which
+ * allocated it. Each class keeps at most maxBytesPerClass; the larger
+ * blocks are not pooled.
+ */
+
+class BufferPool
+{
+  public:
+
+    BufferPool(const size_t maxBytesPerClass = BUFFERPOOL_DEFAULT_MAX_BYTES_PER_CLASS);
+    ~BufferPool();
+
+    /**
+    * Get a block
+    * @param size: the minimum size
+    * @param capacity: set to the size of the block, to give back to release()
+    * \return the block, or NULL if the allocation failed
+    */
+    void *allocate(const size_t size, size_t& capacity);
+
+    /**
+    * Give a block back
+    * @param block: the block
+    * @param capacity: its capacity, as returned by allocate()
+    */
+    void release(void *block, const size_t capacity);
+
+  private:
+
+    struct SizeClass
+    {
+      pthread_mutex_t mutex;
+      size_t size;
+      void *freeList;      // linked through the first bytes of the blocks
+      size_t count, maxCount;
+    };
+
+    std::vector<SizeClass> classes;
+
+    BufferPool(const BufferPool&);
+    BufferPool& operator=(const BufferPool&);
+};
+
+#endif
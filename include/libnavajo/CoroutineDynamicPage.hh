@@ -0,0 +1,241 @@
+//********************************************************
+/**
+ * @file  CoroutineDynamicPage.hh
+ *
+ * @brief C++20 coroutine dynamic page définition (abstract class)
+ *        available when LIBNAVAJO_COROUTINES is defined and the
+ *        compiler supports coroutines (cmake -DLIBNAVAJO_COROUTINES=ON)
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef COROUTINEDYNAMICPAGE_HH_
+#define COROUTINEDYNAMICPAGE_HH_
+
+#if defined(LIBNAVAJO_COROUTINES) && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <type_traits>
+#include <utility>
+
+#include "libnavajo/AsyncDynamicPage.hh"
+#include "libnavajo/LogRecorder.hh"
+
+/**
+* HttpTask - return type of CoroutineDynamicPage::getPageCoroutine().
+* The response is sent when the coroutine returns.
+*/
+class HttpTask
+{
+  public:
+
+    struct promise_type
+    {
+      HttpAsyncCompletion *completion = NULL;
+
+      HttpTask get_return_object() { return HttpTask(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+      // the coroutine is started by CoroutineDynamicPage once the completion is known
+      std::suspend_always initial_suspend() noexcept { return {}; }
+
+      struct FinalAwaiter
+      {
+        bool await_ready() noexcept { return false; }
+        void await_suspend(std::coroutine_handle<promise_type> h) noexcept
+        {
+          HttpAsyncCompletion *completion = h.promise().completion;
+          h.destroy();
+          if (completion != NULL)
+            completion->complete();
+        }
+        void await_resume() noexcept { }
+      };
+
+      FinalAwaiter final_suspend() noexcept { return FinalAwaiter(); }
+
+      void return_void() { }
+
+      void unhandled_exception()
+      {
+        try { throw; }
+        catch (std::exception& e)
+        {
+          NVJ_LOG->append(NVJ_ERROR, std::string("CoroutineDynamicPage: coroutine raised an exception: ") + e.what());
+        }
+        catch (...)
+        {
+          NVJ_LOG->append(NVJ_ERROR, "CoroutineDynamicPage: coroutine raised an unknown exception");
+        }
+
+        if (completion != NULL)
+        {
+          HttpResponse *response = completion->getResponse();
+          unsigned char *content = NULL; size_t length = 0; bool zip = false;
+          response->getContent(&content, &length, &zip);
+          if (content != NULL) ::free(content);
+          response->setContent(NULL, 0);
+          response->setHttpReturnCode(500);
+        }
+      }
+    };
+
+    HttpTask(HttpTask&& t) noexcept : handle(t.handle) { t.handle = NULL; }
+
+    ~HttpTask()
+    {
+      if (handle) handle.destroy();
+    }
+
+    /**
+    * start the coroutine, it runs until its first suspension point
+    * @param completion: the completion handle, completed when the coroutine returns
+    */
+    void start(HttpAsyncCompletion *completion)
+    {
+      std::coroutine_handle<promise_type> h = handle;
+      handle = NULL; // the coroutine frame is destroyed by itself on return
+      h.promise().completion = completion;
+      h.resume();
+    }
+
+  private:
+
+    explicit HttpTask(std::coroutine_handle<promise_type> h): handle(h) { }
+    HttpTask(const HttpTask&) = delete;
+    HttpTask& operator=(const HttpTask&) = delete;
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+/**
+* CoroutineDynamicPage - dynamic page written as a coroutine.
+* The pool thread is released at the first co_await which suspends;
+* the coroutine is then resumed by the AsyncExecutor threads.
+* The request is only valid until the first suspension point, whereas
+* the response remains valid until the coroutine returns. The request
+* body is already read when the coroutine starts (getPayload()).
+*/
+class CoroutineDynamicPage : public AsyncDynamicPage
+{
+  public:
+
+    /**
+    * The page processing
+    * @param request: the http request, valid until the first suspension point
+    * @param response: the response to fill
+    */
+    virtual HttpTask getPageCoroutine(HttpRequest* request, HttpResponse *response) = 0;
+
+    /**
+    * Inherited from AsyncDynamicPage: start the coroutine
+    */
+    void getPageAsync(HttpRequest* request, HttpResponse *response, HttpAsyncCompletion* completion)
+    {
+      getPageCoroutine(request, response).start(completion);
+    };
+
+    /**********************************************************************/
+
+    struct SleepAwaiter
+    {
+      unsigned ms;
+
+      bool await_ready() const noexcept { return ms == 0; }
+      // not suspended if the executor is exiting: the coroutine goes on at once
+      bool await_suspend(std::coroutine_handle<> h)
+      {
+        return AsyncExecutor::getInstance()->postDelayed(ms, [h]() { h.resume(); }) != 0;
+      }
+      void await_resume() const noexcept { }
+    };
+
+    /**
+    * co_await sleepFor(ms): resume the coroutine after a delay,
+    * without holding any thread
+    * @param ms: the delay in milliseconds
+    */
+    static inline SleepAwaiter sleepFor(const unsigned ms) { return SleepAwaiter{ ms }; }
+
+    /**********************************************************************/
+
+    // the result is constructed by the work: T needs no default constructor
+    template<class T> struct OffloadAwaiter
+    {
+      std::function<T()> work;
+      std::optional<T> result;
+      std::exception_ptr error;
+
+      void run()
+      {
+        try { result.emplace(work()); }
+        catch (...) { error = std::current_exception(); }
+      }
+
+      bool await_ready() const noexcept { return false; }
+      // the work runs inline if the executor is exiting
+      bool await_suspend(std::coroutine_handle<> h)
+      {
+        if (AsyncExecutor::getInstance()->post([this, h]() { run(); h.resume(); }))
+          return true;
+        run();
+        return false;
+      }
+      T await_resume()
+      {
+        if (error) std::rethrow_exception(error);
+        return std::move(*result);
+      }
+    };
+
+    struct OffloadVoidAwaiter
+    {
+      std::function<void()> work;
+      std::exception_ptr error;
+
+      void run()
+      {
+        try { work(); }
+        catch (...) { error = std::current_exception(); }
+      }
+
+      bool await_ready() const noexcept { return false; }
+      bool await_suspend(std::coroutine_handle<> h)
+      {
+        if (AsyncExecutor::getInstance()->post([this, h]() { run(); h.resume(); }))
+          return true;
+        run();
+        return false;
+      }
+      void await_resume()
+      {
+        if (error) std::rethrow_exception(error);
+      }
+    };
+
+    /**
+    * co_await offload(work): run work on an AsyncExecutor thread and
+    * resume the coroutine with its result (returned by value, it needs only
+    * be movable). Exceptions are rethrown to the coroutine.
+    * @param work: a callable
+    */
+    template<class F>
+    static inline auto offload(F work)
+    {
+      typedef typename std::decay<typename std::invoke_result<F>::type>::type T;
+      if constexpr (std::is_void<T>::value)
+        return OffloadVoidAwaiter{ std::function<void()>(std::move(work)), NULL };
+      else
+        return OffloadAwaiter<T>{ std::function<T()>(std::move(work)), std::nullopt, NULL };
+    }
+};
+
+#endif
+
+#endif
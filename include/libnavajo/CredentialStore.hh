@@ -0,0 +1,166 @@
+//********************************************************
+/**
+ * @file  CredentialStore.hh
+ *
+ * @brief Logins and salted password hashes for the HTTP
+ *        Basic authentication
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef CREDENTIALSTORE_HH_
+#define CREDENTIALSTORE_HH_
+
+#include <atomic>
+#include <ctime>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <pthread.h>
+
+#define CREDENTIALSTORE_PBKDF2_ITERATIONS 10000
+#define CREDENTIALSTORE_SALT_SIZE 16
+#define CREDENTIALSTORE_HASH_SIZE 32                 // PBKDF2-HMAC-SHA256
+#define CREDENTIALSTORE_DEFAULT_CACHE_CAPACITY 1024
+#define CREDENTIALSTORE_DEFAULT_CACHE_LIFETIME 600    // seconds
+#define CREDENTIALSTORE_FAILED_CACHE_CAPACITY 1024
+#define CREDENTIALSTORE_FAILED_CACHE_LIFETIME 60      // seconds
+#define CREDENTIALSTORE_DEFAULT_MAX_HASHING 4         // concurrent PBKDF2 computations
+
+/***********************************************************************
+ * CredentialStore - the users allowed by the HTTP Basic authentication.
+ * Passwords are only kept as PBKDF2-HMAC-SHA256 hashes with a random
+ * salt, in a hash map keyed by login, and compared in constant time.
+ * As hashing is expensive on purpose, the credentials successfully
+ * verified are cached (LRU, bounded, with a lifetime), keyed by a
+ * SHA-256 digest of the Authorization header value. The rejected ones
+ * are cached too, for a shorter time, and the number of hashings run
+ * at once is limited: beyond it, the credentials are refused without
+ * being checked.
+ * An unknown login is hashed with the iterations count of most users,
+ * so that it can't be told from a known one by the response time.
+ */
+
+class CredentialStore
+{
+  public:
+
+    /**
+    * @param cacheCapacity: the number of verified credentials kept (0 disables the cache)
+    * @param cacheLifeTime: the time (in seconds) a verified credential stays valid in the cache
+    */
+    CredentialStore(const size_t cacheCapacity = CREDENTIALSTORE_DEFAULT_CACHE_CAPACITY,
+                    const time_t cacheLifeTime = CREDENTIALSTORE_DEFAULT_CACHE_LIFETIME);
+    ~CredentialStore();
+
+    /**
+    * Add a user (or change its password)
+    * @param login: the user login
+    * @param password: the password, only its hash is kept
+    * @param iterations: the PBKDF2 iterations count
+    */
+    void addUser(const std::string& login, const std::string& password,
+                 const unsigned iterations = CREDENTIALSTORE_PBKDF2_ITERATIONS);
+
+    /**
+    * Add a user with a password hash generated by hashPassword()
+    * @param login: the user login
+    * @param hash: "pbkdf2-sha256$<iterations>$<base64 salt>$<base64 hash>"
+    * \return false if the hash is malformed
+    */
+    bool addUserHash(const std::string& login, const std::string& hash);
+
+    /**
+    * Hash a password, to be given later to addUserHash()
+    * (avoids keeping the password in clear in a configuration)
+    */
+    static std::string hashPassword(const std::string& password,
+                                    const unsigned iterations = CREDENTIALSTORE_PBKDF2_ITERATIONS);
+
+    void removeUser(const std::string& login);
+    void clear();
+    size_t size();
+    inline bool empty() { return size() == 0; };
+
+    /**
+    * Check a login and a password
+    */
+    bool verify(const std::string& login, const std::string& password);
+
+    /**
+    * Check the credentials of an "Authorization: Basic" header
+    * @param b64: the base64 encoded "login:password"
+    * @param login: set to the login
+    * @param cached: if not NULL, set to true if the credentials were found in the cache
+    * \return true if the user is allowed
+    */
+    bool verifyBasic(const std::string& b64, std::string& login, bool *cached = NULL);
+
+    /**
+    * Change the verified credentials cache parameters
+    */
+    void setCacheCapacity(const size_t capacity, const time_t lifeTime = CREDENTIALSTORE_DEFAULT_CACHE_LIFETIME);
+
+    /**
+    * Set the number of password hashings allowed at once
+    * @param max: the limit, 0 for no limit
+    */
+    inline void setMaxConcurrentHashing(const unsigned max) { maxHashing = max; };
+
+  private:
+
+    struct Credential
+    {
+      unsigned iterations;
+      unsigned char salt[CREDENTIALSTORE_SALT_SIZE];
+      unsigned char hash[CREDENTIALSTORE_HASH_SIZE];
+    };
+
+    struct CacheEntry
+    {
+      std::string login;
+      time_t verified;
+    };
+
+    typedef std::list< std::pair<std::string, CacheEntry> > CacheList;
+
+    struct Cache
+    {
+      CacheList list; // most recently used first
+      std::unordered_map<std::string, CacheList::iterator> index;
+      size_t capacity;
+      time_t lifeTime;
+    };
+
+    std::unordered_map<std::string, Credential> users;
+    std::map<unsigned, size_t> usersIterations; // the number of users by iterations count
+    pthread_mutex_t usersMutex;
+
+    Cache verified, rejected;
+    unsigned long cacheGeneration; // incremented when the users change
+    pthread_mutex_t cacheMutex;
+
+    std::atomic<unsigned> hashing;
+    std::atomic<unsigned> maxHashing;
+
+    CredentialStore(const CredentialStore&);
+    CredentialStore& operator=(const CredentialStore&);
+
+    static bool derive(const std::string& password, const Credential& c, unsigned char *out);
+    void setUser(const std::string& login, const Credential& c);
+    void forgetIterations(const unsigned iterations);
+    bool check(const std::string& login, const std::string& password);
+    bool startHashing();
+    static bool cacheFind(Cache& cache, const std::string& key, const time_t now, std::string& login);
+    static void cacheAdd(Cache& cache, const std::string& key, const std::string& login, const time_t now);
+    static void cacheTrim(Cache& cache);
+    void flushCache();
+};
+
+#endif
@@ -26,6 +26,8 @@
 
 #include "libnavajo/IpAddress.hh"
 #include "HttpSession.hh"
+#include "libnavajo/HttpRequestHeaders.hh"
+#include "libnavajo/nvjPercentDecode.h"
 
 #include "MPFDParser/Parser.h"
 
@@ -43,6 +45,8 @@ typedef enum {
 } HttpRequestMethod;
 
 typedef enum { GZIP, ZLIB, NONE } CompressionMode;
+struct IpRateLimiterEntry;
+
 typedef struct
 {
   int socketId;
@@ -50,30 +54,68 @@ typedef struct
   CompressionMode compression;
   SSL *ssl;
   BIO *bio;
-  std::string *peerDN;
+  const std::string *peerDN; // the DN of the authorized X509 peer, interned by the webserver
+  bool resumed;              // connection given back to the pool after an asynchronous response
+  std::string *recvBuffer;   // read-ahead bytes kept while the connection is not owned by a worker
+  unsigned long long enqueueTime; // monotonic time (ms) of the last push into the clients queue
+  unsigned keepAliveLeft;    // the requests still allowed on the connection, asynchronous ones included
+  IpRateLimiterEntry *rateLimiterEntry; // the client limits, released with the connection
 //  pthread_mutex_t client_mutex;
 } ClientSockData;
 
-typedef std::map <std::string, std::string> HttpRequestHeadersMap;
-
 class HttpRequest
 {
   typedef std::map <std::string, std::string> HttpRequestParametersMap;
   typedef std::map <std::string, std::string> HttpRequestCookiesMap;  
 
+  // the raw strings belong to the connection (accept_request) unless detach() is called:
+  // cookies, parameters and session are only decoded when they are asked for
   const char *url;
   const char *origin;
+  const char *rawParams;
+  const char *rawCookies;
   ClientSockData *clientSockData;
   std::string httpAuthUsername;
   HttpRequestMethod httpMethod;
-  HttpRequestCookiesMap cookies;
-  HttpRequestParametersMap parameters;
-  HttpRequestHeadersMap extraHeaders;
-  std::string sessionId;
+  mutable HttpRequestCookiesMap cookies;
+  mutable HttpRequestParametersMap parameters;
+  mutable bool cookiesDecoded, paramsDecoded, sessionResolved;
+  const HttpRequestHeaders *extraHeaders;
+  mutable std::string sessionId;
   MPFD::Parser *mutipartContentParser;
   const char *mimeType;
   std::vector<uint8_t> *payload;
 
+  struct DetachedData
+  {
+    std::string url, origin, params, cookies, mimeType;
+    HttpRequestHeaders extraHeaders;
+    std::vector<uint8_t> payload;
+  } *detached;
+
+  HttpRequest(const HttpRequest&);
+  HttpRequest& operator=(const HttpRequest&);
+
+  /**********************************************************************/
+  /**
+  * decode the raw parameters and cookies on first access
+  */
+  inline void decodeParamsIfNeeded() const
+  {
+    if (paramsDecoded) return;
+    paramsDecoded = true;
+    if (rawParams != NULL && *rawParams)
+      const_cast<HttpRequest*>(this)->decodParams(rawParams);
+  };
+
+  inline void decodeCookiesIfNeeded() const
+  {
+    if (cookiesDecoded) return;
+    cookiesDecoded = true;
+    if (rawCookies != NULL && *rawCookies)
+      const_cast<HttpRequest*>(this)->decodCookies(rawCookies);
+  };
+
   /**********************************************************************/
   /**
   * decode all http parameters and fill the parameters Map
@@ -82,57 +124,26 @@ class HttpRequest
   inline void decodParams( const std::string& p )
   {
     size_t start = 0, end = 0;
-    std::string paramstr=p;
-
-    while ((end = paramstr.find_first_of("%+", start)) != std::string::npos) 
-    {
-      size_t len=paramstr.length()-end-1;
-      switch (paramstr[end])
-      {
-        case '%':
-          if (len >= 1 && paramstr[end+1] == '%')
-          {
-            paramstr.erase(end+1, 1);
-          }
-          else
-          {
-            if (len < 2) { start = end + 1; continue; }
-
-            unsigned int specar = 0;
-            std::string hexChar = paramstr.substr(end+1, 2);
-            std::stringstream ss;
-            ss << std::hex << hexChar;
-            ss >> specar;
-            if (ss.fail()) { start = end + 1; continue; }
-
-            paramstr[end] = static_cast<char>(specar);
-            paramstr.erase(end+1, 2);
-          }
-          break;
-
-        case '+':
-          paramstr[end]=' ';
-          break;
-      }   
-      
-      start=end+1;
-    }
-    
-    start = 0; end = 0;
     bool islastParam=false;
     while (!islastParam) 
     {
-      islastParam= (end = paramstr.find('&', start)) == std::string::npos;
-      if (islastParam) end=paramstr.size();
+      islastParam= (end = p.find('&', start)) == std::string::npos;
+      if (islastParam) end=p.size();
       
-      std::string theParam=paramstr.substr(start, end - start);
+      // split before decoding: an escaped '&' or '=' belongs to the name or the value
+      std::string theParam=p.substr(start, end - start);
       
       size_t posEq=0;
       if ((posEq = theParam.find('=')) == std::string::npos)
+      {
+        nvj_percent_decode(theParam, true);
         parameters[theParam]="";
+      }
       else {
 	std::string key        = theParam.substr(0,posEq);
 	std::string value      = theParam.substr(posEq+1);
+        nvj_percent_decode(key, true);
+        nvj_percent_decode(value, true);
         if( parameters.count( key ) == 0 ) {
           parameters[key] = value;
         } else {
@@ -176,16 +187,19 @@ class HttpRequest
   /**********************************************************************/
   /**
   * check the SID cookie and set the sessionID attribute if the session is valid
-  * (called by constructor)
+  * (called on the first session access)
   */
-  inline void getSession()
+  inline void getSession() const
   {
+    if (sessionResolved) return;
+    sessionResolved = true;
+
     sessionId = getCookie("SID");
 
     if (sessionId.length() && HttpSession::find(sessionId))
       return;
 
-    initSessionId();
+    sessionId = "";
   };
 
 
@@ -213,6 +227,7 @@ class HttpRequest
     */  
     inline bool getCookie( const std::string& name, std::string &value ) const
     {
+      decodeCookiesIfNeeded();
       if(!cookies.empty())
       {
         HttpRequestCookiesMap::const_iterator it;
@@ -232,6 +247,7 @@ class HttpRequest
     */ 
     inline std::vector<std::string> getCookiesNames() const
     {
+      decodeCookiesIfNeeded();
       std::vector<std::string> res;
       for(HttpRequestCookiesMap::const_iterator iter=cookies.begin(); iter!=cookies.end(); ++iter)
        res.push_back(iter->first);
@@ -240,25 +256,42 @@ class HttpRequest
 
     /**********************************************************************/
     /**
-    * get header value
-    * @param name: the header name
+    * get header value (its first occurrence)
+    * @param name: the header name, case-insensitive
     * @param value: the header value
     * @return true is the header exists
     */
     inline bool getExtraHeader( const std::string& name, std::string &value ) const
     {
-      if(!extraHeaders.empty())
-      {
-        HttpRequestHeadersMap::const_iterator it;
-        if((it = extraHeaders.find(name)) != extraHeaders.end())
-        {
-          value=it->second;
-          return true;
-        }
-      }
-      return false;
+      return extraHeaders != NULL && extraHeaders->get(name, value);
     }
 
+    /**
+    * get the value of a well-known header, without name lookup
+    * @param id: the header id (ex: HTTP_HEADER_USER_AGENT)
+    * @param value: the header value
+    * @return true is the header exists
+    */
+    inline bool getExtraHeader( const HttpHeaderId id, std::string &value ) const
+    {
+      return extraHeaders != NULL && extraHeaders->get(id, value);
+    }
+
+    /**
+    * get all the values of a header received several times
+    * @param name: the header name, case-insensitive
+    */
+    inline std::vector<std::string> getExtraHeaderValues( const std::string& name ) const
+    {
+      if (extraHeaders == NULL) return std::vector<std::string>();
+      return extraHeaders->getAll(name);
+    }
+
+    /**
+    * get the request headers
+    */
+    inline const HttpRequestHeaders* getExtraHeaders() const { return extraHeaders; };
+
     /**********************************************************************/
     /**
     * get parameter value
@@ -268,6 +301,7 @@ class HttpRequest
     */   
     inline bool getParameter( const std::string& name, std::string &value ) const
     {
+      decodeParamsIfNeeded();
       if(!parameters.empty())
       {
         HttpRequestParametersMap::const_iterator it;
@@ -312,6 +346,7 @@ class HttpRequest
     */ 
     inline std::vector<std::string> getParameterNames() const
     {
+      decodeParamsIfNeeded();
       std::vector<std::string> res;
       for(HttpRequestParametersMap::const_iterator iter=parameters.begin(); iter!=parameters.end(); ++iter)
        res.push_back(iter->first);
@@ -324,16 +359,19 @@ class HttpRequest
     */
     inline bool isSessionValid()
     {
+      getSession();
       return sessionId != "";
     }
 
     /**********************************************************************/
     /**
     * create a session cookie
+    * @return false if the session can't be created (no cookie is set)
     */ 
-    inline void createSession()
+    inline bool createSession()
     {
-      HttpSession::create(sessionId);
+      sessionResolved = true;
+      return HttpSession::create(sessionId);
     }
     
     /**
@@ -341,6 +379,7 @@ class HttpRequest
     */ 
     inline void removeSession()
     {
+      getSession();
       if (sessionId == "") return;
       HttpSession::remove(sessionId);
     }
@@ -352,7 +391,8 @@ class HttpRequest
     */ 
     void setSessionAttribute ( const std::string &name, void* value )
     {
-      if (sessionId == "") createSession();
+      getSession();
+      if (sessionId == "" && !createSession()) return;
       HttpSession::setAttribute(sessionId, name, value);
     }
 
@@ -363,10 +403,39 @@ class HttpRequest
     */
     void setSessionObjectAttribute ( const std::string &name, SessionAttributeObject* value )
     {
-      if (sessionId == "") createSession();
+      getSession();
+      if (sessionId == "" && !createSession()) return;
       HttpSession::setObjectAttribute(sessionId, name, value);
     }
     
+    /**
+    * add a binary attribute to the session: the value is copied, and shared
+    * between the processes when a session backend is used
+    * @param name: the attribute name
+    * @param data: the attribute value
+    * @param len: the value length
+    * @return false if the attribute can't be stored
+    */
+    bool setSessionBinaryAttribute ( const std::string &name, const void* data, const size_t len )
+    {
+      getSession();
+      if (sessionId == "" && !createSession()) return false;
+      return HttpSession::setBinaryAttribute(sessionId, name, data, len);
+    }
+
+    /**
+    * get a binary attribute of the server session
+    * @param name: the attribute name
+    * @param value: set to the attribute value
+    * @return false if not found
+    */
+    bool getSessionBinaryAttribute( const std::string &name, std::string &value )
+    {
+      getSession();
+      if (sessionId == "") return false;
+      return HttpSession::getBinaryAttribute(sessionId, name, value);
+    }
+
     /**
     * get an attribute of the server session
     * @param name: the attribute name
@@ -374,6 +443,7 @@ class HttpRequest
     */ 
     void *getSessionAttribute( const std::string &name )
     {
+      getSession();
       if (sessionId == "") return NULL;
       return HttpSession::getAttribute(sessionId, name);
     }
@@ -385,6 +455,7 @@ class HttpRequest
     */
     SessionAttributeObject* getSessionObjectAttribute( const std::string &name )
     {
+      getSession();
       if (sessionId == "") return NULL;
       return HttpSession::getObjectAttribute(sessionId, name);
     }
@@ -395,6 +466,7 @@ class HttpRequest
     */ 
     inline std::vector<std::string> getSessionAttributeNames()
     {
+      getSession();
       if (sessionId == "") return std::vector<std::string>();;
       return HttpSession::getAttributeNames(sessionId);
     }
@@ -405,6 +477,7 @@ class HttpRequest
     */ 
     inline void getSessionRemoveAttribute( const std::string &name )
     {
+      getSession();
       if (sessionId != "")
         HttpSession::removeAttribute( sessionId, name );
     }
@@ -412,13 +485,13 @@ class HttpRequest
     /**
     * initialize sessionId value
     */ 
-    inline void initSessionId() { sessionId = ""; };
+    inline void initSessionId() { sessionId = ""; sessionResolved = true; };
 
     /**
     * get sessionId value
     * @return the sessionId value
     */    
-    std::string getSessionId() const { return sessionId; };
+    std::string getSessionId() const { getSession(); return sessionId; };
 
     /**********************************************************************/
     /**
@@ -429,24 +502,46 @@ class HttpRequest
     * @cookies params: raw http cookies string
     */         
     HttpRequest(const HttpRequestMethod type, const char *url, const char *params, const char *cookies,
-                HttpRequestHeadersMap& hMap, const char *origin, const std::string &username, ClientSockData *client,
+                HttpRequestHeaders& hMap, const char *origin, const std::string &username, ClientSockData *client,
                 const char* mimeType, std::vector<uint8_t>* payload=NULL, MPFD::Parser *parser=NULL)
     {
       this->httpMethod = type;
       this->url = url;
       this->origin = origin;
+      this->rawParams = params;
+      this->rawCookies = cookies;
       this->httpAuthUsername=username;
       this->clientSockData=client;
       this->mimeType=mimeType ;
       this->payload=payload ;
       this->mutipartContentParser=parser;
-      this->extraHeaders = hMap;
+      this->extraHeaders = &hMap;
+      this->cookiesDecoded = false;
+      this->paramsDecoded = false;
+      this->sessionResolved = false;
+      this->detached = NULL;
+    };
 
-      setParams( params );
-      
-      if (cookies != NULL && strlen(cookies))
-        decodCookies(cookies);        
+    ~HttpRequest() { if (detached != NULL) delete detached; };
+
+    /**********************************************************************/
+    /**
+    * Copy everything the request refers to, so that it can outlive
+    * the connection buffers (websockets). The multipart parser is dropped.
+    */
+    void detach()
+    {
+      if (detached != NULL) return;
+      detached = new DetachedData;
       getSession();
+      if (url != NULL) { detached->url = url; url = detached->url.c_str(); }
+      if (origin != NULL) { detached->origin = origin; origin = detached->origin.c_str(); }
+      if (mimeType != NULL) { detached->mimeType = mimeType; mimeType = detached->mimeType.c_str(); }
+      if (!paramsDecoded && rawParams != NULL) { detached->params = rawParams; rawParams = detached->params.c_str(); }
+      if (!cookiesDecoded && rawCookies != NULL) { detached->cookies = rawCookies; rawCookies = detached->cookies.c_str(); }
+      if (extraHeaders != NULL) { detached->extraHeaders = *extraHeaders; extraHeaders = &detached->extraHeaders; }
+      if (payload != NULL) { detached->payload = *payload; payload = &detached->payload; }
+      mutipartContentParser = NULL;
     };
 
     /**********************************************************************/
@@ -499,6 +594,7 @@ class HttpRequest
 
     // GLSR: torna pública a configuração de parâmetros permitindo realizar forwardTo com novos parâmetros
     inline void setParams( const char*params ) {
+      decodeParamsIfNeeded();
       if (params != NULL && strlen(params)) {
         decodParams(params);
       }
@@ -550,9 +646,9 @@ class HttpRequest
     * get peer x509 dn 
     * @return the DN of the peer certificate
     */   
-    inline std::string& getX509PeerDN()
+    inline const std::string& getX509PeerDN()
     {
-      static std::string emptyDN;
+      static const std::string emptyDN;
       return (clientSockData != NULL && clientSockData->peerDN != NULL) ? *(clientSockData->peerDN) : emptyDN;
     };
 
@@ -0,0 +1,262 @@
+//********************************************************
+/**
+ * @file  HttpRequestHeaders.hh
+ *
+ * @brief Flat, case-insensitive storage of the request
+ *        headers
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef HTTPREQUESTHEADERS_HH_
+#define HTTPREQUESTHEADERS_HH_
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+/**
+* HttpHeaderId - the headers which can be accessed without a name lookup
+*/
+typedef enum
+{
+  HTTP_HEADER_HOST = 0,
+  HTTP_HEADER_USER_AGENT,
+  HTTP_HEADER_ACCEPT,
+  HTTP_HEADER_ACCEPT_ENCODING,
+  HTTP_HEADER_ACCEPT_LANGUAGE,
+  HTTP_HEADER_CONNECTION,
+  HTTP_HEADER_CONTENT_LENGTH,
+  HTTP_HEADER_CONTENT_TYPE,
+  HTTP_HEADER_COOKIE,
+  HTTP_HEADER_ORIGIN,
+  HTTP_HEADER_REFERER,
+  HTTP_HEADER_IF_MODIFIED_SINCE,
+  HTTP_HEADER_IF_NONE_MATCH,
+  HTTP_HEADER_RANGE,
+  HTTP_HEADER_UPGRADE,
+  HTTP_HEADER_X_FORWARDED_FOR,
+  HTTP_HEADER_X_REAL_IP,
+  HTTP_HEADER_X_REQUESTED_WITH,
+  HTTP_HEADER_SEC_WEBSOCKET_KEY,
+  HTTP_HEADER_SEC_WEBSOCKET_VERSION,
+  HTTP_HEADER_SEC_WEBSOCKET_PROTOCOL,
+  HTTP_HEADER_SEC_WEBSOCKET_EXTENSIONS,
+  HTTP_HEADER_KNOWN_COUNT,
+  HTTP_HEADER_UNKNOWN = HTTP_HEADER_KNOWN_COUNT
+} HttpHeaderId;
+
+/***********************************************************************
+ * HttpRequestHeaders - the header lines of a request, in arrival order.
+ * Names and values are copied once in a single buffer, each entry keeps
+ * their offsets, the case-folded hash of the name and its HttpHeaderId.
+ * A header received several times has several entries.
+ */
+
+class HttpRequestHeaders
+{
+    struct Entry
+    {
+      u_int32_t nameOffset, nameLen;
+      u_int32_t valueOffset, valueLen;
+      u_int32_t hash;
+      u_int32_t id;
+    };
+
+    std::string buffer;
+    std::vector<Entry> entries;
+    int32_t known[HTTP_HEADER_KNOWN_COUNT]; // first entry of each well-known header, -1 if none
+
+    static inline char toLower(const char c) { return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c; };
+
+    static inline u_int32_t hashName(const char *name, const size_t len)
+    {
+      u_int32_t h = 2166136261U;
+      for (size_t i = 0; i < len; i++) { h ^= (unsigned char)toLower(name[i]); h *= 16777619U; }
+      return h;
+    };
+
+    static const char* knownName(const unsigned id)
+    {
+      static const char *names[HTTP_HEADER_KNOWN_COUNT] =
+      {
+        "Host", "User-Agent", "Accept", "Accept-Encoding", "Accept-Language", "Connection",
+        "Content-Length", "Content-Type", "Cookie", "Origin", "Referer", "If-Modified-Since",
+        "If-None-Match", "Range", "Upgrade", "X-Forwarded-For", "X-Real-IP", "X-Requested-With",
+        "Sec-WebSocket-Key", "Sec-WebSocket-Version", "Sec-WebSocket-Protocol", "Sec-WebSocket-Extensions"
+      };
+      return names[id];
+    };
+
+    // the well-known names in an open addressing table, indexed by their hash
+    struct KnownHashes
+    {
+      enum { SLOTS = 64 }; // a power of 2, at least twice HTTP_HEADER_KNOWN_COUNT
+      u_int32_t hashes[SLOTS];
+      unsigned char ids[SLOTS]; // HTTP_HEADER_UNKNOWN if the slot is free
+      size_t lengths[HTTP_HEADER_KNOWN_COUNT];
+      KnownHashes()
+      {
+        memset(ids, HTTP_HEADER_UNKNOWN, sizeof(ids));
+        for (unsigned i = 0; i < HTTP_HEADER_KNOWN_COUNT; i++)
+        {
+          lengths[i] = strlen(knownName(i));
+          u_int32_t h = hashName(knownName(i), lengths[i]);
+          unsigned slot = h & (SLOTS - 1);
+          while (ids[slot] != HTTP_HEADER_UNKNOWN)
+            slot = (slot + 1) & (SLOTS - 1);
+          hashes[slot] = h;
+          ids[slot] = (unsigned char)i;
+        }
+      };
+    };
+
+    static unsigned knownId(const char *name, const size_t len, const u_int32_t hash)
+    {
+      static const KnownHashes known;
+      for (unsigned slot = hash & (KnownHashes::SLOTS - 1); known.ids[slot] != HTTP_HEADER_UNKNOWN;
+           slot = (slot + 1) & (KnownHashes::SLOTS - 1))
+      {
+        unsigned id = known.ids[slot];
+        if (known.hashes[slot] == hash && known.lengths[id] == len && strncasecmp(knownName(id), name, len) == 0)
+          return id;
+      }
+      return HTTP_HEADER_UNKNOWN;
+    };
+
+    inline int find(const char *name, const size_t len, const size_t from = 0) const
+    {
+      u_int32_t h = hashName(name, len);
+      for (size_t i = from; i < entries.size(); i++)
+        if ( entries[i].hash == h && entries[i].nameLen == len
+          && strncasecmp(buffer.data() + entries[i].nameOffset, name, len) == 0 )
+          return (int)i;
+      return -1;
+    };
+
+  public:
+
+    HttpRequestHeaders() { clear(); };
+
+    /**
+    * Remove every header (the memory is kept for the next request)
+    */
+    inline void clear()
+    {
+      buffer.clear();
+      entries.clear();
+      for (unsigned i = 0; i < HTTP_HEADER_KNOWN_COUNT; i++) known[i] = -1;
+    };
+
+    /**
+    * Add a header line "Name: value" (without CRLF)
+    * \return false if the line is not a header
+    */
+    bool add(const char *line, const size_t len)
+    {
+      const char *colon = (const char*)memchr(line, ':', len);
+      if (colon == NULL)
+        return false;
+
+      // Keep the full value after the first ':'; values such as
+      // "Host: localhost:8080" or URLs may contain additional colons.
+      const char *nameStart = line, *nameEnd = colon;
+      while (nameStart < nameEnd && (*nameStart == ' ' || *nameStart == '\t')) nameStart++;
+      while (nameEnd > nameStart && (nameEnd[-1] == ' ' || nameEnd[-1] == '\t')) nameEnd--;
+      if (nameStart == nameEnd)
+        return false;
+
+      const char *valueStart = colon + 1, *valueEnd = line + len;
+      while (valueStart < valueEnd && (*valueStart == ' ' || *valueStart == '\t')) valueStart++;
+      while (valueEnd > valueStart && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'
+                                    || valueEnd[-1] == '\r' || valueEnd[-1] == '\n')) valueEnd--;
+
+      Entry e;
+      e.nameOffset = (u_int32_t)buffer.size();
+      e.nameLen = (u_int32_t)(nameEnd - nameStart);
+      buffer.append(nameStart, e.nameLen);
+      e.valueOffset = (u_int32_t)buffer.size();
+      e.valueLen = (u_int32_t)(valueEnd - valueStart);
+      buffer.append(valueStart, e.valueLen);
+      e.hash = hashName(nameStart, e.nameLen);
+      e.id = knownId(nameStart, e.nameLen, e.hash);
+
+      if (e.id != HTTP_HEADER_UNKNOWN && known[e.id] < 0)
+        known[e.id] = (int32_t)entries.size();
+      entries.push_back(e);
+      return true;
+    };
+
+    inline bool add(const char *line) { return add(line, strlen(line)); };
+
+    /**
+    * Number of header lines
+    */
+    inline size_t size() const { return entries.size(); };
+
+    inline bool empty() const { return entries.empty(); };
+
+    inline std::string getName(const size_t i) const
+      { return std::string(buffer.data() + entries[i].nameOffset, entries[i].nameLen); };
+
+    inline std::string getValue(const size_t i) const
+      { return std::string(buffer.data() + entries[i].valueOffset, entries[i].valueLen); };
+
+    /**
+    * Get the value of a header (its first occurrence)
+    * @param name: the header name, case-insensitive
+    * @param value: set to the header value
+    * \return true if found
+    */
+    inline bool get(const std::string& name, std::string& value) const
+    {
+      int i = find(name.data(), name.size());
+      if (i < 0) return false;
+      value.assign(buffer.data() + entries[i].valueOffset, entries[i].valueLen);
+      return true;
+    };
+
+    /**
+    * Get the value of a well-known header (its first occurrence)
+    */
+    inline bool get(const HttpHeaderId id, std::string& value) const
+    {
+      if (id >= HTTP_HEADER_KNOWN_COUNT || known[id] < 0) return false;
+      const Entry& e = entries[known[id]];
+      value.assign(buffer.data() + e.valueOffset, e.valueLen);
+      return true;
+    };
+
+    /**
+    * Get every value of a header received several times
+    * @param name: the header name, case-insensitive
+    */
+    std::vector<std::string> getAll(const std::string& name) const
+    {
+      std::vector<std::string> res;
+      for (int i = find(name.data(), name.size()); i >= 0; i = find(name.data(), name.size(), i + 1))
+        res.push_back(std::string(buffer.data() + entries[i].valueOffset, entries[i].valueLen));
+      return res;
+    };
+
+    /**
+    * Get the names of the headers (once each, in arrival order)
+    */
+    std::vector<std::string> getNames() const
+    {
+      std::vector<std::string> res;
+      for (size_t i = 0; i < entries.size(); i++)
+        if (find(buffer.data() + entries[i].nameOffset, entries[i].nameLen) == (int)i)
+          res.push_back(getName(i));
+      return res;
+    };
+};
+
+#endif
@@ -22,6 +22,8 @@
 
 #include "libnavajo/HttpSession.hh"
 
+class HttpAsyncCompletion;
+
 class HttpResponse
 {
   unsigned char *responseContent;
@@ -35,6 +37,7 @@ class HttpResponse
   unsigned httpReturnCode;
   std::string httpReturnCodeMessage;
   std::string httpSpecificHeaders;
+  HttpAsyncCompletion *asyncCompletion;
 
   static const unsigned unsetHttpReturnCodeMessage = 0;
 
@@ -42,7 +45,8 @@ class HttpResponse
 
   public:
     HttpResponse(const std::string mime="") : responseContent (NULL), responseContentLength (0), zippedFile (false), mimeType(mime), forwardToUrl(""), cors(false), corsCred(false), corsDomain(""),
-                                        httpReturnCode(unsetHttpReturnCodeMessage), httpReturnCodeMessage("Unspecified"), httpSpecificHeaders("")
+                                        httpReturnCode(unsetHttpReturnCodeMessage), httpReturnCodeMessage("Unspecified"), httpSpecificHeaders(""),
+                                        asyncCompletion(NULL)
     {
       initializeHttpReturnCode();
     }
@@ -374,6 +378,21 @@ class HttpResponse
     {
         return httpSpecificHeaders;
     }
+
+    /************************************************************************/
+    /**
+    * set the completion handle of an asynchronous response
+    * (called by AsyncDynamicPage)
+    * @param completion: the completion handle
+    */
+    inline void setAsyncCompletion(HttpAsyncCompletion *completion) { asyncCompletion=completion; };
+
+    /************************************************************************/
+    /**
+    * get the completion handle of an asynchronous response
+    * @return the completion handle, NULL if the response is synchronous
+    */
+    inline HttpAsyncCompletion *getAsyncCompletion() const { return asyncCompletion; };
 };
 
 
@@ -18,237 +18,669 @@
 #include <cstdio>
 #include <cstdlib>
 #include <map>
+#include <unordered_map>
+#include <functional>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <sstream>
 
+#include <stdexcept>
+#include <cerrno>
+
 #include <pthread.h>
+#include <sys/types.h>
+#include <openssl/rand.h>
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 25))
+#include <sys/random.h>
+#define HTTPSESSION_HAVE_GETRANDOM
+#endif
+
+#include "libnavajo/HttpSessionBackend.hh"
+#include "libnavajo/nvjBase64.h"
+#include "libnavajo/LogRecorder.hh"
 
 class SessionAttributeObject
 {
   public:
     virtual ~SessionAttributeObject() {};
+
+    /**
+    * Serialize the object for the sessions snapshot (see HttpSession::setSnapshotFile())
+    * @param out: the object state must be appended to out
+    * \return false if the object is not serializable (it's not saved)
+    */
+    virtual bool serialize(std::string& out) const { (void)out; return false; };
+
+    /**
+    * The name of the factory rebuilding the object (see HttpSession::registerAttributeFactory())
+    */
+    virtual std::string getTypeName() const { return ""; };
 };
 
+/**
+* SessionAttributeFactory - rebuild a SessionAttributeObject from its serialized state
+* \return the new object, or NULL if the data is invalid
+*/
+typedef SessionAttributeObject* (*SessionAttributeFactory)(const char *data, const size_t len);
+
+#define HTTPSESSION_NB_SHARDS 32
+#define HTTPSESSION_ID_RANDOM_BYTES 48                         // 384 bits, 64 base64url chars (multiple of 3)
+#define HTTPSESSION_RANDOM_POOL_SIZE 4096                      // per-thread random bytes, refilled in bulk
+#define HTTPSESSION_WHEEL_BITS 6                               // 64 slots per level
+#define HTTPSESSION_WHEEL_SLOTS (1 << HTTPSESSION_WHEEL_BITS)
+#define HTTPSESSION_WHEEL_LEVELS 4                             // 1s, 64s, ~68min, ~3days per slot
+
 class HttpSession
 {
   typedef struct {
-    enum{BASIC, OBJECT} type;
+    enum{BASIC, OBJECT, BINARY} type;
     union
     {
       void *ptr;
       SessionAttributeObject *obj;
     };
+    size_t len;                   // BINARY only
   } SessionAttribute;
 
+  typedef std::map <std::string, SessionAttribute> SessionAttributesMap;
+
+  struct Session
+  {
+    std::string id;
+    SessionAttributesMap attributes;
+    time_t expiration;            // 0: never expires
+    // snapshot
+    bool dirty;                   // changed since it has been saved
+    bool saved;                   // is in the snapshot file
+    time_t savedExpiration;
+    // timer wheel
+    bool inWheel;
+    time_t wheelTime;             // when the wheel looks at this session again
+    unsigned wheelLevel, wheelSlot;
+    Session *wheelPrev, *wheelNext;
+  };
+
+  typedef std::unordered_map <std::string, Session*> HttpSessionsContainerMap;
+
+  /**
+  * Shard - a part of the sessions, with its own lock and its own
+  * hierarchical timer wheel. The wheel only holds a hint: the
+  * expiration is kept in the session and updated without touching the
+  * wheel, a session found too early in the wheel is put back at its
+  * new expiration time.
+  */
+  struct Shard
+  {
+    pthread_mutex_t mutex;
+    HttpSessionsContainerMap sessions;
+    Session *wheel[HTTPSESSION_WHEEL_LEVELS][HTTPSESSION_WHEEL_SLOTS];
+    time_t wheelCurrent;          // last tick processed
+    size_t wheelCount;
+    std::vector<std::string> removedIds; // saved sessions removed since the last snapshot
+
+    Shard(): wheelCurrent(0), wheelCount(0)
+    {
+      pthread_mutex_init(&mutex, NULL);
+      memset(wheel, 0, sizeof(wheel));
+    };
+  };
 
-  typedef std::map <std::string, std::map <std::string, SessionAttribute>* > HttpSessionsContainerMap;
-
-  static HttpSessionsContainerMap sessions;
-  static pthread_mutex_t sessions_mutex; 
-  static time_t lastExpirationSearchTime;
+  static Shard shards[HTTPSESSION_NB_SHARDS];
   static time_t sessionLifeTime;
-  
+  static HttpSessionBackend *backend;
+
+  static bool snapshotEnabled;
+  static std::string snapshotPath;
+  static unsigned snapshotPeriod;
+  static unsigned long long snapshotTimer;
+  static size_t snapshotRecords;  // records appended since the last compaction
+  static bool snapshotCompactNeeded;
+  static pthread_mutex_t snapshot_mutex;
+  static std::map<std::string, SessionAttributeFactory> attributeFactories;
+
+  static bool loadSnapshot(const std::string& path);
+  static bool writeSnapshotFile(const std::string& data, const bool compact);
+  static void serializeSession(const Session* session, std::string& out);
+  static void scheduleSnapshot();
+
+  inline static Shard& getShard(const std::string& id)
+  {
+    return shards[std::hash<std::string>()(id) % HTTPSESSION_NB_SHARDS];
+  };
+
+  /**********************************************************************/
+  // timer wheel (shard mutex held)
+
+  static void wheelInsert(Shard& shard, Session* session, const time_t when, const bool cascading = false)
+  {
+    // the current level 0 slot is only still to be processed while cascading
+    time_t t = when > shard.wheelCurrent ? when : shard.wheelCurrent + (cascading ? 0 : 1);
+    time_t delta = t - shard.wheelCurrent;
+
+    unsigned level = 0;
+    while ( level < HTTPSESSION_WHEEL_LEVELS - 1
+         && delta >= ((time_t)1 << (HTTPSESSION_WHEEL_BITS * (level + 1))) )
+      level++;
+
+    time_t maxDelta = ((time_t)1 << (HTTPSESSION_WHEEL_BITS * (level + 1))) - 1;
+    if (delta > maxDelta) t = shard.wheelCurrent + maxDelta;  // will be cascaded again
+
+    unsigned slot = (unsigned)((t >> (HTTPSESSION_WHEEL_BITS * level)) & (HTTPSESSION_WHEEL_SLOTS - 1));
+
+    session->inWheel = true;
+    session->wheelTime = when;
+    session->wheelLevel = level;
+    session->wheelSlot = slot;
+    session->wheelPrev = NULL;
+    session->wheelNext = shard.wheel[level][slot];
+    if (session->wheelNext != NULL) session->wheelNext->wheelPrev = session;
+    shard.wheel[level][slot] = session;
+    shard.wheelCount++;
+  };
+
+  static void wheelUnlink(Shard& shard, Session* session)
+  {
+    if (!session->inWheel) return;
+    if (session->wheelPrev != NULL)
+      session->wheelPrev->wheelNext = session->wheelNext;
+    else
+      shard.wheel[session->wheelLevel][session->wheelSlot] = session->wheelNext;
+    if (session->wheelNext != NULL) session->wheelNext->wheelPrev = session->wheelPrev;
+    session->inWheel = false;
+    shard.wheelCount--;
+  };
+
+  static Session* wheelTakeSlot(Shard& shard, const unsigned level, const unsigned slot)
+  {
+    Session *list = shard.wheel[level][slot];
+    shard.wheel[level][slot] = NULL;
+    for (Session *s = list; s != NULL; s = s->wheelNext)
+    {
+      s->inWheel = false;
+      shard.wheelCount--;
+    }
+    return list;
+  };
+
+  static void deleteSession(Shard& shard, Session* session)
+  {
+    wheelUnlink(shard, session);
+    if (snapshotEnabled && session->saved)
+      shard.removedIds.push_back(session->id);
+    shard.sessions.erase(session->id);
+    removeAllAttribute(&session->attributes);
+    delete session;
+  };
+
+  /**
+  * expireSessions - advance the shard wheel up to now and remove the expired sessions
+  */
+  static void expireSessions(Shard& shard, const time_t now)
+  {
+    if (!shard.wheelCount || !shard.wheelCurrent)
+    {
+      shard.wheelCurrent = now;
+      return;
+    }
+
+    while (shard.wheelCurrent < now)
+    {
+      time_t tick = ++shard.wheelCurrent;
+
+      // cascade the upper levels whose slot starts now, highest first
+      unsigned topLevel = 0;
+      while ( topLevel < HTTPSESSION_WHEEL_LEVELS - 1
+           && !(tick & (((time_t)1 << (HTTPSESSION_WHEEL_BITS * (topLevel + 1))) - 1)) )
+        topLevel++;
+
+      for (unsigned level = topLevel; level > 0; level--)
+      {
+        unsigned slot = (unsigned)((tick >> (HTTPSESSION_WHEEL_BITS * level)) & (HTTPSESSION_WHEEL_SLOTS - 1));
+        Session *s = wheelTakeSlot(shard, level, slot);
+        while (s != NULL)
+        {
+          Session *next = s->wheelNext;
+          wheelInsert(shard, s, s->wheelTime, true);
+          s = next;
+        }
+      }
+
+      Session *s = wheelTakeSlot(shard, 0, (unsigned)(tick & (HTTPSESSION_WHEEL_SLOTS - 1)));
+      while (s != NULL)
+      {
+        Session *next = s->wheelNext;
+        if (!s->expiration)
+          ; // no expiration: leaves the wheel
+        else if (s->expiration <= tick)
+          deleteSession(shard, s);
+        else
+          wheelInsert(shard, s, s->expiration);
+        s = next;
+      }
+
+      if (!shard.wheelCount)
+        shard.wheelCurrent = now;
+    }
+  };
+
+  /**********************************************************************/
+
+  /**
+  * getRandomBytes - take bytes from a per-thread buffer of cryptographically
+  * secure random bytes, refilled in bulk
+  */
+  static void getRandomBytes(unsigned char *buf, const size_t len)
+  {
+    static thread_local unsigned char pool[HTTPSESSION_RANDOM_POOL_SIZE];
+    static thread_local size_t poolAvailable = 0;
+
+    size_t done = 0;
+    while (done < len)
+    {
+      if (!poolAvailable)
+      {
+        if (!fillRandom(pool, sizeof(pool)))
+          throw std::runtime_error("HttpSession: no random source available");
+        poolAvailable = sizeof(pool);
+      }
+      size_t n = len - done < poolAvailable ? len - done : poolAvailable;
+      unsigned char *src = pool + sizeof(pool) - poolAvailable;
+      memcpy(buf + done, src, n);
+      memset(src, 0, n); // don't keep the bytes already given
+      poolAvailable -= n;
+      done += n;
+    }
+  };
+
+  static bool fillRandom(unsigned char *buf, const size_t len)
+  {
+#ifdef HTTPSESSION_HAVE_GETRANDOM
+    size_t done = 0;
+    while (done < len)
+    {
+      ssize_t n = getrandom(buf + done, len - done, 0);
+      if (n < 0)
+      {
+        if (errno == EINTR) continue;
+        break;
+      }
+      done += n;
+    }
+    if (done == len) return true;
+#endif
+    return RAND_bytes(buf, (int)len) == 1;
+  };
+
+  /**
+  * generateId - a new random session id (base64url encoded)
+  */
+  static void generateId(std::string& id)
+  {
+    unsigned char rnd[HTTPSESSION_ID_RANDOM_BYTES];
+    char b64[HTTPSESSION_ID_RANDOM_BYTES / 3 * 4];
+    getRandomBytes(rnd, sizeof(rnd));
+    id.assign(b64, nvj_base64_encode(rnd, sizeof(rnd), b64, true, false));
+  };
+
+  /**********************************************************************/
+
+  inline static Session* getSession(Shard& shard, const std::string& sid)
+  {
+    HttpSessionsContainerMap::iterator it = shard.sessions.find(sid);
+    return it == shard.sessions.end() ? NULL : it->second;
+  };
+
+  /**
+  * newSession - add a session to a shard (shard mutex held)
+  */
+  static Session* newSession(Shard& shard, const std::string& id, const time_t expiration)
+  {
+    Session *session = new Session;
+    session->id = id;
+    session->expiration = expiration;
+    session->dirty = true;
+    session->saved = false;
+    session->savedExpiration = 0;
+    session->inWheel = false;
+    shard.sessions[id] = session;
+    if (expiration)
+      wheelInsert(shard, session, expiration);
+    return session;
+  };
+
+  static bool setSessionAttribute(const std::string &sid, const std::string &name, const SessionAttribute& attribute)
+  {
+    // with a backend, the session may have been created by another process
+    time_t now = time(NULL);
+    bool shared = backend != NULL && backend->exists(sid, now);
+
+    Shard& shard = getShard(sid);
+    pthread_mutex_lock( &shard.mutex );
+    Session *session = getSession(shard, sid);
+
+    if (session == NULL && shared)
+      session = newSession(shard, sid, now + sessionLifeTime);
+
+    if (session == NULL) { pthread_mutex_unlock( &shard.mutex ); return false; };
+
+    session->dirty = true;
+    SessionAttributesMap::iterator existing = session->attributes.find(name);
+    if (existing != session->attributes.end())
+    {
+      if (existing->second.ptr != NULL)
+      {
+        if (existing->second.type == SessionAttribute::OBJECT)
+          delete existing->second.obj;
+        else
+          free(existing->second.ptr);
+      }
+      existing->second = attribute;
+    }
+    else
+      session->attributes.insert(std::pair<std::string, SessionAttribute>(name, attribute ));
+    pthread_mutex_unlock( &shard.mutex );
+    return true;
+  };
+
   public:
 
     inline static void setSessionLifeTime(const time_t sec) { sessionLifeTime = sec; };
 
     inline static time_t getSessionLifeTime() { return sessionLifeTime; };
 
-    /**********************************************************************/
-
-    static void create(std::string& id)
+    /**
+    * Store the sessions in a backend (shared memory, ...) instead of this process only.
+    * Only the binary attributes are stored in the backend: the pointer and object
+    * attributes stay in the process which set them, for as long as it sees the session.
+    * Must be set before the first session is created.
+    * @param b: the backend, NULL to keep the sessions in this process
+    */
+    inline static void setBackend(HttpSessionBackend *b) { backend = b; };
+
+    inline static HttpSessionBackend* getBackend() { return backend; };
+
+    /**
+    * Register the factory of a serializable SessionAttributeObject type.
+    * Must be done before setSnapshotFile() to reload the objects of this type.
+    * @param typeName: the name returned by SessionAttributeObject::getTypeName()
+    * @param factory: the function rebuilding an object
+    */
+    static void registerAttributeFactory(const std::string& typeName, SessionAttributeFactory factory)
     {
+      pthread_mutex_lock( &snapshot_mutex );
+      attributeFactories[typeName] = factory;
+      pthread_mutex_unlock( &snapshot_mutex );
+    };
 
-      const size_t idLength=128;
-      const char elements[] = "abcdefghijklmnopqrstuvwxyz0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
-      const size_t nbElements = sizeof(elements) / sizeof(char);
-      srand(time(NULL));
+    /**
+    * Save the sessions in a file, and reload them now if the file exists.
+    * The changes are appended periodically (incremental snapshot), and the
+    * file is rewritten when it gets too large. The binary attributes and
+    * the serializable objects are saved, the pointer attributes are not.
+    * Ignored when a session backend is used.
+    * @param path: the snapshot file
+    * @param periodSec: the time between two snapshots (Default value: 30)
+    * \return false if the file exists but can't be loaded
+    */
+    static bool setSnapshotFile(const std::string& path, const unsigned periodSec = 30);
+
+    /**
+    * Stop the periodic snapshot (the file is kept)
+    */
+    static void disableSnapshot();
+
+    inline static bool isSnapshotEnabled() { return snapshotEnabled; };
+
+    /**
+    * Save the changes now (called when the WebServer stops)
+    * @param compact: rewrite the whole file
+    * \return false on write error
+    */
+    static bool snapshot(const bool compact = false);
 
-      id.reserve(idLength);
+    /**********************************************************************/
+    /**
+    * Create a session
+    * @param id: set to the session id, cleared if the session can't be created
+    * \return false if the session backend is full
+    */
 
-      do
+    static bool create(std::string& id)
+    {
+      time_t now = time(NULL);
+
+      if (backend != NULL)
       {
-        id.clear();
-        for(size_t i = 0; i < idLength; ++i) 
-          id+=elements[rand()%(nbElements - 1)];
+        unsigned tries = 0;
+        do
+        {
+          generateId(id);
+          if (++tries > 16)
+          {
+            NVJ_LOG->appendUniq(NVJ_ERROR, "HttpSession: the session backend is full");
+            id.clear();
+            return false;
+          }
+        }
+        while (!backend->create(id, now + sessionLifeTime));
+        return true;
       }
-      while (find(id));
-
-      pthread_mutex_lock( &sessions_mutex );
-      sessions[id]=new std::map <std::string, SessionAttribute>();
-      pthread_mutex_unlock( &sessions_mutex );
-      time_t *expiration=(time_t *)malloc(sizeof(time_t));
-      *expiration=time(NULL)+sessionLifeTime;
-      setAttribute(id, "session_expiration", expiration);
-      
-      // look for expired session (max every minute)
-      if (time(NULL) > lastExpirationSearchTime + 60)
+
+      Session *session = new Session;
+      session->expiration = now + sessionLifeTime;
+      session->dirty = true;
+      session->saved = false;
+      session->savedExpiration = 0;
+      session->inWheel = false;
+
+      for (;;)
       {
-        removeExpiredSession();
-        lastExpirationSearchTime = time(NULL);
+        generateId(id);
+        Shard& shard = getShard(id);
+        pthread_mutex_lock( &shard.mutex );
+        expireSessions(shard, now);
+        if (shard.sessions.insert(HttpSessionsContainerMap::value_type(id, session)).second)
+        {
+          session->id = id;
+          wheelInsert(shard, session, session->expiration);
+          pthread_mutex_unlock( &shard.mutex );
+          return true;
+        }
+        pthread_mutex_unlock( &shard.mutex );
       }
     };
-    
+
     /**********************************************************************/
 
     static void updateExpiration(const std::string& id)
     {
-      time_t *expiration=(time_t*)getAttribute(id, "session_expiration");
-      if (expiration != NULL)
-        *expiration=time(NULL)+sessionLifeTime;
+      time_t now = time(NULL);
+      if (backend != NULL)
+        backend->setExpiration(id, now + sessionLifeTime);
+      Shard& shard = getShard(id);
+      pthread_mutex_lock( &shard.mutex );
+      expireSessions(shard, now);
+      Session *session = getSession(shard, id);
+      if (session != NULL)
+      {
+        session->expiration = now + sessionLifeTime;
+        if (!session->inWheel)
+          wheelInsert(shard, session, session->expiration);
+      }
+      pthread_mutex_unlock( &shard.mutex );
     };
 
     /**********************************************************************/
 
     static void noExpiration(const std::string& id)
     {
-      time_t *expiration=(time_t*)getAttribute(id, "session_expiration");
-      if (expiration != NULL)
-        *expiration=0;
+      if (backend != NULL)
+        backend->setExpiration(id, 0);
+      Shard& shard = getShard(id);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, id);
+      if (session != NULL)
+        session->expiration = 0;
+      pthread_mutex_unlock( &shard.mutex );
     };
 
     /**********************************************************************/
 
     static void removeExpiredSession()
     {
-
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); )
+      time_t now = time(NULL);
+      if (backend != NULL)
+        backend->removeExpired(now);
+      for (size_t i = 0; i < HTTPSESSION_NB_SHARDS; i++)
       {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        std::map <std::string, SessionAttribute>::iterator it2 = attributesMap->find("session_expiration");
-        time_t *expiration=NULL;
-        if (it2 != attributesMap->end()) expiration=(time_t*) it2->second.ptr;
-
-        if (expiration!=NULL && *expiration && *expiration > time(NULL))
-        {
-          it++;
-          continue;
-        }
-
-        removeAllAttribute(attributesMap);
-        delete attributesMap;
-        sessions.erase(it++);
+        pthread_mutex_lock( &shards[i].mutex );
+        expireSessions(shards[i], now);
+        pthread_mutex_unlock( &shards[i].mutex );
       }
-      pthread_mutex_unlock( &sessions_mutex );
     }
 
     /**********************************************************************/
 
     static void removeAllSession()
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); )
+      if (backend != NULL)
+        backend->removeAll();
+      for (size_t i = 0; i < HTTPSESSION_NB_SHARDS; i++)
       {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        removeAllAttribute(attributesMap);
-        delete attributesMap;
-        sessions.erase(it++);
+        Shard& shard = shards[i];
+        pthread_mutex_lock( &shard.mutex );
+        while (!shard.sessions.empty())
+          deleteSession(shard, shard.sessions.begin()->second);
+        pthread_mutex_unlock( &shard.mutex );
       }
-      pthread_mutex_unlock( &sessions_mutex );
     }
     
+    /**
+    * Is the session valid ? Its expiration is postponed if so.
+    * @param id: the session id
+    */
     static bool find(const std::string& id)
     {
+      time_t now = time(NULL);
+      bool shared = backend != NULL && backend->touch(id, now, now + sessionLifeTime);
+
+      Shard& shard = getShard(id);
+      pthread_mutex_lock( &shard.mutex );
+      expireSessions(shard, now);
+      Session *session = getSession(shard, id);
+      if (session != NULL && backend != NULL && !shared)
+      {
+        deleteSession(shard, session); // removed by another process
+        session = NULL;
+      }
+      if (session != NULL && session->expiration)
+      {
+        session->expiration = now + sessionLifeTime;
+        if (!session->inWheel)
+          wheelInsert(shard, session, session->expiration);
+      }
+      pthread_mutex_unlock( &shard.mutex );
 
-      bool res;
-      pthread_mutex_lock( &sessions_mutex );
-      res=sessions.size() && sessions.find(id) != sessions.end() ;
-      pthread_mutex_unlock( &sessions_mutex );
-      if (res)
-        updateExpiration(id);
-
-      return res;
+      return backend != NULL ? shared : session != NULL;
     }
     
     /**********************************************************************/
     
     static void remove(const std::string& sid)
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
-      removeAllAttribute(it->second);
-      delete it->second;
-      sessions.erase(it);
-      pthread_mutex_unlock( &sessions_mutex );
+      if (backend != NULL)
+        backend->remove(sid);
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
+      if (session != NULL)
+        deleteSession(shard, session);
+      pthread_mutex_unlock( &shard.mutex );
     }
 
     /**********************************************************************/
 
     static void setObjectAttribute ( const std::string &sid, const std::string &name, SessionAttributeObject *sessionAttributeObject )
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::const_iterator it = sessions.find(sid);
-
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
-
-      std::map <std::string, SessionAttribute>::iterator existing = it->second->find(name);
-      if (existing != it->second->end())
-      {
-        if (existing->second.ptr != NULL)
-        {
-          if (existing->second.type == SessionAttribute::OBJECT)
-            delete existing->second.obj;
-          else
-            free(existing->second.ptr);
-        }
-        it->second->erase(existing);
-      }
-
       SessionAttribute attribute;
       attribute.type=SessionAttribute::OBJECT;
       attribute.obj=sessionAttributeObject;
-      it->second->insert(std::pair<std::string, SessionAttribute>(name, attribute ));
-      pthread_mutex_unlock( &sessions_mutex );
+      setSessionAttribute(sid, name, attribute);
     }
 
     /**********************************************************************/
 
     static void setAttribute ( const std::string &sid, const std::string &name, void* value )
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::const_iterator it = sessions.find(sid);
+      SessionAttribute attribute;
+      attribute.type=SessionAttribute::BASIC;
+      attribute.ptr=value;
+      setSessionAttribute(sid, name, attribute);
+    }
+
+    /**
+    * Set a binary attribute: the value is copied, and shared with the other
+    * processes when a backend is used
+    * \return false if the session is unknown or if the backend can't store the value
+    */
+    static bool setBinaryAttribute ( const std::string &sid, const std::string &name, const void* data, const size_t len )
+    {
+      if (backend != NULL)
+        return backend->setAttribute(sid, name, data, len);
 
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; };
+      SessionAttribute attribute;
+      attribute.type=SessionAttribute::BINARY;
+      attribute.ptr=malloc(len ? len : 1);
+      attribute.len=len;
+      if (attribute.ptr == NULL) return false;
+      memcpy(attribute.ptr, data, len);
+
+      if (setSessionAttribute(sid, name, attribute))
+        return true;
+      free(attribute.ptr);
+      return false;
+    }
+
+    /**********************************************************************/
 
-      std::map <std::string, SessionAttribute>::iterator existing = it->second->find(name);
-      if (existing != it->second->end())
+    static bool getBinaryAttribute( const std::string &sid, const std::string &name, std::string &value )
+    {
+      if (backend != NULL)
+        return backend->getAttribute(sid, name, value);
+
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
+      bool res = false;
+      if (session != NULL)
       {
-        if (existing->second.ptr != NULL)
+        SessionAttributesMap::iterator it2 = session->attributes.find(name);
+        if ( it2 != session->attributes.end() && (it2->second.type == SessionAttribute::BINARY) )
         {
-          if (existing->second.type == SessionAttribute::OBJECT)
-            delete existing->second.obj;
-          else
-            free(existing->second.ptr);
+          value.assign((const char*)it2->second.ptr, it2->second.len);
+          res = true;
         }
-        it->second->erase(existing);
       }
-
-      SessionAttribute attribute;
-      attribute.type=SessionAttribute::BASIC;
-      attribute.ptr=value;
-      it->second->insert(std::pair<std::string, SessionAttribute>(name, attribute ));
-      pthread_mutex_unlock( &sessions_mutex );
+      pthread_mutex_unlock( &shard.mutex );
+      return res;
     }
 
     /**********************************************************************/
 
     static SessionAttributeObject *getObjectAttribute( const std::string &sid, const std::string &name )
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return NULL; }
-
-      std::map <std::string, SessionAttribute>* sessionMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = sessionMap->find(name);
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
       SessionAttributeObject *res = NULL;
-      if ( it2 != sessionMap->end() && (it2->second.type == SessionAttribute::OBJECT) )
-        res = it2->second.obj;
-      pthread_mutex_unlock( &sessions_mutex );
+      if (session != NULL)
+      {
+        SessionAttributesMap::iterator it2 = session->attributes.find(name);
+        if ( it2 != session->attributes.end() && (it2->second.type == SessionAttribute::OBJECT) )
+          res = it2->second.obj;
+      }
+      pthread_mutex_unlock( &shard.mutex );
       return res;
     }
 
@@ -256,24 +688,25 @@ class HttpSession
 
     static void *getAttribute( const std::string &sid, const std::string &name )
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return NULL; }
-
-      std::map <std::string, SessionAttribute>* sessionMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = sessionMap->find(name);
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
       void *res = NULL;
-      if ( it2 != sessionMap->end() && (it2->second.type == SessionAttribute::BASIC))
-        res = it2->second.ptr;
-      pthread_mutex_unlock( &sessions_mutex );
+      if (session != NULL)
+      {
+        SessionAttributesMap::iterator it2 = session->attributes.find(name);
+        if ( it2 != session->attributes.end() && (it2->second.type == SessionAttribute::BASIC))
+          res = it2->second.ptr;
+      }
+      pthread_mutex_unlock( &shard.mutex );
       return res;
     }
 
     /**********************************************************************/
     
-    static void removeAllAttribute( std::map <std::string, SessionAttribute>* attributesMap)
+    static void removeAllAttribute( SessionAttributesMap* attributesMap)
     {
-      std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
+      SessionAttributesMap::iterator iter = attributesMap->begin();
       for(; iter!=attributesMap->end(); ++iter)
         if (iter->second.ptr != NULL)
         {
@@ -288,40 +721,49 @@ class HttpSession
     
     static void removeAttribute( const std::string &sid, const std::string &name )
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it == sessions.end()) { pthread_mutex_unlock( &sessions_mutex ); return; }
-      std::map <std::string, SessionAttribute>* attributesMap=it->second;
-      std::map <std::string, SessionAttribute>::iterator it2 = attributesMap->find(name);
-      if ( it2 != attributesMap->end() ) 
-      { 
-        if (it2->second.ptr != NULL)
-        {
-          if (it2->second.type==SessionAttribute::OBJECT)
-            delete it2->second.obj;
-          else
-            free (it2->second.ptr);
+      if (backend != NULL)
+        backend->removeAttribute(sid, name);
+
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
+      if (session != NULL)
+      {
+        SessionAttributesMap::iterator it2 = session->attributes.find(name);
+        if ( it2 != session->attributes.end() ) 
+        { 
+          if (it2->second.ptr != NULL)
+          {
+            if (it2->second.type==SessionAttribute::OBJECT)
+              delete it2->second.obj;
+            else
+              free (it2->second.ptr);
+          }
+          session->attributes.erase(it2);
+          session->dirty = true;
         }
-        attributesMap->erase(it2);
       }
-      pthread_mutex_unlock( &sessions_mutex ); 
+      pthread_mutex_unlock( &shard.mutex ); 
     }
 
     /**********************************************************************/
     
     static std::vector<std::string> getAttributeNames( const std::string &sid )
     {
-      pthread_mutex_lock( &sessions_mutex );
       std::vector<std::string> res;
-      HttpSessionsContainerMap::iterator it = sessions.find(sid);
-      if (it != sessions.end()) 
+      if (backend != NULL)
+        res = backend->getAttributeNames(sid);
+
+      Shard& shard = getShard(sid);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, sid);
+      if (session != NULL) 
       {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
-        for(; iter!=attributesMap->end(); ++iter)
+        SessionAttributesMap::iterator iter = session->attributes.begin();
+        for(; iter!=session->attributes.end(); ++iter)
           res.push_back(iter->first);
       }
-      pthread_mutex_unlock( &sessions_mutex );
+      pthread_mutex_unlock( &shard.mutex );
       return res;
     }
     
@@ -329,17 +771,19 @@ class HttpSession
     
     static void printAll()
     {
-      pthread_mutex_lock( &sessions_mutex );
-      HttpSessionsContainerMap::iterator it = sessions.begin();
-      for (;it != sessions.end(); ++it )
+      for (size_t i = 0; i < HTTPSESSION_NB_SHARDS; i++)
       {
-        std::map <std::string, SessionAttribute>* attributesMap=it->second;
-        printf("Session SID : '%s' \n", it->first.c_str());
-        std::map <std::string, SessionAttribute>::iterator iter = attributesMap->begin();
-        for(; iter!=attributesMap->end(); ++iter)
-          if ( iter->second.ptr != NULL ) printf("\t'%s'\n", iter->first.c_str());
+        pthread_mutex_lock( &shards[i].mutex );
+        HttpSessionsContainerMap::iterator it = shards[i].sessions.begin();
+        for (;it != shards[i].sessions.end(); ++it )
+        {
+          printf("Session SID : '%s' \n", it->first.c_str());
+          SessionAttributesMap::iterator iter = it->second->attributes.begin();
+          for(; iter!=it->second->attributes.end(); ++iter)
+            if ( iter->second.ptr != NULL ) printf("\t'%s'\n", iter->first.c_str());
+        }
+        pthread_mutex_unlock( &shards[i].mutex );
       }
-            pthread_mutex_unlock( &sessions_mutex );    
     }
     
     /**********************************************************************/    
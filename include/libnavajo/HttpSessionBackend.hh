@@ -0,0 +1,110 @@
+//********************************************************
+/**
+ * @file  HttpSessionBackend.hh
+ *
+ * @brief Session storage interface, used to share the
+ *        sessions between several processes
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef HTTPSESSIONBACKEND_HH_
+#define HTTPSESSIONBACKEND_HH_
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+/***********************************************************************
+ * HttpSessionBackend - where the sessions and their binary attributes
+ * are stored when they must outlive the process or be shared with
+ * other processes (see HttpSession::setBackend()).
+ * Implementations must be thread-safe.
+ * Expiration times are absolute (time(NULL) based), 0 means never.
+ */
+
+class HttpSessionBackend
+{
+  public:
+    virtual ~HttpSessionBackend() {};
+
+    /**
+    * Create a session
+    * @param id: the session id
+    * @param expiration: the expiration time
+    * \return false if the id is already used, or if there is no room left
+    */
+    virtual bool create(const std::string& id, const time_t expiration) = 0;
+
+    /**
+    * Is the session valid ?
+    * @param id: the session id
+    * @param now: the current time
+    */
+    virtual bool exists(const std::string& id, const time_t now) = 0;
+
+    /**
+    * Is the session valid ? Its expiration time is postponed if so (unless it never expires)
+    * @param id: the session id
+    * @param now: the current time
+    * @param expiration: the new expiration time
+    */
+    virtual bool touch(const std::string& id, const time_t now, const time_t expiration) = 0;
+
+    /**
+    * Set the expiration time of a session
+    * @param id: the session id
+    * @param expiration: the expiration time, 0 for never
+    */
+    virtual void setExpiration(const std::string& id, const time_t expiration) = 0;
+
+    /**
+    * Remove a session
+    */
+    virtual void remove(const std::string& id) = 0;
+
+    /**
+    * Remove the sessions expired at this time
+    */
+    virtual void removeExpired(const time_t now) = 0;
+
+    /**
+    * Remove every session
+    */
+    virtual void removeAll() = 0;
+
+    /**
+    * Set a binary attribute
+    * @param id: the session id
+    * @param name: the attribute name
+    * @param data: the value
+    * @param len: the value length
+    * \return false if the session is unknown or if the attribute can't be stored
+    */
+    virtual bool setAttribute(const std::string& id, const std::string& name, const void *data, const size_t len) = 0;
+
+    /**
+    * Get a binary attribute
+    * @param id: the session id
+    * @param name: the attribute name
+    * @param value: set to the attribute value
+    * \return false if not found
+    */
+    virtual bool getAttribute(const std::string& id, const std::string& name, std::string& value) = 0;
+
+    /**
+    * Remove an attribute (if found)
+    */
+    virtual void removeAttribute(const std::string& id, const std::string& name) = 0;
+
+    /**
+    * Get the names of the attributes of a session
+    */
+    virtual std::vector<std::string> getAttributeNames(const std::string& id) = 0;
+};
+
+#endif
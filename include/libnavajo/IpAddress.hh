@@ -290,14 +290,7 @@ class IpNetwork
       {
         if (addr.ipversion != 4) return false; // IpV6 > IpV4
 
-        u_int32_t netmask=0, Anetmask=0;
-     	  for (u_int8_t i=0; i < A.mask ; i++)
-     	    Anetmask |= 1 << (31-i);
-        Anetmask=htonl(Anetmask);
-
-     	  for (u_int8_t i=0; i < mask ; i++)
-     	    netmask |= 1 << (31-i);
-        netmask=htonl(netmask);
+        u_int32_t netmask=htonl(getV4Netmask(mask)), Anetmask=htonl(getV4Netmask(A.mask));
         return (addr.ip.v4 & netmask) < (A.addr.ip.v4 & Anetmask);
       }
 
@@ -313,8 +306,8 @@ class IpNetwork
         {
      	    for (u_int8_t j=i*8; j<(i+1)*8 ; j++)
           {
-     	      if (j < A.mask) Anetmask |= 1 << (8-(j-i*8));
-     	      if (j < mask) netmask |= 1 << (8-(j-i*8));
+     	      if (j < A.mask) Anetmask |= 1 << (7-(j-i*8));
+     	      if (j < mask) netmask |= 1 << (7-(j-i*8));
           }
 
           res = ( addr.ip.v6.s6_addr[i] & netmask ) == ( A.addr.ip.v6.s6_addr[i] & Anetmask );
@@ -342,39 +335,36 @@ class IpNetwork
 
     inline bool isInside(const IpAddress& ip) const
     {
-      bool res = false;
+      if (ip.ipversion != addr.ipversion)
+        return false;
 
       if (ip.ipversion == 4)
       {
-        if (addr.ipversion == 4)
-        {
-          u_int32_t netmask=0;
-          for (u_int8_t j=0; j < mask ; j++)
-     	      netmask |= 1 << (31-j);
-          netmask=htonl(netmask);
-          res = ( addr.ip.v4 & netmask ) == ( ip.ip.v4 & netmask ) ;
-        }
+        u_int32_t netmask = htonl(getV4Netmask(mask));
+        return ( addr.ip.v4 & netmask ) == ( ip.ip.v4 & netmask ) ;
       }
 
       if (ip.ipversion == 6)
       {
-        if (addr.ipversion == 6)
-        {
-          res=true;
-          int i=0;
-
-          for (; i<INET6_ADDRLEN && res; i++)
-          {
-            u_int8_t netmask=0;
-            for (u_int8_t j=i*8; j<(i+1)*8 ; j++)
-     	        if (j < mask) netmask |= 1 << (8-(j-i*8));
-
-            res = ( ( addr.ip.v6.s6_addr[i] & netmask ) == (ip.ip.v6.s6_addr[i] & netmask) );
-          }
-        }
+        unsigned fullBytes = mask >= 128 ? INET6_ADDRLEN : mask / 8;
+        if ( memcmp(addr.ip.v6.s6_addr, ip.ip.v6.s6_addr, fullBytes) != 0 )
+          return false;
+        if ( fullBytes == INET6_ADDRLEN || !(mask % 8) )
+          return true;
+        u_int8_t netmask = (u_int8_t)(0xFF00 >> (mask % 8));
+        return ( addr.ip.v6.s6_addr[fullBytes] & netmask ) == ( ip.ip.v6.s6_addr[fullBytes] & netmask );
       }
 
-      return res;
+      return false;
+    };
+
+    /**
+      * IPv4 netmask of a prefix length, in host byte order
+      */
+    inline static u_int32_t getV4Netmask(const u_int8_t prefix)
+    {
+      if (!prefix) return 0;
+      return 0xFFFFFFFFu << (32 - (prefix > 32 ? 32 : prefix));
     };
 
     inline static IpNetwork* fromString(const std::string& value)
@@ -454,7 +444,11 @@ class IpNetwork
 	        while (j < maskStr.length() && ( maskStr[j] == ' ' || maskStr[j] == '\t' || maskStr[j] == '\n' || maskStr[j] == '\r') )
 	          j++;
 
-	        if (e==s || j!=maskStr.length()) return NULL;
+	        if (e==s || j!=maskStr.length())
+	        {
+	          delete addr;
+	          return NULL;
+	        }
 
           maskDec=atoi(maskStr.substr(s,e-s+1).c_str());
         }
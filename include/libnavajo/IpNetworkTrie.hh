@@ -0,0 +1,128 @@
+//********************************************************
+/**
+ * @file  IpNetworkTrie.hh
+ *
+ * @brief Binary prefix trie of IpNetwork (V4 and V6),
+ *        used for the allowed/denied hosts lists
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef IPNETWORKTRIE_HH_
+#define IPNETWORKTRIE_HH_
+
+#include <vector>
+
+#include "libnavajo/IpAddress.hh"
+
+
+/***********************************************************************
+ * IpNetworkTrie - a set of IpNetwork, each one tagged with flags.
+ * lookup() walks the address bits once: its cost only depends on the
+ * longest prefix length, not on the number of networks.
+ * The trie is built once (add) then only read, so it can be shared
+ * between threads without lock once built.
+ */
+
+class IpNetworkTrie
+{
+    struct Node
+    {
+      u_int32_t child[2]; // 0: no child
+      u_int8_t flags;     // flags of the networks ending on this node
+    };
+
+    std::vector<Node> nodes; // nodes[0]: IPv4 root, nodes[1]: IPv6 root
+    u_int8_t allFlags;
+
+    static inline bool getBit(const IpAddress& ip, const unsigned i, const u_int32_t v4)
+    {
+      if (ip.ipversion == 4)
+        return (v4 >> (31 - i)) & 1;
+      return (ip.ip.v6.s6_addr[i >> 3] >> (7 - (i & 7))) & 1;
+    }
+
+  public:
+
+    IpNetworkTrie() { clear(); };
+
+    /**
+    * Remove every network
+    */
+    inline void clear()
+    {
+      nodes.clear();
+      Node root; root.child[0] = root.child[1] = 0; root.flags = 0;
+      nodes.push_back(root); // IPv4
+      nodes.push_back(root); // IPv6
+      allFlags = 0;
+    };
+
+    /**
+    * Is there a network tagged with these flags ?
+    */
+    inline bool contains(const u_int8_t flags) const { return (allFlags & flags) != 0; };
+
+    /**
+    * Add a network
+    * @param net: the network
+    * @param flags: the flags of this network (must not be null)
+    */
+    inline void add(const IpNetwork& net, const u_int8_t flags)
+    {
+      if (net.addr.ipversion != 4 && net.addr.ipversion != 6)
+        return;
+
+      unsigned maxLen = net.addr.ipversion == 4 ? 32 : 128;
+      unsigned len = net.mask > maxLen ? maxLen : net.mask;
+      u_int32_t v4 = net.addr.ipversion == 4 ? ntohl(net.addr.ip.v4) : 0;
+      u_int32_t n = net.addr.ipversion == 4 ? 0 : 1;
+
+      for (unsigned i = 0; i < len; i++)
+      {
+        bool b = getBit(net.addr, i, v4);
+        if (!nodes[n].child[b])
+        {
+          Node node; node.child[0] = node.child[1] = 0; node.flags = 0;
+          nodes.push_back(node);
+          nodes[n].child[b] = (u_int32_t)(nodes.size() - 1);
+        }
+        n = nodes[n].child[b];
+      }
+
+      nodes[n].flags |= flags;
+      allFlags |= flags;
+    };
+
+    /**
+    * Get the flags of the networks containing an address
+    * @param ip: the address
+    * @param stopFlags: stop the walk as soon as one of these flags is found
+    * \return the union of the flags of every network containing ip
+    */
+    inline u_int8_t lookup(const IpAddress& ip, const u_int8_t stopFlags = 0) const
+    {
+      if (ip.ipversion != 4 && ip.ipversion != 6)
+        return 0;
+
+      unsigned len = ip.ipversion == 4 ? 32 : 128;
+      u_int32_t v4 = ip.ipversion == 4 ? ntohl(ip.ip.v4) : 0;
+      u_int32_t n = ip.ipversion == 4 ? 0 : 1;
+      u_int8_t res = nodes[n].flags;
+
+      for (unsigned i = 0; i < len && !(res & stopFlags); i++)
+      {
+        n = nodes[n].child[getBit(ip, i, v4)];
+        if (!n) break;
+        res |= nodes[n].flags;
+      }
+
+      return res;
+    };
+};
+
+#endif
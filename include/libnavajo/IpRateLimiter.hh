@@ -0,0 +1,193 @@
+//********************************************************
+/**
+ * @file  IpRateLimiter.hh
+ *
+ * @brief Per-client connection caps and token bucket
+ *        rate limits, keyed on IpAddress / IpNetwork
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef IPRATELIMITER_HH_
+#define IPRATELIMITER_HH_
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+
+#include "libnavajo/IpAddress.hh"
+
+class IpRateLimiter;
+
+/**
+* IpRateLimiterLimits - the limits applied to a client (an address or a network)
+* A null value means no limit.
+*/
+struct IpRateLimiterLimits
+{
+  unsigned maxConnections;      // concurrent connections
+  double connectionsPerSecond;  // new connections rate...
+  unsigned connectionsBurst;    // ...and burst
+  double requestsPerSecond;     // requests rate (keep-alive requests included)...
+  unsigned requestsBurst;       // ...and burst
+
+  IpRateLimiterLimits(): maxConnections(0), connectionsPerSecond(0), connectionsBurst(0),
+                         requestsPerSecond(0), requestsBurst(0) { };
+};
+
+/**
+* IpRateLimiterKey - a client address masked to its prefix length
+*/
+struct IpRateLimiterKey
+{
+  u_int8_t ipversion;
+  u_int8_t prefix;
+  unsigned char addr[INET6_ADDRLEN];
+
+  inline bool operator== (const IpRateLimiterKey& k) const
+    { return ipversion == k.ipversion && prefix == k.prefix && memcmp(addr, k.addr, INET6_ADDRLEN) == 0; };
+};
+
+struct IpRateLimiterKeyHash
+{
+  inline size_t operator()(const IpRateLimiterKey& k) const
+  {
+    u_int64_t a, b;
+    memcpy(&a, k.addr, 8);
+    memcpy(&b, k.addr + 8, 8);
+    u_int64_t h = a * 0x9E3779B97F4A7C15ULL ^ (b + 0x632BE59BD9B4E019ULL + ((u_int64_t)k.prefix << 8 | k.ipversion));
+    h ^= h >> 29; h *= 0xBF58476D1CE4E5B9ULL; h ^= h >> 32;
+    return (size_t)h;
+  };
+};
+
+/**
+* IpRateLimiterEntry - the state of a client, kept by the connection (ClientSockData)
+* while it is open. An entry is never evicted while it has open connections.
+*/
+struct IpRateLimiterEntry
+{
+  IpRateLimiterKey key;
+  IpRateLimiterLimits limits;
+  IpRateLimiter *limiter;
+  unsigned shard;
+  unsigned connections;
+  double connectionTokens, requestTokens;
+  unsigned long long connectionRefill, requestRefill; // ms
+};
+
+  /**
+  * IpRateLimiter - limits the connections and requests of each client,
+  * so that a single client can't monopolize the worker threads.
+  * Clients are keyed on their address masked to a prefix length (so
+  * that an IPv6 client can't escape its limits by changing of address
+  * in its /64), or on a configured IpNetwork which then shares its limits.
+  * The state is kept in a sharded table bounded in size: idle clients
+  * are evicted in least recently seen order, and while every client
+  * tracked has open connections, the new clients are refused.
+  * The configuration must be done before the WebServer is started.
+  */
+  class IpRateLimiter
+  {
+    public:
+
+      IpRateLimiter();
+      ~IpRateLimiter();
+
+      /**
+      * Set the limits applied to every client
+      * @param limits: the default limits
+      */
+      inline void setDefaultLimits(const IpRateLimiterLimits& limits) { defaultLimits = limits; };
+
+      /**
+      * Set the limits applied to a network: its clients share these limits.
+      * The first network added which contains the client is used.
+      * A network added with no limits is exempted.
+      * @param net: the network
+      * @param limits: the network limits
+      */
+      inline void addNetworkLimits(const IpNetwork& net, const IpRateLimiterLimits& limits)
+        { networkLimits.push_back(std::pair<IpNetwork, IpRateLimiterLimits>(net, limits)); };
+
+      /**
+      * Set the prefix lengths used to key the clients which are not inside a configured network
+      * @param v4Prefix: IPv4 prefix length (Default value: 32)
+      * @param v6Prefix: IPv6 prefix length (Default value: 64)
+      */
+      inline void setPrefixLength(const u_int8_t v4Prefix, const u_int8_t v6Prefix)
+        { prefixV4 = v4Prefix > 32 ? 32 : v4Prefix; prefixV6 = v6Prefix > 128 ? 128 : v6Prefix; };
+
+      /**
+      * Set the maximum number of clients tracked, which bounds the number
+      * of distinct clients connected at the same time
+      * @param max: the table size (Default value: 65536)
+      */
+      void setMaxEntries(const size_t max);
+
+      /**
+      * A connection is accepted: check the client limits
+      * @param ip: the client address
+      * @param entry: set to the client entry, to be released with releaseConnection()
+      *               (NULL if the client is not tracked)
+      * \return false if the connection must be refused
+      */
+      bool acquireConnection(const IpAddress& ip, IpRateLimiterEntry **entry);
+
+      /**
+      * A request is received on a connection: check the client requests rate
+      * @param entry: the entry returned by acquireConnection(), can be NULL
+      * \return false if the request must be refused
+      */
+      static bool allowRequest(IpRateLimiterEntry *entry);
+
+      /**
+      * A connection is closed
+      * @param entry: the entry returned by acquireConnection(), can be NULL
+      */
+      static void releaseConnection(IpRateLimiterEntry *entry);
+
+      /**
+      * Get the number of connections refused
+      */
+      unsigned long long getDeniedConnectionsCount();
+
+      /**
+      * Get the number of requests refused
+      */
+      unsigned long long getDeniedRequestsCount();
+
+    private:
+
+      struct Shard
+      {
+        pthread_mutex_t mutex;
+        std::list<IpRateLimiterEntry> idle;      // without connection, most recently seen first
+        std::list<IpRateLimiterEntry> connected; // not evicted
+        std::unordered_map<IpRateLimiterKey, std::list<IpRateLimiterEntry>::iterator, IpRateLimiterKeyHash> index;
+        unsigned long long deniedConnections, deniedRequests;
+      };
+
+      std::vector<Shard> shards;
+      size_t maxEntriesPerShard;
+      u_int8_t prefixV4, prefixV6;
+      IpRateLimiterLimits defaultLimits;
+      std::vector< std::pair<IpNetwork, IpRateLimiterLimits> > networkLimits;
+
+      IpRateLimiter(const IpRateLimiter&);
+      IpRateLimiter& operator=(const IpRateLimiter&);
+
+      static void makeKey(const IpAddress& ip, const u_int8_t prefix, IpRateLimiterKey& key);
+      const IpRateLimiterLimits& getLimits(const IpAddress& ip, IpRateLimiterKey& key) const;
+      bool evictOne(Shard& shard);
+      static bool takeToken(double& tokens, unsigned long long& lastRefill, const double rate,
+                            const unsigned burst, const unsigned long long now);
+  };
+
+#endif
@@ -0,0 +1,144 @@
+//********************************************************
+/**
+ * @file  JwtVerifier.hh
+ *
+ * @brief JSON Web Token (RFC 7519) signature and claims
+ *        verification, HS256, RS256 and ES256
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef JWTVERIFIER_HH_
+#define JWTVERIFIER_HH_
+
+#include <ctime>
+#include <string>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <openssl/evp.h>
+
+/**
+* JwtClaims - the registered claims of a token, and its scopes,
+* parsed once when the token is verified
+*/
+struct JwtClaims
+{
+  std::string subject;                // "sub"
+  std::string issuer;                 // "iss"
+  std::vector<std::string> audiences; // "aud"
+  time_t expiration;                  // "exp", 0 if none
+  time_t notBefore;                   // "nbf", 0 if none
+  time_t issuedAt;                    // "iat", 0 if none
+  std::vector<std::string> scopes;    // "scope" (space separated) or "scp" (array), sorted
+  std::string payload;                // the JSON payload, for the other claims
+
+  JwtClaims(): expiration(0), notBefore(0), issuedAt(0) { };
+
+  /**
+  * Does the token carry this scope ?
+  */
+  inline bool hasScope(const std::string& scope) const
+    { return std::binary_search(scopes.begin(), scopes.end(), scope); };
+};
+
+/***********************************************************************
+ * JwtVerifier - checks the compact serialization of a JWT: the
+ * signature with the configured key (the "alg" of the token must be the
+ * one of the key, "none" is never accepted), then the expiration,
+ * not-before, issuer and audience claims.
+ * Scopes can be required for the resources under an url prefix.
+ * See WebServer::setAuthBearerJwtVerifier().
+ */
+
+class JwtVerifier
+{
+  public:
+
+    JwtVerifier();
+    ~JwtVerifier();
+
+    /**
+    * Use a HS256 shared secret
+    */
+    void setHmacSecret(const std::string& secret);
+
+    /**
+    * Use a public key (RSA for RS256, EC P-256 for ES256)
+    * @param pem: the PEM encoded public key or certificate
+    * @throw std::runtime_error if the key can't be loaded
+    */
+    void setPublicKeyPem(const std::string& pem);
+
+    /**
+    * Require the "iss" claim
+    */
+    inline void setIssuer(const std::string& iss) { issuer = iss; };
+
+    /**
+    * Require the "aud" claim to contain this audience
+    */
+    inline void setAudience(const std::string& aud) { audience = aud; };
+
+    /**
+    * Clock skew tolerated on "exp" and "nbf" (Default value: 0 second)
+    */
+    inline void setLeeway(const time_t seconds) { leeway = seconds; };
+
+    /**
+    * Require a scope for the resources whose url starts with urlPrefix
+    * (the url has no leading '/', as given to the repositories)
+    */
+    inline void addRequiredScope(const std::string& urlPrefix, const std::string& scope)
+      { requiredScopes.push_back(std::make_pair(urlPrefix, scope)); };
+
+    /**
+    * Verify a token
+    * @param token: the token (header.payload.signature, base64url encoded)
+    * @param now: the current time
+    * @param claims: set to the token claims
+    * @param error: set to the reason of the failure
+    * \return true if the token is valid
+    */
+    bool verify(const std::string& token, const time_t now, JwtClaims& claims, std::string& error) const;
+
+    /**
+    * Check the scopes required for a resource
+    * @param claims: the token claims
+    * @param resourceUrl: the resource url
+    * @param missing: set to the first missing scope
+    * \return true if all the required scopes are present
+    */
+    bool checkScopes(const JwtClaims& claims, const std::string& resourceUrl, std::string& missing) const;
+
+    /**
+    * Callbacks for WebServer::setAuthBearerDecodeCallbacks(), for HS256 tokens
+    * (the secret given to setAuthBearerDecodeCallbacks() is the HMAC key).
+    * The decoded token is its JSON payload.
+    */
+    static int hs256DecodeCallback(const std::string& tokb64, std::string& secret, std::string& decoded);
+    static time_t expirationCallback(std::string& decoded);
+
+  private:
+
+    typedef enum { NO_KEY, HS256, RS256, ES256 } Algorithm;
+
+    Algorithm algorithm;
+    std::string hmacSecret;
+    EVP_PKEY *publicKey;
+    std::string issuer, audience;
+    time_t leeway;
+    std::vector< std::pair<std::string, std::string> > requiredScopes;
+
+    JwtVerifier(const JwtVerifier&);
+    JwtVerifier& operator=(const JwtVerifier&);
+
+    bool checkSignature(const std::string& signedPart, const std::string& signature) const;
+    static bool parseClaims(const std::string& json, JwtClaims& claims);
+};
+
+#endif
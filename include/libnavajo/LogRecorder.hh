@@ -64,6 +64,7 @@
 	      theLogRecorder=NULL;
       }
       void setDebugMode(bool d=true) { debugMode=d; };
+      bool isDebugMode() { return debugMode; };
       void addLogOutput(LogOutput *);
       void removeLogOutputs();
 
@@ -0,0 +1,135 @@
+//********************************************************
+/**
+ * @file  PeerDnAuthorizer.hh
+ *
+ * @brief X509 client authorization by Distinguished Name,
+ *        with cached decisions and lock-free statistics
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef PEERDNAUTHORIZER_HH_
+#define PEERDNAUTHORIZER_HH_
+
+#include <ctime>
+#include <atomic>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "libnavajo/PeerHistory.hh"
+
+#define PEERDNAUTHORIZER_NB_SHARDS 16
+#define PEERDNAUTHORIZER_DEFAULT_MAX_ENTRIES 4096
+
+/***********************************************************************
+ * PeerDnAuthorizer - the authorized DN are indexed in a hash table and
+ * interned: an authorized connection only points to its DN, which lives
+ * as long as the authorizer.
+ * The decision taken for a certificate is cached by fingerprint
+ * (SHA-256), in independently locked and bounded shards, for verified
+ * certificates only: the resumed
+ * sessions, which carry the certificate of the full handshake, and the
+ * clients reconnecting are authorized without decoding their DN.
+ * Each authorized DN keeps its own connections counter and last connection
+ * time, updated atomically: the history is bounded by the number of
+ * authorized DN and takes no lock. It is the DN history of the webserver
+ * (PeerHistory only keeps the IP addresses one).
+ */
+
+class PeerDnAuthorizer
+{
+  public:
+
+    /**
+    * @param maxEntries: the maximum number of certificate decisions kept
+    */
+    PeerDnAuthorizer(const size_t maxEntries = PEERDNAUTHORIZER_DEFAULT_MAX_ENTRIES);
+    ~PeerDnAuthorizer();
+
+    /**
+    * Authorize a DN
+    * @param dn: the DN, in the X509_NAME_oneline() format
+    */
+    void addDn(const std::string& dn);
+
+    /**
+    * Is this DN authorized ?
+    */
+    bool isAuthorized(const std::string& dn);
+
+    /**
+    * Authorize the peer of a TLS connection (after the handshake), and
+    * record its connection
+    * @param ssl: the connection
+    * @param now: the connection time
+    * @param previous: set to the previous connection time of this peer, or 0 if unknown
+    * \return the interned DN of the peer, or NULL if it is not authorized
+    */
+    const std::string* authorize(SSL *ssl, const time_t now, time_t& previous);
+
+    /**
+    * Get the most recently seen peers
+    * @param maxPeers: the maximum number of peers returned
+    */
+    std::map<std::string, time_t> getLastSeen(const size_t maxPeers);
+
+    /**
+    * Get the peers statistics. The number of unique peers is exact.
+    * @param maxPeers: the maximum number of peers in lastSeen
+    * @param topK: the number of most frequent peers returned
+    */
+    PeerHistorySnapshot<std::string> getSnapshot(const size_t maxPeers, const size_t topK);
+
+    /**
+    * Change the maximum number of certificate decisions kept
+    */
+    void setCapacity(const size_t maxEntries);
+
+  private:
+
+    struct AuthorizedDn
+    {
+      std::string dn;
+      std::atomic<unsigned long long> connections;
+      std::atomic<time_t> lastSeen;
+      AuthorizedDn(const std::string& dn): dn(dn), connections(0), lastSeen(0) { };
+    };
+
+    // the certificates seen, most recently used first
+    // (the DN is NULL when the certificate is not authorized)
+    typedef std::list< std::pair<std::string, AuthorizedDn*> > DecisionList;
+
+    struct Shard
+    {
+      pthread_mutex_t mutex;
+      DecisionList decisions;
+      std::unordered_map<std::string, DecisionList::iterator> index;
+    };
+
+    pthread_mutex_t dnMutex;
+    std::unordered_map<std::string, AuthorizedDn*> authorizedDn;
+    std::atomic<unsigned long> generation; // incremented when the authorized DN change
+    std::vector<Shard> shards;
+    size_t maxEntriesPerShard;
+
+    PeerDnAuthorizer(const PeerDnAuthorizer&);
+    PeerDnAuthorizer& operator=(const PeerDnAuthorizer&);
+
+    inline Shard& shardOf(const std::string& fingerprint)
+      { return shards[(unsigned char)fingerprint[0] % shards.size()]; };
+
+    AuthorizedDn* lookup(X509 *peer, unsigned long& gen);
+    void flushDecisions();
+};
+
+#endif
@@ -0,0 +1,270 @@
+//********************************************************
+/**
+ * @file  PeerHistory.hh
+ *
+ * @brief Bounded history of the web clients: unique
+ *        clients estimate (HyperLogLog), heavy hitters
+ *        (Space-Saving top-K) and last-seen LRU
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef PEERHISTORY_HH_
+#define PEERHISTORY_HH_
+
+#include <time.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <unordered_map>
+
+#include "libnavajo/IpAddress.hh"
+
+#define PEERHISTORY_HLL_PRECISION 12 // 4096 registers, ~1.6% standard error
+
+/***********************************************************************
+ * peerHistoryHash - 64 bits hash of the keys (FNV-1a + final mixing)
+ */
+
+inline u_int64_t peerHistoryHash(const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char *)data;
+  u_int64_t h = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 0x100000001B3ULL; }
+  h ^= h >> 33; h *= 0xFF51AFD7ED558CCDULL;
+  h ^= h >> 33; h *= 0xC4CEB9FE1A85EC53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+inline u_int64_t peerHistoryHash(const IpAddress& ip)
+{
+  if (ip.ipversion == 4)
+    return peerHistoryHash(&ip.ip.v4, sizeof(ip.ip.v4));
+  return peerHistoryHash(ip.ip.v6.s6_addr, INET6_ADDRLEN);
+}
+
+/***********************************************************************
+ * PeerHistorySnapshot - a copy of the history at a given time
+ */
+
+template <class Key> struct PeerHistorySnapshot
+{
+  unsigned long long connections;      // total number of connections
+  unsigned long long uniquePeers;      // estimated number of distinct peers
+  std::vector< std::pair<Key, unsigned long long> > topPeers; // heavy hitters, most frequent first
+                                                              // (counts are overestimated by at most connections/K)
+  std::map<Key, time_t> lastSeen;      // the most recently seen peers
+};
+
+/***********************************************************************
+ * PeerHistory - thread-safe and bounded in memory whatever the number
+ * of peers: only the heavy hitters and the most recently seen peers
+ * are kept, the distinct peers are counted with a HyperLogLog sketch.
+ * Used for the IP addresses: the authorized DN are a known set, their
+ * history is kept by PeerDnAuthorizer.
+ */
+
+template <class Key> class PeerHistory
+{
+    struct KeyHash { size_t operator()(const Key& k) const { return (size_t)peerHistoryHash(k); } };
+
+    struct Counter
+    {
+      Key key;
+      unsigned long long count;
+    };
+
+    pthread_mutex_t mutex;
+
+    unsigned long long connections;
+    unsigned char registers[1 << PEERHISTORY_HLL_PRECISION];
+
+    size_t topK;
+    std::vector<Counter> counters;
+    std::unordered_map<Key, size_t, KeyHash> countersIndex;
+
+    size_t lastSeenCapacity;
+    typedef std::list< std::pair<Key, time_t> > LastSeenList;
+    LastSeenList lastSeen; // most recently seen first
+    std::unordered_map<Key, typename LastSeenList::iterator, KeyHash> lastSeenIndex;
+
+    PeerHistory(const PeerHistory&);
+    PeerHistory& operator=(const PeerHistory&);
+
+    inline void addToSketch(const u_int64_t h)
+    {
+      size_t idx = (size_t)(h >> (64 - PEERHISTORY_HLL_PRECISION));
+      u_int64_t w = (h << PEERHISTORY_HLL_PRECISION) | ((u_int64_t)1 << (PEERHISTORY_HLL_PRECISION - 1));
+      unsigned char rank = (unsigned char)(__builtin_clzll(w) + 1);
+      if (rank > registers[idx]) registers[idx] = rank;
+    }
+
+    inline void addToTopK(const Key& key)
+    {
+      typename std::unordered_map<Key, size_t, KeyHash>::iterator it = countersIndex.find(key);
+      if (it != countersIndex.end())
+      {
+        counters[it->second].count++;
+        return;
+      }
+
+      if (counters.size() < topK)
+      {
+        Counter c; c.key = key; c.count = 1;
+        countersIndex[key] = counters.size();
+        counters.push_back(c);
+        return;
+      }
+
+      if (counters.empty())
+        return;
+
+      // Space-Saving: the new key replaces the least frequent one and inherits its count
+      size_t min = 0;
+      for (size_t i = 1; i < counters.size(); i++)
+        if (counters[i].count < counters[min].count) min = i;
+      countersIndex.erase(counters[min].key);
+      counters[min].key = key;
+      counters[min].count++;
+      countersIndex[key] = min;
+    }
+
+    inline unsigned long long estimateUniquePeers() const
+    {
+      const double m = 1 << PEERHISTORY_HLL_PRECISION;
+      double sum = 0; unsigned zeros = 0;
+      for (size_t i = 0; i < sizeof(registers); i++)
+      {
+        sum += ldexp(1.0, -registers[i]);
+        if (!registers[i]) zeros++;
+      }
+      double estimate = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+      if (estimate <= 2.5 * m && zeros)
+        estimate = m * log(m / zeros); // linear counting for the small cardinalities
+      return (unsigned long long)(estimate + 0.5);
+    }
+
+    static bool compareCounters(const std::pair<Key, unsigned long long>& a, const std::pair<Key, unsigned long long>& b)
+      { return a.second > b.second; }
+
+  public:
+
+    /**
+    * @param lastSeenCapacity: the number of peers whose last connection time is kept
+    * @param topK: the number of heavy hitters tracked
+    */
+    PeerHistory(const size_t lastSeenCapacity = 1024, const size_t topK = 32):
+      connections(0), topK(topK), lastSeenCapacity(lastSeenCapacity)
+    {
+      pthread_mutex_init(&mutex, NULL);
+      memset(registers, 0, sizeof(registers));
+    }
+
+    ~PeerHistory() { pthread_mutex_destroy(&mutex); }
+
+    /**
+    * Change the capacities. The heavy hitters are reset if topK changes.
+    */
+    void setCapacity(const size_t lastSeenCap, const size_t k)
+    {
+      pthread_mutex_lock(&mutex);
+      lastSeenCapacity = lastSeenCap;
+      while (lastSeen.size() > lastSeenCapacity)
+      {
+        lastSeenIndex.erase(lastSeen.back().first);
+        lastSeen.pop_back();
+      }
+      if (k != topK)
+      {
+        topK = k;
+        counters.clear();
+        countersIndex.clear();
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+
+    /**
+    * Record a connection
+    * @param key: the peer
+    * @param now: the connection time
+    * \return the previous connection time of this peer, or 0 if unknown
+    */
+    time_t update(const Key& key, const time_t now)
+    {
+      time_t previous = 0;
+      u_int64_t h = peerHistoryHash(key);
+
+      pthread_mutex_lock(&mutex);
+
+      connections++;
+      addToSketch(h);
+      addToTopK(key);
+
+      typename std::unordered_map<Key, typename LastSeenList::iterator, KeyHash>::iterator it = lastSeenIndex.find(key);
+      if (it != lastSeenIndex.end())
+      {
+        previous = it->second->second;
+        it->second->second = now;
+        lastSeen.splice(lastSeen.begin(), lastSeen, it->second);
+      }
+      else if (lastSeenCapacity)
+      {
+        if (lastSeen.size() >= lastSeenCapacity)
+        {
+          lastSeenIndex.erase(lastSeen.back().first);
+          lastSeen.pop_back();
+        }
+        lastSeen.push_front(std::pair<Key, time_t>(key, now));
+        lastSeenIndex[key] = lastSeen.begin();
+      }
+
+      pthread_mutex_unlock(&mutex);
+
+      return previous;
+    }
+
+    /**
+    * Get the most recently seen peers
+    * \return a copy of the last-seen table
+    */
+    std::map<Key, time_t> getLastSeen()
+    {
+      pthread_mutex_lock(&mutex);
+      std::map<Key, time_t> res(lastSeen.begin(), lastSeen.end());
+      pthread_mutex_unlock(&mutex);
+      return res;
+    }
+
+    /**
+    * Get a copy of the whole history
+    */
+    PeerHistorySnapshot<Key> getSnapshot()
+    {
+      PeerHistorySnapshot<Key> res;
+
+      pthread_mutex_lock(&mutex);
+      res.connections = connections;
+      res.uniquePeers = estimateUniquePeers();
+      res.topPeers.reserve(counters.size());
+      for (size_t i = 0; i < counters.size(); i++)
+        res.topPeers.push_back(std::pair<Key, unsigned long long>(counters[i].key, counters[i].count));
+      res.lastSeen.insert(lastSeen.begin(), lastSeen.end());
+      pthread_mutex_unlock(&mutex);
+
+      std::sort(res.topPeers.begin(), res.topPeers.end(), compareCounters);
+      return res;
+    }
+};
+
+#endif
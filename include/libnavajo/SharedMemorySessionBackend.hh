@@ -0,0 +1,105 @@
+//********************************************************
+/**
+ * @file  SharedMemorySessionBackend.hh
+ *
+ * @brief Sessions stored in a shared memory hash table,
+ *        shared by the processes of a host
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef SHAREDMEMORYSESSIONBACKEND_HH_
+#define SHAREDMEMORYSESSIONBACKEND_HH_
+
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+#include "libnavajo/HttpSessionBackend.hh"
+
+/***********************************************************************
+ * SharedMemorySessionBackend - an open addressing hash table in a POSIX
+ * shared memory object (shm_open + mmap), usable by several processes.
+ * The table is split into stripes, each one with a process-shared robust
+ * mutex taken by the writers and a sequence counter: the readers never
+ * lock, they retry if a writer was working on the same stripe.
+ * A process dying while it holds a stripe (or during a write) doesn't
+ * lose the other sessions: the next writer rebuilds the stripe.
+ * Each session has a fixed number of attribute slots of a fixed size.
+ * The segment outlives the processes, until unlink() is called.
+ */
+
+class SharedMemorySessionBackend : public HttpSessionBackend
+{
+  public:
+
+    /**
+    * Open (or create) the shared table. Every process must use the same sizes.
+    * @param name: the shared memory object name (ex: "/navajo_sessions")
+    * @param maxSessions: the maximum number of sessions (Default value: 16384)
+    * @param maxAttributes: the maximum number of attributes per session (Default value: 8)
+    * @param attributeValueSize: the maximum size of an attribute value (Default value: 256)
+    * @throw std::runtime_error if the table can't be opened
+    */
+    SharedMemorySessionBackend(const std::string& name, const size_t maxSessions = 16384,
+                               const unsigned maxAttributes = 8, const size_t attributeValueSize = 256);
+    ~SharedMemorySessionBackend();
+
+    /**
+    * Remove the shared memory object (the processes which have it mapped keep using it)
+    */
+    static void unlink(const std::string& name);
+
+    bool create(const std::string& id, const time_t expiration);
+    bool exists(const std::string& id, const time_t now);
+    bool touch(const std::string& id, const time_t now, const time_t expiration);
+    void setExpiration(const std::string& id, const time_t expiration);
+    void remove(const std::string& id);
+    void removeExpired(const time_t now);
+    void removeAll();
+    bool setAttribute(const std::string& id, const std::string& name, const void *data, const size_t len);
+    bool getAttribute(const std::string& id, const std::string& name, std::string& value);
+    void removeAttribute(const std::string& id, const std::string& name);
+    std::vector<std::string> getAttributeNames(const std::string& id);
+
+  private:
+
+    struct Header;
+    struct Stripe;
+    struct Slot;
+    struct Attribute;
+
+    int fd;
+    void *mapping;
+    size_t mappingSize;
+    Header *header;
+    unsigned nbStripes, slotsPerStripe, maxAttributes;
+    size_t attributeValueSize, attributeSize, slotSize;
+
+    SharedMemorySessionBackend(const SharedMemorySessionBackend&);
+    SharedMemorySessionBackend& operator=(const SharedMemorySessionBackend&);
+
+    Stripe* getStripe(const unsigned i) const;
+    Slot* getSlot(const unsigned stripe, const unsigned i) const;
+    Attribute* attributeAt(Slot* slot, const unsigned i) const;
+    static u_int64_t hash(const char *id, const size_t len);
+    unsigned stripeOf(const u_int64_t h) const;
+    unsigned homeOf(const u_int64_t h) const;
+
+    int lookup(const unsigned stripe, const u_int64_t h, const std::string& id) const;
+    Attribute* findAttribute(Slot* slot, const std::string& name) const;
+    void lockStripe(const unsigned stripe);
+    void unlockStripe(const unsigned stripe);
+    u_int32_t readBegin(const unsigned stripe) const;
+    bool readEnd(const unsigned stripe, const u_int32_t seq) const;
+    void writeBegin(const unsigned stripe);
+    void writeEnd(const unsigned stripe);
+    void eraseSlot(const unsigned stripe, unsigned i);
+    void rebuildStripe(const unsigned stripe);
+};
+
+#endif
@@ -25,18 +25,31 @@
 #include <queue>
 #include <string>
 #include <map>
+#include <set>
+#include <atomic>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
 #include "libnavajo/LogRecorder.hh"
 #include "libnavajo/IpAddress.hh"
+#include "libnavajo/IpNetworkTrie.hh"
+#include "libnavajo/IpRateLimiter.hh"
+#include "libnavajo/BearerTokenCache.hh"
+#include "libnavajo/CredentialStore.hh"
+#include "libnavajo/JwtVerifier.hh"
+#include "libnavajo/PeerDnAuthorizer.hh"
+#include "libnavajo/PeerHistory.hh"
 #include "libnavajo/WebRepository.hh"
 #include "libnavajo/nvjThread.h"
 
 
 class WebSocket;
+class WebSocketDeflateParams;
+class HttpAsyncCompletion;
 class WebServer
 {
+    friend class HttpAsyncCompletion;
+
     pthread_t threadWebServer;
     SSL_CTX *sslCtx;
     int s_server_session_id_context;
@@ -45,6 +58,8 @@ class WebServer
     int (*tokDecodeCallback) (const std::string& tokb64, std::string& secret, std::string& decoded);
     time_t (*authBearTokDecExpirationCb) (std::string& tokenDecoded);
     int (*authBearTokDecScopesCb) (const std::string& tokenDecoded, const std::string& resourceUrl, std::string& errDescr);
+    JwtVerifier *jwtVerifier;
+    int (*authBearerJwtScopesCb) (const JwtClaims& claims, const std::string& resourceUrl, std::string& errDescr);
     std::string authBearerRealm;
     bool authBearerEnabled;
     std::string tokDecodeSecret;
@@ -52,6 +67,18 @@ class WebServer
     pthread_cond_t clientsQueue_cond;
     pthread_mutex_t clientsQueue_mutex;
 
+    // admission control (clientsQueue_mutex held)
+    size_t clientsQueueMaxDepth;
+    unsigned clientsQueueTargetDelay, clientsQueueInterval;
+    unsigned long long clientsQueueFirstAboveTime;
+    bool clientsQueueDropping;
+    unsigned long long shedConnectionsCount;
+    bool shedWithServiceUnavailable;
+    ushort shedRetryAfterInSecond;
+    std::string serviceUnavailableMsg;
+    bool isClientTooOld(const ClientSockData* client, const unsigned long long now);
+    void shedConnection(const int socketId);
+
     void initialize_ctx(const char *certfile, const char *cafile, const char *password);
     static int password_cb(char *buf, int num, int rwflag, void *userdata);
 
@@ -59,12 +86,20 @@ class WebServer
     bool isTokenAllowed(const std::string &tokb64,
                         const std::string &resourceUrl,
                         std::string &respHeader);
-    bool isAuthorizedDN(const std::string str);
 
     size_t recvLine(int client, char *bufLine, size_t);
     size_t recvBytes(int client, char *buffer, size_t requestedLength);
     void clearRecvBuffer(int client);
-    bool accept_request(ClientSockData* client, bool authSSL);
+    static void stashRecvBuffer(ClientSockData* client);
+    static void restoreRecvBuffer(ClientSockData* client);
+    void sendAsyncResponse(HttpAsyncCompletion *completion, const bool timedOut);
+    std::set<HttpAsyncCompletion *> asyncCompletions; // armed, their response not sent yet
+    pthread_mutex_t asyncCompletions_mutex;
+    pthread_cond_t asyncCompletions_cond;
+    void addAsyncCompletion(HttpAsyncCompletion *completion);
+    void removeAsyncCompletion(HttpAsyncCompletion *completion);
+    void dropAsyncCompletions();
+    bool accept_request(ClientSockData* client, bool authSSL, HttpRequestHeaders& requestExtraHeaders);
     void fatalError(const char *);
     static std::string getHttpHeader(const char *messageType, const size_t len=0, const bool keepAlive=true, const char *authBearerAdditionalHeaders=NULL, const bool zipped=false, HttpResponse* response=NULL);
     static const char* get_mime_type(const char *name);
@@ -88,22 +123,19 @@ class WebServer
     bool httpdAuth;
     
     volatile bool exiting;
-    volatile size_t exitedThread;
+    std::atomic<size_t> exitedThread;
     volatile int server_sock [ 3 ];
-    volatile size_t nbServerSock;
+    std::atomic<size_t> nbServerSock;
     
     const static char authStr[];
     const static char authBearerStr[];
 
-    std::map<std::string,time_t> usersAuthHistory;
-    pthread_mutex_t usersAuthHistory_mutex;
-    std::map<std::string,time_t> tokensAuthHistory;
-    pthread_mutex_t tokensAuthHistory_mutex;
-    std::map<IpAddress,time_t> peerIpHistory;
-    std::map<std::string,time_t> peerDnHistory;
-    pthread_mutex_t peerDnHistory_mutex;
+    BearerTokenCache bearerTokenCache;
+    PeerHistory<IpAddress> peerIpHistory;
+    PeerDnAuthorizer peerDnAuthorizer;
+    size_t peerHistoryLastSeen, peerHistoryTopK;
     void updatePeerIpHistory(IpAddress&);
-    void updatePeerDnHistory(std::string);
+    void logPeerDn(const std::string&, const time_t now, const time_t previous);
     static int verify_callback(int preverify_ok, X509_STORE_CTX *ctx);
     static const int verify_depth;
 
@@ -123,14 +155,21 @@ class WebServer
     
     bool sslEnabled;
     std::string sslCertFile, sslCaFile, sslCertPwd;
-    std::vector<std::string> authLoginPwdList;
+    CredentialStore credentials;
     bool authPeerSsl;
-    std::vector<std::string> authDnList;
     std::vector<IpNetwork> hostsAllowed;
+    std::vector<IpNetwork> hostsDenied;
+    enum { HOST_ALLOWED = 1, HOST_DENIED = 2 };
+    IpNetworkTrie hostsAcl;
+    void compileHostsAcl();
+    inline bool isHostAllowed(const IpAddress& ip) const
+    {
+      u_int8_t flags = hostsAcl.lookup(ip, HOST_DENIED);
+      if (flags & HOST_DENIED) return false;
+      return !hostsAcl.contains(HOST_ALLOWED) || (flags & HOST_ALLOWED);
+    };
+    IpRateLimiter *ipRateLimiter;
     std::vector<WebRepository *> webRepositories;
-    static inline bool is_base64(unsigned char c)
-      { return (isalnum(c) || (c == '+') || (c == '/')); };
-    static const std::string base64_chars;
     static std::string base64_decode(const std::string& encoded_string);
     static std::string base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len);
     static void closeSocket(ClientSockData* client);
@@ -138,7 +177,7 @@ class WebServer
     static std::string SHA1_encode(const std::string& input);
     static const std::string webSocketMagicString;
     static std::string generateWebSocketServerKey(std::string webSocketKey);
-    static std::string getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const bool webSocketDeflate);
+    static std::string getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const WebSocketDeflateParams *webSocketDeflate);
 
   public:
     WebServer();
@@ -167,6 +206,62 @@ class WebServer
     */
     inline void setSocketTimeoutInSecond(const ushort dur) { socketTimeoutInSecond=dur; };
 
+    /**
+    * Set the maximum number of accepted connections waiting for a free thread.
+    * Connections accepted beyond this limit are shed (see setLoadSheddingResponse)
+    * @param depth: the maximum queue length, 0 for no limit (Default value: 0)
+    */
+    inline void setClientsQueueMaxDepth(const size_t depth)
+      { pthread_mutex_lock( &clientsQueue_mutex ); clientsQueueMaxDepth = depth; pthread_mutex_unlock( &clientsQueue_mutex ); };
+
+    /**
+    * Set the queue-wait deadline (CoDel-style): once connections have waited more than
+    * targetMs for a whole interval, the ones waiting longer than targetMs are shed
+    * until the queueing delay goes back under the target
+    * @param targetMs: the acceptable queueing delay in milliseconds, 0 to disable (Default value: 0)
+    * @param intervalMs: how long the delay may stay above the target before shedding (Default value: 100)
+    */
+    inline void setClientsQueueTargetDelay(const unsigned targetMs, const unsigned intervalMs = 100)
+    {
+      pthread_mutex_lock( &clientsQueue_mutex );
+      clientsQueueTargetDelay = targetMs; clientsQueueInterval = intervalMs;
+      clientsQueueFirstAboveTime = 0; clientsQueueDropping = false;
+      pthread_mutex_unlock( &clientsQueue_mutex );
+    };
+
+    /**
+    * Set how shed connections are answered. HTTPS connections are always closed,
+    * the TLS handshake being too expensive under overload.
+    * @param send503: answer "503 Service Unavailable" if true, or just close the connection
+    * @param retryAfterInSecond: the Retry-After header value, 0 to omit it (Default value: 1)
+    */
+    inline void setLoadSheddingResponse(const bool send503, const ushort retryAfterInSecond = 1)
+      { shedWithServiceUnavailable = send503; shedRetryAfterInSecond = retryAfterInSecond; };
+
+    /**
+    * Get the number of accepted connections waiting for a free thread
+    * @return the clients queue length
+    */
+    inline size_t getClientsQueueLength()
+    {
+      pthread_mutex_lock( &clientsQueue_mutex );
+      size_t res = clientsQueue.size();
+      pthread_mutex_unlock( &clientsQueue_mutex );
+      return res;
+    };
+
+    /**
+    * Get the number of connections shed since the webserver creation
+    * @return the shed connections count
+    */
+    inline unsigned long long getShedConnectionsCount()
+    {
+      pthread_mutex_lock( &clientsQueue_mutex );
+      unsigned long long res = shedConnectionsCount;
+      pthread_mutex_unlock( &clientsQueue_mutex );
+      return res;
+    };
+
     /**
     * Set the device to use (work on linux only). 
     * @param d: the device name
@@ -197,14 +292,28 @@ class WebServer
     * Restricted X509 authentification to a DN user list. Add this given DN.
     * @param dn: user certificate DN
     */ 
-    inline void addAuthPeerDN(const char* dn) { authDnList.push_back(std::string(dn)); };
+    inline void addAuthPeerDN(const char* dn) { peerDnAuthorizer.addDn(dn); };
 
     /**
     * Enabled http authentification for a given login/password list
     * @param login: user login
     * @param pass : user password
     */ 
-    inline void addLoginPass(const char* login, const char* pass) { authLoginPwdList.push_back(std::string(login)+':'+std::string(pass)); };
+    inline void addLoginPass(const char* login, const char* pass) { credentials.addUser(login, pass); };
+
+    /**
+    * Enabled http authentification for a login, with a password hash
+    * @param login: user login
+    * @param hash : the password hash, as generated by CredentialStore::hashPassword()
+    * @return false if the hash is malformed
+    */ 
+    inline bool addLoginHash(const char* login, const char* hash) { return credentials.addUserHash(login, hash); };
+
+    /**
+    * Remove a login from the http authentification list
+    * @param login: user login
+    */ 
+    inline void removeLogin(const char* login) { credentials.removeUser(login); };
 
     /**
     * Set http Bearer token decode callback function
@@ -229,9 +338,34 @@ class WebServer
       tokDecodeSecret = secret;
       authBearTokDecExpirationCb = expirationCallback;
       authBearTokDecScopesCb = scopesCheckCallback;
+      jwtVerifier = NULL;
       authBearerEnabled = true;
+      bearerTokenCache.clear();
+    };
+
+    /**
+    * Set the built-in JWT verifier for the http Bearer tokens (instead of the decode callbacks)
+    * @param realm: realm attribute defining scope of resources being accessed
+    * @param verifier: the JwtVerifier (key, issuer, audience, required scopes), kept by the caller
+    * @param scopesCheckCallback: function callback for checking the claims of a valid token for a resource, optionnal and can be set to NULL,
+    * errDescr will be updated with a description of the error to insert in HTTP header error code insufficient_scope, returns 0 on sucess
+    */
+    inline void setAuthBearerJwtVerifier(const std::string& realm, JwtVerifier *verifier,
+                                         int (*scopesCheckCallback) (const JwtClaims& claims, const std::string& resourceUrl, std::string& errDescr) = NULL)
+    {
+      authBearerRealm = realm;
+      jwtVerifier = verifier;
+      authBearerJwtScopesCb = scopesCheckCallback;
+      authBearerEnabled = verifier != NULL;
+      bearerTokenCache.clear();
     };
 
+    /**
+    * Set the maximum number of verified bearer tokens kept in cache
+    * @param maxEntries: the number of tokens (Default value: 65536)
+    */
+    inline void setAuthBearerCacheCapacity(const size_t maxEntries) { bearerTokenCache.setCapacity(maxEntries); };
+
     /**
     * Set the path to store uploaded files on disk. Used to set the MPFD function.
     * @param pathdir: path to a writtable directory
@@ -287,21 +421,67 @@ class WebServer
 
     /**
     * set network access restriction to webserver. 
+    * The lists are compiled when the service starts.
     * @param ipnet: an IpNetwork of allowed web client to add
     */   
     inline void addHostsAllowed(const IpNetwork &ipnet) { hostsAllowed.push_back(ipnet); };    
+
+    /**
+    * refuse the connections coming from a network, even if it is inside an allowed network.
+    * The lists are compiled when the service starts.
+    * @param ipnet: an IpNetwork of denied web client to add
+    */   
+    inline void addHostsDenied(const IpNetwork &ipnet) { hostsDenied.push_back(ipnet); };    
+
+    /**
+    * set per-client connections and requests limits. Connections over the limits
+    * are closed as soon as accepted, requests over the limits are answered with
+    * "429 Too Many Requests".
+    * @param limiter: a pointer to an IpRateLimiter instance, NULL to disable
+    */
+    inline void setIpRateLimiter(IpRateLimiter *limiter) { ipRateLimiter = limiter; };
     
     /**
-    * Get the list of http client peer IP address. 
-    * @return a map of every IP address and last connection to the webserver
+    * Get the list of the most recent http client peer IP address. 
+    * @return a copy of the map of the last IP addresses and their last connection to the webserver
     */ 
-    inline std::map<IpAddress,time_t>& getPeerIpHistory() { return peerIpHistory; };
+    inline std::map<IpAddress,time_t> getPeerIpHistory() { return peerIpHistory.getLastSeen(); };
 
     /**
-    * Get the list of http client DN (work with X509 authentification)
-    * @return a map of every DN and last connection to the webserver
+    * Get the list of the most recent http client DN (work with X509 authentification)
+    * @return a copy of the map of the last DN and their last connection to the webserver
     */ 
-    inline std::map<std::string,time_t>& getPeerDnHistory() { return peerDnHistory; };
+    inline std::map<std::string,time_t> getPeerDnHistory() { return peerDnAuthorizer.getLastSeen(peerHistoryLastSeen); };
+
+    /**
+    * Get the http clients statistics: connections count, unique IP addresses
+    * estimate, most frequent IP addresses and last seen IP addresses
+    * @return a snapshot of the IP addresses history
+    */
+    inline PeerHistorySnapshot<IpAddress> getPeerIpStats() { return peerIpHistory.getSnapshot(); };
+
+    /**
+    * Get the X509 clients statistics (work with X509 authentification).
+    * The authorized DN are all tracked: the unique clients count is exact.
+    * @return a snapshot of the DN history
+    */
+    inline PeerHistorySnapshot<std::string> getPeerDnStats()
+      { return peerDnAuthorizer.getSnapshot(peerHistoryLastSeen, peerHistoryTopK); };
+
+    /**
+    * Set the size of the clients history (IP addresses and DN)
+    * @param lastSeen: the number of last seen clients kept (Default value: 1024)
+    * @param topK: the number of most frequent clients tracked (Default value: 32)
+    */
+    inline void setPeerHistoryCapacity(const size_t lastSeen, const size_t topK)
+      { peerIpHistory.setCapacity(lastSeen, topK); peerHistoryLastSeen = lastSeen; peerHistoryTopK = topK; };
+
+    /**
+    * Set the number of X509 certificates whose authorization is cached
+    * @param maxEntries: the maximum number of certificates (Default value: 4096)
+    */
+    inline void setAuthPeerDnCacheCapacity(const size_t maxEntries)
+      { peerDnAuthorizer.setCapacity(maxEntries); };
  
     /**
     * startService: the webserver starts
@@ -349,11 +529,7 @@ class WebServer
 
       if (client->ssl != NULL)
       {
-        if ( client->peerDN != NULL )
-        {
-          delete client->peerDN;
-          client->peerDN = NULL;
-        }
+        client->peerDN = NULL;
 
         if ( client->bio == NULL )
           SSL_free (client->ssl);
@@ -362,6 +538,12 @@ class WebServer
         client->ssl = NULL;
         client->bio = NULL;
       }
+
+      if (client->recvBuffer != NULL)
+        delete client->recvBuffer;
+
+      IpRateLimiter::releaseConnection(client->rateLimiterEntry);
+
       free(client);
     };
 };
@@ -24,29 +24,50 @@
 // Max latency allowed is fixed to 500ms by default
 #define CLIENTSENDING_MAXLATENCY_DEFAULT 500
 #define DEFAULT_WEBSOCKET_TIMEOUT 750
+// Messages shorter are sent uncompressed
+#define WEBSOCKET_COMPRESSION_THRESHOLD_DEFAULT 128
+// Larger messages received (once inflated) close the connection
+#define WEBSOCKET_MAX_MESSAGE_SIZE_DEFAULT (16*1024*1024)
 
 class WebSocket
 {
+    friend class WebSocketClient;
+
     std::list<WebSocketClient*> webSocketClientList;
     pthread_mutex_t webSocketClientList_mutex;
+    pthread_cond_t clientsReleased_cond;
+    size_t nbClients;                 // the client objects not freed yet, closed or not
+    bool broadcastFragmented;         // the last broadcast data message isn't final
     bool useCompression;
+    size_t compressionThreshold;
+    size_t maxMessageSize;
     bool useNaggleAlgo;
     unsigned short clientSending_maxLatency;
     ushort websocketTimeoutInMilliSecond;
 
   public:
-    WebSocket(bool compression=true): useCompression(compression), useNaggleAlgo(true),
+    WebSocket(bool compression=true): nbClients(0), broadcastFragmented(false), useCompression(compression),
+                                      compressionThreshold(WEBSOCKET_COMPRESSION_THRESHOLD_DEFAULT),
+                                      maxMessageSize(WEBSOCKET_MAX_MESSAGE_SIZE_DEFAULT), useNaggleAlgo(true),
                                       clientSending_maxLatency(CLIENTSENDING_MAXLATENCY_DEFAULT),
                                       websocketTimeoutInMilliSecond(DEFAULT_WEBSOCKET_TIMEOUT)
-
     {
       pthread_mutex_init(&webSocketClientList_mutex, NULL);
+      pthread_cond_init(&clientsReleased_cond, NULL);
     }
 
     virtual ~WebSocket()
     {
       // Free all request, close all sockets
       removeAllClients();
+
+      // wait for the I/O threads and the pending callbacks
+      pthread_mutex_lock(&webSocketClientList_mutex);
+      while (nbClients)
+        pthread_cond_wait(&clientsReleased_cond, &webSocketClientList_mutex);
+      pthread_mutex_unlock(&webSocketClientList_mutex);
+
+      pthread_cond_destroy(&clientsReleased_cond);
       pthread_mutex_destroy(&webSocketClientList_mutex);
     }
 
@@ -109,6 +130,20 @@ class WebSocket
     { return true; };
 
 
+    /**
+    * Send a frame to all connected clients. The frame is encoded once and
+    * shared by their sending queues. The fragments following a non final
+    * one are created with the opcode 0x0 (continuation).
+    * @param frame: the frame (see WebSocketFrame::create())
+    */
+    inline void sendBroadcastFrame(WebSocketFrame *frame)
+    {
+      pthread_mutex_lock(&webSocketClientList_mutex);
+      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
+        (*it)->sendFrame(frame);
+      pthread_mutex_unlock(&webSocketClientList_mutex);
+    };
+
     /**
     * Send Text Message to all connected clients
     * @param message: the message content
@@ -116,10 +151,7 @@ class WebSocket
     */
     inline void sendBroadcastTextMessage(const std::string &message, bool fin=true)
     {
-      pthread_mutex_lock(&webSocketClientList_mutex);
-      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
-          (*it)->sendTextMessage(message, fin);
-      pthread_mutex_unlock(&webSocketClientList_mutex);
+      sendBroadcastMessage(0x1, (const unsigned char*)message.c_str(), message.length(), fin);
     };
 
     /**
@@ -130,10 +162,7 @@ class WebSocket
     */
     inline void sendBroadcastBinaryMessage(const unsigned char *message, size_t length, bool fin = true)
     {
-      pthread_mutex_lock(&webSocketClientList_mutex);
-      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
-        (*it)->sendBinaryMessage(message, length, fin);
-      pthread_mutex_unlock(&webSocketClientList_mutex);
+      sendBroadcastMessage(0x2, message, length, fin);
     };
 
     /**
@@ -143,10 +172,7 @@ class WebSocket
     */
     inline void sendBroadcastCloseCtrlFrame(const unsigned char *message, size_t length)
     {
-      pthread_mutex_lock(&webSocketClientList_mutex);
-      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
-        (*it)->sendCloseCtrlFrame(message, length);
-      pthread_mutex_unlock(&webSocketClientList_mutex);
+      sendBroadcastMessage(0x8, message, length, true);
     };
 
     /**
@@ -165,10 +191,7 @@ class WebSocket
     */
     inline void sendBroadcastPingCtrlFrame(const unsigned char *message, size_t length)
     {
-      pthread_mutex_lock(&webSocketClientList_mutex);
-      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
-        (*it)->sendPingCtrlFrame(message, length);
-      pthread_mutex_unlock(&webSocketClientList_mutex);
+      sendBroadcastMessage(0x9, message, length, true);
     };
 
     /**
@@ -187,10 +210,7 @@ class WebSocket
     */
     inline void sendBroadcastPongCtrlFrame(const unsigned char *message, size_t length)
     {
-      pthread_mutex_lock(&webSocketClientList_mutex);
-      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
-        (*it)->sendPongCtrlFrame(message, length);
-      pthread_mutex_unlock(&webSocketClientList_mutex);
+      sendBroadcastMessage(0xa, message, length, true);
     }
 
     /**
@@ -206,21 +226,31 @@ class WebSocket
     * New Websocket Connection Request
     * create a new websocket client if onOpening() return true
     * @param request: the http request object
+    * @param deflate: the permessage-deflate parameters, if it's negotiated
+    *                 (their memory held in the budget is given to the client)
     */
-    inline void newConnectionRequest(HttpRequest* request)
+    inline void newConnectionRequest(HttpRequest* request, const WebSocketDeflateParams *deflate = NULL)
     {
       pthread_mutex_lock(&webSocketClientList_mutex);
 
       if (onOpening(request))
-        webSocketClientList.push_back(new WebSocketClient(this, request));
+      {
+        nbClients++;
+        webSocketClientList.push_back(new WebSocketClient(this, request, deflate));
+      }
       else
+      {
+        if (deflate != NULL)
+          WebSocketDeflateParams::releaseMemory(deflate->getMemoryCost());
         WebServer::freeClientSockData( request->getClientSockData() );
+      }
 
       pthread_mutex_unlock(&webSocketClientList_mutex);
     };
 
     /**
-    * Remove and close all Websocket client's Connection
+    * Remove and close all Websocket client's Connection (the connections
+    * are closed by their I/O thread)
     */
     inline void removeAllClients()
     {
@@ -268,6 +298,17 @@ class WebSocket
       pthread_mutex_unlock(&webSocketClientList_mutex);
     }
 
+    /**
+    * Get the number of connected clients
+    */
+    inline size_t getClientsCount()
+    {
+      pthread_mutex_lock(&webSocketClientList_mutex);
+      size_t res = webSocketClientList.size();
+      pthread_mutex_unlock(&webSocketClientList_mutex);
+      return res;
+    }
+
     /**
     * Get the compression behavior: data compression allowed or not
     *  @return true if compression is allowed
@@ -286,6 +327,65 @@ class WebSocket
       useCompression = compression;
     }
 
+    /**
+    * Get the size under which the messages are sent uncompressed
+    * @return the size in bytes
+    */
+    inline size_t getCompressionThreshold()
+    {
+      return compressionThreshold;
+    }
+
+    /**
+    * Set the size under which the messages are sent uncompressed:
+    * the small ones hardly shrink and their compression costs
+    * @param bytes: the size
+    */
+    inline void setCompressionThreshold(size_t bytes)
+    {
+      compressionThreshold = bytes;
+    }
+
+    /**
+    * Get the size of the largest message accepted from the clients
+    * @return the size in bytes, 0 for no limit
+    */
+    inline size_t getMaxMessageSize()
+    {
+      return maxMessageSize;
+    }
+
+    /**
+    * Set the size of the largest message accepted from the clients: its
+    * fragments together and once inflated. A client sending a larger one
+    * is closed with the status 1009 (message too big)
+    * @param bytes: the size, 0 for no limit
+    */
+    inline void setMaxMessageSize(size_t bytes)
+    {
+      maxMessageSize = bytes;
+    }
+
+    /**
+    * Set the memory allowed to the compression contexts of all the websocket
+    * connections: while it's short, the new connections negotiate smaller
+    * windows, then no compression (see WebSocketDeflateParams)
+    * @param bytes: the budget, 0 for no limit (default)
+    */
+    static inline void setCompressionMemoryBudget(size_t bytes)
+    {
+      WebSocketDeflateParams::setMemoryBudget(bytes);
+    }
+
+    /**
+    * Get the memory held by the compression contexts of the connections
+    * @return the size in bytes
+    */
+    static inline size_t getCompressionMemoryUsed()
+    {
+      return WebSocketDeflateParams::getMemoryUsed();
+    }
+
     /**
     * Get if client socket behavior: Naggle Algorithm is used or not
     * @return true if enabled
@@ -323,7 +423,8 @@ class WebSocket
     }
 
     /**
-    * Get the websocket timeout value in milliseconds
+    * Get the websocket timeout value in milliseconds: a connection whose
+    * sending is blocked for longer (plus 10 seconds) is closed
     * @return the value in milliseconds
     */
     inline ushort getWebsocketTimeoutInMilliSecond()
@@ -340,6 +441,42 @@ class WebSocket
       websocketTimeoutInMilliSecond=ms;
     }
 
+  private:
+
+    inline void sendBroadcastMessage(u_int8_t opcode, const unsigned char *message, size_t length, bool fin)
+    {
+      WebSocketFrame *frame = NULL;
+      pthread_mutex_lock(&webSocketClientList_mutex);
+      // the data frames following a non final fragment continue its message
+      if (opcode < 0x8 && broadcastFragmented)
+        opcode = 0x0;
+      try
+      {
+        frame = WebSocketFrame::create(opcode, message, length, fin);
+      }
+      catch (...)
+      {
+        pthread_mutex_unlock(&webSocketClientList_mutex);
+        throw;
+      }
+      if (opcode < 0x8)
+        broadcastFragmented = !fin;
+      for (std::list<WebSocketClient*>::iterator it = webSocketClientList.begin(); it != webSocketClientList.end(); it++)
+        (*it)->sendFrame(frame);
+      pthread_mutex_unlock(&webSocketClientList_mutex);
+      frame->release();
+    }
+
+    /**
+    * A client object has been freed
+    */
+    inline void clientReleased()
+    {
+      pthread_mutex_lock(&webSocketClientList_mutex);
+      nbClients--;
+      pthread_cond_broadcast(&clientsReleased_cond);
+      pthread_mutex_unlock(&webSocketClientList_mutex);
+    }
 };
 
 #endif
@@ -15,14 +15,22 @@
 #define WEBSOCKETCLIENT_HH_
 
 #include <queue>
+#include <atomic>
 #include <chrono>
 #include "libnavajo/HttpRequest.hh"
 #include "libnavajo/nvjThread.h"
 #include "libnavajo/nvjGzip.h"
+#include "libnavajo/WebSocketFrame.hh"
+#include "libnavajo/WebSocketDeflate.hh"
+
+// Queued frames written by the same send (writev, or a TLS write)
+#define WEBSOCKETCLIENT_SENDING_BATCH 32
 
 class WebSocket;
 class WebSocketClient
 {
+    friend class WebSocketEngine;
+
     typedef struct
     {
       u_int8_t opcode;
@@ -30,84 +38,145 @@ class WebSocketClient
       size_t length;
       bool fin;
       unsigned long long date_ms;
+      WebSocketFrame *frame;  // a shared frame (a reference held), instead of message
+      size_t capacity;        // the size of the block (pool), message is inline when it starts after this structure
     } MessageContent;
 
+    // permessage-deflate (rfc7692), if client->compression == ZLIB: the
+    // contexts are created by the first compressed message of each way
     typedef struct
     {
-      unsigned char z_dictionary_inflate[32768];
-      unsigned int dictInfLength;
+      z_stream strm_inflate;        // the client context, kept from a message to the next one
+      bool inflateReady;
       z_stream strm_deflate;
+      bool deflateReady;
     } GzipContext;
 
-    GzipContext gzipcontext;
+    GzipContext *gzipcontext;
+    GzipContext *getGzipContext();
+    WebSocketDeflateParams deflateParams;
+    size_t deflateMemory;           // held in the compression memory budget, since the negotiation
+    size_t compressionThreshold;
+    bool deflateReset;              // a shared frame was compressed out of the deflate context
+    bool sendCompressed;            // the message being sent is compressed (its next fragments too)
     std::queue<MessageContent *> sendingQueue;
     pthread_mutex_t sendingQueueMutex;
-    pthread_cond_t sendingNotification;
+    bool sendingFragmented;         // the last data message of this client queued isn't final
+    bool sharedFragmented;          // the last shared data frame queued isn't final
+    bool sharedReceived;            // the last shared data frame received isn't final
+    std::queue<MessageContent *> heldMessages; // the messages waiting for the end of another one
+    bool orderMessage(MessageContent *msgContent);
     void addSendingQueue(MessageContent *msgContent);
+    void sendMessage(const u_int8_t opcode, const unsigned char *message, size_t length, bool fin);
 
     WebSocket *websocket;
     HttpRequest *request;
-    volatile bool closing;
-    pthread_t receivingThreadId, sendingThreadId;
-
-    void receivingThread();
-    void sendingThread();
-
-    bool sendMessage(const MessageContent *msg);
-
-    void updateSessionExpiration(HttpRequest *request);
-
-    inline static void* startReceivingThread(void* t)
-    {
-      WebSocketClient *_this=static_cast<WebSocketClient *>(t);
-      _this->receivingThread();
-      pthread_exit(NULL);
-      return NULL;
-    };
-
-    inline static void* startSendingThread(void* t)
-    {
-      WebSocketClient *_this=static_cast<WebSocketClient *>(t);
-      _this->sendingThread();
-      pthread_exit(NULL);
-      return NULL;
-    };
-
-    void startWebSocketThreads()
+    volatile bool closing;          // no more message accepted, the connection is closed...
+    volatile bool flushBeforeClose; // ...once the queued messages are sent
+
+    // the connection is owned by an I/O thread of the WebSocketEngine,
+    // the object is freed when the last reference is released
+    std::atomic<unsigned> refCount;
+    std::atomic<bool> wakeupPending;
+    void *ioThread;
+    bool registered, disconnected;
+    u_int32_t events;               // the epoll events registered
+
+    // frame being received (I/O thread)
+    enum { HEADER, PAYLOAD, CLOSED } recvStep;  // CLOSED: failed, nothing more is read
+    unsigned char recvHeader[14];   // the beginning of a header, received without its end
+    size_t recvHeaderLen;
+    bool fin, recvCompressed;       // recvCompressed: the message being received is compressed
+    unsigned char rsv, opcode;
+    unsigned char msgKeys[4];
+    u_int64_t msgLength, msgReceived;
+    MessageContent *recvMsg;        // NULL while the payload is skipped
+    MessageContent *fragmentedMsg;  // the fragments received of a message
+    size_t maxMessageSize;          // the largest message accepted, 0 for no limit
+
+    // messages received, given to the callbacks in order (worker threads)
+    std::queue<MessageContent *> receivedQueue;
+    pthread_mutex_t receivedQueueMutex;
+    bool dispatching, closingNotified;
+    std::atomic<bool> readingPaused;  // too many messages waiting for the callbacks
+    bool readingStopped;              // readInput() has stopped on readingPaused (I/O thread)
+
+    // messages being sent (I/O thread), written together
+    typedef struct
     {
-      create_thread( &receivingThreadId, WebSocketClient::startReceivingThread, static_cast<void *>(this) );
-      create_thread( &sendingThreadId,   WebSocketClient::startSendingThread,   static_cast<void *>(this) );
-    }
+      MessageContent *msg;
+      unsigned char header[10];
+      size_t headerLen;
+      unsigned char *payload;     // compressed, or the message or shared frame bytes
+      size_t payloadLen;
+    } SendingFrame;
+
+    SendingFrame sendingFrames[WEBSOCKETCLIENT_SENDING_BATCH];
+    size_t sendingFirst, sendingCount;  // the frames not sent yet
+    size_t sendingOffset;               // bytes of the first one already sent
+    size_t sendingBytes;                // bytes of the frames not sent yet
+    unsigned long long sendingBlockedSince;
+
+    void retain() { refCount++; };
+    void release();
+
+    ssize_t recvSome(char *buffer, size_t length);
+    ssize_t sendSome(const void *buffer, size_t length);
+    bool readInput(char *buffer, size_t bufferSize);
+    ssize_t parseFrames(const unsigned char *data, size_t length);
+    bool frameReceived();
+    bool isTooLarge(const u_int64_t length);
+    void failConnection(const u_int16_t status);
+    void pushReceivedMessage(MessageContent *msg);
+    bool prepareFrame(SendingFrame &frame, MessageContent *msg);
+    void endSendingFrame(SendingFrame &frame);
+    bool fillSendingFrames(const unsigned long long now);
+    ssize_t sendFrames(char *buffer, size_t bufferSize);
+    void sentFrames(size_t length);
+    void freeSendingFrames();
+    bool writeOutput(const unsigned long long now, char *buffer, size_t bufferSize);
+    bool isSendingLate(const unsigned long long now);
+    bool mustClose();
+    void disconnect();
+    void dispatchMessages();
+
+    static unsigned char *inlinePayload(MessageContent *msg)
+      { return (unsigned char*)(msg + 1); };
+
+    static MessageContent *allocMessage(const u_int8_t opcode, const size_t length);
+    static bool appendMessage(MessageContent *msg, const unsigned char *data, const size_t length);
+    static void freeMessage(MessageContent *msg);
 
     void freeSendingQueue()
     {
       while (!sendingQueue.empty())
       {
-        MessageContent *msg = sendingQueue.front();
-        free(msg->message);
-        free(msg);
+        freeMessage(sendingQueue.front());
         sendingQueue.pop();
       }
+      while (!heldMessages.empty())
+      {
+        freeMessage(heldMessages.front());
+        heldMessages.pop();
+      }
     }
 
     unsigned short snd_maxLatency;
+    unsigned long long snd_timeout;
 
     void noSessionExpiration(HttpRequest *request);
     void restoreSessionExpiration(HttpRequest *request);
 
+    ~WebSocketClient();
 
   public:
-    WebSocketClient(WebSocket *ws, HttpRequest *req);
-
-    ~WebSocketClient()
-    {
-      pthread_mutex_lock(&sendingQueueMutex);
-      freeSendingQueue();
-      pthread_mutex_unlock(&sendingQueueMutex);
-      nvj_end_stream(&(gzipcontext.strm_deflate));
-      pthread_mutex_destroy(&sendingQueueMutex);
-      pthread_cond_destroy(&sendingNotification);
-    }
+    /**
+    * @param ws: the websocket endpoint
+    * @param req: the http request of the handshake
+    * @param deflate: the permessage-deflate parameters, if it's negotiated
+    *                 (the client releases their memory from the budget)
+    */
+    WebSocketClient(WebSocket *ws, HttpRequest *req, const WebSocketDeflateParams *deflate = NULL);
 
     /**
     * Send Text Message on the websocket
@@ -164,11 +233,22 @@ class WebSocketClient
     */
     void sendPongCtrlFrame(const std::string &message);
 
+    /**
+    * Send a frame built once for several clients (see WebSocketFrame)
+    * @param frame: the frame, a reference is taken until it is sent
+    */
+    void sendFrame(WebSocketFrame *frame);
+
     HttpRequest *getHttpRequest() { return request; };
 
+    /**
+    * Close the connection, without sending the queued messages.
+    * The connection is closed by its I/O thread: onClosing() is called
+    * after the pending callbacks, then the client object is freed.
+    */
     void closeWS();
-    void closeSend();
-    void closeRecv();
+    inline void closeSend() { closeWS(); };
+    inline void closeRecv() { closeWS(); };
 };
 
 #endif //WEBSOCKETCLIENT_HH_
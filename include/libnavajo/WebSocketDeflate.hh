@@ -0,0 +1,108 @@
+//********************************************************
+/**
+ * @file  WebSocketDeflate.hh
+ *
+ * @brief permessage-deflate extension negotiation
+ *        rfc7692 Compression Extensions for WebSocket
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef WEBSOCKETDEFLATE_HH_
+#define WEBSOCKETDEFLATE_HH_
+
+#include <string>
+
+/***********************************************************************
+ * WebSocketDeflateParams - the parameters of the permessage-deflate
+ * extension agreed with a client, from the offers of its
+ * Sec-WebSocket-Extensions headers:
+ *
+ *   WebSocketDeflateParams params;
+ *   if (params.negotiate(extensions))
+ *     header += "Sec-WebSocket-Extensions: " + params.getResponse() + "\r\n";
+ *
+ * The first offer with valid and supported parameters is accepted.
+ *
+ * The compression contexts of all the connections share a memory budget
+ * (setMemoryBudget(), no limit by default): while it's short, smaller
+ * windows are negotiated (server_max_window_bits, and client_max_window_bits
+ * if the client allows it), then compression is declined. The cost of the
+ * contexts is held by negotiate(), then by the WebSocketClient until it's
+ * freed, whether they are allocated yet or not (they are created by the
+ * first compressed message).
+ */
+
+class WebSocketDeflateParams
+{
+  public:
+
+    bool serverNoContextTakeover;       // the server deflate context is reset after each message
+    bool clientNoContextTakeover;       // ... and the client one
+    unsigned char serverMaxWindowBits;  // the LZ77 window of the server compressor (9 to 15)
+    unsigned char clientMaxWindowBits;  // ... and of the client compressor (8 to 15)
+    unsigned char deflateMemLevel;      // the memory of the server compressor (zlib memLevel)
+
+    WebSocketDeflateParams();
+
+    /**
+    * Accept an offer
+    * @param extensions: the values of the Sec-WebSocket-Extensions headers, comma separated
+    * \return true if a permessage-deflate offer is accepted, the parameters are set
+    *         and getMemoryCost() is held in the budget
+    */
+    bool negotiate(const std::string &extensions);
+
+    /**
+    * The extension to put in the Sec-WebSocket-Extensions header of the response
+    */
+    std::string getResponse() const;
+
+    /**
+    * The memory needed by the deflate and inflate contexts
+    */
+    size_t getMemoryCost() const;
+
+    /**
+    * Set the memory allowed to the compression contexts of all the connections
+    * @param bytes: the budget, 0 for no limit
+    */
+    static void setMemoryBudget(const size_t bytes);
+    static size_t getMemoryBudget();
+
+    /**
+    * The memory held by the connections using compression
+    */
+    static size_t getMemoryUsed();
+
+    /**
+    * The memory needed by a deflate context
+    */
+    static size_t getDeflateMemoryCost(const unsigned char windowBits, const unsigned char memLevel);
+
+    /**
+    * Hold memory in the budget for a context that isn't negotiated
+    * (e.g. the one compressing a shared frame)
+    * \return false if the budget is short
+    */
+    static bool reserveMemory(const size_t bytes);
+
+    /**
+    * Give back memory held in the budget
+    * @param bytes: the getMemoryCost() of the parameters negotiated, or the reserved memory
+    */
+    static void releaseMemory(const size_t bytes);
+
+  private:
+
+    bool clientMaxWindowBitsOffered;    // the client accepts a client_max_window_bits limit
+
+    bool parseOffer(const std::string &offer);
+    bool fitMemoryBudget();
+};
+
+#endif
@@ -0,0 +1,144 @@
+//********************************************************
+/**
+ * @file  WebSocketEngine.hh
+ *
+ * @brief Event-driven WebSocket I/O: a few epoll threads
+ *        read and write every connection, a worker pool
+ *        runs the callbacks
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef WEBSOCKETENGINE_HH_
+#define WEBSOCKETENGINE_HH_
+
+#include <queue>
+#include <vector>
+#include <unordered_set>
+
+#include "libnavajo/nvjThread.h"
+
+class WebSocketClient;
+
+  /**
+  * WebSocketEngine - shared by the whole process. Each connection
+  * belongs to one I/O thread, which owns its socket: frames are parsed
+  * and written without any lock on the connection. The messages
+  * received are dispatched to the worker threads, one connection at a
+  * time and in order, so that a slow callback never holds an I/O thread.
+  */
+  class WebSocketEngine
+  {
+    public:
+
+      /**
+      * getInstance - return/create the static engine object
+      * \return theWebSocketEngine - the static engine
+      */
+      inline static WebSocketEngine *getInstance()
+      {
+        static pthread_mutex_t init_mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_mutex_lock(&init_mutex);
+        if (theWebSocketEngine == NULL)
+          theWebSocketEngine = new WebSocketEngine;
+        pthread_mutex_unlock(&init_mutex);
+        return theWebSocketEngine;
+      };
+
+      /**
+      * freeInstance - stop the threads and free the static engine object.
+      * Every WebSocket must have been destroyed before.
+      */
+      static void freeInstance()
+      {
+        if (theWebSocketEngine != NULL)
+          delete theWebSocketEngine;
+
+        theWebSocketEngine=NULL;
+      }
+
+      /**
+      * Set the number of threads. Ignored once the engine is started.
+      * @param ioThreads: the number of epoll threads (Default value: 2)
+      * @param workerThreads: the number of threads running the callbacks (Default value: 4)
+      */
+      void setThreadsNumber(const size_t ioThreads, const size_t workerThreads);
+
+      /**
+      * Give a new connection to an I/O thread
+      */
+      void attach(WebSocketClient *client);
+
+      /**
+      * Ask the I/O thread of a connection to flush its sending queue,
+      * to resume reading or to close it
+      */
+      void wakeup(WebSocketClient *client);
+
+      /**
+      * Run the callbacks of a connection on a worker thread
+      */
+      void schedule(WebSocketClient *client);
+
+    protected:
+
+      WebSocketEngine();
+      ~WebSocketEngine();
+
+      static WebSocketEngine *theWebSocketEngine;
+
+    private:
+
+      struct IoThread
+      {
+        WebSocketEngine *engine;
+        pthread_t thread;
+        int epollFd;
+        int eventFd, wakeupFd;                      // wakes the thread up (read and write sides)
+        pthread_mutex_t mutex;
+        std::vector<WebSocketClient *> wakeups;     // connections to process (a reference each)
+        std::unordered_set<WebSocketClient *> clients; // owned by the thread
+      };
+
+      pthread_mutex_t engine_mutex;
+      pthread_cond_t workers_cond;
+      std::queue<WebSocketClient *> readyClients;   // connections with callbacks to run
+      std::vector<IoThread *> ioThreads;
+      std::vector<pthread_t> workerThreads;
+      size_t nbIoThreads, nbWorkerThreads;
+      size_t nextIoThread;
+      bool started;
+      volatile bool exiting;
+
+      WebSocketEngine(const WebSocketEngine&);
+      WebSocketEngine& operator=(const WebSocketEngine&);
+
+      void start();
+      void ioThreadProcessing(IoThread *t);
+      void workerThreadProcessing();
+      void processWakeup(IoThread *t, WebSocketClient *client, char *buffer, const unsigned long long now,
+                         std::vector<WebSocketClient *>& released);
+      void closeConnection(IoThread *t, WebSocketClient *client, std::vector<WebSocketClient *>& released);
+      bool updateEvents(IoThread *t, WebSocketClient *client);
+
+      inline static void *startIoThread(void *t)
+      {
+        IoThread *ioThread = static_cast<IoThread *>(t);
+        ioThread->engine->ioThreadProcessing(ioThread);
+        pthread_exit(NULL);
+        return NULL;
+      };
+
+      inline static void *startWorkerThread(void *t)
+      {
+        static_cast<WebSocketEngine *>(t)->workerThreadProcessing();
+        pthread_exit(NULL);
+        return NULL;
+      };
+  };
+
+#endif
@@ -0,0 +1,107 @@
+//********************************************************
+/**
+ * @file  WebSocketFrame.hh
+ *
+ * @brief A WebSocket frame encoded once and shared by the
+ *        sending queues of several clients
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef WEBSOCKETFRAME_HH_
+#define WEBSOCKETFRAME_HH_
+
+#include <atomic>
+#include <stddef.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+  /**
+  * WebSocketFrame - a message encoded once, header included, for all the
+  * clients it is sent to: each sending queue holds a reference to the same
+  * bytes, which are freed with the last reference.
+  * For the clients using compression, the payload is compressed once too,
+  * on first use, without context takeover: the frame doesn't depend on
+  * what was sent before to a client. Its deflate context is held in the
+  * compression memory budget (WebSocketDeflateParams) while it's used: the
+  * frame is sent uncompressed if the budget is short.
+  * A fragmented message is never interleaved with another one: a data frame
+  * sent to a client while it's sending a fragmented message waits for the
+  * final fragment, and the next fragments of a shared message are created
+  * with the opcode 0x0 (continuation).
+  *
+  *   WebSocketFrame *frame = WebSocketFrame::create(0x1, msg, len);
+  *   for (...) client->sendFrame(frame);
+  *   frame->release();
+  */
+  class WebSocketFrame
+  {
+    public:
+
+      /**
+      * Build a frame
+      * @param opcode: the frame opcode (0x0 continuation, 0x1 text, 0x2 binary, 0x8 close, 0x9 ping, 0xa pong)
+      * @param message: the payload
+      * @param length: the payload length
+      * @param fin: is-it the final fragment of the message ?
+      * \return the frame, with one reference held by the caller
+      */
+      static WebSocketFrame *create(const u_int8_t opcode, const unsigned char *message, const size_t length, const bool fin = true);
+
+      void retain() { refCount++; };
+
+      /**
+      * Drop a reference, the last one frees the frame
+      */
+      void release();
+
+      /**
+      * The encoded frame, uncompressed
+      */
+      const unsigned char *getData(size_t& len) { len = length; return data; };
+
+      size_t getPayloadLength() { return length - headerLength; };
+
+      u_int8_t getOpcode() { return firstByte & 0x0f; };
+
+      bool isFinal() { return (firstByte & 0x80) != 0; };
+
+      /**
+      * The encoded frame, with its payload compressed (RSV1 set); only the
+      * unfragmented data frames are compressed, the others are returned
+      * uncompressed
+      */
+      const unsigned char *getCompressedData(size_t& len);
+
+      /**
+      * Is the payload of getCompressedData() compressed ?
+      */
+      bool isCompressed() { return zdata != NULL; };
+
+      unsigned long long getDate() { return date_ms; };
+
+    private:
+
+      std::atomic<unsigned> refCount;
+      u_int8_t firstByte;           // FIN & OPCODE
+      unsigned char *data;          // header and payload
+      size_t length, headerLength;
+      unsigned char *zdata;         // compressed: header and payload
+      size_t zlength;
+      std::atomic<bool> zbuilt;
+      pthread_mutex_t zmutex;
+      unsigned long long date_ms;
+
+      WebSocketFrame();
+      ~WebSocketFrame();
+      WebSocketFrame(const WebSocketFrame&);
+      WebSocketFrame& operator=(const WebSocketFrame&);
+
+      static size_t encodeHeader(unsigned char *header, const u_int8_t firstByte, const size_t payloadLength);
+  };
+
+#endif
@@ -4,4 +4,7 @@
 #include "libnavajo/LocalRepository.hh"
 #include "libnavajo/DynamicPage.hh"
 #include "libnavajo/DynamicRepository.hh"
+#include "libnavajo/AsyncDynamicPage.hh"
+#include "libnavajo/CoroutineDynamicPage.hh"
+#include "libnavajo/SharedMemorySessionBackend.hh"
 
@@ -0,0 +1,265 @@
+//********************************************************
+/**
+ * @file  nvjBase64.h
+ *
+ * @brief base64 encoding and decoding (RFC 4648), with
+ *        lookup tables and an AVX2 path selected at runtime
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef NVJBASE64_H_
+#define NVJBASE64_H_
+
+#include <string.h>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+  #define NVJ_BASE64_X86
+  #include <immintrin.h>
+#endif
+
+//********************************************************
+
+static const char nvj_base64_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static const char nvj_base64url_chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+// value of a base64 character ('+' and '/'), -1 if the character is not one
+static const signed char nvj_base64_value[256] =
+{
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,62,-1,-1,-1,63, 52,53,54,55,56,57,58,59,60,61,-1,-1,-1,-1,-1,-1,
+  -1, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9,10,11,12,13,14, 15,16,17,18,19,20,21,22,23,24,25,-1,-1,-1,-1,-1,
+  -1,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40, 41,42,43,44,45,46,47,48,49,50,51,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+/**
+* Size of the encoding of len bytes
+*/
+inline size_t nvj_base64_encoded_size( const size_t len, const bool pad=true )
+{
+  return pad ? (len + 2) / 3 * 4 : (len * 4 + 2) / 3;
+}
+
+/**
+* Size of the buffer to give to nvj_base64_decode() for len characters
+*/
+inline size_t nvj_base64_decoded_max_size( const size_t len )
+{
+  return len / 4 * 3 + 3 + 32;
+}
+
+//********************************************************
+
+inline size_t nvj_base64_encode_scalar( const unsigned char *src, const size_t len, char *dst,
+                                        const bool url=false, const bool pad=true )
+{
+  const char *chars = url ? nvj_base64url_chars : nvj_base64_chars;
+  char *o = dst;
+  size_t i = 0;
+
+  for (; i + 3 <= len; i += 3)
+  {
+    unsigned v = (src[i] << 16) | (src[i+1] << 8) | src[i+2];
+    o[0] = chars[v >> 18];
+    o[1] = chars[(v >> 12) & 0x3F];
+    o[2] = chars[(v >> 6) & 0x3F];
+    o[3] = chars[v & 0x3F];
+    o += 4;
+  }
+
+  if (i < len)
+  {
+    unsigned v = src[i] << 16;
+    if (i + 1 < len) v |= src[i+1] << 8;
+    *o++ = chars[v >> 18];
+    *o++ = chars[(v >> 12) & 0x3F];
+    if (i + 1 < len) *o++ = chars[(v >> 6) & 0x3F];
+    else if (pad) *o++ = '=';
+    if (pad) *o++ = '=';
+  }
+
+  return o - dst;
+}
+
+// Decode until the first '=' or invalid character. A trailing group of
+// n (2 or 3) characters gives n-1 bytes.
+inline size_t nvj_base64_decode_scalar( const char *src, const size_t len, unsigned char *dst )
+{
+  unsigned char *o = dst;
+  unsigned v = 0, n = 0;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    int c = nvj_base64_value[(unsigned char)src[i]];
+    if (c < 0)
+      break;
+    v = (v << 6) | c;
+    if (++n == 4)
+    {
+      o[0] = (unsigned char)(v >> 16);
+      o[1] = (unsigned char)(v >> 8);
+      o[2] = (unsigned char)v;
+      o += 3; v = 0; n = 0;
+    }
+  }
+
+  if (n >= 2)
+  {
+    v <<= 6 * (4 - n);
+    *o++ = (unsigned char)(v >> 16);
+    if (n == 3) *o++ = (unsigned char)(v >> 8);
+  }
+
+  return o - dst;
+}
+
+//********************************************************
+
+#ifdef NVJ_BASE64_X86
+
+// 24 bytes -> 32 characters per iteration (W. Mula and D. Lemire's algorithm)
+__attribute__((target("avx2")))
+inline size_t nvj_base64_encode_avx2( const unsigned char *src, const size_t len, char *dst,
+                                      const bool url=false, const bool pad=true )
+{
+  const __m256i shuffle = _mm256_setr_epi8( 5, 4, 6, 5,  8, 7, 9, 8, 11,10,12,11, 14,13,15,14,
+                                            1, 0, 2, 1,  4, 3, 5, 4,  7, 6, 8, 7, 10, 9,11,10 );
+  const __m256i offsets = url ? _mm256_setr_epi8( 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -17, 32, 0, 0,
+                                                  65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -17, 32, 0, 0 )
+                              : _mm256_setr_epi8( 65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                                  65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0 );
+  size_t i = 0;
+  char *o = dst;
+
+  // 32 bytes are loaded for 24 used
+  for (; i + 32 <= len; i += 24, o += 32)
+  {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(src + i));
+    // bytes 0..11 in the upper 12 bytes of the low lane, 12..23 in the lower 12 bytes of the high lane
+    in = _mm256_permutevar8x32_epi32(in, _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6));
+    in = _mm256_shuffle_epi8(in, shuffle);
+
+    // split each group of 3 bytes into 4 indexes of 6 bits
+    __m256i t0 = _mm256_mulhi_epu16(_mm256_and_si256(in, _mm256_set1_epi32(0x0FC0FC00)), _mm256_set1_epi32(0x04000040));
+    __m256i t1 = _mm256_mullo_epi16(_mm256_and_si256(in, _mm256_set1_epi32(0x003F03F0)), _mm256_set1_epi32(0x01000010));
+    __m256i idx = _mm256_or_si256(t0, t1);
+
+    // index -> character: add the offset of its range
+    __m256i range = _mm256_subs_epu8(idx, _mm256_set1_epi8(51));
+    range = _mm256_sub_epi8(range, _mm256_cmpgt_epi8(idx, _mm256_set1_epi8(25)));
+    _mm256_storeu_si256((__m256i*)o, _mm256_add_epi8(idx, _mm256_shuffle_epi8(offsets, range)));
+  }
+
+  return (o - dst) + nvj_base64_encode_scalar(src + i, len - i, o, url, pad);
+}
+
+// 32 characters -> 24 bytes per iteration, 32 bytes are written: the
+// output buffer needs nvj_base64_decoded_max_size() bytes
+__attribute__((target("avx2")))
+inline size_t nvj_base64_decode_avx2( const char *src, const size_t len, unsigned char *dst )
+{
+  const __m256i lutLo = _mm256_setr_epi8( 0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A );
+  const __m256i lutHi = _mm256_setr_epi8( 0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10 );
+  const __m256i lutRoll = _mm256_setr_epi8( 0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0 );
+  const __m256i mask2F = _mm256_set1_epi8(0x2F);
+  size_t i = 0;
+  unsigned char *o = dst;
+
+  for (; i + 32 <= len; i += 32, o += 24)
+  {
+    __m256i in = _mm256_loadu_si256((const __m256i*)(src + i));
+    __m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+    __m256i loNibbles = _mm256_and_si256(in, mask2F);
+
+    // '=' or an invalid character: the scalar decoder handles the end
+    if (!_mm256_testz_si256(_mm256_shuffle_epi8(lutLo, loNibbles), _mm256_shuffle_epi8(lutHi, hiNibbles)))
+      break;
+
+    // character -> 6 bits value
+    __m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(_mm256_cmpeq_epi8(in, mask2F), hiNibbles));
+    in = _mm256_add_epi8(in, roll);
+
+    // pack 4 values of 6 bits into 3 bytes
+    __m256i out = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+    out = _mm256_madd_epi16(out, _mm256_set1_epi32(0x00011000));
+    out = _mm256_shuffle_epi8(out, _mm256_setr_epi8( 2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                                     2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1 ));
+    out = _mm256_permutevar8x32_epi32(out, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i*)o, out);
+  }
+
+  return (o - dst) + nvj_base64_decode_scalar(src + i, len - i, o);
+}
+
+inline bool nvj_base64_has_avx2()
+{
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  return hasAvx2;
+}
+
+#endif
+
+//********************************************************
+
+/**
+* Encode in base64
+* @param src: the bytes to encode
+* @param len: the number of bytes
+* @param dst: the output, nvj_base64_encoded_size(len, pad) characters (not null-terminated)
+* @param url: use the base64url alphabet ('-' and '_')
+* @param pad: add the '=' padding
+* \return the number of characters written
+*/
+inline size_t nvj_base64_encode( const unsigned char *src, const size_t len, char *dst,
+                                 const bool url=false, const bool pad=true )
+{
+#ifdef NVJ_BASE64_X86
+  if (len >= 32 && nvj_base64_has_avx2())
+    return nvj_base64_encode_avx2(src, len, dst, url, pad);
+#endif
+  return nvj_base64_encode_scalar(src, len, dst, url, pad);
+}
+
+/**
+* Decode base64 (standard alphabet), until the first '=' or invalid character
+* @param src: the characters to decode
+* @param len: the number of characters
+* @param dst: the output, at least nvj_base64_decoded_max_size(len) bytes
+* \return the number of bytes written
+*/
+inline size_t nvj_base64_decode( const char *src, const size_t len, unsigned char *dst )
+{
+#ifdef NVJ_BASE64_X86
+  if (len >= 32 && nvj_base64_has_avx2())
+    return nvj_base64_decode_avx2(src, len, dst);
+#endif
+  return nvj_base64_decode_scalar(src, len, dst);
+}
+
+inline std::string nvj_base64_encode( const unsigned char *src, const size_t len, const bool url=false, const bool pad=true )
+{
+  std::string res(nvj_base64_encoded_size(len, pad), '\0');
+  if (len) res.resize(nvj_base64_encode(src, len, &res[0], url, pad));
+  return res;
+}
+
+inline std::string nvj_base64_decode( const std::string& encoded )
+{
+  std::string res(nvj_base64_decoded_max_size(encoded.size()), '\0');
+  res.resize(nvj_base64_decode(encoded.data(), encoded.size(), (unsigned char*)&res[0]));
+  return res;
+}
+
+#endif
@@ -16,6 +16,7 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <string>
 #include <stdexcept>
  
@@ -161,30 +162,28 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
 
 //----------------------------------------------------------------------------------------
   
-  inline size_t nvj_gzip_websocket_v2( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, z_stream* pstream=NULL, const unsigned int sizeChunk = CHUNK)
+  /**
+  * nvj_gzip_websocket_v2 - compress a message, or a fragment of it, with the
+  * deflate context of the connection (rfc7692 7.2.1)
+  * @param finalFragment: the last fragment: the trailing 0x00 0x00 0xff 0xff is removed
+  * \return the compressed length, *dst is allocated (malloc)
+  */
+  inline size_t nvj_gzip_websocket_v2( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, z_stream* pstream=NULL, const bool finalFragment=true, const unsigned int sizeChunk = CHUNK)
   {
-
-    unsigned sizeDst = 0;
-
-    int rmndr = sizeSrc % sizeChunk;
-    int iterations = (rmndr == 0 ? sizeSrc / sizeChunk : sizeSrc / sizeChunk + 1) ;
-    int in = sizeChunk;
-    int flush = Z_NO_FLUSH;
+    size_t sizeDst = 0, left = sizeSrc;
+    const unsigned char *in = src;
 
     *dst = NULL;
 
-    for ( int i = 0; i < iterations; i++ ) 
+    // an empty message still gives an empty block
+    do
     {
-      if(i == iterations - 1){
-        flush = Z_SYNC_FLUSH;
-        if(rmndr != 0){
-          in = rmndr;
-        }
-      }
-
+      size_t n = left < sizeChunk ? left : sizeChunk;
+      left -= n;
 
-      (*pstream).avail_in = in;
-      (*pstream).next_in = (Bytef*)src + i * sizeChunk;
+      (*pstream).avail_in = n;
+      (*pstream).next_in = (Bytef*)in;
+      in += n;
 
       do
       {
@@ -195,7 +194,6 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
         }
         else
         {
-          free (reallocDst);
           free (*dst);
           throw std::runtime_error(std::string("gzip : (re)allocating memory") );
         }
@@ -203,7 +201,7 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
         (*pstream).avail_out = sizeChunk;
         (*pstream).next_out = (Bytef*)*dst + sizeDst;
 
-        if (deflate(pstream, flush) == Z_STREAM_ERROR)  /* state not clobbered */
+        if (deflate(pstream, left ? Z_NO_FLUSH : Z_SYNC_FLUSH) == Z_STREAM_ERROR)  /* state not clobbered */
         {
           free (*dst);
           throw std::runtime_error(std::string("gzip : deflate error") );
@@ -212,8 +210,10 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
       }
       while ((*pstream).avail_out == 0 );
     }
+    while (left);
 
-    sizeDst -= 4;
+    if (finalFragment)
+      sizeDst -= 4;
 
     unsigned char* reallocDst = (unsigned char*) realloc (*dst, sizeDst * sizeof (unsigned char) );
 
@@ -222,7 +222,6 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
     }
     else
     {
-      free (reallocDst);
       free (*dst);
       throw std::runtime_error(std::string("gzip : (re)allocating memory") );
     }
@@ -241,16 +240,110 @@ inline size_t nvj_gunzip( unsigned char** dst, const unsigned char* src, const s
 
   //********************************************************
 
-  inline void nvj_init_stream(z_stream* pstream=NULL, bool rawDeflateData=false, int level=Z_BEST_COMPRESSION, int strategy=Z_DEFAULT_STRATEGY ){
+  inline void nvj_init_stream(z_stream* pstream=NULL, bool rawDeflateData=false, int level=Z_BEST_COMPRESSION, int strategy=Z_DEFAULT_STRATEGY, int windowBits=MAX_WBITS, int memLevel=9 ){
         (*pstream).zalloc = Z_NULL;
         (*pstream).zfree = Z_NULL;
         (*pstream).opaque = Z_NULL;
-    if ( deflateInit2(pstream, level, Z_DEFLATED, rawDeflateData ? -15 : 16+MAX_WBITS, 9, strategy) != Z_OK)
+    if ( deflateInit2(pstream, level, Z_DEFLATED, rawDeflateData ? -windowBits : 16+windowBits, memLevel, strategy) != Z_OK)
       throw std::runtime_error(std::string("gzip : deflateInit2 error") );
   }
 
+  //********************************************************
+
+  inline void nvj_init_inflate_stream(z_stream* pstream, bool rawDeflateData=false, int windowBits=MAX_WBITS ){
+        (*pstream).zalloc = Z_NULL;
+        (*pstream).zfree = Z_NULL;
+        (*pstream).opaque = Z_NULL;
+        (*pstream).avail_in = 0;
+        (*pstream).next_in = Z_NULL;
+    if ( inflateInit2(pstream, rawDeflateData ? -windowBits : 16+windowBits) != Z_OK)
+      throw std::runtime_error(std::string("gunzip : inflateInit2 error") );
+  }
+
+  //********************************************************
+
+  inline void nvj_end_inflate_stream(z_stream* pstream){
+    (void)inflateEnd(pstream);
+  }
+
    //********************************************************
 
+/**
+* nvj_gunzip_websocket_stream - decompress a message, or a fragment of it,
+* with the inflate context kept by the connection (rfc7692 7.2.2)
+* @param finalFragment: the last fragment: 0x00 0x00 0xff 0xff is appended
+* @param maxSize: the largest decompressed length allowed, SIZE_MAX for no
+*                 limit (std::length_error is thrown beyond)
+* \return the decompressed length, *dst is allocated (malloc)
+*/
+inline size_t nvj_gunzip_websocket_stream( unsigned char** dst, const unsigned char* src, const size_t sizeSrc, z_stream* pstream,
+                                           const bool finalFragment=true, const size_t maxSize=SIZE_MAX )
+{
+  static const unsigned char trailer[4] = { 0x00, 0x00, 0xff, 0xff };
+  size_t sizeDst = 0, capacity = 0;
+
+  *dst = NULL;
+
+  for (int i = 0; i < 2; i++)
+  {
+    const unsigned char *in = i ? trailer : src;
+    size_t left = i ? (finalFragment ? 4 : 0) : sizeSrc;
+
+    while (left)
+    {
+      uInt n = left < 0x40000000 ? (uInt)left : 0x40000000;
+      (*pstream).avail_in = n;
+      (*pstream).next_in = (Bytef*)in;
+
+      do
+      {
+        if (sizeDst == capacity)
+        {
+          capacity = capacity ? 2 * capacity : 4 * sizeSrc + 256;
+          if (capacity > maxSize)
+            capacity = maxSize + 1; // one byte more tells it's too large
+          unsigned char* reallocDst = (unsigned char*) realloc (*dst, capacity * sizeof (unsigned char) );
+          if (reallocDst == NULL)
+          {
+            free (*dst);
+            throw std::runtime_error(std::string("gunzip : (re)allocating memory") );
+          }
+          *dst = reallocDst;
+        }
+
+        size_t out = capacity - sizeDst < 0x40000000 ? capacity - sizeDst : 0x40000000;
+        (*pstream).avail_out = (uInt)out;
+        (*pstream).next_out = (Bytef*)*dst + sizeDst;
+
+        int ret = inflate(pstream, Z_SYNC_FLUSH);
+        sizeDst += out - (*pstream).avail_out;
+
+        if (sizeDst > maxSize)
+        {
+          free (*dst);
+          throw std::length_error(std::string("gunzip : decompressed data too large") );
+        }
+
+        if (ret == Z_STREAM_END) // a final block: the next one starts a new stream
+          inflateReset(pstream);
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+          free (*dst);
+          throw std::runtime_error(std::string("gunzip : inflate error") );
+        }
+      }
+      while ((*pstream).avail_in != 0 || (*pstream).avail_out == 0);
+
+      in += n;
+      left -= n;
+    }
+  }
+
+  return sizeDst;
+}
+
+//********************************************************
+
 inline size_t nvj_gunzip_websocket_v2( unsigned char** dst, const unsigned char* src,  size_t sizeSrc, bool rawDeflateData=false, unsigned char* dictionary = NULL, unsigned int* dictLength = NULL, const unsigned int sizeChunk = CHUNK)
 {
   z_stream strm;
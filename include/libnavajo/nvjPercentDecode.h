@@ -0,0 +1,152 @@
+//********************************************************
+/**
+ * @file  nvjPercentDecode.h
+ *
+ * @brief single pass, in-place decoding of the %XX escapes
+ *        of the urls and form parameters
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef NVJPERCENTDECODE_H_
+#define NVJPERCENTDECODE_H_
+
+#include <string.h>
+#include <string>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+  #define NVJ_PERCENT_DECODE_X86
+  #include <immintrin.h>
+#endif
+
+//********************************************************
+
+// value of an hexadecimal digit, -1 if the character is not one
+static const signed char nvj_hex_value[256] =
+{
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,  0, 1, 2, 3, 4, 5, 6, 7, 8, 9,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,10,11,12,13,14,15,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,
+  -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1, -1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1,-1
+};
+
+//********************************************************
+
+// scalar scan: first '%' (or '+' if plusAsSpace) in [p, end[
+inline const char* nvj_percent_scan_scalar( const char *p, const char *end, const bool plusAsSpace )
+{
+  for (; p < end; p++)
+    if (*p == '%' || (plusAsSpace && *p == '+'))
+      break;
+  return p;
+}
+
+#ifdef NVJ_PERCENT_DECODE_X86
+
+// SSE2 scan, 16 bytes per iteration (SSE2 is always available on x86_64)
+inline const char* nvj_percent_scan_sse2( const char *p, const char *end, const bool plusAsSpace )
+{
+  const __m128i percent = _mm_set1_epi8('%');
+  const __m128i plus = _mm_set1_epi8(plusAsSpace ? '+' : '%');
+  for (; end - p >= 16; p += 16)
+  {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, percent), _mm_cmpeq_epi8(v, plus)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return nvj_percent_scan_scalar(p, end, plusAsSpace);
+}
+
+// AVX2 scan, 32 bytes per iteration, selected at runtime
+__attribute__((target("avx2")))
+inline const char* nvj_percent_scan_avx2( const char *p, const char *end, const bool plusAsSpace )
+{
+  const __m256i percent = _mm256_set1_epi8('%');
+  const __m256i plus = _mm256_set1_epi8(plusAsSpace ? '+' : '%');
+  for (; end - p >= 32; p += 32)
+  {
+    __m256i v = _mm256_loadu_si256((const __m256i*)p);
+    unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, percent), _mm256_cmpeq_epi8(v, plus)));
+    if (mask)
+      return p + __builtin_ctz(mask);
+  }
+  return nvj_percent_scan_sse2(p, end, plusAsSpace);
+}
+
+#endif
+
+//********************************************************
+
+inline const char* nvj_percent_scan( const char *p, const char *end, const bool plusAsSpace )
+{
+#ifdef NVJ_PERCENT_DECODE_X86
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  // short strings are not worth the vector setup
+  if (end - p < 16)
+    return nvj_percent_scan_scalar(p, end, plusAsSpace);
+  return hasAvx2 ? nvj_percent_scan_avx2(p, end, plusAsSpace) : nvj_percent_scan_sse2(p, end, plusAsSpace);
+#else
+  return nvj_percent_scan_scalar(p, end, plusAsSpace);
+#endif
+}
+
+//********************************************************
+
+/**
+* Decode the %XX escapes in place, in a single pass. "%%" gives '%', and an
+* escape which is incomplete or not hexadecimal is kept unchanged.
+* @param s: the string to decode, it doesn't need to be null-terminated
+* @param len: the string length
+* @param plusAsSpace: decode '+' as ' ' (form parameters)
+* \return the decoded length (never longer than len)
+*/
+inline size_t nvj_percent_decode( char *s, const size_t len, const bool plusAsSpace=false )
+{
+  const char *r = s, *end = s + len;
+  char *w = s;
+
+  while (true)
+  {
+    // copy the run without escape
+    const char *next = nvj_percent_scan(r, end, plusAsSpace);
+    if (w != r)
+      memmove(w, r, next - r);
+    w += next - r;
+    r = next;
+    if (r == end)
+      break;
+
+    if (*r == '+')
+      { *w++ = ' '; r++; continue; }
+
+    if (end - r >= 2 && r[1] == '%')
+      { *w++ = '%'; r += 2; continue; }
+
+    if (end - r >= 3)
+    {
+      int hi = nvj_hex_value[(unsigned char)r[1]], lo = nvj_hex_value[(unsigned char)r[2]];
+      if ((hi | lo) >= 0)
+        { *w++ = (char)((hi << 4) | lo); r += 3; continue; }
+    }
+    *w++ = *r++;
+  }
+
+  return w - s;
+}
+
+inline void nvj_percent_decode( std::string& s, const bool plusAsSpace=false )
+{
+  if (!s.empty())
+    s.resize(nvj_percent_decode(&s[0], s.size(), plusAsSpace));
+}
+
+#endif
@@ -37,6 +37,7 @@
 #include <sys/socket.h>
 #include <netinet/tcp.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <strings.h>
 #include <netdb.h>
 #include <sys/poll.h>
@@ -185,6 +186,27 @@ inline bool setSocketTcpAckTimeout(int socket, int seconds, int milliseconds)
 #endif
 }
 
+/***********************************************************************
+* setSocketNonBlocking:  Make the socket operations non blocking
+* @param socket      - socket descriptor
+* @param nonBlocking - true to set the O_NONBLOCK flag, false to clear it
+* \return true is successful, otherwise false
+***********************************************************************/
+
+inline bool setSocketNonBlocking(int socket, bool nonBlocking = true)
+{
+#ifdef WIN32
+  u_long mode = nonBlocking ? 1 : 0;
+  return ioctlsocket(socket, FIONBIO, &mode) == 0;
+#else
+  int flags = fcntl(socket, F_GETFL, 0);
+  if (flags == -1)
+    return false;
+  flags = nonBlocking ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+  return fcntl(socket, F_SETFL, flags) == 0;
+#endif
+}
+
 /***********************************************************************
  * setSocketTcpNoDelay:
  *
@@ -0,0 +1,37 @@
+//********************************************************
+/**
+ * @file  nvjTime.h
+ *
+ * @brief monotonic clock, shared by the timers, the
+ *        queues deadlines and the rate limits
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef NVJTIME_H_
+#define NVJTIME_H_
+
+#include <time.h>
+
+//********************************************************
+
+/**
+* The time elapsed since an arbitrary point, in milliseconds: it doesn't
+* follow the wall clock changes (the realtime clock on darwin)
+*/
+inline unsigned long long nvj_monotonic_ms()
+{
+  struct timespec ts;
+#ifndef __darwin__
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+  clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+#endif
@@ -0,0 +1,145 @@
+//********************************************************
+/**
+ * @file  nvjWebSocketMask.h
+ *
+ * @brief unmasking of the WebSocket payloads (rfc6455 5.3),
+ *        a word at a time, fused with their copy
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#ifndef NVJWEBSOCKETMASK_H_
+#define NVJWEBSOCKETMASK_H_
+
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+  #define NVJ_WEBSOCKET_MASK_X86
+  #include <immintrin.h>
+#endif
+
+//********************************************************
+
+// rotate a key word by n bytes, in memory order
+inline uint32_t nvj_ws_mask_rotate( const uint32_t k, const size_t n )
+{
+  const unsigned s = (n & 3) * 8;
+  if (!s)
+    return k;
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+  return (k << s) | (k >> (32 - s));
+#else
+  return (k >> s) | (k << (32 - s));
+#endif
+}
+
+// the masking key as a word, starting at the payload offset
+inline uint32_t nvj_ws_mask_key( const unsigned char key[4], const size_t offset )
+{
+  uint32_t k;
+  memcpy(&k, key, 4);
+  return nvj_ws_mask_rotate(k, offset);
+}
+
+//********************************************************
+
+// scalar unmasking, 8 bytes per iteration (unaligned accesses through memcpy)
+inline void nvj_ws_unmask_scalar( unsigned char *dst, const unsigned char *src, size_t len, const uint32_t key )
+{
+  const uint64_t k64 = ((uint64_t)key << 32) | key; // the memory order is kept on both endianness
+  uint64_t v;
+  for (; len >= 8; len -= 8, src += 8, dst += 8)
+  {
+    memcpy(&v, src, 8);
+    v ^= k64;
+    memcpy(dst, &v, 8);
+  }
+  if (len)
+  {
+    memcpy(&v, src, len);
+    v ^= k64;
+    memcpy(dst, &v, len);
+  }
+}
+
+#ifdef NVJ_WEBSOCKET_MASK_X86
+
+// SSE2 unmasking, 16 bytes per iteration, aligned stores (SSE2 is always available on x86_64)
+inline void nvj_ws_unmask_sse2( unsigned char *dst, const unsigned char *src, size_t len, uint32_t key )
+{
+  size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+  if (head > len) head = len;
+  nvj_ws_unmask_scalar(dst, src, head, key);
+  dst += head; src += head; len -= head;
+  key = nvj_ws_mask_rotate(key, head);
+
+  const __m128i k = _mm_set1_epi32((int)key);
+  for (; len >= 16; len -= 16, src += 16, dst += 16)
+    _mm_store_si128((__m128i*)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i*)src), k));
+
+  nvj_ws_unmask_scalar(dst, src, len, key);
+}
+
+// AVX2 unmasking, 64 bytes per iteration, selected at runtime
+__attribute__((target("avx2")))
+inline void nvj_ws_unmask_avx2( unsigned char *dst, const unsigned char *src, size_t len, uint32_t key )
+{
+  size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+  if (head > len) head = len;
+  nvj_ws_unmask_scalar(dst, src, head, key);
+  dst += head; src += head; len -= head;
+  key = nvj_ws_mask_rotate(key, head);
+
+  const __m256i k = _mm256_set1_epi32((int)key);
+  for (; len >= 64; len -= 64, src += 64, dst += 64)
+  {
+    __m256i a = _mm256_loadu_si256((const __m256i*)src);
+    __m256i b = _mm256_loadu_si256((const __m256i*)(src + 32));
+    _mm256_store_si256((__m256i*)dst, _mm256_xor_si256(a, k));
+    _mm256_store_si256((__m256i*)(dst + 32), _mm256_xor_si256(b, k));
+  }
+  if (len >= 32)
+  {
+    _mm256_store_si256((__m256i*)dst, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)src), k));
+    len -= 32; src += 32; dst += 32;
+  }
+
+  nvj_ws_unmask_scalar(dst, src, len, key);
+}
+
+#endif
+
+//********************************************************
+
+/**
+* Unmask a part of a WebSocket payload while copying it
+* @param dst: the destination, it may be src (in place) but not overlap it otherwise
+* @param src: the masked bytes
+* @param len: the number of bytes
+* @param key: the masking key of the frame
+* @param offset: the position of src in the payload
+*/
+inline void nvj_ws_unmask( unsigned char *dst, const unsigned char *src, const size_t len, const unsigned char key[4], const size_t offset )
+{
+  const uint32_t k = nvj_ws_mask_key(key, offset);
+#ifdef NVJ_WEBSOCKET_MASK_X86
+  static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+  // short payloads are not worth the vector setup
+  if (len < 128)
+    nvj_ws_unmask_scalar(dst, src, len, k);
+  else if (hasAvx2)
+    nvj_ws_unmask_avx2(dst, src, len, k);
+  else
+    nvj_ws_unmask_sse2(dst, src, len, k);
+#else
+  nvj_ws_unmask_scalar(dst, src, len, k);
+#endif
+}
+
+#endif
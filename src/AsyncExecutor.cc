@@ -0,0 +1,235 @@
+//********************************************************
+/**
+ * @file  AsyncExecutor.cc
+ *
+ * @brief Shared executor and timer used to complete
+ *        asynchronous requests outside the WebServer pool
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <time.h>
+#include <exception>
+
+#include "libnavajo/AsyncExecutor.hh"
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/nvjTime.h"
+
+#define DEFAULT_ASYNCEXECUTOR_THREADS 4
+
+
+  /**
+  * AsyncExecutor - static and unique executor object
+  */
+  AsyncExecutor * AsyncExecutor::theAsyncExecutor = NULL;
+
+  /***********************************************************************/
+
+  AsyncExecutor::AsyncExecutor(): lastTimerId(0), threadsPoolSize(DEFAULT_ASYNCEXECUTOR_THREADS),
+                                  started(false), exiting(false)
+  {
+    pthread_mutex_init(&executor_mutex, NULL);
+    pthread_cond_init(&tasks_cond, NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifndef __darwin__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&timers_cond, &attr);
+    pthread_condattr_destroy(&attr);
+  }
+
+  /***********************************************************************/
+
+  AsyncExecutor::~AsyncExecutor()
+  {
+    pthread_mutex_lock(&executor_mutex);
+    exiting=true;
+    pthread_cond_broadcast(&tasks_cond);
+    pthread_cond_broadcast(&timers_cond);
+    pthread_mutex_unlock(&executor_mutex);
+
+    if (started)
+    {
+      wait_for_thread(timerThread);
+      for (size_t i=0; i<workerThreads.size(); i++)
+        wait_for_thread(workerThreads[i]);
+    }
+
+    pthread_cond_destroy(&tasks_cond);
+    pthread_cond_destroy(&timers_cond);
+    pthread_mutex_destroy(&executor_mutex);
+  }
+
+  /***********************************************************************/
+  /**
+  * start - launch the threads on first use (executor_mutex is held)
+  */
+  void AsyncExecutor::start()
+  {
+    if (started) return;
+    started=true;
+
+    workerThreads.resize(threadsPoolSize);
+    for (size_t i=0; i<threadsPoolSize; i++)
+      create_thread( &workerThreads[i], AsyncExecutor::startWorkerThread, static_cast<void *>(this) );
+    create_thread( &timerThread, AsyncExecutor::startTimerThread, static_cast<void *>(this) );
+  }
+
+  /***********************************************************************/
+
+  void AsyncExecutor::setThreadsPoolSize(const size_t nbThread)
+  {
+    pthread_mutex_lock(&executor_mutex);
+    if (!started && nbThread)
+      threadsPoolSize=nbThread;
+    pthread_mutex_unlock(&executor_mutex);
+  }
+
+  /***********************************************************************/
+
+  bool AsyncExecutor::post(const Task& task)
+  {
+    pthread_mutex_lock(&executor_mutex);
+    bool res = !exiting;
+    if (res)
+    {
+      start();
+      tasks.push(task);
+      pthread_cond_signal(&tasks_cond);
+    }
+    pthread_mutex_unlock(&executor_mutex);
+    return res;
+  }
+
+  /***********************************************************************/
+
+  AsyncExecutor::TimerId AsyncExecutor::postDelayed(const unsigned delayMs, const Task& task)
+  {
+    TimerId id=0;
+
+    pthread_mutex_lock(&executor_mutex);
+    if (!exiting)
+    {
+      start();
+      id=++lastTimerId;
+      unsigned long long deadline=nvj_monotonic_ms()+delayMs;
+      bool isFirst = timers.empty() || deadline < timers.begin()->first.first;
+      timers[TimerKey(deadline, id)]=task;
+      timersDeadline[id]=deadline;
+      if (isFirst)
+        pthread_cond_signal(&timers_cond);
+    }
+    pthread_mutex_unlock(&executor_mutex);
+
+    return id;
+  }
+
+  /***********************************************************************/
+
+  bool AsyncExecutor::cancel(const TimerId id)
+  {
+    bool res=false;
+
+    pthread_mutex_lock(&executor_mutex);
+    std::map<TimerId, unsigned long long>::iterator it=timersDeadline.find(id);
+    if (it != timersDeadline.end())
+    {
+      timers.erase(TimerKey(it->second, id));
+      timersDeadline.erase(it);
+      res=true;
+    }
+    pthread_mutex_unlock(&executor_mutex);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void AsyncExecutor::workerThreadProcessing()
+  {
+    pthread_mutex_lock(&executor_mutex);
+
+    for (;;)
+    {
+      while (tasks.empty() && !exiting)
+        pthread_cond_wait(&tasks_cond, &executor_mutex);
+
+      if (exiting) break;
+
+      Task task=tasks.front();
+      tasks.pop();
+      pthread_mutex_unlock(&executor_mutex);
+
+      try
+      {
+        task();
+      }
+      catch (std::exception& e)
+      {
+        NVJ_LOG->append(NVJ_ERROR, std::string("AsyncExecutor: task raised an exception: ") + e.what());
+      }
+      catch (...)
+      {
+        NVJ_LOG->append(NVJ_ERROR, "AsyncExecutor: task raised an unknown exception");
+      }
+
+      pthread_mutex_lock(&executor_mutex);
+    }
+
+    pthread_mutex_unlock(&executor_mutex);
+  }
+
+  /***********************************************************************/
+  /**
+  * timerThreadProcessing - move expired timers to the tasks queue.
+  * The timer thread never runs user code itself.
+  */
+  void AsyncExecutor::timerThreadProcessing()
+  {
+    pthread_mutex_lock(&executor_mutex);
+
+    while (!exiting)
+    {
+      if (timers.empty())
+      {
+        pthread_cond_wait(&timers_cond, &executor_mutex);
+        continue;
+      }
+
+      unsigned long long now=nvj_monotonic_ms();
+      unsigned long long deadline=timers.begin()->first.first;
+
+      if (deadline > now)
+      {
+        struct timespec ts;
+#ifndef __darwin__
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+        clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+        unsigned long long delay=deadline-now;
+        ts.tv_sec += delay / 1000;
+        ts.tv_nsec += (delay % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) { ts.tv_sec++; ts.tv_nsec -= 1000000000; }
+        pthread_cond_timedwait(&timers_cond, &executor_mutex, &ts);
+        continue;
+      }
+
+      while (!timers.empty() && timers.begin()->first.first <= now)
+      {
+        tasks.push(timers.begin()->second);
+        timersDeadline.erase(timers.begin()->first.second);
+        timers.erase(timers.begin());
+        pthread_cond_signal(&tasks_cond);
+      }
+    }
+
+    pthread_mutex_unlock(&executor_mutex);
+  }
+
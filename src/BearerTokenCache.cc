@@ -0,0 +1,184 @@
+//********************************************************
+/**
+ * @file  BearerTokenCache.cc
+ *
+ * @brief Cache of the verified bearer tokens, sharded and
+ *        bounded, with coalesced verifications
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include "libnavajo/BearerTokenCache.hh"
+
+
+  /***********************************************************************/
+
+  BearerTokenCache::BearerTokenCache(const size_t maxEntries): shards(BEARERTOKENCACHE_NB_SHARDS)
+  {
+    maxEntriesPerShard = (maxEntries + BEARERTOKENCACHE_NB_SHARDS - 1) / BEARERTOKENCACHE_NB_SHARDS;
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_init(&shards[i].mutex, NULL);
+      pthread_cond_init(&shards[i].verified, NULL);
+    }
+  }
+
+  /***********************************************************************/
+
+  BearerTokenCache::~BearerTokenCache()
+  {
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_destroy(&shards[i].mutex);
+      pthread_cond_destroy(&shards[i].verified);
+    }
+  }
+
+  /***********************************************************************/
+  /**
+  * evict - remove the expired tokens, then the ones expiring first
+  *         while the shard is full (shard mutex held)
+  */
+
+  void BearerTokenCache::evict(Shard& shard, const time_t now)
+  {
+    while (!shard.expiry.empty()
+           && (shard.expiry.begin()->first <= now || shard.expiry.size() > maxEntriesPerShard))
+    {
+      shard.entries.erase(shard.expiry.begin()->second);
+      shard.expiry.erase(shard.expiry.begin());
+    }
+  }
+
+  /***********************************************************************/
+
+  bool BearerTokenCache::get(const std::string& token, const time_t now, const Verifier& verify, BearerTokenVerification& result)
+  {
+    Shard& shard = shardOf(token);
+    std::shared_ptr<Pending> pending;
+
+    pthread_mutex_lock(&shard.mutex);
+    std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(token);
+    if (it != shard.entries.end())
+    {
+      if (it->second.pending)
+      {
+        // already being verified by another request: wait for its result
+        pending = it->second.pending;
+        while (!pending->done)
+          pthread_cond_wait(&shard.verified, &shard.mutex);
+        result = pending->result;
+        pthread_mutex_unlock(&shard.mutex);
+        return true;
+      }
+
+      if (it->second.result.expiration > now)
+      {
+        result = it->second.result;
+        pthread_mutex_unlock(&shard.mutex);
+        return true;
+      }
+
+      shard.expiry.erase(it->second.expiryIt);
+      shard.entries.erase(it);
+    }
+
+    pending = std::make_shared<Pending>();
+    shard.entries[token].pending = pending;
+    pthread_mutex_unlock(&shard.mutex);
+
+    result = BearerTokenVerification();
+    try
+    {
+      verify(token, result);
+    }
+    catch (...)
+    {
+      result = BearerTokenVerification();
+      result.error = "error=\"invalid_token\"";
+      result.logMessage = "verification failed";
+    }
+
+    pthread_mutex_lock(&shard.mutex);
+    pending->result = result;
+    pending->done = true;
+    it = shard.entries.find(token);
+    if (it != shard.entries.end() && it->second.pending == pending)
+    {
+      if (result.valid && result.expiration > now && maxEntriesPerShard)
+      {
+        it->second.pending.reset();
+        it->second.result = result;
+        it->second.expiryIt = shard.expiry.insert(ExpiryIndex::value_type(result.expiration, token));
+        evict(shard, now);
+      }
+      else
+        shard.entries.erase(it);
+    }
+    pthread_cond_broadcast(&shard.verified);
+    pthread_mutex_unlock(&shard.mutex);
+
+    return false;
+  }
+
+  /***********************************************************************/
+
+  void BearerTokenCache::remove(const std::string& token)
+  {
+    Shard& shard = shardOf(token);
+    pthread_mutex_lock(&shard.mutex);
+    std::unordered_map<std::string, Entry>::iterator it = shard.entries.find(token);
+    if (it != shard.entries.end() && !it->second.pending)
+    {
+      shard.expiry.erase(it->second.expiryIt);
+      shard.entries.erase(it);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+  }
+
+  /***********************************************************************/
+
+  void BearerTokenCache::clear()
+  {
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      Shard& shard = shards[i];
+      pthread_mutex_lock(&shard.mutex);
+      for (ExpiryIndex::iterator it = shard.expiry.begin(); it != shard.expiry.end(); it++)
+        shard.entries.erase(it->second);
+      shard.expiry.clear();
+      pthread_mutex_unlock(&shard.mutex);
+    }
+  }
+
+  /***********************************************************************/
+
+  void BearerTokenCache::setCapacity(const size_t maxEntries)
+  {
+    time_t now = time(NULL);
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_lock(&shards[i].mutex);
+      maxEntriesPerShard = (maxEntries + BEARERTOKENCACHE_NB_SHARDS - 1) / BEARERTOKENCACHE_NB_SHARDS;
+      evict(shards[i], now);
+      pthread_mutex_unlock(&shards[i].mutex);
+    }
+  }
+
+  /***********************************************************************/
+
+  size_t BearerTokenCache::size()
+  {
+    size_t res = 0;
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_lock(&shards[i].mutex);
+      res += shards[i].expiry.size();
+      pthread_mutex_unlock(&shards[i].mutex);
+    }
+    return res;
+  }
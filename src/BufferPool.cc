@@ -0,0 +1,107 @@
+//********************************************************
+/**
+ * @file  BufferPool.cc
+ *
+ * @brief Pool of memory blocks, by size class
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdlib.h>
+
+#include "libnavajo/BufferPool.hh"
+
+#define BUFFERPOOL_SMALLEST_CLASS 256
+#define BUFFERPOOL_NB_CLASSES 4
+
+
+  /***********************************************************************/
+
+  BufferPool::BufferPool(const size_t maxBytesPerClass): classes(BUFFERPOOL_NB_CLASSES)
+  {
+    size_t size = BUFFERPOOL_SMALLEST_CLASS;
+    for (size_t i=0; i<classes.size(); i++, size*=4)
+    {
+      pthread_mutex_init(&classes[i].mutex, NULL);
+      classes[i].size = size;
+      classes[i].freeList = NULL;
+      classes[i].count = 0;
+      classes[i].maxCount = maxBytesPerClass / size;
+    }
+  }
+
+  /***********************************************************************/
+
+  BufferPool::~BufferPool()
+  {
+    for (size_t i=0; i<classes.size(); i++)
+    {
+      while (classes[i].freeList != NULL)
+      {
+        void *block = classes[i].freeList;
+        classes[i].freeList = *(void**)block;
+        free(block);
+      }
+      pthread_mutex_destroy(&classes[i].mutex);
+    }
+  }
+
+  /***********************************************************************/
+
+  void *BufferPool::allocate(const size_t size, size_t& capacity)
+  {
+    for (size_t i=0; i<classes.size(); i++)
+    {
+      SizeClass& c = classes[i];
+      if (size > c.size)
+        continue;
+
+      capacity = c.size;
+      pthread_mutex_lock(&c.mutex);
+      void *block = c.freeList;
+      if (block != NULL)
+      {
+        c.freeList = *(void**)block;
+        c.count--;
+      }
+      pthread_mutex_unlock(&c.mutex);
+
+      return block != NULL ? block : malloc(c.size);
+    }
+
+    capacity = size;
+    return malloc(size);
+  }
+
+  /***********************************************************************/
+
+  void BufferPool::release(void *block, const size_t capacity)
+  {
+    if (block == NULL)
+      return;
+
+    for (size_t i=0; i<classes.size(); i++)
+    {
+      SizeClass& c = classes[i];
+      if (capacity != c.size)
+        continue;
+
+      pthread_mutex_lock(&c.mutex);
+      if (c.count < c.maxCount)
+      {
+        *(void**)block = c.freeList;
+        c.freeList = block;
+        c.count++;
+        block = NULL;
+      }
+      pthread_mutex_unlock(&c.mutex);
+      break;
+    }
+
+    if (block != NULL)
+      free(block);
+  }
@@ -0,0 +1,359 @@
+//********************************************************
+/**
+ * @file  CredentialStore.cc
+ *
+ * @brief Logins and salted password hashes for the HTTP
+ *        Basic authentication
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/sha.h>
+
+#include "libnavajo/CredentialStore.hh"
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/nvjBase64.h"
+
+#define CREDENTIALSTORE_HASH_PREFIX "pbkdf2-sha256$"
+
+
+  /***********************************************************************/
+
+  CredentialStore::CredentialStore(const size_t cacheCapacity, const time_t cacheLifeTime):
+    cacheGeneration(0), hashing(0), maxHashing(CREDENTIALSTORE_DEFAULT_MAX_HASHING)
+  {
+    verified.capacity = cacheCapacity;
+    verified.lifeTime = cacheLifeTime;
+    rejected.capacity = CREDENTIALSTORE_FAILED_CACHE_CAPACITY;
+    rejected.lifeTime = CREDENTIALSTORE_FAILED_CACHE_LIFETIME;
+    pthread_mutex_init(&usersMutex, NULL);
+    pthread_mutex_init(&cacheMutex, NULL);
+  }
+
+  /***********************************************************************/
+
+  CredentialStore::~CredentialStore()
+  {
+    pthread_mutex_destroy(&usersMutex);
+    pthread_mutex_destroy(&cacheMutex);
+  }
+
+  /***********************************************************************/
+
+  bool CredentialStore::derive(const std::string& password, const Credential& c, unsigned char *out)
+  {
+    return PKCS5_PBKDF2_HMAC(password.data(), (int)password.size(), c.salt, CREDENTIALSTORE_SALT_SIZE,
+                             (int)c.iterations, EVP_sha256(), CREDENTIALSTORE_HASH_SIZE, out) == 1;
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::setUser(const std::string& login, const Credential& c)
+  {
+    pthread_mutex_lock(&usersMutex);
+    std::unordered_map<std::string, Credential>::iterator it = users.find(login);
+    if (it != users.end())
+    {
+      forgetIterations(it->second.iterations);
+      it->second = c;
+    }
+    else
+      users[login] = c;
+    usersIterations[c.iterations]++;
+    pthread_mutex_unlock(&usersMutex);
+    // a changed password must not be accepted from the cache
+    flushCache();
+  }
+
+  /***********************************************************************/
+  /**
+  * forgetIterations - a user hashed with this iterations count is removed
+  *                    (usersMutex held)
+  */
+
+  void CredentialStore::forgetIterations(const unsigned iterations)
+  {
+    std::map<unsigned, size_t>::iterator it = usersIterations.find(iterations);
+    if (it != usersIterations.end() && !--it->second)
+      usersIterations.erase(it);
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::addUser(const std::string& login, const std::string& password, const unsigned iterations)
+  {
+    Credential c;
+    c.iterations = iterations ? iterations : 1;
+    if (RAND_bytes(c.salt, CREDENTIALSTORE_SALT_SIZE) != 1 || !derive(password, c, c.hash))
+      throw std::runtime_error("CredentialStore: can't hash the password of '" + login + "'");
+    setUser(login, c);
+  }
+
+  /***********************************************************************/
+
+  std::string CredentialStore::hashPassword(const std::string& password, const unsigned iterations)
+  {
+    Credential c;
+    c.iterations = iterations ? iterations : 1;
+    if (RAND_bytes(c.salt, CREDENTIALSTORE_SALT_SIZE) != 1 || !derive(password, c, c.hash))
+      throw std::runtime_error("CredentialStore: can't hash the password");
+
+    char iter[16];
+    snprintf(iter, sizeof(iter), "%u", c.iterations);
+    return std::string(CREDENTIALSTORE_HASH_PREFIX) + iter + '$'
+           + nvj_base64_encode(c.salt, CREDENTIALSTORE_SALT_SIZE) + '$'
+           + nvj_base64_encode(c.hash, CREDENTIALSTORE_HASH_SIZE);
+  }
+
+  /***********************************************************************/
+
+  bool CredentialStore::addUserHash(const std::string& login, const std::string& hash)
+  {
+    const size_t prefixLen = sizeof(CREDENTIALSTORE_HASH_PREFIX) - 1;
+    if (hash.compare(0, prefixLen, CREDENTIALSTORE_HASH_PREFIX) != 0)
+      return false;
+
+    size_t sep1 = hash.find('$', prefixLen), sep2;
+    if (sep1 == std::string::npos || (sep2 = hash.find('$', sep1 + 1)) == std::string::npos)
+      return false;
+
+    Credential c;
+    char *end = NULL;
+    unsigned long iterations = strtoul(hash.c_str() + prefixLen, &end, 10);
+    if (end != hash.c_str() + sep1 || iterations == 0 || iterations > 0x7FFFFFFF)
+      return false;
+    c.iterations = (unsigned)iterations;
+
+    std::string salt = nvj_base64_decode(hash.substr(sep1 + 1, sep2 - sep1 - 1));
+    std::string h = nvj_base64_decode(hash.substr(sep2 + 1));
+    if (salt.size() != CREDENTIALSTORE_SALT_SIZE || h.size() != CREDENTIALSTORE_HASH_SIZE)
+      return false;
+    memcpy(c.salt, salt.data(), CREDENTIALSTORE_SALT_SIZE);
+    memcpy(c.hash, h.data(), CREDENTIALSTORE_HASH_SIZE);
+
+    setUser(login, c);
+    return true;
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::removeUser(const std::string& login)
+  {
+    pthread_mutex_lock(&usersMutex);
+    std::unordered_map<std::string, Credential>::iterator it = users.find(login);
+    if (it != users.end())
+    {
+      forgetIterations(it->second.iterations);
+      users.erase(it);
+    }
+    pthread_mutex_unlock(&usersMutex);
+    flushCache();
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::clear()
+  {
+    pthread_mutex_lock(&usersMutex);
+    users.clear();
+    usersIterations.clear();
+    pthread_mutex_unlock(&usersMutex);
+    flushCache();
+  }
+
+  /***********************************************************************/
+
+  size_t CredentialStore::size()
+  {
+    pthread_mutex_lock(&usersMutex);
+    size_t res = users.size();
+    pthread_mutex_unlock(&usersMutex);
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool CredentialStore::startHashing()
+  {
+    unsigned max = maxHashing;
+    if (++hashing > max && max)
+    {
+      hashing--;
+      NVJ_LOG->appendUniq(NVJ_WARNING, "CredentialStore: too many passwords checked at once, credentials refused");
+      return false;
+    }
+    return true;
+  }
+
+  /***********************************************************************/
+  /**
+  * check - hash the password and compare it, without limit
+  */
+
+  bool CredentialStore::check(const std::string& login, const std::string& password)
+  {
+    // an unknown login costs the same hashing as the known ones
+    Credential c = { CREDENTIALSTORE_PBKDF2_ITERATIONS, { 0 }, { 0 } };
+
+    pthread_mutex_lock(&usersMutex);
+    std::unordered_map<std::string, Credential>::const_iterator it = users.find(login);
+    bool found = it != users.end();
+    if (found)
+      c = it->second;
+    else
+    {
+      size_t most = 0;
+      for (std::map<unsigned, size_t>::const_iterator i = usersIterations.begin(); i != usersIterations.end(); i++)
+        if (i->second > most)
+        {
+          most = i->second;
+          c.iterations = i->first;
+        }
+    }
+    pthread_mutex_unlock(&usersMutex);
+
+    unsigned char hash[CREDENTIALSTORE_HASH_SIZE];
+    if (!derive(password, c, hash))
+      return false;
+    return (CRYPTO_memcmp(hash, c.hash, CREDENTIALSTORE_HASH_SIZE) == 0) & found;
+  }
+
+  /***********************************************************************/
+
+  bool CredentialStore::verify(const std::string& login, const std::string& password)
+  {
+    if (!startHashing())
+      return false;
+    bool res = check(login, password);
+    hashing--;
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool CredentialStore::verifyBasic(const std::string& b64, std::string& login, bool *cached)
+  {
+    if (cached != NULL) *cached = false;
+
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)b64.data(), b64.size(), digest);
+    std::string key((const char*)digest, sizeof(digest));
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&cacheMutex);
+    bool found = cacheFind(verified, key, now, login);
+    bool refused = !found && cacheFind(rejected, key, now, login);
+    unsigned long generation = cacheGeneration;
+    pthread_mutex_unlock(&cacheMutex);
+    if (found || refused)
+    {
+      if (cached != NULL) *cached = true;
+      return found;
+    }
+
+    std::string loginPwd = nvj_base64_decode(b64);
+    size_t sep = loginPwd.find(':');
+    if (sep == std::string::npos)
+      return false;
+    login = loginPwd.substr(0, sep);
+
+    // refused, but not cached: the credentials are not checked
+    if (!startHashing())
+      return false;
+    bool res = check(login, loginPwd.substr(sep + 1));
+    hashing--;
+
+    pthread_mutex_lock(&cacheMutex);
+    // not cached if the users changed meanwhile
+    if (generation == cacheGeneration)
+      cacheAdd(res ? verified : rejected, key, login, now);
+    pthread_mutex_unlock(&cacheMutex);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::setCacheCapacity(const size_t capacity, const time_t lifeTime)
+  {
+    pthread_mutex_lock(&cacheMutex);
+    verified.capacity = capacity;
+    verified.lifeTime = lifeTime;
+    cacheTrim(verified);
+    pthread_mutex_unlock(&cacheMutex);
+  }
+
+  /***********************************************************************/
+  /**
+  * cacheFind - look for a digest in a cache (cacheMutex held)
+  * @param login: set to the login of the entry found
+  * \return true if it's found and not expired
+  */
+
+  bool CredentialStore::cacheFind(Cache& cache, const std::string& key, const time_t now, std::string& login)
+  {
+    std::unordered_map<std::string, CacheList::iterator>::iterator it = cache.index.find(key);
+    if (it == cache.index.end())
+      return false;
+    if (now - it->second->second.verified > cache.lifeTime)
+    {
+      cache.list.erase(it->second);
+      cache.index.erase(it);
+      return false;
+    }
+    cache.list.splice(cache.list.begin(), cache.list, it->second);
+    login = it->second->second.login;
+    return true;
+  }
+
+  /***********************************************************************/
+  /**
+  * cacheAdd - add a digest to a cache (cacheMutex held)
+  */
+
+  void CredentialStore::cacheAdd(Cache& cache, const std::string& key, const std::string& login, const time_t now)
+  {
+    if (!cache.capacity || cache.index.find(key) != cache.index.end())
+      return;
+    CacheEntry e;
+    e.login = login;
+    e.verified = now;
+    cache.list.push_front(std::make_pair(key, e));
+    cache.index[key] = cache.list.begin();
+    cacheTrim(cache);
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::cacheTrim(Cache& cache)
+  {
+    while (cache.list.size() > cache.capacity)
+    {
+      cache.index.erase(cache.list.back().first);
+      cache.list.pop_back();
+    }
+  }
+
+  /***********************************************************************/
+
+  void CredentialStore::flushCache()
+  {
+    pthread_mutex_lock(&cacheMutex);
+    verified.list.clear();
+    verified.index.clear();
+    rejected.list.clear();
+    rejected.index.clear();
+    cacheGeneration++;
+    pthread_mutex_unlock(&cacheMutex);
+  }
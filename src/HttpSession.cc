@@ -0,0 +1,475 @@
+//********************************************************
+/**
+ * @file  HttpSession.cc
+ *
+ * @brief Sessions snapshot file, for warm restarts
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "libnavajo/HttpSession.hh"
+#include "libnavajo/AsyncExecutor.hh"
+
+/*
+ * File format: "NVJSNAP1", then records appended one after the other:
+ *   u32 payload length, u32 crc32 of the payload, payload
+ * payload: u8 type, u32 id length, id, then
+ *   SESSION:    i64 expiration, u32 attributes count, attributes:
+ *               u8 kind, name, [OBJECT: type name], value  (strings: u32 length + bytes)
+ *   EXPIRATION: i64 expiration
+ *   REMOVE:     -
+ * The last record of a file written during a crash may be truncated: it is ignored.
+ */
+
+#define SNAPSHOT_MAGIC "NVJSNAP1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+enum { SNAPSHOT_SESSION = 1, SNAPSHOT_EXPIRATION = 2, SNAPSHOT_REMOVE = 3 };
+enum { SNAPSHOT_ATTR_BINARY = 0, SNAPSHOT_ATTR_OBJECT = 1 };
+
+bool HttpSession::snapshotEnabled=false;
+std::string HttpSession::snapshotPath;
+unsigned HttpSession::snapshotPeriod=30;
+unsigned long long HttpSession::snapshotTimer=0;
+size_t HttpSession::snapshotRecords=0;
+bool HttpSession::snapshotCompactNeeded=true;
+pthread_mutex_t HttpSession::snapshot_mutex=PTHREAD_MUTEX_INITIALIZER;
+std::map<std::string, SessionAttributeFactory> HttpSession::attributeFactories;
+
+
+  /***********************************************************************/
+
+  static inline void putU32(std::string& out, const u_int32_t v)
+  {
+    out.append((const char*)&v, sizeof(v));
+  }
+
+  static inline void putI64(std::string& out, const int64_t v)
+  {
+    out.append((const char*)&v, sizeof(v));
+  }
+
+  static inline void putString(std::string& out, const char *data, const size_t len)
+  {
+    putU32(out, (u_int32_t)len);
+    out.append(data, len);
+  }
+
+  static inline void putString(std::string& out, const std::string& str)
+  {
+    putString(out, str.data(), str.size());
+  }
+
+  /**
+  * beginRecord/endRecord - frame a record: length and crc32 of the payload
+  */
+  static inline size_t beginRecord(std::string& out, const u_int8_t type, const std::string& id)
+  {
+    size_t start = out.size();
+    putU32(out, 0);
+    putU32(out, 0);
+    out += (char)type;
+    putString(out, id);
+    return start;
+  }
+
+  static inline void endRecord(std::string& out, const size_t start)
+  {
+    u_int32_t len = (u_int32_t)(out.size() - start - 8);
+    u_int32_t crc = (u_int32_t)crc32(0L, (const Bytef*)out.data() + start + 8, len);
+    memcpy(&out[start], &len, sizeof(len));
+    memcpy(&out[start + 4], &crc, sizeof(crc));
+  }
+
+  /**
+  * SnapshotReader - bounds checked reads in the mapped file
+  */
+  struct SnapshotReader
+  {
+    const char *pos, *end;
+
+    SnapshotReader(const char *p, const char *e): pos(p), end(e) {};
+
+    inline bool getU8(u_int8_t& v)
+      { if (end - pos < 1) return false; v = (u_int8_t)*pos++; return true; };
+    inline bool getU32(u_int32_t& v)
+      { if (end - pos < 4) return false; memcpy(&v, pos, 4); pos += 4; return true; };
+    inline bool getI64(int64_t& v)
+      { if (end - pos < 8) return false; memcpy(&v, pos, 8); pos += 8; return true; };
+    inline bool getString(const char *& data, u_int32_t& len)
+      { if (!getU32(len) || (size_t)(end - pos) < len) return false; data = pos; pos += len; return true; };
+  };
+
+  /***********************************************************************/
+  /**
+  * serializeSession - append a SESSION record (shard mutex held)
+  */
+  void HttpSession::serializeSession(const Session* session, std::string& out)
+  {
+    size_t start = beginRecord(out, SNAPSHOT_SESSION, session->id);
+    putI64(out, session->expiration);
+    size_t countPos = out.size();
+    putU32(out, 0);
+
+    u_int32_t count = 0;
+    std::string value;
+    for (SessionAttributesMap::const_iterator it = session->attributes.begin(); it != session->attributes.end(); ++it)
+    {
+      if (it->second.type == SessionAttribute::BINARY)
+      {
+        out += (char)SNAPSHOT_ATTR_BINARY;
+        putString(out, it->first);
+        putString(out, (const char*)it->second.ptr, it->second.len);
+        count++;
+      }
+      else if (it->second.type == SessionAttribute::OBJECT && it->second.obj != NULL)
+      {
+        value.clear();
+        std::string typeName = it->second.obj->getTypeName();
+        if (typeName.empty() || !it->second.obj->serialize(value))
+          continue;
+        out += (char)SNAPSHOT_ATTR_OBJECT;
+        putString(out, it->first);
+        putString(out, typeName);
+        putString(out, value);
+        count++;
+      }
+      // pointer attributes: size and content unknown, not saved
+    }
+
+    memcpy(&out[countPos], &count, sizeof(count));
+    endRecord(out, start);
+  }
+
+  /***********************************************************************/
+  /**
+  * loadSnapshot - replay the records of the snapshot file
+  */
+  bool HttpSession::loadSnapshot(const std::string& path)
+  {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return errno == ENOENT;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < SNAPSHOT_MAGIC_LEN)
+    {
+      close(fd);
+      NVJ_LOG->append(NVJ_ERROR, "HttpSession: invalid snapshot file '" + path + "'");
+      return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+      NVJ_LOG->append(NVJ_ERROR, "HttpSession: can't map the snapshot file '" + path + "'");
+      return false;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+    const char *data = (const char*)map;
+    if (memcmp(data, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0)
+    {
+      munmap(map, st.st_size);
+      NVJ_LOG->append(NVJ_ERROR, "HttpSession: '" + path + "' is not a snapshot file");
+      return false;
+    }
+
+    time_t now = time(NULL);
+    size_t nbRecords = 0;
+    SnapshotReader file(data + SNAPSHOT_MAGIC_LEN, data + st.st_size);
+
+    while (file.pos < file.end)
+    {
+      u_int32_t len, crc;
+      if (!file.getU32(len) || !file.getU32(crc) || (size_t)(file.end - file.pos) < len
+        || crc32(0L, (const Bytef*)file.pos, len) != crc)
+      {
+        NVJ_LOG->append(NVJ_WARNING, "HttpSession: snapshot file truncated, the last changes are lost");
+        break;
+      }
+
+      SnapshotReader rec(file.pos, file.pos + len);
+      file.pos += len;
+      nbRecords++;
+
+      u_int8_t type; const char *idData; u_int32_t idLen;
+      if (!rec.getU8(type) || !rec.getString(idData, idLen))
+        continue;
+      std::string id(idData, idLen);
+
+      Shard& shard = getShard(id);
+      pthread_mutex_lock( &shard.mutex );
+      Session *session = getSession(shard, id);
+
+      if (type == SNAPSHOT_REMOVE)
+      {
+        if (session != NULL) deleteSession(shard, session);
+      }
+      else if (type == SNAPSHOT_EXPIRATION)
+      {
+        int64_t expiration;
+        if (session != NULL && rec.getI64(expiration))
+        {
+          wheelUnlink(shard, session);
+          session->expiration = session->savedExpiration = (time_t)expiration;
+          if (session->expiration)
+            wheelInsert(shard, session, session->expiration);
+        }
+      }
+      else if (type == SNAPSHOT_SESSION)
+      {
+        int64_t expiration; u_int32_t count;
+        if (rec.getI64(expiration) && rec.getU32(count))
+        {
+          if (session != NULL) deleteSession(shard, session);
+          expireSessions(shard, now);
+          session = newSession(shard, id, (time_t)expiration);
+
+          for (u_int32_t i = 0; i < count; i++)
+          {
+            u_int8_t kind; const char *name, *typeName = NULL, *value; u_int32_t nameLen, typeLen = 0, valueLen;
+            if ( !rec.getU8(kind) || !rec.getString(name, nameLen)
+              || (kind == SNAPSHOT_ATTR_OBJECT && !rec.getString(typeName, typeLen))
+              || !rec.getString(value, valueLen) )
+              break;
+
+            SessionAttribute attribute;
+            if (kind == SNAPSHOT_ATTR_BINARY)
+            {
+              attribute.type = SessionAttribute::BINARY;
+              attribute.len = valueLen;
+              attribute.ptr = malloc(valueLen ? valueLen : 1);
+              if (attribute.ptr == NULL) continue;
+              memcpy(attribute.ptr, value, valueLen);
+            }
+            else
+            {
+              std::map<std::string, SessionAttributeFactory>::const_iterator factory
+                = attributeFactories.find(std::string(typeName, typeLen));
+              if (factory == attributeFactories.end())
+              {
+                NVJ_LOG->appendUniq(NVJ_WARNING, "HttpSession: no factory registered for the session attributes of type '"
+                                                 + std::string(typeName, typeLen) + "'");
+                continue;
+              }
+              attribute.type = SessionAttribute::OBJECT;
+              attribute.len = 0;
+              attribute.obj = factory->second(value, valueLen);
+              if (attribute.obj == NULL) continue;
+            }
+            session->attributes.insert(std::pair<std::string, SessionAttribute>(std::string(name, nameLen), attribute));
+          }
+
+          session->dirty = false;
+          session->saved = true;
+          session->savedExpiration = session->expiration;
+        }
+      }
+
+      pthread_mutex_unlock( &shard.mutex );
+    }
+
+    munmap(map, st.st_size);
+
+    char buf[200];
+    snprintf(buf, 200, "HttpSession: %zu records reloaded from the snapshot file", nbRecords);
+    NVJ_LOG->append(NVJ_INFO, buf);
+
+    return true;
+  }
+
+  /***********************************************************************/
+  /**
+  * writeSnapshotFile - append the records, or replace the file (compaction)
+  */
+  bool HttpSession::writeSnapshotFile(const std::string& data, const bool compact)
+  {
+    std::string path = compact ? snapshotPath + ".tmp" : snapshotPath;
+    int fd = compact ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)
+                     : open(path.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0)
+    {
+      NVJ_LOG->appendUniq(NVJ_ERROR, "HttpSession: can't write the snapshot file '" + path + "': " + strerror(errno));
+      return false;
+    }
+
+    bool res = true;
+    const char *p = data.data();
+    size_t remaining = data.size();
+    if (compact)
+      res = write(fd, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) == SNAPSHOT_MAGIC_LEN;
+    while (res && remaining)
+    {
+      ssize_t n = write(fd, p, remaining);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) { res = false; break; }
+      p += n; remaining -= n;
+    }
+    if (res)
+      res = fdatasync(fd) == 0;
+    close(fd);
+
+    if (res && compact)
+      res = rename(path.c_str(), snapshotPath.c_str()) == 0;
+
+    if (!res)
+      NVJ_LOG->appendUniq(NVJ_ERROR, "HttpSession: error writing the snapshot file '" + path + "': " + strerror(errno));
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool HttpSession::snapshot(const bool compactRequested)
+  {
+    pthread_mutex_lock( &snapshot_mutex );
+
+    if (!snapshotEnabled)
+    {
+      pthread_mutex_unlock( &snapshot_mutex );
+      return false;
+    }
+
+    size_t nbSessions = 0;
+    for (size_t i = 0; i < HTTPSESSION_NB_SHARDS; i++)
+    {
+      pthread_mutex_lock( &shards[i].mutex );
+      nbSessions += shards[i].sessions.size();
+      pthread_mutex_unlock( &shards[i].mutex );
+    }
+
+    bool compact = compactRequested || snapshotCompactNeeded || snapshotRecords > 2 * nbSessions + 1024;
+    time_t granularity = sessionLifeTime / 16 ? sessionLifeTime / 16 : 1;
+    size_t nbRecords = 0;
+    std::string data;
+
+    for (size_t i = 0; i < HTTPSESSION_NB_SHARDS; i++)
+    {
+      Shard& shard = shards[i];
+      pthread_mutex_lock( &shard.mutex );
+
+      if (!compact)
+        for (size_t r = 0; r < shard.removedIds.size(); r++)
+        {
+          endRecord(data, beginRecord(data, SNAPSHOT_REMOVE, shard.removedIds[r]));
+          nbRecords++;
+        }
+      shard.removedIds.clear();
+
+      for (HttpSessionsContainerMap::iterator it = shard.sessions.begin(); it != shard.sessions.end(); ++it)
+      {
+        Session *session = it->second;
+        if (compact || session->dirty)
+        {
+          serializeSession(session, data);
+          nbRecords++;
+        }
+        else if ( session->expiration != session->savedExpiration
+               && ( !session->expiration || !session->savedExpiration
+                 || session->expiration - session->savedExpiration >= granularity ) )
+        {
+          size_t start = beginRecord(data, SNAPSHOT_EXPIRATION, session->id);
+          putI64(data, session->expiration);
+          endRecord(data, start);
+          nbRecords++;
+        }
+        else
+          continue;
+
+        session->dirty = false;
+        session->saved = true;
+        session->savedExpiration = session->expiration;
+      }
+
+      pthread_mutex_unlock( &shard.mutex );
+    }
+
+    bool res = true;
+    if (compact || !data.empty())
+    {
+      res = writeSnapshotFile(data, compact);
+      if (res && compact)
+      {
+        snapshotRecords = nbRecords;
+        snapshotCompactNeeded = false;
+      }
+      else if (res)
+        snapshotRecords += nbRecords;
+      else
+        snapshotCompactNeeded = true; // the file may be incomplete: rewrite it
+    }
+
+    pthread_mutex_unlock( &snapshot_mutex );
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void HttpSession::scheduleSnapshot()
+  {
+    snapshotTimer = AsyncExecutor::getInstance()->postDelayed(snapshotPeriod * 1000, []()
+    {
+      snapshot();
+      pthread_mutex_lock( &snapshot_mutex );
+      if (snapshotEnabled)
+        scheduleSnapshot();
+      pthread_mutex_unlock( &snapshot_mutex );
+    });
+  }
+
+  /***********************************************************************/
+
+  bool HttpSession::setSnapshotFile(const std::string& path, const unsigned periodSec)
+  {
+    if (backend != NULL)
+    {
+      NVJ_LOG->append(NVJ_WARNING, "HttpSession: the sessions are stored in a backend, snapshot ignored");
+      return true;
+    }
+
+    disableSnapshot();
+
+    pthread_mutex_lock( &snapshot_mutex );
+    bool res = loadSnapshot(path);
+    snapshotPath = path;
+    snapshotPeriod = periodSec ? periodSec : 1;
+    snapshotRecords = 0;
+    snapshotCompactNeeded = true;
+    snapshotEnabled = true;
+    pthread_mutex_unlock( &snapshot_mutex );
+
+    // drop the stale records now, then incrementally
+    snapshot(true);
+
+    pthread_mutex_lock( &snapshot_mutex );
+    if (snapshotEnabled)
+      scheduleSnapshot();
+    pthread_mutex_unlock( &snapshot_mutex );
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void HttpSession::disableSnapshot()
+  {
+    pthread_mutex_lock( &snapshot_mutex );
+    if (snapshotEnabled)
+      AsyncExecutor::getInstance()->cancel(snapshotTimer);
+    snapshotEnabled = false;
+    pthread_mutex_unlock( &snapshot_mutex );
+  }
+
@@ -0,0 +1,283 @@
+//********************************************************
+/**
+ * @file  IpRateLimiter.cc
+ *
+ * @brief Per-client connection caps and token bucket
+ *        rate limits, keyed on IpAddress / IpNetwork
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include "libnavajo/IpRateLimiter.hh"
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/nvjTime.h"
+
+#define IPRATELIMITER_NB_SHARDS 64
+#define IPRATELIMITER_DEFAULT_MAX_ENTRIES 65536
+
+
+  static inline double bucketCapacity(const double rate, const unsigned burst)
+  {
+    return burst ? burst : (rate < 1 ? 1 : rate);
+  }
+
+  /***********************************************************************/
+
+  IpRateLimiter::IpRateLimiter(): shards(IPRATELIMITER_NB_SHARDS),
+                                  maxEntriesPerShard(IPRATELIMITER_DEFAULT_MAX_ENTRIES / IPRATELIMITER_NB_SHARDS),
+                                  prefixV4(32), prefixV6(64)
+  {
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_init(&shards[i].mutex, NULL);
+      shards[i].deniedConnections=0;
+      shards[i].deniedRequests=0;
+    }
+  }
+
+  /***********************************************************************/
+
+  IpRateLimiter::~IpRateLimiter()
+  {
+    for (size_t i=0; i<shards.size(); i++)
+      pthread_mutex_destroy(&shards[i].mutex);
+  }
+
+  /***********************************************************************/
+
+  void IpRateLimiter::setMaxEntries(const size_t max)
+  {
+    maxEntriesPerShard = max / IPRATELIMITER_NB_SHARDS;
+    if (!maxEntriesPerShard) maxEntriesPerShard=1;
+  }
+
+  /***********************************************************************/
+  /**
+  * makeKey - mask the address to the prefix length
+  */
+  void IpRateLimiter::makeKey(const IpAddress& ip, const u_int8_t prefix, IpRateLimiterKey& key)
+  {
+    memset(&key, 0, sizeof(key));
+    key.ipversion=ip.ipversion;
+    key.prefix=prefix;
+
+    if (ip.ipversion == 4)
+      memcpy(key.addr, &ip.ip.v4, 4);
+    else if (ip.ipversion == 6)
+      memcpy(key.addr, ip.ip.v6.s6_addr, INET6_ADDRLEN);
+
+    size_t len = ip.ipversion == 4 ? 4 : INET6_ADDRLEN;
+    for (size_t i=0; i<len; i++)
+    {
+      unsigned bits = prefix > i*8 ? prefix - i*8 : 0;
+      if (bits < 8)
+        key.addr[i] &= (unsigned char)(0xFF00 >> bits);
+    }
+  }
+
+  /***********************************************************************/
+  /**
+  * getLimits - find the limits of a client and build its key
+  */
+  const IpRateLimiterLimits& IpRateLimiter::getLimits(const IpAddress& ip, IpRateLimiterKey& key) const
+  {
+    for (size_t i=0; i<networkLimits.size(); i++)
+    {
+      const IpNetwork& net=networkLimits[i].first;
+      if (net.addr.ipversion != ip.ipversion)
+        continue;
+
+      IpRateLimiterKey netKey;
+      makeKey(net.addr, net.mask, netKey);
+      makeKey(ip, net.mask, key);
+      if (key == netKey)
+        return networkLimits[i].second;
+    }
+
+    makeKey(ip, ip.ipversion == 4 ? prefixV4 : prefixV6, key);
+    return defaultLimits;
+  }
+
+  /***********************************************************************/
+  /**
+  * takeToken - refill a token bucket and try to take a token
+  */
+  bool IpRateLimiter::takeToken(double& tokens, unsigned long long& lastRefill, const double rate,
+                                const unsigned burst, const unsigned long long now)
+  {
+    if (rate <= 0)
+      return true;
+
+    double capacity = bucketCapacity(rate, burst);
+    tokens += (now - lastRefill) * rate / 1000.;
+    if (tokens > capacity) tokens=capacity;
+    lastRefill=now;
+
+    if (tokens < 1)
+      return false;
+
+    tokens -= 1;
+    return true;
+  }
+
+  /***********************************************************************/
+  /**
+  * evictOne - free a slot, evicting the least recently seen idle client
+  * (shard mutex held)
+  * \return false if every client has open connections
+  */
+  bool IpRateLimiter::evictOne(Shard& shard)
+  {
+    if (shard.idle.empty())
+      return false;
+
+    shard.index.erase(shard.idle.back().key);
+    shard.idle.pop_back();
+    return true;
+  }
+
+  /***********************************************************************/
+
+  bool IpRateLimiter::acquireConnection(const IpAddress& ip, IpRateLimiterEntry **entry)
+  {
+    *entry=NULL;
+
+    IpRateLimiterKey key;
+    const IpRateLimiterLimits& limits=getLimits(ip, key);
+
+    if (!limits.maxConnections && limits.connectionsPerSecond <= 0 && limits.requestsPerSecond <= 0)
+      return true;
+
+    unsigned shardIdx=(unsigned)(IpRateLimiterKeyHash()(key) % shards.size());
+    Shard& shard=shards[shardIdx];
+    unsigned long long now=nvj_monotonic_ms();
+    bool res=true;
+
+    pthread_mutex_lock(&shard.mutex);
+
+    IpRateLimiterEntry *e=NULL;
+    std::list<IpRateLimiterEntry>::iterator it;
+    std::unordered_map<IpRateLimiterKey, std::list<IpRateLimiterEntry>::iterator, IpRateLimiterKeyHash>::iterator
+      found=shard.index.find(key);
+
+    if (found != shard.index.end())
+    {
+      it=found->second;
+      e=&(*it);
+    }
+    else if (shard.index.size() < maxEntriesPerShard || evictOne(shard))
+    {
+      IpRateLimiterEntry newEntry;
+      newEntry.key=key;
+      newEntry.limits=limits;
+      newEntry.limiter=this;
+      newEntry.shard=shardIdx;
+      newEntry.connections=0;
+      newEntry.connectionTokens=bucketCapacity(limits.connectionsPerSecond, limits.connectionsBurst);
+      newEntry.requestTokens=bucketCapacity(limits.requestsPerSecond, limits.requestsBurst);
+      newEntry.connectionRefill=now;
+      newEntry.requestRefill=now;
+      shard.idle.push_front(newEntry);
+      it=shard.idle.begin();
+      shard.index[key]=it;
+      e=&(*it);
+    }
+
+    if (e == NULL)
+    {
+      // the table is full of connected clients: an untracked client
+      // would escape its limits
+      shard.deniedConnections++;
+      res=false;
+    }
+    else if ( (e->limits.maxConnections && e->connections >= e->limits.maxConnections)
+           || !takeToken(e->connectionTokens, e->connectionRefill, e->limits.connectionsPerSecond, e->limits.connectionsBurst, now) )
+    {
+      shard.deniedConnections++;
+      res=false;
+      if (!e->connections)
+        shard.idle.splice(shard.idle.begin(), shard.idle, it);
+    }
+    else
+    {
+      if (!e->connections++)
+        shard.connected.splice(shard.connected.begin(), shard.idle, it);
+      *entry=e;
+    }
+
+    pthread_mutex_unlock(&shard.mutex);
+
+    if (e == NULL)
+      NVJ_LOG->appendUniq(NVJ_WARNING, "IpRateLimiter: table full of connected clients, new clients are refused");
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool IpRateLimiter::allowRequest(IpRateLimiterEntry *entry)
+  {
+    if (entry == NULL || entry->limits.requestsPerSecond <= 0)
+      return true;
+
+    Shard& shard=entry->limiter->shards[entry->shard];
+
+    pthread_mutex_lock(&shard.mutex);
+    bool res=takeToken(entry->requestTokens, entry->requestRefill, entry->limits.requestsPerSecond, entry->limits.requestsBurst, nvj_monotonic_ms());
+    if (!res) shard.deniedRequests++;
+    pthread_mutex_unlock(&shard.mutex);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void IpRateLimiter::releaseConnection(IpRateLimiterEntry *entry)
+  {
+    if (entry == NULL)
+      return;
+
+    Shard& shard=entry->limiter->shards[entry->shard];
+
+    pthread_mutex_lock(&shard.mutex);
+    if (entry->connections && !--entry->connections)
+    {
+      // idle: evicted when it's the least recently seen
+      std::list<IpRateLimiterEntry>::iterator it=shard.index.find(entry->key)->second;
+      shard.idle.splice(shard.idle.begin(), shard.connected, it);
+    }
+    pthread_mutex_unlock(&shard.mutex);
+  }
+
+  /***********************************************************************/
+
+  unsigned long long IpRateLimiter::getDeniedConnectionsCount()
+  {
+    unsigned long long res=0;
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_lock(&shards[i].mutex);
+      res+=shards[i].deniedConnections;
+      pthread_mutex_unlock(&shards[i].mutex);
+    }
+    return res;
+  }
+
+  /***********************************************************************/
+
+  unsigned long long IpRateLimiter::getDeniedRequestsCount()
+  {
+    unsigned long long res=0;
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_lock(&shards[i].mutex);
+      res+=shards[i].deniedRequests;
+      pthread_mutex_unlock(&shards[i].mutex);
+    }
+    return res;
+  }
+
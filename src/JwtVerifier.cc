@@ -0,0 +1,525 @@
+//********************************************************
+/**
+ * @file  JwtVerifier.cc
+ *
+ * @brief JSON Web Token (RFC 7519) signature and claims
+ *        verification, HS256, RS256 and ES256
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <limits>
+#include <stdexcept>
+#include <openssl/bio.h>
+#include <openssl/bn.h>
+#include <openssl/crypto.h>
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/hmac.h>
+#include <openssl/objects.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+#include "libnavajo/JwtVerifier.hh"
+#include "libnavajo/nvjBase64.h"
+
+#define JWT_MAX_JSON_DEPTH 16
+
+
+  /***********************************************************************
+  * A minimal JSON reader: only the members of the top-level object are
+  * returned, nested objects and non-string array items are skipped.
+  */
+
+  namespace
+  {
+    struct JsonValue
+    {
+      enum { NONE, STRING, NUMBER, ARRAY, OTHER } type;
+      std::string str;
+      double number;
+      std::vector<std::string> strings; // the string items of an array
+    };
+
+    struct JsonReader
+    {
+      const char *p, *end;
+
+      JsonReader(const std::string& json): p(json.data()), end(json.data() + json.size()) { };
+
+      inline void skipSpaces()
+        { while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++; };
+
+      static void appendUtf8(std::string& s, unsigned long c)
+      {
+        if (c < 0x80) s += (char)c;
+        else if (c < 0x800) { s += (char)(0xC0 | (c >> 6)); s += (char)(0x80 | (c & 0x3F)); }
+        else if (c < 0x10000) { s += (char)(0xE0 | (c >> 12)); s += (char)(0x80 | ((c >> 6) & 0x3F)); s += (char)(0x80 | (c & 0x3F)); }
+        else { s += (char)(0xF0 | (c >> 18)); s += (char)(0x80 | ((c >> 12) & 0x3F)); s += (char)(0x80 | ((c >> 6) & 0x3F)); s += (char)(0x80 | (c & 0x3F)); }
+      }
+
+      bool hex4(unsigned long& c)
+      {
+        if (end - p < 4) return false;
+        c = 0;
+        for (int i = 0; i < 4; i++)
+        {
+          int v = hexDigit(*p++);
+          if (v < 0) return false;
+          c = (c << 4) | v;
+        }
+        return true;
+      }
+
+      static inline int hexDigit(const char c)
+      {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+      }
+
+      bool readString(std::string& s)
+      {
+        if (p >= end || *p != '"') return false;
+        p++;
+        s.clear();
+        while (p < end && *p != '"')
+        {
+          if (*p != '\\') { s += *p++; continue; }
+          if (++p >= end) return false;
+          char c = *p++;
+          switch (c)
+          {
+            case '"': case '\\': case '/': s += c; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u':
+            {
+              unsigned long cp, low;
+              if (!hex4(cp)) return false;
+              if (cp >= 0xD800 && cp < 0xDC00 && end - p >= 6 && p[0] == '\\' && p[1] == 'u')
+              {
+                p += 2;
+                if (!hex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+              }
+              appendUtf8(s, cp);
+              break;
+            }
+            default: return false;
+          }
+        }
+        if (p >= end) return false;
+        p++;
+        return true;
+      }
+
+      bool readValue(JsonValue& v, const int depth)
+      {
+        if (depth > JWT_MAX_JSON_DEPTH) return false;
+        skipSpaces();
+        if (p >= end) return false;
+
+        v.type = JsonValue::OTHER;
+        switch (*p)
+        {
+          case '"':
+            v.type = JsonValue::STRING;
+            return readString(v.str);
+
+          case '[':
+          {
+            v.type = JsonValue::ARRAY;
+            v.strings.clear();
+            p++; skipSpaces();
+            if (p < end && *p == ']') { p++; return true; }
+            for (;;)
+            {
+              JsonValue item;
+              if (!readValue(item, depth + 1)) return false;
+              if (item.type == JsonValue::STRING) v.strings.push_back(item.str);
+              skipSpaces();
+              if (p < end && *p == ',') { p++; continue; }
+              if (p < end && *p == ']') { p++; return true; }
+              return false;
+            }
+          }
+
+          case '{':
+          {
+            p++; skipSpaces();
+            if (p < end && *p == '}') { p++; return true; }
+            for (;;)
+            {
+              std::string name;
+              JsonValue member;
+              skipSpaces();
+              if (!readString(name)) return false;
+              skipSpaces();
+              if (p >= end || *p++ != ':') return false;
+              if (!readValue(member, depth + 1)) return false;
+              skipSpaces();
+              if (p < end && *p == ',') { p++; continue; }
+              if (p < end && *p == '}') { p++; return true; }
+              return false;
+            }
+          }
+
+          case 't': if (end - p >= 4 && !strncmp(p, "true", 4)) { p += 4; return true; } return false;
+          case 'f': if (end - p >= 5 && !strncmp(p, "false", 5)) { p += 5; return true; } return false;
+          case 'n': if (end - p >= 4 && !strncmp(p, "null", 4)) { p += 4; return true; } return false;
+
+          default:
+          {
+            // the json strings are null-terminated (std::string)
+            char *e = NULL;
+            v.number = strtod(p, &e);
+            if (e == p || e > end) return false;
+            v.type = JsonValue::NUMBER;
+            p = e;
+            return true;
+          }
+        }
+      }
+
+      /**
+      * Read the top-level object, calling member(name, value) for each member
+      */
+      template <class F> bool readObject(F member)
+      {
+        skipSpaces();
+        if (p >= end || *p++ != '{') return false;
+        skipSpaces();
+        if (p < end && *p == '}') { p++; return true; }
+        for (;;)
+        {
+          std::string name;
+          JsonValue value;
+          skipSpaces();
+          if (!readString(name)) return false;
+          skipSpaces();
+          if (p >= end || *p++ != ':') return false;
+          if (!readValue(value, 1)) return false;
+          member(name, value);
+          skipSpaces();
+          if (p < end && *p == ',') { p++; continue; }
+          if (p < end && *p == '}') { p++; skipSpaces(); return p == end; }
+          return false;
+        }
+      }
+    };
+
+    /**
+    * base64url decoding of a whole segment (no padding, no other character)
+    */
+    bool base64UrlDecode(const char *s, const size_t len, std::string& out)
+    {
+      if (len % 4 == 1) return false;
+      std::string b64(s, len);
+      for (size_t i = 0; i < len; i++)
+      {
+        if (b64[i] == '-') b64[i] = '+';
+        else if (b64[i] == '_') b64[i] = '/';
+        else if (b64[i] == '+' || b64[i] == '/' || nvj_base64_value[(unsigned char)b64[i]] < 0) return false;
+      }
+      out = nvj_base64_decode(b64);
+      return out.size() == len * 3 / 4;
+    }
+  }
+
+
+  /***********************************************************************/
+
+  JwtVerifier::JwtVerifier(): algorithm(NO_KEY), publicKey(NULL), leeway(0)
+  {
+  }
+
+  /***********************************************************************/
+
+  JwtVerifier::~JwtVerifier()
+  {
+    if (publicKey != NULL)
+      EVP_PKEY_free(publicKey);
+    OPENSSL_cleanse(&hmacSecret[0], hmacSecret.size());
+  }
+
+  /***********************************************************************/
+
+  void JwtVerifier::setHmacSecret(const std::string& secret)
+  {
+    if (publicKey != NULL) { EVP_PKEY_free(publicKey); publicKey = NULL; }
+    OPENSSL_cleanse(&hmacSecret[0], hmacSecret.size());
+    hmacSecret = secret;
+    algorithm = HS256;
+  }
+
+  /***********************************************************************/
+  /**
+  * isP256 - check an EC key is on the P-256 curve (ES256), not only 256 bits long
+  */
+
+  static bool isP256(const EVP_PKEY *key)
+  {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    char name[64];
+    return EVP_PKEY_get_group_name(key, name, sizeof(name), NULL) == 1
+           && OBJ_sn2nid(name) == NID_X9_62_prime256v1;
+#else
+    const EC_KEY *ec = EVP_PKEY_get0_EC_KEY((EVP_PKEY*)key);
+    return ec != NULL && EC_GROUP_get_curve_name(EC_KEY_get0_group(ec)) == NID_X9_62_prime256v1;
+#endif
+  }
+
+  /***********************************************************************/
+
+  void JwtVerifier::setPublicKeyPem(const std::string& pem)
+  {
+    BIO *bio = BIO_new_mem_buf(pem.data(), (int)pem.size());
+    if (bio == NULL)
+      throw std::runtime_error("JwtVerifier: can't read the public key");
+
+    EVP_PKEY *key = PEM_read_bio_PUBKEY(bio, NULL, NULL, NULL);
+    if (key == NULL)
+    {
+      // maybe a certificate
+      BIO_reset(bio);
+      X509 *cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+      if (cert != NULL)
+      {
+        key = X509_get_pubkey(cert);
+        X509_free(cert);
+      }
+    }
+    BIO_free(bio);
+
+    if (key == NULL)
+      throw std::runtime_error("JwtVerifier: invalid PEM public key");
+
+    Algorithm alg;
+    switch (EVP_PKEY_base_id(key))
+    {
+      case EVP_PKEY_RSA: alg = RS256; break;
+      case EVP_PKEY_EC:
+        if (isP256(key)) { alg = ES256; break; }
+        // fall through
+      default:
+        EVP_PKEY_free(key);
+        throw std::runtime_error("JwtVerifier: unsupported public key (RSA or EC P-256 expected)");
+    }
+
+    if (publicKey != NULL)
+      EVP_PKEY_free(publicKey);
+    publicKey = key;
+    OPENSSL_cleanse(&hmacSecret[0], hmacSecret.size());
+    hmacSecret.clear();
+    algorithm = alg;
+  }
+
+  /***********************************************************************/
+
+  bool JwtVerifier::checkSignature(const std::string& signedPart, const std::string& signature) const
+  {
+    if (algorithm == HS256)
+    {
+      unsigned char mac[EVP_MAX_MD_SIZE];
+      unsigned int macLen = 0;
+      if (HMAC(EVP_sha256(), hmacSecret.data(), (int)hmacSecret.size(),
+               (const unsigned char*)signedPart.data(), signedPart.size(), mac, &macLen) == NULL)
+        return false;
+      return signature.size() == macLen && CRYPTO_memcmp(mac, signature.data(), macLen) == 0;
+    }
+
+    std::string der;
+    const std::string *sig = &signature;
+    if (algorithm == ES256)
+    {
+      // JWS uses the raw r|s concatenation, OpenSSL the DER encoding
+      if (signature.size() != 64)
+        return false;
+      ECDSA_SIG *ecSig = ECDSA_SIG_new();
+      BIGNUM *r = BN_bin2bn((const unsigned char*)signature.data(), 32, NULL);
+      BIGNUM *s = BN_bin2bn((const unsigned char*)signature.data() + 32, 32, NULL);
+      if (ecSig == NULL || r == NULL || s == NULL || !ECDSA_SIG_set0(ecSig, r, s))
+      {
+        BN_free(r); BN_free(s); ECDSA_SIG_free(ecSig);
+        return false;
+      }
+      unsigned char *buf = NULL;
+      int len = i2d_ECDSA_SIG(ecSig, &buf);
+      ECDSA_SIG_free(ecSig);
+      if (len <= 0)
+        return false;
+      der.assign((const char*)buf, len);
+      OPENSSL_free(buf);
+      sig = &der;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (ctx == NULL)
+      return false;
+    bool ok = EVP_DigestVerifyInit(ctx, NULL, EVP_sha256(), NULL, publicKey) == 1
+              && EVP_DigestVerify(ctx, (const unsigned char*)sig->data(), sig->size(),
+                                  (const unsigned char*)signedPart.data(), signedPart.size()) == 1;
+    EVP_MD_CTX_free(ctx);
+    return ok;
+  }
+
+  /***********************************************************************/
+
+  /**
+  * toTime - a NumericDate claim
+  * \return false if it's not finite or out of the time_t range
+  */
+
+  static bool toTime(const double number, time_t& t)
+  {
+    if (!isfinite(number) || number < (double)std::numeric_limits<time_t>::min()
+        || number >= (double)std::numeric_limits<time_t>::max())
+      return false;
+    t = (time_t)number;
+    return true;
+  }
+
+  /***********************************************************************/
+
+  bool JwtVerifier::parseClaims(const std::string& json, JwtClaims& claims)
+  {
+    JsonReader reader(json);
+    bool validTimes = true;
+    bool ok = reader.readObject([&claims, &validTimes](const std::string& name, const JsonValue& v)
+    {
+      if (name == "sub" && v.type == JsonValue::STRING) claims.subject = v.str;
+      else if (name == "iss" && v.type == JsonValue::STRING) claims.issuer = v.str;
+      else if (name == "aud")
+      {
+        if (v.type == JsonValue::STRING) claims.audiences.push_back(v.str);
+        else if (v.type == JsonValue::ARRAY) claims.audiences = v.strings;
+      }
+      else if (name == "exp" && v.type == JsonValue::NUMBER) validTimes &= toTime(v.number, claims.expiration);
+      else if (name == "nbf" && v.type == JsonValue::NUMBER) validTimes &= toTime(v.number, claims.notBefore);
+      else if (name == "iat" && v.type == JsonValue::NUMBER) validTimes &= toTime(v.number, claims.issuedAt);
+      else if (name == "scope" || name == "scp")
+      {
+        if (v.type == JsonValue::ARRAY)
+          claims.scopes.insert(claims.scopes.end(), v.strings.begin(), v.strings.end());
+        else if (v.type == JsonValue::STRING)
+        {
+          size_t start = 0, end;
+          do
+          {
+            end = v.str.find(' ', start);
+            if (end == std::string::npos) end = v.str.size();
+            if (end > start) claims.scopes.push_back(v.str.substr(start, end - start));
+            start = end + 1;
+          }
+          while (end < v.str.size());
+        }
+      }
+    });
+    if (!ok || !validTimes)
+      return false;
+
+    std::sort(claims.scopes.begin(), claims.scopes.end());
+    claims.scopes.erase(std::unique(claims.scopes.begin(), claims.scopes.end()), claims.scopes.end());
+    claims.payload = json;
+    return true;
+  }
+
+  /***********************************************************************/
+
+  bool JwtVerifier::verify(const std::string& token, const time_t now, JwtClaims& claims, std::string& error) const
+  {
+    claims = JwtClaims();
+
+    size_t dot1 = token.find('.'), dot2;
+    if (dot1 == std::string::npos || (dot2 = token.find('.', dot1 + 1)) == std::string::npos
+        || token.find('.', dot2 + 1) != std::string::npos)
+      { error = "malformed token"; return false; }
+
+    std::string header, payload, signature;
+    if ( !base64UrlDecode(token.data(), dot1, header)
+      || !base64UrlDecode(token.data() + dot1 + 1, dot2 - dot1 - 1, payload)
+      || !base64UrlDecode(token.data() + dot2 + 1, token.size() - dot2 - 1, signature) )
+      { error = "malformed token"; return false; }
+
+    // the algorithm must be the one of the configured key ("none" is never accepted)
+    std::string alg;
+    bool critical = false;
+    JsonReader headerReader(header);
+    if (!headerReader.readObject([&alg, &critical](const std::string& name, const JsonValue& v)
+          { if (name == "alg" && v.type == JsonValue::STRING) alg = v.str;
+            else if (name == "crit") critical = true; }))
+      { error = "malformed token"; return false; }
+
+    static const char *algNames[] = { "", "HS256", "RS256", "ES256" };
+    if (algorithm == NO_KEY || alg != algNames[algorithm])
+      { error = "unexpected algorithm"; return false; }
+    if (critical)
+      { error = "unsupported critical header"; return false; }
+
+    if (!checkSignature(token.substr(0, dot2), signature))
+      { error = "invalid signature"; return false; }
+
+    if (!parseClaims(payload, claims))
+      { error = "malformed claims"; return false; }
+
+    if (!claims.expiration)
+      { error = "no expiration in token"; return false; }
+    if (now > claims.expiration + leeway)
+      { error = "token expired"; return false; }
+    if (claims.notBefore && now + leeway < claims.notBefore)
+      { error = "token not yet valid"; return false; }
+    if (!issuer.empty() && claims.issuer != issuer)
+      { error = "invalid issuer"; return false; }
+    if (!audience.empty() && std::find(claims.audiences.begin(), claims.audiences.end(), audience) == claims.audiences.end())
+      { error = "invalid audience"; return false; }
+
+    return true;
+  }
+
+  /***********************************************************************/
+
+  bool JwtVerifier::checkScopes(const JwtClaims& claims, const std::string& resourceUrl, std::string& missing) const
+  {
+    for (size_t i = 0; i < requiredScopes.size(); i++)
+      if ( resourceUrl.compare(0, requiredScopes[i].first.size(), requiredScopes[i].first) == 0
+        && !claims.hasScope(requiredScopes[i].second) )
+      {
+        missing = requiredScopes[i].second;
+        return false;
+      }
+    return true;
+  }
+
+  /***********************************************************************/
+
+  int JwtVerifier::hs256DecodeCallback(const std::string& tokb64, std::string& secret, std::string& decoded)
+  {
+    JwtVerifier verifier;
+    verifier.setHmacSecret(secret);
+    JwtClaims claims;
+    std::string error;
+    if (!verifier.verify(tokb64, time(NULL), claims, error))
+      return 1;
+    decoded = claims.payload;
+    return 0;
+  }
+
+  /***********************************************************************/
+
+  time_t JwtVerifier::expirationCallback(std::string& decoded)
+  {
+    JwtClaims claims;
+    return parseClaims(decoded, claims) ? claims.expiration : 0;
+  }
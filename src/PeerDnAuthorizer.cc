@@ -0,0 +1,237 @@
+//********************************************************
+/**
+ * @file  PeerDnAuthorizer.cc
+ *
+ * @brief X509 client authorization by Distinguished Name,
+ *        with cached decisions and lock-free statistics
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <algorithm>
+#include <openssl/evp.h>
+
+#include "libnavajo/PeerDnAuthorizer.hh"
+
+
+  /***********************************************************************/
+
+  PeerDnAuthorizer::PeerDnAuthorizer(const size_t maxEntries): generation(0), shards(PEERDNAUTHORIZER_NB_SHARDS)
+  {
+    pthread_mutex_init(&dnMutex, NULL);
+    maxEntriesPerShard = (maxEntries + PEERDNAUTHORIZER_NB_SHARDS - 1) / PEERDNAUTHORIZER_NB_SHARDS;
+    for (size_t i=0; i<shards.size(); i++)
+      pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+
+  /***********************************************************************/
+
+  PeerDnAuthorizer::~PeerDnAuthorizer()
+  {
+    for (std::unordered_map<std::string, AuthorizedDn*>::iterator it = authorizedDn.begin(); it != authorizedDn.end(); it++)
+      delete it->second;
+    pthread_mutex_destroy(&dnMutex);
+    for (size_t i=0; i<shards.size(); i++)
+      pthread_mutex_destroy(&shards[i].mutex);
+  }
+
+  /***********************************************************************/
+
+  void PeerDnAuthorizer::addDn(const std::string& dn)
+  {
+    pthread_mutex_lock(&dnMutex);
+    if (authorizedDn.find(dn) == authorizedDn.end())
+      authorizedDn[dn] = new AuthorizedDn(dn);
+    generation++;
+    pthread_mutex_unlock(&dnMutex);
+    // the certificates refused until now may be authorized
+    flushDecisions();
+  }
+
+  /***********************************************************************/
+
+  bool PeerDnAuthorizer::isAuthorized(const std::string& dn)
+  {
+    pthread_mutex_lock(&dnMutex);
+    bool res = authorizedDn.find(dn) != authorizedDn.end();
+    pthread_mutex_unlock(&dnMutex);
+    return res;
+  }
+
+  /***********************************************************************/
+  /**
+  * lookup - decode the DN of a certificate and find it
+  * @param gen: set to the generation of the authorized DN used
+  */
+
+  PeerDnAuthorizer::AuthorizedDn* PeerDnAuthorizer::lookup(X509 *peer, unsigned long& gen)
+  {
+    char *str = X509_NAME_oneline(X509_get_subject_name(peer), 0, 0);
+    if (str == NULL)
+      return NULL;
+    std::string dn(str);
+    free(str);
+
+    AuthorizedDn *res = NULL;
+    pthread_mutex_lock(&dnMutex);
+    std::unordered_map<std::string, AuthorizedDn*>::const_iterator it = authorizedDn.find(dn);
+    if (it != authorizedDn.end())
+      res = it->second;
+    gen = generation;
+    pthread_mutex_unlock(&dnMutex);
+    return res;
+  }
+
+  /***********************************************************************/
+
+  const std::string* PeerDnAuthorizer::authorize(SSL *ssl, const time_t now, time_t& previous)
+  {
+    previous = 0;
+
+    X509 *peer = SSL_get_peer_certificate(ssl);
+    if (peer == NULL)
+      return NULL;
+
+    AuthorizedDn *res = NULL;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int mdLen = 0;
+
+    // an allow/deny decision: keyed by a collision resistant digest
+    if (SSL_get_verify_result(ssl) != X509_V_OK || !X509_digest(peer, EVP_sha256(), md, &mdLen))
+    {
+      X509_free(peer);
+      return NULL;
+    }
+
+    std::string fingerprint((const char*)md, mdLen);
+    Shard& shard = shardOf(fingerprint);
+    bool found = false;
+
+    pthread_mutex_lock(&shard.mutex);
+    std::unordered_map<std::string, DecisionList::iterator>::iterator it = shard.index.find(fingerprint);
+    if (it != shard.index.end())
+    {
+      shard.decisions.splice(shard.decisions.begin(), shard.decisions, it->second);
+      res = it->second->second;
+      found = true;
+    }
+    pthread_mutex_unlock(&shard.mutex);
+
+    if (!found)
+    {
+      unsigned long gen;
+      res = lookup(peer, gen);
+
+      pthread_mutex_lock(&shard.mutex);
+      // not cached if the authorized DN changed meanwhile
+      if (maxEntriesPerShard && gen == generation && shard.index.find(fingerprint) == shard.index.end())
+      {
+        shard.decisions.push_front(std::make_pair(fingerprint, res));
+        shard.index[fingerprint] = shard.decisions.begin();
+        while (shard.decisions.size() > maxEntriesPerShard)
+        {
+          shard.index.erase(shard.decisions.back().first);
+          shard.decisions.pop_back();
+        }
+      }
+      pthread_mutex_unlock(&shard.mutex);
+    }
+
+    X509_free(peer);
+
+    if (res == NULL)
+      return NULL;
+
+    res->connections.fetch_add(1, std::memory_order_relaxed);
+    previous = res->lastSeen.exchange(now, std::memory_order_relaxed);
+    return &res->dn;
+  }
+
+  /***********************************************************************/
+
+  static bool compareLastSeen(const std::pair<std::string, time_t>& a, const std::pair<std::string, time_t>& b)
+    { return a.second > b.second; }
+
+  std::map<std::string, time_t> PeerDnAuthorizer::getLastSeen(const size_t maxPeers)
+  {
+    std::vector< std::pair<std::string, time_t> > seen;
+
+    pthread_mutex_lock(&dnMutex);
+    for (std::unordered_map<std::string, AuthorizedDn*>::const_iterator it = authorizedDn.begin(); it != authorizedDn.end(); it++)
+    {
+      time_t t = it->second->lastSeen.load(std::memory_order_relaxed);
+      if (t) seen.push_back(std::make_pair(it->first, t));
+    }
+    pthread_mutex_unlock(&dnMutex);
+
+    if (seen.size() > maxPeers)
+    {
+      std::nth_element(seen.begin(), seen.begin() + maxPeers, seen.end(), compareLastSeen);
+      seen.resize(maxPeers);
+    }
+    return std::map<std::string, time_t>(seen.begin(), seen.end());
+  }
+
+  /***********************************************************************/
+
+  static bool compareConnections(const std::pair<std::string, unsigned long long>& a, const std::pair<std::string, unsigned long long>& b)
+    { return a.second > b.second; }
+
+  PeerHistorySnapshot<std::string> PeerDnAuthorizer::getSnapshot(const size_t maxPeers, const size_t topK)
+  {
+    PeerHistorySnapshot<std::string> res;
+    res.connections = 0;
+
+    pthread_mutex_lock(&dnMutex);
+    for (std::unordered_map<std::string, AuthorizedDn*>::const_iterator it = authorizedDn.begin(); it != authorizedDn.end(); it++)
+    {
+      unsigned long long n = it->second->connections.load(std::memory_order_relaxed);
+      if (!n) continue;
+      res.connections += n;
+      res.topPeers.push_back(std::make_pair(it->first, n));
+    }
+    pthread_mutex_unlock(&dnMutex);
+
+    res.uniquePeers = res.topPeers.size();
+    std::sort(res.topPeers.begin(), res.topPeers.end(), compareConnections);
+    if (res.topPeers.size() > topK)
+      res.topPeers.resize(topK);
+    res.lastSeen = getLastSeen(maxPeers);
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void PeerDnAuthorizer::setCapacity(const size_t maxEntries)
+  {
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      Shard& shard = shards[i];
+      pthread_mutex_lock(&shard.mutex);
+      maxEntriesPerShard = (maxEntries + PEERDNAUTHORIZER_NB_SHARDS - 1) / PEERDNAUTHORIZER_NB_SHARDS;
+      while (shard.decisions.size() > maxEntriesPerShard)
+      {
+        shard.index.erase(shard.decisions.back().first);
+        shard.decisions.pop_back();
+      }
+      pthread_mutex_unlock(&shard.mutex);
+    }
+  }
+
+  /***********************************************************************/
+
+  void PeerDnAuthorizer::flushDecisions()
+  {
+    for (size_t i=0; i<shards.size(); i++)
+    {
+      pthread_mutex_lock(&shards[i].mutex);
+      shards[i].decisions.clear();
+      shards[i].index.clear();
+      pthread_mutex_unlock(&shards[i].mutex);
+    }
+  }
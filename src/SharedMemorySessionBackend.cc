@@ -0,0 +1,740 @@
+//********************************************************
+/**
+ * @file  SharedMemorySessionBackend.cc
+ *
+ * @brief Sessions stored in a shared memory hash table,
+ *        shared by the processes of a host
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include <stdexcept>
+
+#include "libnavajo/SharedMemorySessionBackend.hh"
+#include "libnavajo/LogRecorder.hh"
+
+#define SHMSESSION_MAGIC 0x4E564A53     // "NVJS"
+#define SHMSESSION_VERSION 1
+#define SHMSESSION_ID_SIZE 128          // longest session id
+#define SHMSESSION_NAME_SIZE 32         // longest attribute name
+#define SHMSESSION_MAX_STRIPES 64
+#define SHMSESSION_READ_TRIES 64        // lock-free read attempts before taking the lock
+#define SHMSESSION_OPEN_TIMEOUT 5000    // ms, waiting for the process which creates the table
+
+#define SHMSESSION_ALIGN(x) (((x) + 63) & ~(size_t)63)
+
+
+struct SharedMemorySessionBackend::Header
+{
+  u_int32_t magic, version;
+  u_int32_t nbStripes, slotsPerStripe, maxAttributes;
+  u_int64_t attributeValueSize;
+  std::atomic<u_int32_t> ready;
+};
+
+struct SharedMemorySessionBackend::Stripe
+{
+  pthread_mutex_t mutex;        // writers
+  std::atomic<u_int32_t> seq;   // odd while a writer is working
+  u_int32_t count;              // used slots
+};
+
+struct SharedMemorySessionBackend::Slot
+{
+  u_int32_t used;
+  u_int32_t idLen;
+  int64_t expiration;           // 0: never expires
+  u_int32_t nbAttributes;
+  u_int32_t reserved;
+  char id[SHMSESSION_ID_SIZE];
+};
+
+struct SharedMemorySessionBackend::Attribute
+{
+  u_int32_t nameLen;
+  u_int32_t valueLen;
+  char name[SHMSESSION_NAME_SIZE];
+  // followed by attributeValueSize bytes
+};
+
+
+  /***********************************************************************/
+
+  SharedMemorySessionBackend::SharedMemorySessionBackend(const std::string& name, const size_t maxSessions,
+                                                         const unsigned maxAttr, const size_t valueSize):
+                                                         fd(-1), mapping(MAP_FAILED), mappingSize(0), header(NULL),
+                                                         maxAttributes(maxAttr), attributeValueSize(valueSize)
+  {
+    size_t sessions = maxSessions ? maxSessions : 1;
+    nbStripes = sessions < SHMSESSION_MAX_STRIPES ? (unsigned)sessions : SHMSESSION_MAX_STRIPES;
+    // load factor 3/4
+    slotsPerStripe = (unsigned)(((sessions + nbStripes - 1) / nbStripes) * 4 / 3 + 1);
+    attributeSize = (sizeof(Attribute) + attributeValueSize + 7) & ~(size_t)7;
+    slotSize = (sizeof(Slot) + maxAttributes * attributeSize + 7) & ~(size_t)7;
+    mappingSize = SHMSESSION_ALIGN(sizeof(Header)) + nbStripes * SHMSESSION_ALIGN(sizeof(Stripe))
+                + (size_t)nbStripes * slotsPerStripe * slotSize;
+
+    bool creator = true;
+    fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0 && errno == EEXIST)
+    {
+      creator = false;
+      fd = shm_open(name.c_str(), O_RDWR, 0600);
+    }
+    if (fd < 0)
+      throw std::runtime_error("SharedMemorySessionBackend: can't open '" + name + "': " + strerror(errno));
+
+    if (creator && ftruncate(fd, mappingSize) != 0)
+    {
+      std::string err = strerror(errno);
+      close(fd); shm_unlink(name.c_str());
+      throw std::runtime_error("SharedMemorySessionBackend: can't size '" + name + "': " + err);
+    }
+
+    // wait for the creator to size and initialize the table
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    unsigned waited = 0;
+    while (!creator && (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Header)))
+    {
+      if (waited++ >= SHMSESSION_OPEN_TIMEOUT)
+      {
+        close(fd);
+        throw std::runtime_error("SharedMemorySessionBackend: '" + name + "' is not sized by its creator");
+      }
+      usleep(1000);
+    }
+
+    if (!creator && (size_t)st.st_size != mappingSize)
+    {
+      close(fd);
+      throw std::runtime_error("SharedMemorySessionBackend: '" + name + "' exists with other sizes");
+    }
+
+    mapping = mmap(NULL, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED)
+    {
+      std::string err = strerror(errno);
+      close(fd);
+      if (creator) shm_unlink(name.c_str());
+      throw std::runtime_error("SharedMemorySessionBackend: can't map '" + name + "': " + err);
+    }
+    header = (Header*)mapping;
+
+    if (creator)
+    {
+      header->magic = SHMSESSION_MAGIC;
+      header->version = SHMSESSION_VERSION;
+      header->nbStripes = nbStripes;
+      header->slotsPerStripe = slotsPerStripe;
+      header->maxAttributes = maxAttributes;
+      header->attributeValueSize = attributeValueSize;
+
+      pthread_mutexattr_t attr;
+      pthread_mutexattr_init(&attr);
+      pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifndef __darwin__
+      pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+      for (unsigned i = 0; i < nbStripes; i++)
+      {
+        Stripe *stripe = getStripe(i);
+        pthread_mutex_init(&stripe->mutex, &attr);
+        stripe->seq.store(0);
+        stripe->count = 0;
+      }
+      pthread_mutexattr_destroy(&attr);
+
+      header->ready.store(1, std::memory_order_release);
+      NVJ_LOG->append(NVJ_INFO, "SharedMemorySessionBackend: '" + name + "' created");
+      return;
+    }
+
+    for (waited = 0; header->ready.load(std::memory_order_acquire) != 1 && waited < SHMSESSION_OPEN_TIMEOUT; waited++)
+      usleep(1000);
+
+    if ( header->ready.load(std::memory_order_acquire) != 1
+      || header->magic != SHMSESSION_MAGIC || header->version != SHMSESSION_VERSION
+      || header->nbStripes != nbStripes || header->slotsPerStripe != slotsPerStripe
+      || header->maxAttributes != maxAttributes || header->attributeValueSize != attributeValueSize )
+    {
+      munmap(mapping, mappingSize);
+      close(fd);
+      throw std::runtime_error("SharedMemorySessionBackend: '" + name + "' is not initialized or has other sizes");
+    }
+  }
+
+  /***********************************************************************/
+
+  SharedMemorySessionBackend::~SharedMemorySessionBackend()
+  {
+    if (mapping != MAP_FAILED)
+      munmap(mapping, mappingSize);
+    if (fd >= 0)
+      close(fd);
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::unlink(const std::string& name)
+  {
+    shm_unlink(name.c_str());
+  }
+
+  /***********************************************************************/
+
+  inline SharedMemorySessionBackend::Stripe* SharedMemorySessionBackend::getStripe(const unsigned i) const
+  {
+    return (Stripe*)((char*)mapping + SHMSESSION_ALIGN(sizeof(Header)) + i * SHMSESSION_ALIGN(sizeof(Stripe)));
+  }
+
+  inline SharedMemorySessionBackend::Slot* SharedMemorySessionBackend::getSlot(const unsigned stripe, const unsigned i) const
+  {
+    return (Slot*)((char*)mapping + SHMSESSION_ALIGN(sizeof(Header)) + nbStripes * SHMSESSION_ALIGN(sizeof(Stripe))
+                   + ((size_t)stripe * slotsPerStripe + i) * slotSize);
+  }
+
+  inline SharedMemorySessionBackend::Attribute* SharedMemorySessionBackend::attributeAt(Slot* slot, const unsigned i) const
+  {
+    return (Attribute*)((char*)slot + sizeof(Slot) + i * attributeSize);
+  }
+
+  /***********************************************************************/
+  /**
+  * hash - FNV-1a, the same in every process
+  */
+  u_int64_t SharedMemorySessionBackend::hash(const char *id, const size_t len)
+  {
+    u_int64_t h = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < len; i++) { h ^= (unsigned char)id[i]; h *= 0x100000001B3ULL; }
+    return h;
+  }
+
+  inline unsigned SharedMemorySessionBackend::stripeOf(const u_int64_t h) const
+  {
+    return (unsigned)(h % nbStripes);
+  }
+
+  inline unsigned SharedMemorySessionBackend::homeOf(const u_int64_t h) const
+  {
+    return (unsigned)((h / nbStripes) % slotsPerStripe);
+  }
+
+  /***********************************************************************/
+  /**
+  * lookup - find the slot of a session in its stripe
+  * \return the slot index or -1
+  */
+  int SharedMemorySessionBackend::lookup(const unsigned stripe, const u_int64_t h, const std::string& id) const
+  {
+    unsigned i = homeOf(h);
+    for (unsigned n = 0; n < slotsPerStripe; n++)
+    {
+      Slot *slot = getSlot(stripe, i);
+      if (!slot->used)
+        return -1;
+      if (slot->idLen == id.size() && memcmp(slot->id, id.data(), id.size()) == 0)
+        return (int)i;
+      if (++i == slotsPerStripe) i = 0;
+    }
+    return -1;
+  }
+
+  SharedMemorySessionBackend::Attribute* SharedMemorySessionBackend::findAttribute(Slot* slot, const std::string& name) const
+  {
+    unsigned nb = slot->nbAttributes < maxAttributes ? slot->nbAttributes : maxAttributes;
+    for (unsigned i = 0; i < nb; i++)
+    {
+      Attribute *attr = attributeAt(slot, i);
+      if (attr->nameLen == name.size() && memcmp(attr->name, name.data(), name.size()) == 0)
+        return attr;
+    }
+    return NULL;
+  }
+
+  /***********************************************************************/
+  // seqlock: the writers hold the stripe mutex and make the sequence odd while they write
+
+  void SharedMemorySessionBackend::lockStripe(const unsigned stripe)
+  {
+    Stripe *st = getStripe(stripe);
+    int res = pthread_mutex_lock(&st->mutex);
+#ifndef __darwin__
+    if (res == EOWNERDEAD)
+    {
+      // the owner died: the stripe is only inconsistent if it was writing
+      if (st->seq.load(std::memory_order_relaxed) & 1)
+      {
+        NVJ_LOG->append(NVJ_WARNING, "SharedMemorySessionBackend: a process died while writing, rebuilding its sessions stripe");
+        rebuildStripe(stripe);
+        st->seq.fetch_add(1, std::memory_order_release);
+      }
+      pthread_mutex_consistent(&st->mutex);
+    }
+#endif
+  }
+
+  void SharedMemorySessionBackend::unlockStripe(const unsigned stripe)
+  {
+    pthread_mutex_unlock(&getStripe(stripe)->mutex);
+  }
+
+  inline u_int32_t SharedMemorySessionBackend::readBegin(const unsigned stripe) const
+  {
+    return getStripe(stripe)->seq.load(std::memory_order_acquire);
+  }
+
+  inline bool SharedMemorySessionBackend::readEnd(const unsigned stripe, const u_int32_t seq) const
+  {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return !(seq & 1) && getStripe(stripe)->seq.load(std::memory_order_relaxed) == seq;
+  }
+
+  inline void SharedMemorySessionBackend::writeBegin(const unsigned stripe)
+  {
+    Stripe *st = getStripe(stripe);
+    st->seq.store(st->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  inline void SharedMemorySessionBackend::writeEnd(const unsigned stripe)
+  {
+    Stripe *st = getStripe(stripe);
+    st->seq.store(st->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  /***********************************************************************/
+  /**
+  * eraseSlot - remove a slot, moving back the following ones of the probe
+  * sequence so that no tombstone is needed (stripe locked, write started)
+  */
+  void SharedMemorySessionBackend::eraseSlot(const unsigned stripe, unsigned i)
+  {
+    unsigned j = i;
+    for (unsigned n = 0; n < slotsPerStripe; n++)
+    {
+      if (++j == slotsPerStripe) j = 0;
+      Slot *next = getSlot(stripe, j);
+      if (!next->used)
+        break;
+      unsigned home = homeOf(hash(next->id, next->idLen));
+      // can next be moved to i ? (its home is not in ]i, j])
+      bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+      if (movable)
+      {
+        memcpy(getSlot(stripe, i), next, slotSize);
+        i = j;
+      }
+    }
+    getSlot(stripe, i)->used = 0;
+    getStripe(stripe)->count--;
+  }
+
+  /***********************************************************************/
+  /**
+  * rebuildStripe - reinsert the valid sessions of a stripe left inconsistent
+  * by a dead process (stripe locked)
+  */
+  void SharedMemorySessionBackend::rebuildStripe(const unsigned stripe)
+  {
+    std::vector<char> copy((size_t)slotsPerStripe * slotSize);
+    memcpy(&copy[0], getSlot(stripe, 0), copy.size());
+    memset(getSlot(stripe, 0), 0, copy.size());
+    getStripe(stripe)->count = 0;
+
+    for (unsigned n = 0; n < slotsPerStripe; n++)
+    {
+      Slot *old = (Slot*)&copy[(size_t)n * slotSize];
+      if (!old->used || !old->idLen || old->idLen > SHMSESSION_ID_SIZE)
+        continue;
+      u_int64_t h = hash(old->id, old->idLen);
+      if (stripeOf(h) != stripe || lookup(stripe, h, std::string(old->id, old->idLen)) >= 0)
+        continue;
+
+      if (old->nbAttributes > maxAttributes) old->nbAttributes = maxAttributes;
+      for (unsigned a = 0; a < old->nbAttributes; a++)
+      {
+        Attribute *attr = attributeAt(old, a);
+        if (attr->nameLen > SHMSESSION_NAME_SIZE || attr->valueLen > attributeValueSize)
+          { old->nbAttributes = a; break; }
+      }
+
+      unsigned i = homeOf(h);
+      while (getSlot(stripe, i)->used)
+        if (++i == slotsPerStripe) i = 0;
+      memcpy(getSlot(stripe, i), old, slotSize);
+      getStripe(stripe)->count++;
+    }
+  }
+
+  /***********************************************************************/
+
+  bool SharedMemorySessionBackend::create(const std::string& id, const time_t expiration)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return false;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+    bool res = false;
+
+    lockStripe(stripe);
+    if (lookup(stripe, h, id) < 0)
+    {
+      if (getStripe(stripe)->count + 1 > (u_int64_t)slotsPerStripe * 3 / 4)
+      {
+        // full: make room by removing the expired sessions
+        time_t now = time(NULL);
+        writeBegin(stripe);
+        for (unsigned i = 0; i < slotsPerStripe; )
+        {
+          Slot *slot = getSlot(stripe, i);
+          if (slot->used && slot->expiration && slot->expiration <= now)
+            eraseSlot(stripe, i); // a following slot may have been moved here
+          else
+            i++;
+        }
+        writeEnd(stripe);
+      }
+
+      if (getStripe(stripe)->count + 1 <= (u_int64_t)slotsPerStripe * 3 / 4)
+      {
+        unsigned i = homeOf(h);
+        while (getSlot(stripe, i)->used)
+          if (++i == slotsPerStripe) i = 0;
+
+        writeBegin(stripe);
+        Slot *slot = getSlot(stripe, i);
+        slot->idLen = (u_int32_t)id.size();
+        memcpy(slot->id, id.data(), id.size());
+        slot->expiration = expiration;
+        slot->nbAttributes = 0;
+        slot->used = 1;
+        getStripe(stripe)->count++;
+        writeEnd(stripe);
+        res = true;
+      }
+    }
+    unlockStripe(stripe);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool SharedMemorySessionBackend::exists(const std::string& id, const time_t now)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return false;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    for (unsigned tries = 0; ; tries++)
+    {
+      bool locked = tries >= SHMSESSION_READ_TRIES;
+      u_int32_t seq = 0;
+      if (locked) lockStripe(stripe); else seq = readBegin(stripe);
+
+      int i = lookup(stripe, h, id);
+      int64_t expiration = i >= 0 ? getSlot(stripe, i)->expiration : 0;
+      bool res = i >= 0 && (!expiration || expiration > now);
+
+      if (locked) { unlockStripe(stripe); return res; }
+      if (readEnd(stripe, seq)) return res;
+    }
+  }
+
+  /***********************************************************************/
+
+  bool SharedMemorySessionBackend::touch(const std::string& id, const time_t now, const time_t expiration)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return false;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+    int64_t current = 0;
+    bool found = false;
+
+    for (unsigned tries = 0; ; tries++)
+    {
+      bool locked = tries >= SHMSESSION_READ_TRIES;
+      u_int32_t seq = 0;
+      if (locked) lockStripe(stripe); else seq = readBegin(stripe);
+
+      int i = lookup(stripe, h, id);
+      found = i >= 0;
+      current = found ? getSlot(stripe, i)->expiration : 0;
+
+      if (locked) { unlockStripe(stripe); break; }
+      if (readEnd(stripe, seq)) break;
+    }
+
+    if (!found || (current && current <= now))
+      return false;
+
+    // only write when the expiration moves enough: most finds stay lock-free
+    time_t granularity = (expiration - now) / 64;
+    if (!current || expiration - current < (granularity ? granularity : 1))
+      return true;
+
+    bool res = false;
+    lockStripe(stripe);
+    int i = lookup(stripe, h, id);
+    if (i >= 0)
+    {
+      Slot *slot = getSlot(stripe, i);
+      res = !slot->expiration || slot->expiration > now;
+      if (res && slot->expiration)
+      {
+        writeBegin(stripe);
+        slot->expiration = expiration;
+        writeEnd(stripe);
+      }
+    }
+    unlockStripe(stripe);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::setExpiration(const std::string& id, const time_t expiration)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    lockStripe(stripe);
+    int i = lookup(stripe, h, id);
+    if (i >= 0)
+    {
+      writeBegin(stripe);
+      getSlot(stripe, i)->expiration = expiration;
+      writeEnd(stripe);
+    }
+    unlockStripe(stripe);
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::remove(const std::string& id)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    lockStripe(stripe);
+    int i = lookup(stripe, h, id);
+    if (i >= 0)
+    {
+      writeBegin(stripe);
+      eraseSlot(stripe, (unsigned)i);
+      writeEnd(stripe);
+    }
+    unlockStripe(stripe);
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::removeExpired(const time_t now)
+  {
+    for (unsigned stripe = 0; stripe < nbStripes; stripe++)
+    {
+      lockStripe(stripe);
+      bool writing = false;
+      for (unsigned i = 0; i < slotsPerStripe; )
+      {
+        Slot *slot = getSlot(stripe, i);
+        if (slot->used && slot->expiration && slot->expiration <= now)
+        {
+          if (!writing) { writeBegin(stripe); writing = true; }
+          eraseSlot(stripe, i);
+        }
+        else
+          i++;
+      }
+      if (writing) writeEnd(stripe);
+      unlockStripe(stripe);
+    }
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::removeAll()
+  {
+    for (unsigned stripe = 0; stripe < nbStripes; stripe++)
+    {
+      lockStripe(stripe);
+      writeBegin(stripe);
+      for (unsigned i = 0; i < slotsPerStripe; i++)
+        getSlot(stripe, i)->used = 0;
+      getStripe(stripe)->count = 0;
+      writeEnd(stripe);
+      unlockStripe(stripe);
+    }
+  }
+
+  /***********************************************************************/
+
+  bool SharedMemorySessionBackend::setAttribute(const std::string& id, const std::string& name, const void *data, const size_t len)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE || name.size() > SHMSESSION_NAME_SIZE)
+      return false;
+
+    if (len > attributeValueSize)
+    {
+      NVJ_LOG->appendUniq(NVJ_WARNING, "SharedMemorySessionBackend: attribute '" + name + "' is too large");
+      return false;
+    }
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+    bool res = false;
+
+    lockStripe(stripe);
+    int i = lookup(stripe, h, id);
+    if (i >= 0)
+    {
+      Slot *slot = getSlot(stripe, i);
+      Attribute *attr = findAttribute(slot, name);
+      if (attr == NULL && slot->nbAttributes < maxAttributes)
+        attr = attributeAt(slot, slot->nbAttributes);
+
+      if (attr != NULL)
+      {
+        writeBegin(stripe);
+        if (attr == attributeAt(slot, slot->nbAttributes))
+        {
+          attr->nameLen = (u_int32_t)name.size();
+          memcpy(attr->name, name.data(), name.size());
+          slot->nbAttributes++;
+        }
+        attr->valueLen = (u_int32_t)len;
+        memcpy((char*)attr + sizeof(Attribute), data, len);
+        writeEnd(stripe);
+        res = true;
+      }
+      else
+        NVJ_LOG->appendUniq(NVJ_WARNING, "SharedMemorySessionBackend: no attribute slot left");
+    }
+    unlockStripe(stripe);
+
+    return res;
+  }
+
+  /***********************************************************************/
+
+  bool SharedMemorySessionBackend::getAttribute(const std::string& id, const std::string& name, std::string& value)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return false;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    for (unsigned tries = 0; ; tries++)
+    {
+      bool locked = tries >= SHMSESSION_READ_TRIES;
+      u_int32_t seq = 0;
+      if (locked) lockStripe(stripe); else seq = readBegin(stripe);
+
+      bool res = false;
+      int i = lookup(stripe, h, id);
+      if (i >= 0)
+      {
+        Attribute *attr = findAttribute(getSlot(stripe, i), name);
+        if (attr != NULL)
+        {
+          size_t len = attr->valueLen < attributeValueSize ? attr->valueLen : attributeValueSize;
+          value.assign((const char*)attr + sizeof(Attribute), len);
+          res = true;
+        }
+      }
+
+      if (locked) { unlockStripe(stripe); return res; }
+      if (readEnd(stripe, seq)) return res;
+    }
+  }
+
+  /***********************************************************************/
+
+  void SharedMemorySessionBackend::removeAttribute(const std::string& id, const std::string& name)
+  {
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    lockStripe(stripe);
+    int i = lookup(stripe, h, id);
+    if (i >= 0)
+    {
+      Slot *slot = getSlot(stripe, i);
+      Attribute *attr = findAttribute(slot, name);
+      if (attr != NULL)
+      {
+        writeBegin(stripe);
+        Attribute *last = attributeAt(slot, slot->nbAttributes - 1);
+        if (attr != last)
+          memcpy(attr, last, attributeSize);
+        slot->nbAttributes--;
+        writeEnd(stripe);
+      }
+    }
+    unlockStripe(stripe);
+  }
+
+  /***********************************************************************/
+
+  std::vector<std::string> SharedMemorySessionBackend::getAttributeNames(const std::string& id)
+  {
+    std::vector<std::string> res;
+    if (id.empty() || id.size() > SHMSESSION_ID_SIZE)
+      return res;
+
+    u_int64_t h = hash(id.data(), id.size());
+    unsigned stripe = stripeOf(h);
+
+    for (unsigned tries = 0; ; tries++)
+    {
+      bool locked = tries >= SHMSESSION_READ_TRIES;
+      u_int32_t seq = 0;
+      if (locked) lockStripe(stripe); else seq = readBegin(stripe);
+
+      res.clear();
+      int i = lookup(stripe, h, id);
+      if (i >= 0)
+      {
+        Slot *slot = getSlot(stripe, i);
+        unsigned nb = slot->nbAttributes < maxAttributes ? slot->nbAttributes : maxAttributes;
+        for (unsigned a = 0; a < nb; a++)
+        {
+          Attribute *attr = attributeAt(slot, a);
+          res.push_back(std::string(attr->name, attr->nameLen < SHMSESSION_NAME_SIZE ? attr->nameLen : SHMSESSION_NAME_SIZE));
+        }
+      }
+
+      if (locked) { unlockStripe(stripe); return res; }
+      if (readEnd(stripe, seq)) return res;
+    }
+  }
+
@@ -41,8 +41,12 @@
 #include "libnavajo/WebServer.hh"
 #include "libnavajo/nvjSocket.h"
 #include "libnavajo/nvjGzip.h"
+#include "libnavajo/nvjPercentDecode.h"
+#include "libnavajo/nvjBase64.h"
+#include "libnavajo/nvjTime.h"
 #include "libnavajo/htonll.h"
 #include "libnavajo/WebSocket.hh"
+#include "libnavajo/AsyncDynamicPage.hh"
 
 #include "MPFDParser/Parser.h"
 
@@ -58,17 +62,12 @@ const int WebServer::verify_depth=512;
 char *WebServer::certpass=NULL;
 std::string WebServer::webServerName;
 pthread_mutex_t IpAddress::resolvIP_mutex = PTHREAD_MUTEX_INITIALIZER;
-HttpSession::HttpSessionsContainerMap HttpSession::sessions;
-pthread_mutex_t HttpSession::sessions_mutex=PTHREAD_MUTEX_INITIALIZER;
-const std::string WebServer::base64_chars =
-             "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-             "abcdefghijklmnopqrstuvwxyz"
-             "0123456789+/";
+HttpSession::Shard HttpSession::shards[HTTPSESSION_NB_SHARDS];
 const std::string WebServer::webSocketMagicString="258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
 
 std::map<unsigned, const char*> HttpResponse::httpReturnCodes;
-time_t HttpSession::lastExpirationSearchTime=0;
 time_t HttpSession::sessionLifeTime=20*60;
+HttpSessionBackend *HttpSession::backend=NULL;
 
 #ifndef MSG_NOSIGNAL
   #define MSG_NOSIGNAL 0
@@ -85,12 +84,17 @@ namespace
 
 WebServer::WebServer(): sslCtx(NULL), s_server_session_id_context(1),
                         tokDecodeCallback(NULL), authBearTokDecExpirationCb(NULL), authBearTokDecScopesCb(NULL),
+                        jwtVerifier(NULL), authBearerJwtScopesCb(NULL),
                         authBearerEnabled(false),
+                        clientsQueueMaxDepth(0), clientsQueueTargetDelay(0), clientsQueueInterval(100),
+                        clientsQueueFirstAboveTime(0), clientsQueueDropping(false), shedConnectionsCount(0),
+                        shedWithServiceUnavailable(true), shedRetryAfterInSecond(1),
                         httpdAuth(false), exiting(false), exitedThread(0),
-                        nbServerSock(0), disableIpV4(false), disableIpV6(false),
+                        nbServerSock(0), peerHistoryLastSeen(1024), peerHistoryTopK(32),
+                        disableIpV4(false), disableIpV6(false),
                         socketTimeoutInSecond(DEFAULT_HTTP_SERVER_SOCKET_TIMEOUT), tcpPort(DEFAULT_HTTP_PORT),
                         threadsPoolSize(64), mutipartMaxCollectedDataLength( 20*1024 ),
-                        sslEnabled(false), authPeerSsl(false)
+                        sslEnabled(false), authPeerSsl(false), ipRateLimiter(NULL)
 {
 
   webServerName=std::string("Server: libNavajo/")+std::string(LIBNAVAJO_SOFTWARE_VERSION);
@@ -98,10 +102,9 @@ WebServer::WebServer(): sslCtx(NULL), s_server_session_id_context(1),
 
   pthread_mutex_init(&clientsQueue_mutex, NULL);
   pthread_cond_init(&clientsQueue_cond, NULL);
+  pthread_mutex_init(&asyncCompletions_mutex, NULL);
+  pthread_cond_init(&asyncCompletions_cond, NULL);
 
-  pthread_mutex_init(&peerDnHistory_mutex, NULL);
-  pthread_mutex_init(&usersAuthHistory_mutex, NULL);
-  pthread_mutex_init(&tokensAuthHistory_mutex, NULL);
 }
 
 /*********************************************************************/
@@ -109,49 +112,18 @@ WebServer::WebServer(): sslCtx(NULL), s_server_session_id_context(1),
 void WebServer::updatePeerIpHistory(IpAddress& ip)
 {
   time_t t = time ( NULL );
-  std::map<IpAddress, time_t>::iterator i = peerIpHistory.find (ip);
+  time_t previous = peerIpHistory.update(ip, t);
 
-  bool dispPeer = false;
-  if (i != peerIpHistory.end())
-  {
-        dispPeer = t - i->second > LOGHIST_EXPIRATION_DELAY;
-        i->second = t;
-  }
-  else
-  {
-        peerIpHistory[ip]=t;
-         dispPeer = true;
-  }
-
-  if (dispPeer)
+  if (!previous || t - previous > LOGHIST_EXPIRATION_DELAY)
      NVJ_LOG->append(NVJ_DEBUG,std::string ("WebServer: Connection from IP: ") + ip.str());
 }
 
 /*********************************************************************/
 
-void WebServer::updatePeerDnHistory(std::string dn)
+void WebServer::logPeerDn(const std::string& dn, const time_t t, const time_t previous)
 {
-
-  pthread_mutex_lock( &peerDnHistory_mutex );
-  time_t t = time ( NULL );
-  std::map<std::string,time_t>::iterator i = peerDnHistory.find (dn);
-
-  bool dispPeer = false;
-  if (i != peerDnHistory.end())
-  {
-    dispPeer = t - i->second > LOGHIST_EXPIRATION_DELAY;
-    i->second = t;
-  }
-  else
-  {
-    peerDnHistory[dn]=t;
-    dispPeer = true;
-  }
-
-  if (dispPeer)
+  if (!previous || t - previous > LOGHIST_EXPIRATION_DELAY)
     NVJ_LOG->append(NVJ_DEBUG,"WebServer: Authorized DN: "+dn);
-
-  pthread_mutex_unlock( &peerDnHistory_mutex );
 }
 
 /*********************************************************************/
@@ -163,57 +135,17 @@ void WebServer::updatePeerDnHistory(std::string dn)
 */ 
 bool WebServer::isUserAllowed(const std::string &pwdb64, std::string& login)
 {
+  bool cached = false;
+  bool authOK = credentials.verifyBasic(pwdb64, login, &cached);
 
-  pthread_mutex_lock( &usersAuthHistory_mutex );
-  time_t t = time ( NULL );
-
-  bool isNewUser = true;
-  std::map<std::string,time_t>::iterator i = usersAuthHistory.find (pwdb64);
-
-  if (i != usersAuthHistory.end())
-  {
-    isNewUser = t - i->second > LOGHIST_EXPIRATION_DELAY;
-    i->second = t;
-  }
-
-  if (!isNewUser)
-  {
-    pthread_mutex_unlock( &usersAuthHistory_mutex );
-    return true;
-  }
-
-  // It's a new user !
-  bool authOK=false;
-  std::string loginPwd=base64_decode(pwdb64.c_str());
-  size_t loginPwdSep=loginPwd.find(':');
-  if (loginPwdSep==std::string::npos)
-  {
-    pthread_mutex_unlock( &usersAuthHistory_mutex );
-    return false;
-  }
-
-  login=loginPwd.substr(0,loginPwdSep);
-  std::string pwd=loginPwd.substr(loginPwdSep+1);
-
-  std::vector<std::string> httpAuthLoginPwd=authLoginPwdList;
-  if (httpAuthLoginPwd.size())
-  {
-    std::string logPass=login+':'+pwd;
-    for ( std::vector<std::string>::iterator it=httpAuthLoginPwd.begin(); it != httpAuthLoginPwd.end(); it++ )
-      if ( logPass == *it )
-        authOK=true;
-  }
-  
   if (authOK)
   {
-    NVJ_LOG->append(NVJ_INFO,"WebServer: Authentification passed for user '"+login+"'");
-    if (i == usersAuthHistory.end())
-      usersAuthHistory[pwdb64]=t;
+    if (!cached)
+      NVJ_LOG->append(NVJ_INFO,"WebServer: Authentification passed for user '"+login+"'");
   }
   else
     NVJ_LOG->append(NVJ_DEBUG,"WebServer: Authentification failed for user '"+login+"'");
 
-  pthread_mutex_unlock( &usersAuthHistory_mutex );
   return authOK;
 }
 
@@ -228,96 +160,97 @@ bool WebServer::isTokenAllowed(const std::string &tokb64,
                                const std::string &resourceUrl,
                                std::string &respHeader)
 {
-  std::string logAuth = "WebServer: Authentication passed for token '"+tokb64+"'";
-  NvjLogSeverity logAuthLvl = NVJ_DEBUG;
   time_t t = time ( NULL );
-  struct tm * timeinfo;
-  bool isTokenExpired = true;
-  bool authOK = false;
-  time_t expiration = 0;
-
-  timeinfo = localtime ( &t );
-  t = mktime ( timeinfo );
-
-  pthread_mutex_lock( &tokensAuthHistory_mutex );
-  std::map<std::string,time_t>::iterator i = tokensAuthHistory.find (tokb64);
+  BearerTokenVerification verification;
 
-  if (i != tokensAuthHistory.end())
-  {
-    NVJ_LOG->append(NVJ_DEBUG, "WebServer: token already authenticated");
-
-    /* get current timeinfo and compare to the one previously stored */
-    isTokenExpired = t > i->second;
+  // cached by digest: the tokens (JWT) can be long
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256((const unsigned char*)tokb64.data(), tokb64.size(), digest);
 
-    if (isTokenExpired)
+  // the callbacks run without lock; concurrent requests with the same token wait for the first verification
+  bool cached = bearerTokenCache.get(std::string((const char*)digest, sizeof(digest)), t,
+    [this, t, &tokb64](const std::string&, BearerTokenVerification& result)
     {
-      /* Remove token from the map to avoid infinite grow of it */
-      tokensAuthHistory.erase(tokb64);
-      NVJ_LOG->append(NVJ_DEBUG, "WebServer: removing outdated token from cache '"+tokb64+"'");
-    }
+      if (jwtVerifier != NULL)
+      {
+        std::shared_ptr<JwtClaims> claims = std::make_shared<JwtClaims>();
+        if (!jwtVerifier->verify(tokb64, t, *claims, result.logMessage))
+        {
+          result.error = "error=\"invalid_token\", error_description=\"" + result.logMessage + "\"";
+          return;
+        }
+        result.expiration = claims->expiration;
+        result.claims = claims;
+        result.valid = true;
+        return;
+      }
 
-    pthread_mutex_unlock( &tokensAuthHistory_mutex );
-    return !isTokenExpired;
-  }
+      // Use callback configured to decode token
+      if (tokDecodeCallback(tokb64, tokDecodeSecret, result.decoded))
+      {
+        result.logMessage = "invalid signature";
+        result.error = "error=\"invalid_token\", error_description=\"invalid signature\"";
+        return;
+      }
 
-  // It's a new token !
+      // retrieve expiration date
+      result.expiration = authBearTokDecExpirationCb(result.decoded);
 
-  std::string tokDecoded;
+      if (!result.expiration)
+      {
+        result.logMessage = "expiration date not found";
+        result.error = "error=\"invalid_token\", error_description=\"no expiration in token\"";
+        return;
+      }
 
-  // Use callback configured to decode token
-  if (tokDecodeCallback(tokb64, tokDecodeSecret, tokDecoded))
-  {
-    logAuth = "WebServer: Authentication failed for token '"+tokb64+"'";
-    respHeader = "realm=\"" + authBearerRealm;
-    respHeader += "\",error=\"invalid_token\", error_description=\"invalid signature\"";
-    goto end;
-  }
+      if (result.expiration < t)
+      {
+        result.logMessage = "validity expired";
+        result.error = "error=\"invalid_token\", error_description=\"token expired\"";
+        return;
+      }
 
-  // retrieve expiration date
-  expiration = authBearTokDecExpirationCb(tokDecoded);
+      result.valid = true;
+    },
+    verification);
 
-  if (!expiration)
+  if (!verification.valid)
   {
-    logAuth = "WebServer: Authentication failed, expiration date not found for token '"+tokb64+"'";
-    respHeader = "realm=\"" + authBearerRealm;
-    respHeader += "\",error=\"invalid_token\", error_description=\"no expiration in token\"";
-    goto end;
+    NVJ_LOG->append(NVJ_DEBUG, "WebServer: Authentication failed, " + verification.logMessage + " for token '"+tokb64+"'");
+    respHeader = "realm=\"" + authBearerRealm + "\"," + verification.error;
+    return false;
   }
 
-  if (expiration < t)
-  {
-    logAuth = "WebServer: Authentication failed, validity expired for token '"+tokb64+"'";
-    respHeader = "realm=\"" + authBearerRealm;
-    respHeader += "\",error=\"invalid_token\", error_description=\"token expired\"";
-    goto end;
-  }
+  // the scopes depend on the resource: checked for each request
+  std::string errDescr;
+  bool scopesOK = true;
 
-  // check for extra attribute if any callback was set to that purpose
-  if (authBearTokDecScopesCb)
+  if (verification.claims)
   {
-    std::string errDescr;
-
-    if (authBearTokDecScopesCb(tokDecoded, resourceUrl, errDescr))
+    if (!jwtVerifier->checkScopes(*verification.claims, resourceUrl, errDescr))
     {
-      logAuth = "WebServer: Authentication failed, invalid scope for token '"+tokb64+"'";
-      respHeader = "realm=\"" + authBearerRealm;
-      respHeader += "\",error=\"insufficient_scope\",error_description=\"";
-      respHeader += errDescr +"\"";
-      goto end;
+      errDescr = "scope '" + errDescr + "' required";
+      scopesOK = false;
     }
+    else if (authBearerJwtScopesCb)
+      scopesOK = !authBearerJwtScopesCb(*verification.claims, resourceUrl, errDescr);
   }
+  else if (authBearTokDecScopesCb)
+    scopesOK = !authBearTokDecScopesCb(verification.decoded, resourceUrl, errDescr);
 
-  // All checks passed successfully, store the token to speed up processing of next request
-  // proposing same token
-  authOK = true;
-  logAuthLvl = NVJ_INFO;
-  tokensAuthHistory[tokb64] = expiration;
+  if (!scopesOK)
+  {
+    NVJ_LOG->append(NVJ_DEBUG, "WebServer: Authentication failed, invalid scope for token '"+tokb64+"'");
+    respHeader = "realm=\"" + authBearerRealm;
+    respHeader += "\",error=\"insufficient_scope\",error_description=\"";
+    respHeader += errDescr +"\"";
+    return false;
+  }
 
-end:
-  pthread_mutex_unlock( &tokensAuthHistory_mutex );
-  NVJ_LOG->append(logAuthLvl, logAuth);
+  if (!cached)
+    NVJ_LOG->append(NVJ_INFO, "WebServer: Authentication passed for token '"+tokb64+"'");
 
-  return authOK;
+  return true;
 }
 
 /***********************************************************************
@@ -435,70 +368,51 @@ void WebServer::clearRecvBuffer(int client)
   httpRecvBuffers.erase(client);
 }
 
-/**********************************************************************/
-/**
-* trim from start
-*/
-
-static inline std::string &ltrim(std::string &s) {
-    s.erase(
-        s.begin(),
-        std::find_if(s.begin(), s.end(), [](unsigned char ch) {
-            return !std::isspace(ch);
-        })
-    );
-    return s;
-}
+/***********************************************************************
+* stashRecvBuffer: Move the read-ahead bytes of a socket into its
+*                  ClientSockData, before the connection leaves the
+*                  current worker thread.
+***********************************************************************/
 
-/**********************************************************************/
-/**
-* trim from end
-*/
+void WebServer::stashRecvBuffer(ClientSockData* client)
+{
+  std::unordered_map<int, std::string>::iterator it = httpRecvBuffers.find(client->socketId);
+  if (it == httpRecvBuffers.end())
+    return;
 
-static inline std::string &rtrim(std::string &s) {
-    s.erase(
-        std::find_if(s.rbegin(), s.rend(), [](unsigned char ch) {
-            return !std::isspace(ch);
-        }).base(),
-        s.end()
-    );
-    return s;
+  if (!it->second.empty())
+  {
+    if (client->recvBuffer == NULL)
+      client->recvBuffer = new std::string();
+    client->recvBuffer->swap(it->second);
+  }
+  httpRecvBuffers.erase(it);
 }
 
-/**********************************************************************/
-/**
-* trim from both ends
-*/
-static inline std::string &trim(std::string &s) {
-    return ltrim(rtrim(s));
-}
+/***********************************************************************
+* restoreRecvBuffer: Give back the read-ahead bytes saved by
+*                    stashRecvBuffer() to the current worker thread.
+***********************************************************************/
 
-/**********************************************************************/
-/**
-* fill extra http headers Map
-* @param c: raw string containing a header line made of "Header: Value"
-*/
-static void addExtraHeader(const char* l, HttpRequestHeadersMap& m)
+void WebServer::restoreRecvBuffer(ClientSockData* client)
 {
-  std::stringstream ss(l);
-  std::string header;
-  std::string val;
+  if (client->recvBuffer == NULL)
+    return;
 
-  // Keep the full value after the first ':'; header values such as
-  // "Host: localhost:8080" or URLs may contain additional colons.
-  if (std::getline(ss, header, ':') && std::getline(ss, val))
-  {
-    m[trim(header)] = trim(val);
-  }
-};
+  httpRecvBuffers[client->socketId].swap(*(client->recvBuffer));
+  delete client->recvBuffer;
+  client->recvBuffer = NULL;
+}
 
 /***********************************************************************
 * accept_request:  Process a request
 * @param c - the socket connected to the client
+* @param requestExtraHeaders - the headers of the worker thread, cleared
+*        and reused by each request (their buffers are kept)
 * \return true if the socket must to close
 ***********************************************************************/
 
-bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
+bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/, HttpRequestHeaders& requestExtraHeaders)
 {
   char bufLine[BUFSIZE];
   HttpRequestMethod requestMethod;
@@ -510,13 +424,13 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
 
   char *urlBuffer=NULL;
   char *mutipartContent=NULL;
-  size_t nbFileKeepAlive=KEEPALIVE_MAX_NB_QUERY;
+  size_t nbFileKeepAlive=client->keepAliveLeft; // the count goes on after an asynchronous response
   MPFD::Parser *mutipartContentParser=NULL;
   char *requestParams=NULL;
   char *requestCookies=NULL;
   char *requestOrigin=NULL;
-  HttpRequestHeadersMap requestExtraHeaders;
   char *webSocketClientKey=NULL;
+  std::string webSocketExtensions;
   bool websocket=false;
   int webSocketVersion=-1;
   std::string username;
@@ -524,7 +438,7 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
 
   unsigned i=0, j=0;
   
-  bool authOK = authLoginPwdList.size() == 0;
+  bool authOK = credentials.empty();
   char httpVers[4]="";
   bool keepAlive=false;
   bool closing=false;
@@ -544,6 +458,7 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
     requestContentLength=0;
     urlencodedForm=false;
     username="";
+    webSocketExtensions.clear();
     keepAlive=false;
     closing=false;
     isQueryStr=false;
@@ -604,6 +519,9 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
         else *(bufLine+bufLineLen-2)='\0';
         j = 0; while (isspace((int)(bufLine[j])) && j < (unsigned)bufLineLen) j++;
 
+        // every header line (but the credentials) is kept for HttpRequest::getExtraHeader()
+        if (requestMethod != UNKNOWN_METHOD && strncasecmp(bufLine+j, "Authorization:", 14) != 0)
+          requestExtraHeaders.add(bufLine+j);
 
         // decode login/passwd
         if ( strncmp(bufLine+j, authStr, sizeof authStr - 1 ) == 0)
@@ -611,7 +529,7 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
           j+=sizeof authStr - 1;
 
           std::string pwdb64="";
-          while ( j < (unsigned)bufLineLen && *(bufLine + j) != 0x0d && *(bufLine + j) != 0x0a)
+          while ( j < (unsigned)bufLineLen && *(bufLine + j) != 0 && *(bufLine + j) != 0x0d && *(bufLine + j) != 0x0a)
             pwdb64+=*(bufLine + j++);;
           if (!authOK)
             authOK=isUserAllowed(pwdb64, username);
@@ -695,16 +613,17 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
 
         if (strncasecmp(bufLine+j, "Sec-WebSocket-Extensions: ", 26) == 0)
         {
-          // Do not negotiate permessage-deflate for now. The current
-          // websocket deflate implementation is not safe with fragmented
-          // messages; silently ignore the client offer.
+          // the offers, negotiated once the endpoint is known
+          j+=26;
+          if (!webSocketExtensions.empty())
+            webSocketExtensions+=", ";
+          webSocketExtensions+=bufLine+j;
           continue;
         }
         
         if (strncasecmp(bufLine+j, "Sec-WebSocket-Version: ", 23) == 0)
           { j+=23; webSocketVersion = atoi(bufLine+j); continue; }
 
-        addExtraHeader(bufLine+j, requestExtraHeaders);
         isQueryStr=false;
         if (strncmp(bufLine+j, "GET", 3) == 0)
         {  requestMethod=GET_METHOD; isQueryStr=true; j+=4; }
@@ -768,7 +687,7 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
             j+=sizeof authBearerStr - 1;
 
             std::string tokb64="";
-            while ( j < (unsigned)bufLineLen && *(bufLine + j) != 0x0d && *(bufLine + j) != 0x0a)
+            while ( j < (unsigned)bufLineLen && *(bufLine + j) != 0 && *(bufLine + j) != 0x0d && *(bufLine + j) != 0x0a)
                 tokb64+=*(bufLine + j++);
             if (authBearerEnabled)
                 authOK=isTokenAllowed(tokb64, urlBuffer, authRespHeader);
@@ -777,6 +696,15 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
       }
     }
 
+    if ( !IpRateLimiter::allowRequest(client->rateLimiterEntry) )
+    {
+      HttpResponse tooManyRequests;
+      tooManyRequests.addSpecificHeader("Retry-After: 1");
+      std::string msg = getHttpHeader( "429 Too Many Requests", 0, false, NULL, false, &tooManyRequests);
+      httpSend(client, (const void*) msg.c_str(), msg.length());
+      goto FREE_RETURN_TRUE;
+    }
+
     if (!authOK)
     {
       const char *abh = authRespHeader.empty()? NULL: authRespHeader.c_str();
@@ -811,32 +739,7 @@ bool WebServer::accept_request(ClientSockData* client, bool /*authSSL*/)
     }
 
     // Interpret '%' character
-    std::string urlString(urlBuffer);
-    size_t start = 0, end = 0;
-
-    while ((end = urlString.find_first_of('%', start)) != std::string::npos)
-    {
-      size_t len=urlString.length()-end-1;
-      if ( urlString[end]=='%' && len>=1 )
-      {
-        if ( urlString[end+1]=='%' )
-          urlString=urlString.erase(end+1,1);
-        else
-        {
-          if (len>=2)
-          {
-            unsigned int specar;
-            std::string hexChar=urlString.substr(end+1,2);
-            std::stringstream ss; ss << std::hex << hexChar.c_str();
-            ss >> specar;
-            urlString[end] = (char)specar;
-            urlString=urlString.erase(end+1,2);
-          }
-        }
-      }
-      start=end+1;
-    }
-    strcpy (urlBuffer, urlString.c_str());
+    urlBuffer[nvj_percent_decode(urlBuffer, strlen(urlBuffer))] = '\0';
 
     #ifdef DEBUG_TRACES
     char logBuffer[BUFSIZE];
@@ -1004,17 +907,24 @@ if (requestMethod == GET_METHOD && strcmp(urlBuffer, "plaintext") == 0)
       if (it != webSocketEndPoints.end()) // FOUND
       {
         WebSocket* webSocket=it->second;
-        if(!webSocket->isUsingCompression())
-          client->compression = NONE;
+        WebSocketDeflateParams deflateParams;
+        bool useDeflate = webSocket->isUsingCompression() && deflateParams.negotiate(webSocketExtensions);
+        client->compression = useDeflate ? ZLIB : NONE;
 
-        std::string header = getHttpWebSocketHeader("101 Switching Protocols", webSocketClientKey, client->compression == ZLIB);
+        std::string header = getHttpWebSocketHeader("101 Switching Protocols", webSocketClientKey, useDeflate ? &deflateParams : NULL);
 
         if (! httpSend(client, (const void*) header.c_str(), header.length()) )
+        {
+          if (useDeflate)
+            WebSocketDeflateParams::releaseMemory(deflateParams.getMemoryCost());
           goto FREE_RETURN_TRUE;
+        }
 
         HttpRequest* request=new HttpRequest(requestMethod, urlBuffer, requestParams, requestCookies, requestExtraHeaders, requestOrigin, username, client, mimeType, &payload, mutipartContentParser);
+        request->detach(); // the request outlives this connection buffers
+        stashRecvBuffer(client); // the first frames may be read already
 
-        webSocket->newConnectionRequest(request);
+        webSocket->newConnectionRequest(request, useDeflate ? &deflateParams : NULL);
 
         if (urlBuffer != NULL) free (urlBuffer);
         if (requestParams != NULL) free (requestParams);
@@ -1070,6 +980,29 @@ if (requestMethod == GET_METHOD && strcmp(urlBuffer, "plaintext") == 0)
          repo++;
     }
     
+    if (fileFound && response.getAsyncCompletion() != NULL)
+    {
+      // The page will be completed later, by another thread: release the worker
+      if (keepAlive && (--nbFileKeepAlive <= 0))
+        keepAlive = false;
+      client->keepAliveLeft = nbFileKeepAlive;
+
+      HttpAsyncCompletion *asyncCompletion = response.getAsyncCompletion();
+      std::string sessionId = request.getSessionId(); // before its cookies are freed
+      stashRecvBuffer(client);
+
+      if (urlBuffer != NULL) free (urlBuffer);
+      if (requestParams != NULL) free (requestParams);
+      if (requestCookies != NULL) free (requestCookies);
+      if (requestOrigin != NULL) free (requestOrigin);
+      if (webSocketClientKey != NULL) free (webSocketClientKey);
+      if (mutipartContent != NULL) free (mutipartContent);
+      if (mutipartContentParser != NULL) delete mutipartContentParser;
+
+      asyncCompletion->arm(this, keepAlive && !closing, sessionId);
+      return false;
+    }
+
     if (!fileFound)
     {
       char bufLinestr[300]; snprintf(bufLinestr, 300, "Webserver: page not found %s",  urlBuffer);
@@ -1349,6 +1282,290 @@ bool WebServer::httpSend2(ClientSockData *client,
       && httpSend(client, buf2, len2);
 }
 
+/***********************************************************************
+* sendAsyncResponse - send the response of an asynchronous page, then
+*                     give the keep-alive connection back to the pool
+* @param completion - the completion handle
+* @param timedOut - true to send the timeout status instead of the response
+***********************************************************************/
+
+void WebServer::sendAsyncResponse(HttpAsyncCompletion *completion, const bool timedOut)
+{
+  ClientSockData *client = completion->client;
+  HttpResponse &response = completion->response;
+  bool keepAlive = completion->keepAlive;
+  bool sendOk = true;
+
+  if (timedOut)
+  {
+    response.setHttpReturnCode(completion->timeoutHttpCode);
+    std::string msg = getHttpHeader(response.getHttpReturnCodeStr().c_str(), 0, keepAlive);
+    sendOk = httpSend(client, (const void*) msg.c_str(), msg.length());
+  }
+  else
+  {
+    unsigned char *webpage = NULL, *gzipWebPage = NULL;
+    size_t webpageLen = 0;
+    int sizeZip = 0;
+    bool zippedFile = false;
+    bool contentOk = true;
+
+    if (completion->sessionId.size())
+      response.addSessionCookie(completion->sessionId);
+
+    response.getContent(&webpage, &webpageLen, &zippedFile);
+    response.setContent(NULL, 0);
+
+    if ( webpage == NULL || !webpageLen )
+    {
+      std::string msg = getHttpHeader( response.getHttpReturnCodeStr().c_str(), 0, false, NULL, false, &response );
+      httpSend(client, (const void*) msg.c_str(), msg.length());
+      keepAlive = false;
+    }
+    else
+    {
+      try
+      {
+        if (zippedFile && client->compression == GZIP)
+        {
+          gzipWebPage = webpage; webpage = NULL;
+          sizeZip = webpageLen;
+        }
+        else if (zippedFile)
+        {
+          gzipWebPage = webpage; webpage = NULL;
+          if ((int)(webpageLen = nvj_gunzip( &webpage, gzipWebPage, webpageLen )) < 0)
+          {
+            NVJ_LOG->append(NVJ_ERROR, "Webserver: gunzip decompression of an asynchronous response failed !");
+            contentOk = false;
+          }
+          free (gzipWebPage); gzipWebPage = NULL;
+        }
+        else if ( client->compression == GZIP && webpageLen > 2048
+               && ( strncmp(response.getMimeType().c_str(), "application", 11) == 0
+                 || strncmp(response.getMimeType().c_str(), "text", 4) == 0 ) )
+        {
+          if ((sizeZip = nvj_gzip( &gzipWebPage, webpage, webpageLen )) < 0)
+          {
+            NVJ_LOG->append(NVJ_ERROR, "Webserver: gzip compression of an asynchronous response failed !");
+            contentOk = false;
+          }
+          else if ((size_t)sizeZip > webpageLen)
+          {
+            free (gzipWebPage); gzipWebPage = NULL;
+            sizeZip = 0;
+          }
+        }
+      }
+      catch(...)
+      {
+        NVJ_LOG->append(NVJ_ERROR, "Webserver: gzip/gunzip of an asynchronous response raised an exception");
+        // the output is freed by nvj_gzip/nvj_gunzip, the input is kept
+        if (zippedFile)
+          webpage = NULL;
+        else
+          gzipWebPage = NULL;
+        contentOk = false;
+      }
+
+      if (!contentOk || (webpage == NULL && gzipWebPage == NULL))
+      {
+        std::string msg = getInternalServerErrorMsg();
+        httpSend(client, (const void*) msg.c_str(), msg.length());
+        keepAlive = false;
+      }
+      else if (sizeZip > 0)
+      {
+        std::string header = getHttpHeader(response.getHttpReturnCodeStr().c_str(), sizeZip, keepAlive, NULL, true, &response);
+        sendOk = httpSend2(client, header.c_str(), header.length(), gzipWebPage, sizeZip);
+      }
+      else
+      {
+        std::string header = getHttpHeader(response.getHttpReturnCodeStr().c_str(), webpageLen, keepAlive, NULL, false, &response);
+        sendOk = httpSend2(client, header.c_str(), header.length(), webpage, webpageLen);
+      }
+
+      if (webpage != NULL) free (webpage);
+      if (gzipWebPage != NULL) free (gzipWebPage);
+    }
+  }
+
+  if (!sendOk)
+    NVJ_LOG->append(NVJ_DEBUG, std::string("Webserver: httpSend failed sending an asynchronous response - err: ") + strerror(errno));
+
+  pthread_mutex_lock( &clientsQueue_mutex );
+  if (keepAlive && sendOk && !exiting)
+  {
+    client->resumed = true;
+    client->enqueueTime = nvj_monotonic_ms();
+    clientsQueue.push(client);
+    client = NULL;
+  }
+  pthread_mutex_unlock( &clientsQueue_mutex );
+
+  if (client == NULL)
+    pthread_cond_signal (& clientsQueue_cond);
+  else
+    freeClientSockData(client);
+
+  removeAsyncCompletion(completion);
+}
+
+/***********************************************************************
+* addAsyncCompletion - hold a completion until its response is sent
+* removeAsyncCompletion - its response is sent
+***********************************************************************/
+
+void WebServer::addAsyncCompletion(HttpAsyncCompletion *completion)
+{
+  completion->retain();
+  pthread_mutex_lock( &asyncCompletions_mutex );
+  asyncCompletions.insert(completion);
+  pthread_mutex_unlock( &asyncCompletions_mutex );
+}
+
+void WebServer::removeAsyncCompletion(HttpAsyncCompletion *completion)
+{
+  pthread_mutex_lock( &asyncCompletions_mutex );
+  asyncCompletions.erase(completion);
+  pthread_cond_broadcast( &asyncCompletions_cond );
+  pthread_mutex_unlock( &asyncCompletions_mutex );
+  completion->release();
+}
+
+/***********************************************************************
+* dropAsyncCompletions - on exit: close the connections still waiting for
+*                        an asynchronous response (complete() and the
+*                        timeout won't send it anymore), and wait for the
+*                        responses being sent
+***********************************************************************/
+
+void WebServer::dropAsyncCompletions()
+{
+  pthread_mutex_lock( &asyncCompletions_mutex );
+
+  for (std::set<HttpAsyncCompletion *>::iterator it=asyncCompletions.begin(); it!=asyncCompletions.end(); )
+  {
+    HttpAsyncCompletion *completion = *it;
+    pthread_mutex_lock(&completion->mutex);
+    bool drop = !completion->sent;
+    completion->sent = true;
+    pthread_mutex_unlock(&completion->mutex);
+
+    if (!drop)
+    {
+      it++;
+      continue;
+    }
+
+    asyncCompletions.erase(it++);
+    freeClientSockData(completion->client);
+    completion->release();
+  }
+
+  while (!asyncCompletions.empty())
+    pthread_cond_wait( &asyncCompletions_cond, &asyncCompletions_mutex );
+
+  pthread_mutex_unlock( &asyncCompletions_mutex );
+}
+
+/***********************************************************************
+* HttpAsyncCompletion::arm - called by the worker once the request has
+*                            been handed over. Sends the response if the
+*                            page has already been completed.
+***********************************************************************/
+
+void HttpAsyncCompletion::arm(WebServer *server, const bool keepAlive, const std::string& sessionId)
+{
+  server->addAsyncCompletion(this); // dropped if the server stops first
+
+  pthread_mutex_lock(&mutex);
+  webServer = server;
+  this->keepAlive = keepAlive;
+  this->sessionId = sessionId;
+  armed = true;
+  bool doSend = completed && !sent;
+  if (doSend) sent = true;
+  pthread_mutex_unlock(&mutex);
+
+  if (doSend)
+    webServer->sendAsyncResponse(this, timedOut);
+
+  release();
+}
+
+/***********************************************************************
+* HttpAsyncCompletion::complete - send the response (from any thread)
+***********************************************************************/
+
+void HttpAsyncCompletion::complete()
+{
+  pthread_mutex_lock(&mutex);
+  bool doSend = armed && !completed && !sent;
+  completed = true;
+  if (doSend) sent = true;
+  AsyncExecutor::TimerId tid = timerId;
+  timerId = 0;
+  pthread_mutex_unlock(&mutex);
+
+  if (tid && AsyncExecutor::getInstance()->cancel(tid))
+    release(); // the timer's reference
+
+  if (doSend)
+    webServer->sendAsyncResponse(this, false);
+
+  release();
+}
+
+/***********************************************************************
+* HttpAsyncCompletion::setTimeout - complete with a status-only
+*                                   response after a delay
+***********************************************************************/
+
+void HttpAsyncCompletion::setTimeout(const unsigned ms, const unsigned httpCode)
+{
+  pthread_mutex_lock(&mutex);
+  if (sent || completed)
+  {
+    pthread_mutex_unlock(&mutex);
+    return;
+  }
+
+  timeoutHttpCode = httpCode;
+  if (timerId && AsyncExecutor::getInstance()->cancel(timerId))
+    refCount--;
+
+  refCount++; // released by onTimeout()
+  AsyncExecutor::TimerId id = timerId = AsyncExecutor::getInstance()->postDelayed(ms, std::bind(&HttpAsyncCompletion::onTimeout, this));
+  pthread_mutex_unlock(&mutex);
+
+  // no timer while the executor is exiting: the timeout is due now
+  if (!id)
+    onTimeout();
+}
+
+/***********************************************************************/
+
+void HttpAsyncCompletion::onTimeout()
+{
+  pthread_mutex_lock(&mutex);
+  timerId = 0;
+  bool doSend = false;
+  if (!completed && !sent)
+  {
+    timedOut = true;
+    completed = true;
+    doSend = armed;
+    if (doSend) sent = true;
+  }
+  pthread_mutex_unlock(&mutex);
+
+  if (doSend)
+    webServer->sendAsyncResponse(this, true);
+
+  release();
+}
+
 /***********************************************************************
 * fatalError:  Print out a system error and exit
 * @param s - error message
@@ -1581,6 +1798,18 @@ u_short WebServer::init()
   if (sslEnabled)
     initialize_ctx(sslCertFile.c_str(), sslCaFile.c_str(), sslCertPwd.c_str());
 
+  compileHostsAcl();
+
+  // Pre-built answer for shed connections (no Date header: it is sent as is)
+  serviceUnavailableMsg = "HTTP/1.1 503 Service Unavailable\r\n" + webServerName + "\r\n";
+  if (shedRetryAfterInSecond)
+  {
+    char retryAfter[32];
+    snprintf(retryAfter, sizeof(retryAfter), "Retry-After: %u\r\n", (unsigned)shedRetryAfterInSecond);
+    serviceUnavailableMsg += retryAfter;
+  }
+  serviceUnavailableMsg += "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
   struct addrinfo  hints;
   struct addrinfo *result, *rp;
 
@@ -1602,7 +1831,9 @@ u_short WebServer::init()
 
   for (rp = result; rp != NULL && nbServerSock < sizeof(server_sock)/sizeof(int) ; rp = rp->ai_next)
   {
-    if ( (server_sock[ nbServerSock ] = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol)) == -1 ) continue;
+    int sock = socket( rp->ai_family, rp->ai_socktype, rp->ai_protocol );
+    if ( sock == -1 ) continue;
+    server_sock[ nbServerSock ] = sock;
 
     setSocketReuseAddr(server_sock [ nbServerSock ]);
 
@@ -1783,20 +2014,10 @@ void WebServer::initialize_ctx(const char *certfile, const char *cafile, const c
      
 /**********************************************************************/
 
-bool WebServer::isAuthorizedDN(const std::string str)
-{
-  bool res = false;
-  for( std::vector<std::string>::const_iterator i=authDnList.begin(); i!=authDnList.end() && !res; i++)
-    res = (*i == str);
-  return res;
-}
-
-/**********************************************************************/
-
 void WebServer::poolThreadProcessing()
 {
-  X509 *peer=NULL;
   bool authSSL=false;
+  HttpRequestHeaders requestExtraHeaders;
 
   sigset_t set;
   sigemptyset(&set);
@@ -1815,8 +2036,34 @@ void WebServer::poolThreadProcessing()
     // clientsQueue is not empty
     ClientSockData* client = clientsQueue.front();
     clientsQueue.pop();
+
+    if (!client->resumed && isClientTooOld(client, nvj_monotonic_ms()))
+    {
+      shedConnectionsCount++;
+      pthread_mutex_unlock( &clientsQueue_mutex );
+      shedConnection(client->socketId);
+      IpRateLimiter::releaseConnection(client->rateLimiterEntry);
+      free(client);
+      continue;
+    }
+
+    if (client->resumed)
+    {
+      // keep-alive connection coming back after an asynchronous response
+      pthread_mutex_unlock( &clientsQueue_mutex );
+      client->resumed = false;
+      restoreRecvBuffer(client);
+      if (accept_request(client, true, requestExtraHeaders))
+        freeClientSockData (client);
+      continue;
+    }
+
+    // the TLS handshakes run concurrently
+    pthread_mutex_unlock( &clientsQueue_mutex );
+
     client->bio = NULL;
     client->ssl = NULL;
+    authSSL = false;
 
     if (sslEnabled)
     {
@@ -1826,7 +2073,6 @@ void WebServer::poolThreadProcessing()
       {
         NVJ_LOG->append(NVJ_DEBUG,"BIO_new_socket failed !");
         freeClientSockData(client);
-        pthread_mutex_unlock( &clientsQueue_mutex );
         continue;
       }
 
@@ -1835,7 +2081,6 @@ void WebServer::poolThreadProcessing()
         NVJ_LOG->append(NVJ_DEBUG,"SSL_new failed !");
         BIO_free(bio);
         freeClientSockData(client);
-        pthread_mutex_unlock( &clientsQueue_mutex );
         continue;
       }
 
@@ -1851,29 +2096,17 @@ void WebServer::poolThreadProcessing()
         if (sslmsg != NULL) msg+=": "+std::string(sslmsg);
         NVJ_LOG->append(NVJ_DEBUG,msg);
         freeClientSockData(client);
-        pthread_mutex_unlock( &clientsQueue_mutex );
         continue;
       }
 
       if ( authPeerSsl )
       {
-        if ( (peer = SSL_get_peer_certificate(client->ssl)) != NULL )
+        // The client sent a certificate which verified OK, with an authorized DN
+        time_t t = time ( NULL ), previous;
+        if ( (client->peerDN = peerDnAuthorizer.authorize(client->ssl, t, previous)) != NULL )
         {
-          if (SSL_get_verify_result(client->ssl) == X509_V_OK)
-          {
-            // The client sent a certificate which verified OK
-            char *str = X509_NAME_oneline(X509_get_subject_name(peer), 0, 0);                  
-
-            if ((authSSL=isAuthorizedDN(str)) == true)
-            {
-              authSSL=true;
-              client->peerDN = new std::string(str);
-              updatePeerDnHistory(*(client->peerDN));
-            }
-
-            free (str);                           
-            X509_free(peer);
-          }
+          authSSL=true;
+          logPeerDn(*(client->peerDN), t, previous);
         }
       }
       else
@@ -1893,16 +2126,13 @@ void WebServer::poolThreadProcessing()
         std::string msg = getHttpHeader( "403 Forbidden Client Certificate Required", 0, false);
         httpSend(client, (const void*) msg.c_str(), msg.length());
         freeClientSockData(client);
-        pthread_mutex_unlock( &clientsQueue_mutex );
         continue;
       }
     }
 
-    pthread_mutex_unlock( &clientsQueue_mutex );
-
     setSocketTcpNoDelay(client->socketId, true);
 
-    if (accept_request(client, authSSL))
+    if (accept_request(client, authSSL, requestExtraHeaders))
       freeClientSockData (client);
   }
   pthread_mutex_lock( &clientsQueue_mutex );
@@ -1960,7 +2190,7 @@ void WebServer::threadProcessing()
   ushort port=init();
 
   initPoolThreads();
-  httpdAuth = authLoginPwdList.size() ;
+  httpdAuth = !credentials.empty();
 
   char buf[300]; snprintf(buf, 300, "WebServer : Listen on port %d", port);
   NVJ_LOG->append(NVJ_DEBUG,buf);
@@ -2012,8 +2242,7 @@ void WebServer::threadProcessing()
 
       if (exiting) { close(pfd[idx].fd); break; };
     
-      if ( hostsAllowed.size() 
-        && !isIpBelongToIpNetwork(webClientAddr, hostsAllowed ) )
+      if ( !isHostAllowed(webClientAddr) )
         {
           shutdown (client_sock, SHUT_RDWR);      
           close(client_sock);
@@ -2027,6 +2256,15 @@ void WebServer::threadProcessing()
         NVJ_LOG->appendUniq(NVJ_ERROR, "WebServer : An error occurred when attempting to access the socket (accept == -1)");
       else
       {
+        IpRateLimiterEntry *rateLimiterEntry=NULL;
+        if ( ipRateLimiter != NULL && !ipRateLimiter->acquireConnection(webClientAddr, &rateLimiterEntry) )
+        {
+          // too many connections from this client: refuse it before any allocation
+          shutdown (client_sock, SHUT_RDWR);
+          close(client_sock);
+          continue;
+        }
+
         if (socketTimeoutInSecond)
           if (!setSocketSndRcvTimeout(client_sock, socketTimeoutInSecond, 0))
             NVJ_LOG->appendUniq(NVJ_ERROR, std::string("WebServer : setSocketSndRcvTimeout error - ") + strerror(errno) );
@@ -2040,9 +2278,24 @@ void WebServer::threadProcessing()
         client->ssl=NULL;
         client->bio=NULL;
         client->peerDN=NULL;
+        client->resumed=false;
+        client->keepAliveLeft=KEEPALIVE_MAX_NB_QUERY;
+        client->recvBuffer=NULL;
+        client->enqueueTime=nvj_monotonic_ms();
+        client->rateLimiterEntry=rateLimiterEntry;
         //pthread_mutex_init ( &client->client_mutex, NULL );
 
         pthread_mutex_lock( &clientsQueue_mutex );
+        if ( clientsQueueMaxDepth && clientsQueue.size() >= clientsQueueMaxDepth )
+        {
+          // every worker is busy and the backlog is full: answer now rather than time out later
+          shedConnectionsCount++;
+          pthread_mutex_unlock( &clientsQueue_mutex );
+          shedConnection(client_sock);
+          IpRateLimiter::releaseConnection(rateLimiterEntry);
+          free(client);
+          continue;
+        }
         clientsQueue.push(client);
         pthread_mutex_unlock( &clientsQueue_mutex );
         pthread_cond_signal (& clientsQueue_cond);
@@ -2059,6 +2312,12 @@ void WebServer::threadProcessing()
   // Exiting...
   free (pfd);
 
+  // the asynchronous responses not sent yet
+  dropAsyncCompletions();
+
+  if (HttpSession::isSnapshotEnabled())
+    HttpSession::snapshot();
+
   pthread_mutex_destroy(&clientsQueue_mutex);
 }
 
@@ -2081,97 +2340,90 @@ void WebServer::closeSocket(ClientSockData* client)
 }
 
 /***********************************************************************
-* base64_decode & base64_encode
-  thanks to  René Nyffenegger rene.nyffenegger@adp-gmbh.ch for his
-  public implementation of this algorithm
-*
-************************************************************************/
+* compileHostsAcl: build the prefix trie of the allowed/denied networks
+***********************************************************************/
 
-std::string WebServer::base64_decode(const std::string& encoded_string)
+void WebServer::compileHostsAcl()
 {
-             
-  int in_len = encoded_string.size();
-  int i = 0;
-  int j = 0;
-  int in_ = 0;
-  unsigned char char_array_4[4], char_array_3[3];
-  std::string ret;
-
-  while (in_len-- && ( encoded_string[in_] != '=') && is_base64(encoded_string[in_]))
+  hostsAcl.clear();
+
+  for (std::vector<IpNetwork>::const_iterator i=hostsAllowed.begin(); i!=hostsAllowed.end(); i++)
+    hostsAcl.add(*i, HOST_ALLOWED);
+
+  for (std::vector<IpNetwork>::const_iterator i=hostsDenied.begin(); i!=hostsDenied.end(); i++)
+    hostsAcl.add(*i, HOST_DENIED);
+}
+
+/***********************************************************************
+* isClientTooOld: CoDel-style queue-wait deadline, called with
+*   clientsQueue_mutex held for each connection leaving the queue.
+* @param client: the dequeued connection
+* @param now: the monotonic time in ms
+* \return true if the connection must be shed
+***********************************************************************/
+
+bool WebServer::isClientTooOld(const ClientSockData* client, const unsigned long long now)
+{
+  if (!clientsQueueTargetDelay)
+    return false;
+
+  unsigned long long sojourn = now > client->enqueueTime ? now - client->enqueueTime : 0;
+
+  if (sojourn < clientsQueueTargetDelay || clientsQueue.empty())
   {
-    char_array_4[i++] = encoded_string[in_]; in_++;
-    if (i ==4) {
-      for (i = 0; i <4; i++)
-        char_array_4[i] = base64_chars.find(char_array_4[i]);
-
-      char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-      char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-      char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
-
-      for (i = 0; (i < 3); i++)
-        ret += char_array_3[i];
-      i = 0;
-    }
+    // the delay is back under the target, or the backlog has been drained
+    clientsQueueFirstAboveTime = 0;
+    clientsQueueDropping = false;
+    return false;
   }
 
-  if (i)
+  if (!clientsQueueFirstAboveTime)
+    clientsQueueFirstAboveTime = now + clientsQueueInterval;
+  else if (now >= clientsQueueFirstAboveTime)
   {
-    for (j = i; j <4; j++)
-      char_array_4[j] = 0;
+    if (!clientsQueueDropping)
+      NVJ_LOG->append(NVJ_WARNING, "WebServer : clients queue delay above the target, shedding connections");
+    clientsQueueDropping = true;
+  }
 
-    for (j = 0; j <4; j++)
-      char_array_4[j] = base64_chars.find(char_array_4[j]);
+  return clientsQueueDropping;
+}
 
-    char_array_3[0] = (char_array_4[0] << 2) + ((char_array_4[1] & 0x30) >> 4);
-    char_array_3[1] = ((char_array_4[1] & 0xf) << 4) + ((char_array_4[2] & 0x3c) >> 2);
-    char_array_3[2] = ((char_array_4[2] & 0x3) << 6) + char_array_4[3];
+/***********************************************************************
+* shedConnection: answer a connection refused for overload and close it.
+*   Never blocks: the 503 is dropped if the socket buffer is full.
+* @param socketId: the accepted socket
+***********************************************************************/
 
-    for (j = 0; (j < i - 1); j++) ret += char_array_3[j];
+void WebServer::shedConnection(const int socketId)
+{
+  if (shedWithServiceUnavailable && !sslEnabled)
+  {
+    if (send(socketId, serviceUnavailableMsg.c_str(), serviceUnavailableMsg.length(), MSG_DONTWAIT | MSG_NOSIGNAL) > 0)
+    {
+      // read what the client already sent, so that close() does not reset the connection
+      char drain[4096];
+      shutdown(socketId, SHUT_WR);
+      for (int i=0; i<4 && recv(socketId, drain, sizeof(drain), MSG_DONTWAIT) > 0; i++);
+    }
   }
+  shutdown(socketId, SHUT_RDWR);
+  close(socketId);
+}
+
+/***********************************************************************
+* base64_decode & base64_encode (see nvjBase64.h)
+*
+************************************************************************/
 
-  return ret;
+std::string WebServer::base64_decode(const std::string& encoded_string)
+{
+  return nvj_base64_decode(encoded_string);
 }
              
 std::string WebServer::base64_encode(unsigned char const* bytes_to_encode, unsigned int in_len)
 {
-  std::string ret;
-  int i = 0;
-  int j = 0;
-  unsigned char char_array_3[3];
-  unsigned char char_array_4[4];
-
-  while (in_len--) {
-    char_array_3[i++] = *(bytes_to_encode++);
-    if (i == 3) {
-      char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-      char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-      char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-      char_array_4[3] = char_array_3[2] & 0x3f;
-
-      for(i = 0; (i <4) ; i++)
-        ret += base64_chars[char_array_4[i]];
-      i = 0;
-    }
-  }
-
-  if (i)
-  {
-    for(j = i; j < 3; j++)
-      char_array_3[j] = '\0';
-
-    char_array_4[0] = (char_array_3[0] & 0xfc) >> 2;
-    char_array_4[1] = ((char_array_3[0] & 0x03) << 4) + ((char_array_3[1] & 0xf0) >> 4);
-    char_array_4[2] = ((char_array_3[1] & 0x0f) << 2) + ((char_array_3[2] & 0xc0) >> 6);
-    char_array_4[3] = char_array_3[2] & 0x3f;
-
-    for (j = 0; (j < i + 1); j++)
-      ret += base64_chars[char_array_4[j]];
-
-    while((i++ < 3))
-      ret += '=';
-
-  }
-  return ret;
+  return nvj_base64_encode(bytes_to_encode, in_len);
 }
 
 /***********************************************************************
@@ -2239,17 +2491,19 @@ std::string WebServer::generateWebSocketServerKey(std::string webSocketKey)
          input.size(),
          hash);
 
-    return base64_encode(hash, SHA_DIGEST_LENGTH);
+    char key[(SHA_DIGEST_LENGTH + 2) / 3 * 4];
+    return std::string(key, nvj_base64_encode(hash, SHA_DIGEST_LENGTH, key));
 }
 
 
 /***********************************************************************
 * getHttpWebSocketHeader: generate HTTP header
 * @param messageType - client socket descriptor
+* @param webSocketDeflate - the permessage-deflate parameters accepted, or NULL
 * \return the header
 ***********************************************************************/
 
-std::string WebServer::getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const bool webSocketDeflate)
+std::string WebServer::getHttpWebSocketHeader(const char *messageType, const char* webSocketClientKey, const WebSocketDeflateParams *webSocketDeflate)
 {
   char timeBuf[200];
   time_t rawtime;
@@ -2268,8 +2522,8 @@ std::string WebServer::getHttpWebSocketHeader(const char *messageType, const cha
 
   header+="Sec-WebSocket-Accept: "+generateWebSocketServerKey(webSocketClientKey)+"\r\n";
   
-  if (webSocketDeflate)
-    header+="Sec-WebSocket-Extensions: permessage-deflate\r\n"; //x-webkit-deflate-frame
+  if (webSocketDeflate != NULL)
+    header+="Sec-WebSocket-Extensions: "+webSocketDeflate->getResponse()+"\r\n";
    
   header+= "\r\n";
 
@@ -12,479 +12,1116 @@
  */
 //********************************************************
 
+#include <limits.h>
+#include <sys/uio.h>
+
 #include "libnavajo/nvjSocket.h"
 #include "libnavajo/htonll.h"
+#include "libnavajo/nvjWebSocketMask.h"
+#include "libnavajo/nvjTime.h"
+#include "libnavajo/BufferPool.hh"
 #include "libnavajo/WebSocket.hh"
+#include "libnavajo/WebSocketEngine.hh"
 #include "libnavajo/WebServer.hh"
 
-#define BUFSIZE 32768
+// Messages waiting for the callbacks before the connection stops being read
+#define WEBSOCKETCLIENT_MAX_RECEIVED_MESSAGES 64
+// Delay added to the websocket timeout before a blocked sending closes the connection
+#define WEBSOCKETCLIENT_SEND_RETRY_TIMEOUT 10000
+// Bytes of queued frames taken together for a send
+#define WEBSOCKETCLIENT_SENDING_BUDGET 65536
 
 
 /***********************************************************************/
 
-WebSocketClient::WebSocketClient(WebSocket *ws, HttpRequest *req): websocket(ws), request(req), closing(false)
+WebSocketClient::WebSocketClient(WebSocket *ws, HttpRequest *req, const WebSocketDeflateParams *deflate):
+  gzipcontext(NULL), deflateParams(deflate != NULL ? *deflate : WebSocketDeflateParams()),
+  deflateMemory(deflate != NULL ? deflate->getMemoryCost() : 0), compressionThreshold(ws->getCompressionThreshold()),
+  deflateReset(false), sendCompressed(false), sendingFragmented(false), sharedFragmented(false),
+  sharedReceived(false), websocket(ws), request(req),
+  closing(false), flushBeforeClose(false), refCount(1), wakeupPending(false), ioThread(NULL),
+  registered(false), disconnected(false), events(0),
+  recvStep(HEADER), recvHeaderLen(0), fin(false), recvCompressed(false), rsv(0), opcode(0),
+  msgLength(0), msgReceived(0), recvMsg(NULL), fragmentedMsg(NULL),
+  maxMessageSize(ws->getMaxMessageSize()),
+  dispatching(false), closingNotified(false), readingPaused(false), readingStopped(false),
+  sendingFirst(0), sendingCount(0), sendingOffset(0), sendingBytes(0), sendingBlockedSince(0)
 {
   snd_maxLatency=ws->getClientSendingMaxLatency();
+  snd_timeout=ws->getWebsocketTimeoutInMilliSecond() + WEBSOCKETCLIENT_SEND_RETRY_TIMEOUT;
   pthread_mutex_init(&sendingQueueMutex, NULL);
-  pthread_cond_init(&sendingNotification, NULL);
-  gzipcontext.dictInfLength = 0;
-  nvj_init_stream(&(gzipcontext.strm_deflate), true);
+  pthread_mutex_init(&receivedQueueMutex, NULL);
+  memset( msgKeys, 0, 4*sizeof(unsigned char) );
+  memset( recvHeader, 0, sizeof(recvHeader) );
   noSessionExpiration(request);
-  startWebSocketThreads();
+
+  ClientSockData* client = request->getClientSockData();
+
+  if (! setSocketNonBlocking(client->socketId))
+  {
+    NVJ_LOG->appendUniq(NVJ_ERROR, "WebSocketClient : setSocketNonBlocking error");
+    closing=true;
+  }
+
+  if (! websocket->isUsingNaggleAlgo())
+    if (! setSocketNagleAlgo(client->socketId, false)) // Disable Naggle Algorithm
+    {
+      NVJ_LOG->appendUniq(NVJ_ERROR, "WebSocketClient : setSocketNagleAlgo error");
+      closing=true;
+    }
+
+  if (client->ssl != NULL)
+    SSL_set_mode(client->ssl, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+  WebSocketEngine::getInstance()->attach(this);
 };
 
 /***********************************************************************/
 
-void WebSocketClient::sendingThread()
+WebSocketClient::~WebSocketClient()
 {
-  pthread_mutex_lock(&sendingQueueMutex);
-
-  for (;;)
+  freeSendingQueue();
+  while (!receivedQueue.empty())
   {
-    while (sendingQueue.empty() && !closing)
-      pthread_cond_wait(&sendingNotification, &sendingQueueMutex);
+    freeMessage(receivedQueue.front());
+    receivedQueue.pop();
+  }
+  freeSendingFrames();
+  if (recvMsg != NULL) freeMessage(recvMsg);
+  if (fragmentedMsg != NULL) freeMessage(fragmentedMsg);
+  if (gzipcontext != NULL)
+  {
+    if (gzipcontext->deflateReady)
+      nvj_end_stream(&(gzipcontext->strm_deflate));
+    if (gzipcontext->inflateReady)
+      nvj_end_inflate_stream(&(gzipcontext->strm_inflate));
+    delete gzipcontext;
+  }
+  WebSocketDeflateParams::releaseMemory(deflateMemory);
+  pthread_mutex_destroy(&sendingQueueMutex);
+  pthread_mutex_destroy(&receivedQueueMutex);
+}
 
-    if (closing) break;
+/***********************************************************************/
+/**
+* release - drop a reference, the last one closes the socket and frees
+*           the client
+*/
 
-    MessageContent *msg = sendingQueue.front();
-    sendingQueue.pop();
-    pthread_mutex_unlock(&sendingQueueMutex);
+void WebSocketClient::release()
+{
+  if (--refCount)
+    return;
+
+  WebSocket *ws = websocket;
+  WebServer::freeClientSockData( request->getClientSockData() );
+  restoreSessionExpiration(request);
+  delete request;
+  delete this;
+  ws->clientReleased();
+}
 
-    long long msgLatency = (unsigned long long)( std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count() - msg->date_ms );
-    
-    if ( msgLatency > snd_maxLatency || !sendMessage(msg))
+/***********************************************************************/
+/**
+* recvSome - read the bytes available, without blocking
+* \return the number of bytes read, 0 if none is available, -1 if the
+*         connection is closed
+*/
+
+ssize_t WebSocketClient::recvSome(char *buffer, size_t length)
+{
+  ClientSockData* client = request->getClientSockData();
+
+  if (client->recvBuffer != NULL)
+  {
+    // the bytes read ahead with the handshake come first
+    size_t n = std::min(length, client->recvBuffer->size());
+    memcpy(buffer, client->recvBuffer->data(), n);
+    client->recvBuffer->erase(0, n);
+    if (client->recvBuffer->empty())
     {
-      free(msg->message);
-      free(msg);
-      closeSend();
-      return;
+      delete client->recvBuffer;
+      client->recvBuffer = NULL;
     }
-    free(msg->message);
-    free(msg);
-    pthread_mutex_lock(&sendingQueueMutex);
+    return n;
   }
 
-  freeSendingQueue();
+  if (client->bio != NULL && client->ssl != NULL)
+  {
+    // through the buffering BIO of the handshake, which may hold some bytes
+    ERR_clear_error(); // the error queue of the thread is shared by the connections
+    int n=BIO_read(client->bio, buffer, (int)std::min(length, (size_t)INT_MAX));
+    if (n > 0)
+      return n;
+    return BIO_should_retry(client->bio) ? 0 : -1;
+  }
 
-  pthread_mutex_unlock(&sendingQueueMutex);
+  ssize_t n=recv(client->socketId, buffer, length, 0);
+  if (n > 0)
+    return n;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  return -1;
 }
 
 /***********************************************************************/
+/**
+* sendSome - write what the socket accepts, without blocking
+* \return the number of bytes written, 0 if the socket is full, -1 on error
+*/
 
-void WebSocketClient::receivingThread()
+ssize_t WebSocketClient::sendSome(const void *buffer, size_t length)
 {
-  char bufferRecv[BUFSIZE];
-  u_int64_t msgLength=0, msgContentIt=0;
-  bool msgMask=false;
+  ClientSockData* client = request->getClientSockData();
 
-  unsigned char msgKeys[4];
-  unsigned char* msgContent = NULL;
-  enum MsgDecodSteps { FIRSTBYTE, LENGTH, MASK, CONTENT };
+  if (client->bio != NULL && client->ssl != NULL)
+  {
+    ERR_clear_error();
+    int n=SSL_write(client->ssl, buffer, (int)std::min(length, (size_t)INT_MAX));
+    if (n > 0)
+      return n;
+    int err=SSL_get_error(client->ssl, n);
+    return (err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) ? 0 : -1;
+  }
 
-  ClientSockData* client = request->getClientSockData();
+  ssize_t n=sendCompat(client->socketId, buffer, length, MSG_NOSIGNAL);
+  if (n >= 0)
+    return n;
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
 
-  // Fragmented message
-  bool fragmented = false;
-  unsigned char fragmentedOpcode = 0;
-  std::vector<unsigned char> fragmentedPayload;
+/***********************************************************************/
+/**
+* messagePool - the blocks of the messages, shared by the clients. Never
+*               freed: a client may be released after the static objects
+*               destruction.
+*/
 
-  if ( websocket->getWebsocketTimeoutInMilliSecond()
-     && !setSocketSndRcvTimeout(client->socketId, 0, websocket->getWebsocketTimeoutInMilliSecond()) )
-  { // Reduce socket timeout
-    NVJ_LOG->appendUniq(NVJ_ERROR, "WebSocketClient : setSocketSndRcvTimeout error");
-    closeRecv();
-    return;
-  }
+static BufferPool *messagePool()
+{
+  static BufferPool *pool = new BufferPool;
+  return pool;
+}
 
-  if (! websocket->isUsingNaggleAlgo())
-    if (! setSocketNagleAlgo(client->socketId, false)) // Disable Naggle Algorithm
+/***********************************************************************/
+/**
+* allocMessage - get a message with its payload inline, from the pool
+* \return the message, or NULL if the allocation failed
+*/
+
+WebSocketClient::MessageContent *WebSocketClient::allocMessage(const u_int8_t opcode, const size_t length)
+{
+  if (length > SSIZE_MAX - sizeof(MessageContent))
+    return NULL;
+
+  size_t capacity;
+  MessageContent *msg = (MessageContent*)messagePool()->allocate(sizeof(MessageContent) + length, capacity);
+  if (msg == NULL)
+    return NULL;
+
+  msg->opcode = opcode;
+  msg->message = inlinePayload(msg);
+  msg->length = length;
+  msg->fin = true;
+  msg->date_ms = 0;
+  msg->frame = NULL;
+  msg->capacity = capacity;
+  return msg;
+}
+
+/***********************************************************************/
+/**
+* appendMessage - add a fragment at the end of a message payload
+* \return false if the allocation failed
+*/
+
+bool WebSocketClient::appendMessage(MessageContent *msg, const unsigned char *data, const size_t length)
+{
+  if (!length)
+    return true;
+
+  unsigned char *payload = inlinePayload(msg);
+  if (msg->message != payload || sizeof(MessageContent) + msg->length + length > msg->capacity)
+  {
+    // too large for its block: moved to the heap
+    if (msg->message == payload)
     {
-      NVJ_LOG->appendUniq(NVJ_ERROR, "WebSocketClient : setSocketNagleAlgo error");
-      closeRecv();
-      return;
+      if ((payload = (unsigned char*)malloc(msg->length + length)) != NULL)
+        memcpy(payload, msg->message, msg->length);
     }
+    else
+      payload = (unsigned char*)realloc(msg->message, msg->length + length);
 
-  bool fin=false;
-  unsigned char rsv=0, opcode=0;
-  u_int64_t readLength=1;
-  MsgDecodSteps step=FIRSTBYTE;
-  memset( msgKeys, 0, 4*sizeof(unsigned char) );
+    if (payload == NULL)
+      return false;
+    msg->message = payload;
+  }
+
+  memcpy(msg->message + msg->length, data, length);
+  msg->length += length;
+  return true;
+}
 
-  for (;!closing;)
+/***********************************************************************/
+
+void WebSocketClient::freeMessage(MessageContent *msg)
+{
+  if (msg->message != NULL && msg->message != inlinePayload(msg))
+    free(msg->message);
+  if (msg->frame != NULL)
+    msg->frame->release();
+  messagePool()->release(msg, msg->capacity);
+}
+
+/***********************************************************************/
+/**
+* readInput - decode the frames received, until the socket is empty
+*             (I/O thread)
+* @param buffer: the buffer of the I/O thread
+* \return false if the connection must be closed
+*/
+
+bool WebSocketClient::readInput(char *buffer, size_t bufferSize)
+{
+  ClientSockData* client = request->getClientSockData();
+  readingStopped = false;
+
+  for (;;)
   {
-    int n=0;
-    size_t it=0;
-    size_t length=readLength;
+    if (readingPaused || recvStep == CLOSED)
+    {
+      // some bytes may remain in the buffers: read again when resumed
+      readingStopped = true;
+      return true;
+    }
 
-    if (length > BUFSIZE)
+    // without TLS nor bytes read ahead, a short read empties the socket
+    bool plain = client->bio == NULL && client->recvBuffer == NULL;
+    size_t requested;
+    ssize_t n;
+
+    if (recvStep == PAYLOAD && recvMsg != NULL && msgLength - msgReceived >= bufferSize / 2)
+    {
+      // a large payload is received in place, then unmasked
+      unsigned char *payload = recvMsg->message + msgReceived;
+      requested = (size_t)std::min(msgLength - msgReceived, (u_int64_t)SSIZE_MAX);
+      if ((n=recvSome((char*)payload, requested)) <= 0)
+        return n == 0;
+
+      nvj_ws_unmask(payload, payload, n, msgKeys, msgReceived);
+      msgReceived += n;
+      if (msgReceived == msgLength && !frameReceived())
+        return false;
+    }
+    else
     {
-      length=BUFSIZE;
-      readLength-=BUFSIZE;
+      // as many frames as received, after the beginning of header kept
+      memcpy(buffer, recvHeader, recvHeaderLen);
+      requested = bufferSize - recvHeaderLen;
+      if ((n=recvSome(buffer + recvHeaderLen, requested)) <= 0)
+        return n == 0;
+
+      size_t length = recvHeaderLen + n;
+      ssize_t left = parseFrames((unsigned char*)buffer, length);
+      if (left < 0)
+        return false;
+      memcpy(recvHeader, buffer + length - left, left);
+      recvHeaderLen = left;
     }
 
-    do
+    if (plain && (size_t)n < requested)
+      return true;
+  }
+}
+
+/***********************************************************************/
+/**
+* parseFrames - decode the frames of the bytes received (I/O thread)
+* \return the number of bytes left (the beginning of a header), or -1 on
+*         protocol error
+*/
+
+ssize_t WebSocketClient::parseFrames(const unsigned char *data, size_t length)
+{
+  const unsigned char *p = data, *end = data + length;
+
+  while (p < end && recvStep != CLOSED)
+  {
+    if (recvStep == HEADER)
     {
-      if (client->bio != NULL && client->ssl != NULL)
+      size_t available = end - p;
+      if (available < 2)
+        break;
+
+      if (!(p[1] & 0x80))
+        return -1; // the client frames must be masked
+
+      size_t extLength = (p[1] & 0x7f) == 126 ? 2 : ((p[1] & 0x7f) == 127 ? 8 : 0);
+      if (available < 2 + extLength + 4)
+        break;
+
+      fin = (p[0] & 0x80) != 0;
+      rsv = (p[0] & 0x70) >> 4;
+      opcode = p[0] & 0x0f;
+      msgLength = p[1] & 0x7f;
+      if (extLength == 2)
+      {
+        u_int16_t len;
+        memcpy(&len, p+2, 2);
+        msgLength = ntohs(len);
+      }
+      else if (extLength == 8)
       {
-        n=BIO_read(client->bio, bufferRecv+it, length-it);
+        u_int64_t len;
+        memcpy(&len, p+2, 8);
+        msgLength = ntohll(len);
+      }
+      memcpy(msgKeys, p + 2 + extLength, 4);
+      p += 2 + extLength + 4;
 
-        if (SSL_get_error(client->ssl,n) == SSL_ERROR_ZERO_RETURN)
-          closing=true;
-        if ( (n==0) || (n==-1) )
-          continue;
+      if (NVJ_LOG->isDebugMode())
+      {
+        char buf[300]; snprintf(buf, 300, "WebSocket: new message received (len=%llu fin=%d rsv=%d opcode=%d mask=1)",
+                                static_cast<unsigned long long>(msgLength), fin, rsv, opcode);
+        NVJ_LOG->append(NVJ_DEBUG,buf);
       }
-      else
+
+      if ((opcode == 0x8 || opcode == 0x9 || opcode == 0xa) && (!fin || msgLength > 125))
       {
-        n=recv(client->socketId, bufferRecv+it, length-it, 0);
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: invalid control frame");
+        return -1;
+      }
 
-        if ( n <= 0 )
-        {
-          if ( errno==ENOTCONN || errno==EBADF || errno==ECONNRESET )
-            closing=true;
-          continue;
-        }
+      // RSV1: a compressed message, set on its first frame only (rfc7692 6)
+      if ((rsv & 0x3) || ((rsv & 0x4) && (request->getClientSockData()->compression != ZLIB || opcode == 0x0 || opcode >= 0x8)))
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: invalid RSV bits");
+        return -1;
       }
+      if (opcode == 0x1 || opcode == 0x2)
+        recvCompressed = (rsv & 0x4) != 0;
 
-      it += n;
+      if (opcode < 0x8 && isTooLarge(msgLength))
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: message received too large");
+        failConnection(1009);
+        break;
+      }
+
+      msgReceived = 0;
+      recvStep = PAYLOAD;
+      if (msgLength > (u_int64_t)SSIZE_MAX || (recvMsg = allocMessage(opcode, (size_t)msgLength)) == NULL)
+      {
+        char logBuffer[500];
+        snprintf(logBuffer, 500, " Websocket: Message content allocation failed (length: %llu)", static_cast<unsigned long long>(msgLength));
+        NVJ_LOG->append(NVJ_WARNING, logBuffer);
+      }
     }
-    while (it != length && !closing);
 
-    if (closing) continue;
+    // the unmasking is the copy out of the buffer
+    size_t length = (size_t)std::min((u_int64_t)(end - p), msgLength - msgReceived);
+    if (recvMsg != NULL)
+      nvj_ws_unmask(recvMsg->message + msgReceived, p, length, msgKeys, msgReceived);
+    p += length;
+    msgReceived += length;
 
-    // Decode message header
-    switch(step)
-    {
-      case FIRSTBYTE:
-        fin=(bufferRecv[0] & 0x80) >> 7;
-        rsv=(bufferRecv[0] & 0x70) >> 4;
-        opcode=bufferRecv[0] & 0xf;
+    if (msgReceived == msgLength && !frameReceived())
+      return -1;
+  }
 
-        step=LENGTH;
-        readLength=1;
-        break;
+  return recvStep == CLOSED ? 0 : end - p;
+}
 
-      case LENGTH:
-        if (!msgLength)
-        {
-          msgMask = (bufferRecv[0]  & 0x80) >> 7;
-          if (!msgMask)
-          {
-            closeRecv();
-            return;
-          }
-
-          msgLength =  bufferRecv[0] & 0x7f;
-          if (msgLength == 0)
-          {
-            msgContent = NULL;
-            msgContentIt = 0;
-            step = CONTENT;
-            readLength = 0;
-            break;
-          }
-          if (msgLength == 126) { readLength=2; break; }
-          if (msgLength == 127) { readLength=8; break; }
-        }
-        else
-        {
-          if (msgLength == 126)
-          {
-            u_int16_t *tmp=(u_int16_t*)bufferRecv;
-            msgLength=ntohs(*tmp);
-          }
-          if (msgLength == 127)
-          {
-            u_int64_t *tmp=(u_int64_t*)bufferRecv;
-            msgLength=ntohll(*tmp);
-          }
-        }
-        
-        if ( (msgContent = (unsigned char*)malloc(msgLength*sizeof(unsigned char))) == NULL )
-        {
-          char logBuffer[500];
-          snprintf(logBuffer, 500, " Websocket: Message content allocation failed (length: %llu)", static_cast<unsigned long long>(msgLength));
-          NVJ_LOG->append(NVJ_WARNING, logBuffer);
-          msgContent=NULL;
-        }
-        msgContentIt=0;
-        if (msgMask) { step=MASK; readLength=4; } else { step=CONTENT; readLength=msgLength; }
-        break;
+/***********************************************************************/
+/**
+* frameReceived - a frame is complete: reassemble the fragmented
+*                 messages and give the messages to the callbacks
+* \return false on protocol error
+*/
 
-      case MASK:
-        memcpy(msgKeys, bufferRecv, 4*sizeof(unsigned char));
-        readLength=msgLength;
-        step=CONTENT;
-        break;
+bool WebSocketClient::frameReceived()
+{
+  ClientSockData* client = request->getClientSockData();
 
-      case CONTENT:
-        char buf[300]; snprintf(buf, 300, "WebSocket: new message received (len=%llu fin=%d rsv=%d opcode=%d mask=%d)",
-                                static_cast<unsigned long long>(msgLength), fin, rsv, opcode, msgMask);
-        NVJ_LOG->append(NVJ_DEBUG,buf);
-        if (msgContent != NULL)
-        {
-          for (size_t i=0; i<length; i++)
-          {
-            if (msgMask)
-              msgContent[msgContentIt] = bufferRecv[i] ^ msgKeys[msgContentIt % 4];
-            else msgContent[msgContentIt] = bufferRecv[i];
-
-            msgContentIt++;
-          }
-        }
+  MessageContent *msg = recvMsg;
+  recvMsg = NULL;
+  recvStep = HEADER;
 
-        if (msgContentIt == msgLength)
-        {
-          if (msgContent != NULL && (client->compression == ZLIB) && (rsv & 4) )
-          {
-            try
-            {
-              unsigned char *msg = NULL;
-              size_t msgLen=nvj_gunzip_websocket_v2( &msg, msgContent, msgLength, true, gzipcontext.z_dictionary_inflate, &(gzipcontext.dictInfLength) );
-              free(msgContent);
-              msgContent=msg;
-              msgLength=msgLen;
+  if (msg == NULL)
+    return true; // skipped
 
-              msgContent[msgLength]='\0';
-            }
-            catch (std::exception& e)
-            {
-              NVJ_LOG->append(NVJ_ERROR, std::string(" Websocket: nvj_gzip raised an exception: ") +  e.what());
-              msgLength = 0;
-            }
-          }
-
-          if ((opcode == 0x8 || opcode == 0x9 || opcode == 0xa) && (!fin || msgLength > 125)) {
-            NVJ_LOG->append(NVJ_WARNING, "WebSocket: invalid control frame");
-            closeRecv();
-            return;
-          }
-
-          switch(opcode)
-          {
-            case 0x1: // text
-            case 0x2: // binary
-            {
-                if (fragmented) {
-                    NVJ_LOG->append(NVJ_WARNING, "WebSocket: new data frame while fragmented message is pending");
-                    closeRecv();
-                    return;
-                }
-            
-                if (!fin) {
-                    fragmented = true;
-                    fragmentedOpcode = opcode;
-                    fragmentedPayload.clear();
-                    if (msgLength > 0 && msgContent != NULL)
-                      fragmentedPayload.assign(msgContent, msgContent + msgLength);
-                } else {
-                    if (opcode == 0x1)
-                        websocket->onTextMessage(this, std::string((char*)msgContent, msgLength), true);
-                    else
-                        websocket->onBinaryMessage(this, msgContent, msgLength, true);
-                }
-                break;
-            }
-            case 0x0: // continuation
-            {
-                if (!fragmented) {
-                    NVJ_LOG->append(NVJ_WARNING, "WebSocket: unexpected continuation frame");
-                    closeRecv();
-                    return;
-                }
-
-                if (msgLength > 0 && msgContent != NULL) {
-                  fragmentedPayload.insert(
-                    fragmentedPayload.end(),
-                    msgContent,
-                    msgContent + msgLength
-                );
-}
-
-                if (fin) {
-                    if (fragmentedOpcode == 0x1) {
-                        websocket->onTextMessage(
-                            this,
-                            std::string((char*)fragmentedPayload.data(), fragmentedPayload.size()),
-                            true
-                        );
-                    } else if (fragmentedOpcode == 0x2) {
-                        websocket->onBinaryMessage(
-                            this,
-                            fragmentedPayload.data(),
-                            fragmentedPayload.size(),
-                            true
-                        );
-                    }
-
-                    fragmented = false;
-                    fragmentedOpcode = 0;
-                    fragmentedPayload.clear();
-                }
-
-                break;
-}
-            case 0x8:
-              if (websocket->onCloseCtrlFrame(this, msgContent, msgLength))
-              {
-                sendCloseCtrlFrame( msgContent, msgLength );
-                closeRecv();
-                return;
-              }
-              break;
-            case 0x9:
-              if (websocket->onPingCtrlFrame(this, msgContent, msgLength))
-                sendPongCtrlFrame( msgContent, msgLength );
-              break;
-            case 0xa:
-              websocket->onPongCtrlFrame(this, msgContent, msgLength);
-              break;
-            default:
-              char buf[300]; snprintf(buf, 300, "WebSocket: message received with unknown opcode (%d) has been ignored", opcode);
-              NVJ_LOG->append(NVJ_INFO,buf);
-              break;
-          }
-
-          fin=false; rsv=0;
-          opcode=0;
-          msgLength=0;
-          msgContentIt=0;
-          msgMask=false;
-          memset( msgKeys, 0, 4*sizeof(unsigned char) );
-        
-          if (msgContent != NULL) {
-              free(msgContent);
-              msgContent=NULL;
-            }
-            
-          readLength=1;
-          step=FIRSTBYTE;
-        }
-        break;
+  // the fragments of a compressed message are inflated in turn, into the
+  // context kept from the previous messages
+  if (recvCompressed && opcode < 0x8 && client->compression == ZLIB)
+  {
+    try
+    {
+      GzipContext *gz = getGzipContext();
+      if (!gz->inflateReady)
+      {
+        nvj_init_inflate_stream(&(gz->strm_inflate), true, deflateParams.clientMaxWindowBits);
+        gz->inflateReady = true;
+      }
+      // the message inflated is limited too, a few bytes may expand a lot
+      size_t maxSize = SIZE_MAX;
+      if (maxMessageSize)
+        maxSize = maxMessageSize - (fragmentedMsg != NULL ? std::min(fragmentedMsg->length, maxMessageSize) : 0);
+      unsigned char *payload = NULL;
+      size_t payloadLen=nvj_gunzip_websocket_stream( &payload, msg->message, msg->length, &(gz->strm_inflate), fin, maxSize );
+      if (msg->message != inlinePayload(msg))
+        free(msg->message);
+      msg->message=payload;
+      msg->length=payloadLen;
+    }
+    catch (std::length_error& e)
+    {
+      NVJ_LOG->append(NVJ_WARNING, "WebSocket: message received too large once inflated");
+      freeMessage(msg);
+      failConnection(1009);
+      return true;
+    }
+    catch (std::exception& e)
+    {
+      // the context is lost: the next messages can't be inflated
+      NVJ_LOG->append(NVJ_ERROR, std::string(" Websocket: nvj_gunzip raised an exception: ") +  e.what());
+      freeMessage(msg);
+      return false;
     }
   }
+
+  switch(opcode)
+  {
+    case 0x1: // text
+    case 0x2: // binary
+      if (fragmentedMsg != NULL)
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: new data frame while fragmented message is pending");
+        freeMessage(msg);
+        return false;
+      }
+
+      if (!fin)
+        fragmentedMsg = msg;
+      else
+        pushReceivedMessage(msg);
+      break;
+
+    case 0x0: // continuation
+      if (fragmentedMsg == NULL)
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: unexpected continuation frame");
+        freeMessage(msg);
+        return false;
+      }
+
+      if (isTooLarge(msg->length))
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: fragmented message received too large");
+        freeMessage(msg);
+        failConnection(1009);
+        return true;
+      }
+
+      if (!appendMessage(fragmentedMsg, msg->message, msg->length))
+      {
+        NVJ_LOG->append(NVJ_WARNING, "WebSocket: fragmented message allocation failed");
+        freeMessage(msg);
+        return false;
+      }
+      freeMessage(msg);
+
+      if (fin)
+      {
+        pushReceivedMessage(fragmentedMsg);
+        fragmentedMsg = NULL;
+      }
+      break;
+
+    case 0x8: // close
+    case 0x9: // ping
+    case 0xa: // pong
+      pushReceivedMessage(msg);
+      break;
+
+    default:
+      char buf[300]; snprintf(buf, 300, "WebSocket: message received with unknown opcode (%d) has been ignored", opcode);
+      NVJ_LOG->append(NVJ_INFO,buf);
+      freeMessage(msg);
+      break;
+  }
+
+  return true;
 }
 
 /***********************************************************************/
+/**
+* isTooLarge - a data frame would make its message larger than allowed
+* @param length: the payload length of the frame
+*/
 
-void WebSocketClient::closeWS()
+bool WebSocketClient::isTooLarge(const u_int64_t length)
 {
-  closing=true;
-  websocket->removeClient(this, true);
-  websocket->onClosing(this);
-
-  pthread_cond_broadcast ( &sendingNotification );
-  wait_for_thread(sendingThreadId);
-  WebServer::freeClientSockData( request->getClientSockData() );
-  wait_for_thread(receivingThreadId);
-  restoreSessionExpiration(request);
-  delete request;
-  delete this;
+  if (!maxMessageSize)
+    return false;
+  size_t pending = fragmentedMsg != NULL ? fragmentedMsg->length : 0;
+  return length > maxMessageSize || pending > maxMessageSize - length;
 }
 
-void WebSocketClient::closeSend()
+/***********************************************************************/
+/**
+* failConnection - send a close frame with a status code (rfc6455 7.4),
+*                  then close the connection; nothing more is read
+*                  (I/O thread)
+*/
+
+void WebSocketClient::failConnection(const u_int16_t status)
 {
-  closing=true;
-  websocket->removeClient(this, false);
-  websocket->onClosing(this);
+  unsigned char payload[2] = { (unsigned char)(status >> 8), (unsigned char)(status & 0xff) };
+  sendCloseCtrlFrame(payload, 2);
 
-  WebServer::freeClientSockData( request->getClientSockData() );
-  restoreSessionExpiration(request);
-  delete request;
-  delete this;
+  pthread_mutex_lock(&sendingQueueMutex);
+  if (!closing)
+    flushBeforeClose = true;
+  closing = true;
+  pthread_mutex_unlock(&sendingQueueMutex);
+
+  recvStep = CLOSED;
 }
 
-void WebSocketClient::closeRecv()
-{
-  closing=true;
-  websocket->removeClient(this, false);
-  websocket->onClosing(this);
+/***********************************************************************/
+/**
+* pushReceivedMessage - queue a message for the callbacks (I/O thread)
+*/
 
-  pthread_cond_broadcast ( &sendingNotification );
-  wait_for_thread(sendingThreadId);
-  WebServer::freeClientSockData( request->getClientSockData() );
-  restoreSessionExpiration(request);
-  delete request;
-  delete this;
+void WebSocketClient::pushReceivedMessage(MessageContent *msg)
+{
+  pthread_mutex_lock(&receivedQueueMutex);
+  receivedQueue.push(msg);
+  if (receivedQueue.size() >= WEBSOCKETCLIENT_MAX_RECEIVED_MESSAGES)
+    readingPaused = true; // resumed by dispatchMessages()
+  bool schedule = !dispatching;
+  dispatching = true;
+  pthread_mutex_unlock(&receivedQueueMutex);
+
+  if (schedule)
+    WebSocketEngine::getInstance()->schedule(this);
 }
 
 /***********************************************************************/
+/**
+* dispatchMessages - run the callbacks of the messages received, in order
+*                    (worker thread, one at a time for a client)
+*/
 
-void WebSocketClient::noSessionExpiration(HttpRequest *request)
+void WebSocketClient::dispatchMessages()
 {
-  std::string sessionId=request->getSessionId();
-  if (sessionId != "")
-    HttpSession::noExpiration(request->getSessionId());
+  pthread_mutex_lock(&receivedQueueMutex);
+
+  for (;;)
+  {
+    if (!receivedQueue.empty())
+    {
+      MessageContent *msg = receivedQueue.front();
+      receivedQueue.pop();
+      bool resume = readingPaused && receivedQueue.size() <= WEBSOCKETCLIENT_MAX_RECEIVED_MESSAGES / 2;
+      if (resume)
+        readingPaused = false;
+      pthread_mutex_unlock(&receivedQueueMutex);
+
+      if (resume)
+        WebSocketEngine::getInstance()->wakeup(this);
+
+      // the messages still queued are dropped when the client is closed by the server
+      if (!closing || flushBeforeClose)
+        switch(msg->opcode)
+        {
+          case 0x1:
+            websocket->onTextMessage(this, std::string((char*)msg->message, msg->length), true);
+            break;
+          case 0x2:
+            websocket->onBinaryMessage(this, msg->message, msg->length, true);
+            break;
+          case 0x8:
+            if (websocket->onCloseCtrlFrame(this, msg->message, msg->length))
+            {
+              // reply, then close once the reply is sent
+              sendCloseCtrlFrame( msg->message, msg->length );
+              pthread_mutex_lock(&sendingQueueMutex);
+              if (!closing)
+                flushBeforeClose = true;
+              closing = true;
+              pthread_mutex_unlock(&sendingQueueMutex);
+              WebSocketEngine::getInstance()->wakeup(this);
+            }
+            break;
+          case 0x9:
+            if (websocket->onPingCtrlFrame(this, msg->message, msg->length))
+              sendPongCtrlFrame( msg->message, msg->length );
+            break;
+          case 0xa:
+            websocket->onPongCtrlFrame(this, msg->message, msg->length);
+            break;
+        }
+
+      freeMessage(msg);
+      pthread_mutex_lock(&receivedQueueMutex);
+      continue;
+    }
+
+    if (disconnected && !closingNotified)
+    {
+      closingNotified = true;
+      pthread_mutex_unlock(&receivedQueueMutex);
+      websocket->onClosing(this);
+      pthread_mutex_lock(&receivedQueueMutex);
+      continue;
+    }
+
+    break;
+  }
+
+  dispatching = false;
+  pthread_mutex_unlock(&receivedQueueMutex);
 }
 
-void WebSocketClient::restoreSessionExpiration(HttpRequest *request)
+/***********************************************************************/
+/**
+* getGzipContext - the compression contexts, allocated on first use
+*                  (I/O thread)
+*/
+
+WebSocketClient::GzipContext *WebSocketClient::getGzipContext()
 {
-  std::string sessionId=request->getSessionId();
-  if (sessionId != "")
-    HttpSession::updateExpiration(request->getSessionId());
+  if (gzipcontext == NULL)
+  {
+    gzipcontext = new GzipContext;
+    gzipcontext->inflateReady = false;
+    gzipcontext->deflateReady = false;
+  }
+  return gzipcontext;
 }
 
 /***********************************************************************/
+/**
+* prepareFrame - build the frame header of a message to send
+*                (I/O thread)
+*/
 
-bool WebSocketClient::sendMessage( const MessageContent *msgContent )
+bool WebSocketClient::prepareFrame(SendingFrame &frame, MessageContent *msgContent)
 {
   ClientSockData* client = request->getClientSockData();
 
-  unsigned char headerBuffer[10]; // 10 is the max header size
-  size_t headerLen=2; // default header size
-  unsigned char *msg = NULL;
-  size_t msgLen=0;
-  bool result = true;
+  frame.msg = msgContent;
+  frame.headerLen=2; // default header size
 
-  if (client == NULL)
-    return false;
+  if (msgContent->frame != NULL)
+  {
+    // a shared frame, header included; compressed with the largest window
+    frame.headerLen=0;
+    if (client->compression == ZLIB && deflateParams.serverMaxWindowBits == 15
+        && msgContent->frame->getPayloadLength() >= compressionThreshold)
+    {
+      frame.payload=(unsigned char*)msgContent->frame->getCompressedData(frame.payloadLen);
+      // the client inflates it into its context: ours is out of sync
+      if (msgContent->frame->isCompressed())
+        deflateReset=true;
+    }
+    else
+      frame.payload=(unsigned char*)msgContent->frame->getData(frame.payloadLen);
+    return true;
+  }
 
-  headerBuffer[0] = (msgContent->fin ? 0x80 : 0x00) | (msgContent->opcode & 0x0f); // FIN & OPCODE:0x1
+  frame.header[0] = (msgContent->fin ? 0x80 : 0x00) | (msgContent->opcode & 0x0f); // FIN & OPCODE:0x1
+
+  // a message is compressed or not as a whole: its first frame decides
+  // (control frames never are, the small messages aren't)
+  bool compress = false;
   if (client->compression == ZLIB)
   {
-    headerBuffer[0] |= 0x40; // Set RSV1
+    if (msgContent->opcode == 0x0)
+      compress = sendCompressed;
+    else if (msgContent->opcode < 0x8)
+      compress = sendCompressed = !msgContent->fin || msgContent->length >= compressionThreshold;
+  }
+
+  if (compress)
+  {
+    if (msgContent->opcode != 0x0)
+      frame.header[0] |= 0x40; // Set RSV1
     try
     {
-      msgLen=nvj_gzip_websocket_v2( &msg, msgContent->message, msgContent->length, &(gzipcontext.strm_deflate));
+      GzipContext *gz = getGzipContext();
+      if (!gz->deflateReady)
+      {
+        nvj_init_stream(&(gz->strm_deflate), true, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY,
+                        deflateParams.serverMaxWindowBits, deflateParams.deflateMemLevel);
+        gz->deflateReady = true;
+      }
+      else if (deflateReset)
+        ::deflateReset(&(gz->strm_deflate));
+      deflateReset=false;
+
+      frame.payloadLen=nvj_gzip_websocket_v2( &frame.payload, msgContent->message, msgContent->length, &(gz->strm_deflate), msgContent->fin);
+      if (msgContent->fin && deflateParams.serverNoContextTakeover)
+        deflateReset=true;
     }
     catch(...)
     {
       NVJ_LOG->append(NVJ_ERROR, " Websocket: nvj_gzip raised an exception");
+      frame.payload=NULL;
+      frame.msg=NULL;
       return false;
     }
   }
   else
   {
-    msg=msgContent->message;
-    msgLen=msgContent->length;
+    frame.payload=msgContent->message;
+    frame.payloadLen=msgContent->length;
   }
 
-
-  if (msgLen < 126)
-    headerBuffer[1]=msgLen;
+  if (frame.payloadLen < 126)
+    frame.header[1]=frame.payloadLen;
   else
   {
-    if (msgLen <= 0xFFFF)
+    if (frame.payloadLen <= 0xFFFF)
     {
-      headerBuffer[1]=126;
-      *(u_int16_t*)(headerBuffer+2)=htons((u_int16_t)msgLen);
-      headerLen+=2;
+      frame.header[1]=126;
+      u_int16_t len=htons((u_int16_t)frame.payloadLen);
+      memcpy(frame.header+2, &len, 2);
+      frame.headerLen+=2;
     }
     else
     {
-      headerBuffer[1]=127;
-      *(u_int64_t*)(headerBuffer+2)=htonll((u_int64_t)msgLen);
-      headerLen+=8;
+      frame.header[1]=127;
+      u_int64_t len=htonll((u_int64_t)frame.payloadLen);
+      memcpy(frame.header+2, &len, 8);
+      frame.headerLen+=8;
     }
   }
 
-  if (  !WebServer::httpSend(client, headerBuffer, headerLen)
-     || !WebServer::httpSend(client, msg, msgLen) )
-    result = false;
+  return true;
+}
 
-  if (client->compression == ZLIB)
-    free (msg);
+/***********************************************************************/
+
+void WebSocketClient::endSendingFrame(SendingFrame &frame)
+{
+  if (frame.payload != NULL && frame.payload != frame.msg->message && frame.msg->frame == NULL)
+    free (frame.payload); // compressed
+  freeMessage(frame.msg);
+  frame.msg=NULL;
+  frame.payload=NULL;
+}
 
-  return result;
+/***********************************************************************/
+
+void WebSocketClient::freeSendingFrames()
+{
+  for (size_t i=0; i < sendingCount; i++)
+    endSendingFrame(sendingFrames[sendingFirst + i]);
+  sendingFirst=0;
+  sendingCount=0;
+  sendingOffset=0;
+  sendingBytes=0;
+  sendingBlockedSince=0;
+}
+
+/***********************************************************************/
+/**
+* fillSendingFrames - take the queued messages, in order, until the batch
+*                     holds WEBSOCKETCLIENT_SENDING_BATCH frames or about
+*                     WEBSOCKETCLIENT_SENDING_BUDGET bytes (I/O thread)
+* @param now: the current monotonic time (ms)
+* \return false if the connection must be closed
+*/
+
+bool WebSocketClient::fillSendingFrames(const unsigned long long now)
+{
+  if (sendingFirst)
+  {
+    memmove(sendingFrames, sendingFrames + sendingFirst, sendingCount * sizeof(SendingFrame));
+    sendingFirst=0;
+  }
+
+  MessageContent *msgs[WEBSOCKETCLIENT_SENDING_BATCH];
+  size_t nb=0, bytes=sendingBytes;
+
+  pthread_mutex_lock(&sendingQueueMutex);
+  while (sendingCount + nb < WEBSOCKETCLIENT_SENDING_BATCH && bytes < WEBSOCKETCLIENT_SENDING_BUDGET
+         && !sendingQueue.empty())
+  {
+    MessageContent *msg = sendingQueue.front();
+    sendingQueue.pop();
+    size_t len = msg->length;
+    if (msg->frame != NULL)
+      msg->frame->getData(len);
+    bytes += len;
+    msgs[nb++] = msg;
+  }
+  pthread_mutex_unlock(&sendingQueueMutex);
+
+  for (size_t i=0; i < nb; i++)
+  {
+    SendingFrame &frame = sendingFrames[sendingCount];
+    if ( (now > msgs[i]->date_ms && now - msgs[i]->date_ms > snd_maxLatency)
+      || !prepareFrame(frame, msgs[i]) )
+    {
+      for (; i < nb; i++)
+        freeMessage(msgs[i]);
+      return false;
+    }
+    sendingBytes += frame.headerLen + frame.payloadLen;
+    sendingCount++;
+  }
+
+  return true;
+}
+
+/***********************************************************************/
+/**
+* sendFrames - write what the socket accepts of the frames, without
+*              blocking: the frames are gathered into one sendmsg(),
+*              or into the buffer for a TLS write (I/O thread)
+* @param buffer: a buffer of the I/O thread
+* \return the number of bytes written, 0 if the socket is full, -1 on error
+*/
+
+ssize_t WebSocketClient::sendFrames(char *buffer, size_t bufferSize)
+{
+  ClientSockData* client = request->getClientSockData();
+  size_t offset = sendingOffset;
+
+  if (client->bio != NULL && client->ssl != NULL)
+  {
+    // the large parts are written directly
+    const SendingFrame &first = sendingFrames[sendingFirst];
+    if (offset >= first.headerLen && first.payloadLen - (offset - first.headerLen) >= bufferSize)
+      return sendSome(first.payload + (offset - first.headerLen), first.payloadLen - (offset - first.headerLen));
+
+    size_t len = 0;
+    for (size_t i=0; i < sendingCount && len < bufferSize; i++, offset=0)
+    {
+      const SendingFrame &frame = sendingFrames[sendingFirst + i];
+      if (offset < frame.headerLen)
+      {
+        size_t n = std::min(frame.headerLen - offset, bufferSize - len);
+        memcpy(buffer + len, frame.header + offset, n);
+        len += n;
+        offset = frame.headerLen;
+      }
+      size_t n = std::min(frame.payloadLen - (offset - frame.headerLen), bufferSize - len);
+      if (n)
+        memcpy(buffer + len, frame.payload + (offset - frame.headerLen), n);
+      len += n;
+    }
+    return sendSome(buffer, len);
+  }
+
+  struct iovec iov[2*WEBSOCKETCLIENT_SENDING_BATCH];
+  int nbIov = 0;
+  for (size_t i=0; i < sendingCount; i++, offset=0)
+  {
+    SendingFrame &frame = sendingFrames[sendingFirst + i];
+    if (offset < frame.headerLen)
+    {
+      iov[nbIov].iov_base = frame.header + offset;
+      iov[nbIov++].iov_len = frame.headerLen - offset;
+      offset = frame.headerLen;
+    }
+    if (offset - frame.headerLen < frame.payloadLen)
+    {
+      iov[nbIov].iov_base = frame.payload + (offset - frame.headerLen);
+      iov[nbIov++].iov_len = frame.payloadLen - (offset - frame.headerLen);
+    }
+  }
+
+  struct msghdr mh;
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = nbIov;
+  ssize_t n=sendmsg(client->socketId, &mh, MSG_NOSIGNAL);
+  if (n >= 0)
+    return n;
+  return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+/***********************************************************************/
+/**
+* sentFrames - free the frames entirely written (I/O thread)
+* @param length: the number of bytes written
+*/
+
+void WebSocketClient::sentFrames(size_t length)
+{
+  sendingBytes -= length;
+  while (length)
+  {
+    SendingFrame &frame = sendingFrames[sendingFirst];
+    size_t left = frame.headerLen + frame.payloadLen - sendingOffset;
+    if (length < left)
+    {
+      sendingOffset += length;
+      return;
+    }
+    length -= left;
+    endSendingFrame(frame);
+    sendingFirst++;
+    sendingCount--;
+    sendingOffset = 0;
+  }
+}
+
+/***********************************************************************/
+/**
+* writeOutput - send the queued messages, until the socket is full
+*               (I/O thread)
+* @param now: the current monotonic time (ms)
+* @param buffer: a buffer of the I/O thread, to gather the TLS writes
+* \return false if the connection must be closed
+*/
+
+bool WebSocketClient::writeOutput(const unsigned long long now, char *buffer, size_t bufferSize)
+{
+  for (;;)
+  {
+    if (!fillSendingFrames(now))
+      return false;
+    if (!sendingCount)
+      return true;
+
+    ssize_t n=sendFrames(buffer, bufferSize);
+    if (n < 0)
+      return false;
+    if (n == 0)
+    {
+      // socket full: wait for EPOLLOUT
+      if (!sendingBlockedSince)
+        sendingBlockedSince = now ? now : 1;
+      return true;
+    }
+    sendingBlockedSince = 0;
+    sentFrames((size_t)n);
+  }
+}
+
+/***********************************************************************/
+/**
+* isSendingLate - is the client too slow to read its messages ?
+*                 (I/O thread)
+*/
+
+bool WebSocketClient::isSendingLate(const unsigned long long now)
+{
+  if (sendingCount && sendingBlockedSince && now - sendingBlockedSince > snd_timeout)
+    return true;
+
+  pthread_mutex_lock(&sendingQueueMutex);
+  bool late = !sendingQueue.empty() && now > sendingQueue.front()->date_ms
+              && now - sendingQueue.front()->date_ms > snd_maxLatency;
+  pthread_mutex_unlock(&sendingQueueMutex);
+  return late;
+}
+
+/***********************************************************************/
+/**
+* mustClose - has the connection to be closed now ? (I/O thread)
+*/
+
+bool WebSocketClient::mustClose()
+{
+  pthread_mutex_lock(&sendingQueueMutex);
+  bool res = closing && (!flushBeforeClose || (!sendingCount && sendingQueue.empty()));
+  pthread_mutex_unlock(&sendingQueueMutex);
+  return res;
+}
+
+/***********************************************************************/
+/**
+* disconnect - the connection is closed by its I/O thread: free the
+*              buffers, then let the callbacks end with onClosing()
+*/
+
+void WebSocketClient::disconnect()
+{
+  pthread_mutex_lock(&sendingQueueMutex);
+  closing = true;
+  freeSendingQueue();
+  pthread_mutex_unlock(&sendingQueueMutex);
+
+  freeSendingFrames();
+  if (recvMsg != NULL) { freeMessage(recvMsg); recvMsg = NULL; }
+  if (fragmentedMsg != NULL) { freeMessage(fragmentedMsg); fragmentedMsg = NULL; }
+
+  websocket->removeClient(this);
+
+  pthread_mutex_lock(&receivedQueueMutex);
+  disconnected = true;
+  bool schedule = !dispatching;
+  dispatching = true;
+  pthread_mutex_unlock(&receivedQueueMutex);
+
+  if (schedule)
+    WebSocketEngine::getInstance()->schedule(this);
+}
+
+/***********************************************************************/
+
+void WebSocketClient::closeWS()
+{
+  pthread_mutex_lock(&sendingQueueMutex);
+  closing=true;
+  flushBeforeClose=false;
+  pthread_mutex_unlock(&sendingQueueMutex);
+  WebSocketEngine::getInstance()->wakeup(this);
+}
+
+/***********************************************************************/
+
+void WebSocketClient::noSessionExpiration(HttpRequest *request)
+{
+  std::string sessionId=request->getSessionId();
+  if (sessionId != "")
+    HttpSession::noExpiration(request->getSessionId());
+}
+
+void WebSocketClient::restoreSessionExpiration(HttpRequest *request)
+{
+  std::string sessionId=request->getSessionId();
+  if (sessionId != "")
+    HttpSession::updateExpiration(request->getSessionId());
+}
+
+/***********************************************************************/
+
+/**
+* orderMessage - a message can't be sent between the fragments of another
+*                one (rfc6455 5.4): the messages of this client and the
+*                shared frames wait for each other's final fragment
+* @param msgContent: the message, its opcode is set to continue a fragmented one
+* \return true if it can be queued now
+*/
+
+bool WebSocketClient::orderMessage(MessageContent *msgContent)
+{
+  if (msgContent->frame != NULL)
+  {
+    if (msgContent->frame->getOpcode() >= 0x8)
+      return true;
+    if (sendingFragmented)
+      return false;
+    sharedFragmented = !msgContent->frame->isFinal();
+    return true;
+  }
+
+  if (msgContent->opcode != 0x1 && msgContent->opcode != 0x2)
+    return true;
+  if (sharedFragmented)
+    return false;
+  // the data frames following a non final fragment continue its message
+  if (sendingFragmented)
+    msgContent->opcode = 0x0;
+  sendingFragmented = !msgContent->fin;
+  return true;
 }
 
 /***********************************************************************/
@@ -492,52 +1129,78 @@ bool WebSocketClient::sendMessage( const MessageContent *msgContent )
 void WebSocketClient::addSendingQueue(MessageContent *msgContent)
 {
   pthread_mutex_lock(&sendingQueueMutex);
-  if (!closing)
+  bool drop = closing;
+  if (!drop && msgContent->frame != NULL && msgContent->frame->getOpcode() < 0x8)
+  {
+    // the client was added in the middle of a shared message
+    if (msgContent->frame->getOpcode() == 0x0 && !sharedReceived)
+      drop = true;
+    else
+      sharedReceived = !msgContent->frame->isFinal();
+  }
+  if (drop)
+  {
+    pthread_mutex_unlock(&sendingQueueMutex);
+    freeMessage(msgContent);
+    return;
+  }
+
+  bool wasEmpty = sendingQueue.empty();
+  if (!orderMessage(msgContent))
+    heldMessages.push(msgContent);
+  else
+  {
     sendingQueue.push(msgContent);
+    while (!heldMessages.empty() && orderMessage(heldMessages.front()))
+    {
+      sendingQueue.push(heldMessages.front());
+      heldMessages.pop();
+    }
+  }
+  bool wakeup = wasEmpty && !sendingQueue.empty();
   pthread_mutex_unlock(&sendingQueueMutex);
-  pthread_cond_broadcast ( &sendingNotification );
+
+  // otherwise the I/O thread is already sending
+  if (wakeup)
+    WebSocketEngine::getInstance()->wakeup(this);
 }
 
 /***********************************************************************/
 
-void WebSocketClient::sendTextMessage(const std::string &message, bool fin)
+void WebSocketClient::sendMessage(const u_int8_t opcode, const unsigned char* message, size_t length, bool fin)
 {
-  MessageContent *msgContent = (MessageContent*)malloc( sizeof(MessageContent) );
-  msgContent->opcode=0x1;
-  msgContent->message = (unsigned char*) malloc ( message.length() * sizeof (char) );
-  message.copy((char*)msgContent->message, message.length());
-  msgContent->length=message.length();
+  MessageContent *msgContent = allocMessage(opcode, length);
+  if (msgContent == NULL)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebSocket: message allocation failed");
+    return;
+  }
+  if (length)
+    memcpy(msgContent->message, message, length);
   msgContent->fin = fin;
-  msgContent->date_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  msgContent->date_ms = nvj_monotonic_ms();
   addSendingQueue(msgContent);
 }
 
 /***********************************************************************/
 
+void WebSocketClient::sendTextMessage(const std::string &message, bool fin)
+{
+  sendMessage(0x1, (const unsigned char*)message.data(), message.length(), fin);
+}
+
+/***********************************************************************/
+
 void WebSocketClient::sendBinaryMessage(const unsigned char* message, size_t length, bool fin)
 {
-  MessageContent *msgContent = (MessageContent*)malloc( sizeof(MessageContent) );
-  msgContent->opcode=0x2;
-  msgContent->message = (unsigned char*) malloc ( length * sizeof (unsigned char) );
-  memcpy(msgContent->message, message, length);
-  msgContent->length=length;
-  msgContent->fin = fin;
-  msgContent->date_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-  addSendingQueue(msgContent);
+  sendMessage(0x2, message, length, fin);
 }
 
 /***********************************************************************/
 
 void WebSocketClient::sendPingCtrlFrame(const unsigned char* message, size_t length)
 {
-  MessageContent *msgContent = (MessageContent*)malloc( sizeof(MessageContent) );
-  msgContent->opcode=0x9;
-  msgContent->message = (unsigned char*) malloc ( length * sizeof (unsigned char) );
-  memcpy(msgContent->message, message, length);
-  msgContent->length=length;
-  msgContent->fin = true;
-  msgContent->date_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-  addSendingQueue(msgContent);
+  sendMessage(0x9, message, length, true);
 }
 
 void WebSocketClient::sendPingCtrlFrame(const std::string &message)
@@ -549,15 +1212,7 @@ void WebSocketClient::sendPingCtrlFrame(const std::string &message)
 
 void WebSocketClient::sendPongCtrlFrame(const unsigned char* message, size_t length)
 {
-  MessageContent *msgContent = (MessageContent*)malloc( sizeof(MessageContent) );
-  msgContent->opcode=0xa;
-  msgContent->message = (unsigned char*) malloc ( length * sizeof (unsigned char) );
-  memcpy(msgContent->message, message, length);
-  msgContent->length=length;
-  msgContent->fin = true;
-  msgContent->date_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-
-  addSendingQueue(msgContent);
+  sendMessage(0xa, message, length, true);
 }
 
 void WebSocketClient::sendPongCtrlFrame(const std::string &message)
@@ -569,15 +1224,7 @@ void WebSocketClient::sendPongCtrlFrame(const std::string &message)
 
 void WebSocketClient::sendCloseCtrlFrame(const unsigned char* message, size_t length)
 {
-  MessageContent *msgContent = (MessageContent*)malloc( sizeof(MessageContent) );
-  msgContent->opcode=0x8;
-  msgContent->message = (unsigned char*) malloc ( length * sizeof (unsigned char) );
-  memcpy(msgContent->message, message, length);
-  msgContent->length=length;
-  msgContent->fin = true;
-  msgContent->date_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
-
-  addSendingQueue(msgContent);
+  sendMessage(0x8, message, length, true);
 }
 
 void WebSocketClient::sendCloseCtrlFrame(const std::string &message)
@@ -586,3 +1233,20 @@ void WebSocketClient::sendCloseCtrlFrame(const std::string &message)
 }
 
 /***********************************************************************/
+
+void WebSocketClient::sendFrame(WebSocketFrame *frame)
+{
+  MessageContent *msgContent = allocMessage(0, 0);
+  if (msgContent == NULL)
+  {
+    NVJ_LOG->append(NVJ_ERROR, "WebSocket: message allocation failed");
+    return;
+  }
+  frame->retain();
+  msgContent->message=NULL;
+  msgContent->date_ms=frame->getDate();
+  msgContent->frame=frame;
+  addSendingQueue(msgContent);
+}
+
+/***********************************************************************/
@@ -0,0 +1,252 @@
+//********************************************************
+/**
+ * @file  WebSocketDeflate.cc
+ *
+ * @brief permessage-deflate extension negotiation
+ *        rfc7692 Compression Extensions for WebSocket
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <atomic>
+#include <algorithm>
+
+#include "libnavajo/WebSocketDeflate.hh"
+
+// Windows tried, from the largest, while the memory budget is short
+#define WEBSOCKETDEFLATE_MIN_WINDOW_BITS 9
+#define WEBSOCKETDEFLATE_WINDOW_BITS_STEP 2
+
+static std::atomic<size_t> memoryBudget(0);
+static std::atomic<size_t> memoryUsed(0);
+
+
+  /***********************************************************************/
+
+  static std::string trim(const std::string &str)
+  {
+    size_t first = str.find_first_not_of(" \t");
+    if (first == std::string::npos)
+      return "";
+    return str.substr(first, str.find_last_not_of(" \t") - first + 1);
+  }
+
+  /***********************************************************************/
+  /**
+  * parseWindowBits - a window bits value: 1*DIGIT (possibly quoted)
+  * \return the value, or 0 if it's invalid
+  */
+
+  static unsigned char parseWindowBits(std::string value)
+  {
+    if (value.size() >= 2 && value[0] == '"' && value[value.size()-1] == '"')
+      value = value.substr(1, value.size()-2);
+    if (value.empty() || value.size() > 2 || value[0] == '0'
+        || value.find_first_not_of("0123456789") != std::string::npos)
+      return 0;
+    int bits = atoi(value.c_str());
+    return (bits >= 8 && bits <= 15) ? (unsigned char)bits : 0;
+  }
+
+  /***********************************************************************/
+
+  WebSocketDeflateParams::WebSocketDeflateParams(): serverNoContextTakeover(false), clientNoContextTakeover(false),
+                                                    serverMaxWindowBits(15), clientMaxWindowBits(15), deflateMemLevel(8),
+                                                    clientMaxWindowBitsOffered(false)
+  {
+  }
+
+  /***********************************************************************/
+
+  bool WebSocketDeflateParams::negotiate(const std::string &extensions)
+  {
+    size_t pos = 0;
+    while (pos < extensions.size())
+    {
+      size_t end = extensions.find(',', pos);
+      if (end == std::string::npos)
+        end = extensions.size();
+      if (parseOffer(extensions.substr(pos, end - pos)) && fitMemoryBudget())
+        return true;
+      pos = end + 1;
+    }
+    *this = WebSocketDeflateParams();
+    return false;
+  }
+
+  /***********************************************************************/
+  /**
+  * parseOffer - check an offer: "permessage-deflate; param[=value]; ..."
+  * \return true if it's accepted, the parameters are set
+  */
+
+  bool WebSocketDeflateParams::parseOffer(const std::string &offer)
+  {
+    *this = WebSocketDeflateParams();
+
+    size_t pos = offer.find(';');
+    if (strcasecmp(trim(offer.substr(0, pos)).c_str(), "permessage-deflate") != 0)
+      return false;
+
+    bool serverMaxWindowBitsOffered = false;
+    while (pos != std::string::npos)
+    {
+      size_t end = offer.find(';', pos + 1);
+      std::string param = offer.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+      pos = end;
+
+      std::string name = param, value;
+      bool hasValue = false;
+      size_t eq = param.find('=');
+      if (eq != std::string::npos)
+      {
+        name = param.substr(0, eq);
+        value = trim(param.substr(eq + 1));
+        hasValue = true;
+      }
+      name = trim(name);
+
+      // each parameter at most once (rfc7692 5.1)
+      if (strcasecmp(name.c_str(), "server_no_context_takeover") == 0)
+      {
+        if (hasValue || serverNoContextTakeover)
+          return false;
+        serverNoContextTakeover = true;
+      }
+      else if (strcasecmp(name.c_str(), "client_no_context_takeover") == 0)
+      {
+        if (hasValue || clientNoContextTakeover)
+          return false;
+        clientNoContextTakeover = true;
+      }
+      else if (strcasecmp(name.c_str(), "server_max_window_bits") == 0)
+      {
+        // zlib raw deflate doesn't support a 256 bytes window: 8 is declined
+        if (!hasValue || serverMaxWindowBitsOffered || (serverMaxWindowBits = parseWindowBits(value)) < 9)
+          return false;
+        serverMaxWindowBitsOffered = true;
+      }
+      else if (strcasecmp(name.c_str(), "client_max_window_bits") == 0)
+      {
+        if (clientMaxWindowBitsOffered || (hasValue && (clientMaxWindowBits = parseWindowBits(value)) == 0))
+          return false;
+        clientMaxWindowBitsOffered = true;
+      }
+      else
+        return false;
+    }
+
+    return true;
+  }
+
+  /***********************************************************************/
+
+  std::string WebSocketDeflateParams::getResponse() const
+  {
+    std::string response = "permessage-deflate";
+    char buf[64];
+
+    if (serverNoContextTakeover)
+      response += "; server_no_context_takeover";
+    if (clientNoContextTakeover)
+      response += "; client_no_context_takeover";
+    if (serverMaxWindowBits < 15)
+    {
+      snprintf(buf, sizeof(buf), "; server_max_window_bits=%u", serverMaxWindowBits);
+      response += buf;
+    }
+    if (clientMaxWindowBitsOffered && clientMaxWindowBits < 15)
+    {
+      snprintf(buf, sizeof(buf), "; client_max_window_bits=%u", clientMaxWindowBits);
+      response += buf;
+    }
+    return response;
+  }
+
+  /***********************************************************************/
+  /**
+  * fitMemoryBudget - reduce the windows of the accepted offer until its
+  *                   contexts fit in the memory budget left, and hold it
+  * \return false if even the smallest windows don't fit
+  */
+
+  bool WebSocketDeflateParams::fitMemoryBudget()
+  {
+    const size_t budget = memoryBudget;
+    const unsigned char serverRequested = serverMaxWindowBits, clientRequested = clientMaxWindowBits;
+    size_t used = memoryUsed;
+
+    for (unsigned char bits = 15; bits >= WEBSOCKETDEFLATE_MIN_WINDOW_BITS; bits -= WEBSOCKETDEFLATE_WINDOW_BITS_STEP)
+    {
+      // the server may always use a smaller window than asked, the client
+      // only if it has offered client_max_window_bits (rfc7692 7.1.2)
+      serverMaxWindowBits = std::min(serverRequested, bits);
+      if (clientMaxWindowBitsOffered)
+        clientMaxWindowBits = std::min(clientRequested, bits);
+      deflateMemLevel = serverMaxWindowBits - 7;
+
+      const size_t cost = getMemoryCost();
+      while (!budget || used + cost <= budget)
+        if (memoryUsed.compare_exchange_weak(used, used + cost))
+          return true;
+    }
+
+    return false;
+  }
+
+  /***********************************************************************/
+  /**
+  * getMemoryCost - the zlib estimate (zconf.h): deflate needs
+  *                 (1 << (windowBits+2)) + (1 << (memLevel+9)) bytes,
+  *                 inflate (1 << windowBits), plus about 7KB each
+  */
+
+  size_t WebSocketDeflateParams::getMemoryCost() const
+  {
+    return getDeflateMemoryCost(serverMaxWindowBits, deflateMemLevel) + ((size_t)1 << clientMaxWindowBits) + 7168;
+  }
+
+  size_t WebSocketDeflateParams::getDeflateMemoryCost(const unsigned char windowBits, const unsigned char memLevel)
+  {
+    return ((size_t)1 << (windowBits + 2)) + ((size_t)1 << (memLevel + 9)) + 7168;
+  }
+
+  /***********************************************************************/
+
+  void WebSocketDeflateParams::setMemoryBudget(const size_t bytes)
+  {
+    memoryBudget = bytes;
+  }
+
+  size_t WebSocketDeflateParams::getMemoryBudget()
+  {
+    return memoryBudget;
+  }
+
+  size_t WebSocketDeflateParams::getMemoryUsed()
+  {
+    return memoryUsed;
+  }
+
+  bool WebSocketDeflateParams::reserveMemory(const size_t bytes)
+  {
+    const size_t budget = memoryBudget;
+    size_t used = memoryUsed;
+    while (!budget || used + bytes <= budget)
+      if (memoryUsed.compare_exchange_weak(used, used + bytes))
+        return true;
+    return false;
+  }
+
+  void WebSocketDeflateParams::releaseMemory(const size_t bytes)
+  {
+    memoryUsed -= bytes;
+  }
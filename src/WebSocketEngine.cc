@@ -0,0 +1,453 @@
+//********************************************************
+/**
+ * @file  WebSocketEngine.cc
+ *
+ * @brief Event-driven WebSocket I/O: a few epoll threads
+ *        read and write every connection, a worker pool
+ *        runs the callbacks
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdexcept>
+
+#if defined(__linux__) && !defined(NVJ_WEBSOCKET_USE_POLL)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#else
+#ifndef NVJ_WEBSOCKET_USE_POLL
+#define NVJ_WEBSOCKET_USE_POLL
+#endif
+#include <poll.h>
+#endif
+
+#include "libnavajo/WebSocketEngine.hh"
+#include "libnavajo/WebSocketClient.hh"
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/nvjTime.h"
+
+#define DEFAULT_WEBSOCKETENGINE_IO_THREADS 2
+#define DEFAULT_WEBSOCKETENGINE_WORKER_THREADS 4
+#define WEBSOCKETENGINE_MAX_EVENTS 256
+#define WEBSOCKETENGINE_SWEEP_INTERVAL 100 // ms, the slow clients check
+#define WEBSOCKETENGINE_BUFSIZE 32768
+
+// the events of a connection
+#define WEBSOCKETENGINE_READ  1u
+#define WEBSOCKETENGINE_WRITE 2u
+#define WEBSOCKETENGINE_HANGUP 4u // reported whatever the events watched
+
+
+  /**
+  * WebSocketEngine - static and unique engine object
+  */
+  WebSocketEngine * WebSocketEngine::theWebSocketEngine = NULL;
+
+  /***********************************************************************/
+
+  WebSocketEngine::WebSocketEngine(): nbIoThreads(DEFAULT_WEBSOCKETENGINE_IO_THREADS),
+                                      nbWorkerThreads(DEFAULT_WEBSOCKETENGINE_WORKER_THREADS),
+                                      nextIoThread(0), started(false), exiting(false)
+  {
+    pthread_mutex_init(&engine_mutex, NULL);
+    pthread_cond_init(&workers_cond, NULL);
+  }
+
+  /***********************************************************************/
+
+  WebSocketEngine::~WebSocketEngine()
+  {
+    pthread_mutex_lock(&engine_mutex);
+    exiting=true;
+    pthread_cond_broadcast(&workers_cond);
+    pthread_mutex_unlock(&engine_mutex);
+
+    for (size_t i=0; i<ioThreads.size(); i++)
+    {
+      IoThread *t = ioThreads[i];
+      u_int64_t one = 1;
+      if (write(t->wakeupFd, &one, sizeof(one)) < 0) { }
+      wait_for_thread(t->thread);
+#ifndef NVJ_WEBSOCKET_USE_POLL
+      close(t->epollFd);
+#else
+      close(t->wakeupFd);
+#endif
+      close(t->eventFd);
+      pthread_mutex_destroy(&t->mutex);
+      delete t;
+    }
+    for (size_t i=0; i<workerThreads.size(); i++)
+      wait_for_thread(workerThreads[i]);
+
+    pthread_mutex_destroy(&engine_mutex);
+    pthread_cond_destroy(&workers_cond);
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::setThreadsNumber(const size_t ioThreads, const size_t workerThreads)
+  {
+    pthread_mutex_lock(&engine_mutex);
+    if (!started)
+    {
+      nbIoThreads = ioThreads ? ioThreads : 1;
+      nbWorkerThreads = workerThreads ? workerThreads : 1;
+    }
+    pthread_mutex_unlock(&engine_mutex);
+  }
+
+  /***********************************************************************/
+  /**
+  * start - create the threads (engine_mutex held)
+  */
+
+  void WebSocketEngine::start()
+  {
+    for (size_t i=0; i<nbIoThreads; i++)
+    {
+      IoThread *t = new IoThread;
+      t->engine = this;
+      pthread_mutex_init(&t->mutex, NULL);
+#ifndef NVJ_WEBSOCKET_USE_POLL
+      t->epollFd = epoll_create1(EPOLL_CLOEXEC);
+      t->eventFd = t->wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (t->epollFd < 0 || t->eventFd < 0)
+        throw std::runtime_error("WebSocketEngine: epoll initialization failed");
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.ptr = NULL;
+      epoll_ctl(t->epollFd, EPOLL_CTL_ADD, t->eventFd, &ev);
+#else
+      int fds[2];
+      if (pipe(fds) != 0)
+        throw std::runtime_error("WebSocketEngine: pipe creation failed");
+      fcntl(fds[0], F_SETFL, O_NONBLOCK);
+      fcntl(fds[1], F_SETFL, O_NONBLOCK);
+      t->epollFd = -1;
+      t->eventFd = fds[0];
+      t->wakeupFd = fds[1];
+#endif
+      create_thread( &t->thread, WebSocketEngine::startIoThread, static_cast<void *>(t) );
+      ioThreads.push_back(t);
+    }
+
+    workerThreads.resize(nbWorkerThreads);
+    for (size_t i=0; i<nbWorkerThreads; i++)
+      create_thread( &workerThreads[i], WebSocketEngine::startWorkerThread, static_cast<void *>(this) );
+
+    started=true;
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::attach(WebSocketClient *client)
+  {
+    pthread_mutex_lock(&engine_mutex);
+    if (!started)
+      start();
+    client->ioThread = ioThreads[nextIoThread++ % ioThreads.size()];
+    pthread_mutex_unlock(&engine_mutex);
+
+    // registered by its I/O thread
+    wakeup(client);
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::wakeup(WebSocketClient *client)
+  {
+    if (client->wakeupPending.exchange(true))
+      return;
+
+    client->retain();
+    IoThread *t = static_cast<IoThread *>(client->ioThread);
+
+    pthread_mutex_lock(&t->mutex);
+    bool first = t->wakeups.empty();
+    t->wakeups.push_back(client);
+    pthread_mutex_unlock(&t->mutex);
+
+    if (first)
+    {
+      u_int64_t one = 1;
+      if (write(t->wakeupFd, &one, sizeof(one)) < 0) { } // already signaled if full
+    }
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::schedule(WebSocketClient *client)
+  {
+    client->retain();
+    pthread_mutex_lock(&engine_mutex);
+    readyClients.push(client);
+    pthread_cond_signal(&workers_cond);
+    pthread_mutex_unlock(&engine_mutex);
+  }
+
+  /***********************************************************************/
+  /**
+  * updateEvents - watch the socket for reading unless the callbacks are
+  *                late, and for writing while a message is blocked
+  * \return false if the socket can't be watched
+  */
+
+  bool WebSocketEngine::updateEvents(IoThread *t, WebSocketClient *client)
+  {
+    u_int32_t events = (client->readingStopped ? 0 : WEBSOCKETENGINE_READ)
+                     | (client->sendingCount ? WEBSOCKETENGINE_WRITE : 0);
+
+    if (client->registered && events == client->events)
+      return true;
+
+#ifndef NVJ_WEBSOCKET_USE_POLL
+    struct epoll_event ev;
+    ev.events = ((events & WEBSOCKETENGINE_READ) ? (u_int32_t)EPOLLIN : 0) | ((events & WEBSOCKETENGINE_WRITE) ? (u_int32_t)EPOLLOUT : 0);
+    ev.data.ptr = client;
+    if (epoll_ctl(t->epollFd, client->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                  client->getHttpRequest()->getClientSockData()->socketId, &ev) != 0)
+      return false;
+#endif
+
+    if (!client->registered)
+    {
+      client->registered = true;
+      t->clients.insert(client);
+    }
+    client->events = events;
+    return true;
+  }
+
+  /***********************************************************************/
+  /**
+  * closeConnection - stop watching the connection and drop its reference
+  *                   once the current events are processed (I/O thread)
+  */
+
+  void WebSocketEngine::closeConnection(IoThread *t, WebSocketClient *client, std::vector<WebSocketClient *>& released)
+  {
+    if (client->disconnected)
+      return;
+
+    if (client->registered)
+    {
+#ifndef NVJ_WEBSOCKET_USE_POLL
+      struct epoll_event ev;
+      epoll_ctl(t->epollFd, EPOLL_CTL_DEL, client->getHttpRequest()->getClientSockData()->socketId, &ev);
+#endif
+      t->clients.erase(client);
+      client->registered = false;
+    }
+
+    client->disconnect();
+    released.push_back(client);
+  }
+
+  /***********************************************************************/
+  /**
+  * processWakeup - register a new connection, flush its sending queue,
+  *                 resume its reading or close it (I/O thread)
+  */
+
+  void WebSocketEngine::processWakeup(IoThread *t, WebSocketClient *client, char *buffer, const unsigned long long now,
+                                      std::vector<WebSocketClient *>& released)
+  {
+    client->wakeupPending = false;
+
+    if (client->disconnected)
+      return;
+
+    // a new connection may come with bytes already read, a resumed one
+    // with bytes left in the buffers: they won't be notified by the socket
+    bool read = !client->registered || (client->readingStopped && !client->readingPaused);
+
+    if ( client->mustClose()
+      || (read && !client->readInput(buffer, WEBSOCKETENGINE_BUFSIZE))
+      || !client->writeOutput(now, buffer, WEBSOCKETENGINE_BUFSIZE)
+      || client->mustClose()
+      || !updateEvents(t, client) )
+      closeConnection(t, client, released);
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::ioThreadProcessing(IoThread *t)
+  {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    char buffer[WEBSOCKETENGINE_BUFSIZE];
+    std::vector<WebSocketClient *> wakeups, released, late;
+    std::vector< std::pair<WebSocketClient *, u_int32_t> > ready;
+    unsigned long long lastSweep = nvj_monotonic_ms();
+
+#ifndef NVJ_WEBSOCKET_USE_POLL
+    struct epoll_event events[WEBSOCKETENGINE_MAX_EVENTS];
+#else
+    std::vector<struct pollfd> pfds;
+    std::vector<WebSocketClient *> polled;
+#endif
+
+    while (!exiting)
+    {
+      ready.clear();
+
+#ifndef NVJ_WEBSOCKET_USE_POLL
+      int n = epoll_wait(t->epollFd, events, WEBSOCKETENGINE_MAX_EVENTS, WEBSOCKETENGINE_SWEEP_INTERVAL);
+      for (int i=0; i<n; i++)
+        ready.push_back(std::make_pair(static_cast<WebSocketClient *>(events[i].data.ptr),
+                                       ((events[i].events & EPOLLIN) ? WEBSOCKETENGINE_READ : 0)
+                                       | ((events[i].events & EPOLLOUT) ? WEBSOCKETENGINE_WRITE : 0)
+                                       | ((events[i].events & (EPOLLHUP | EPOLLERR)) ? WEBSOCKETENGINE_HANGUP : 0)));
+#else
+      pfds.resize(1);
+      polled.resize(1);
+      pfds[0].fd = t->eventFd;
+      pfds[0].events = POLLIN;
+      polled[0] = NULL;
+      for (std::unordered_set<WebSocketClient *>::iterator it = t->clients.begin(); it != t->clients.end(); it++)
+      {
+        // POLLHUP would be reported again and again while reading is stopped
+        if (!(*it)->events)
+          continue;
+        struct pollfd pfd;
+        pfd.fd = (*it)->getHttpRequest()->getClientSockData()->socketId;
+        pfd.events = (((*it)->events & WEBSOCKETENGINE_READ) ? POLLIN : 0) | (((*it)->events & WEBSOCKETENGINE_WRITE) ? POLLOUT : 0);
+        pfds.push_back(pfd);
+        polled.push_back(*it);
+      }
+      int n = poll(&pfds[0], pfds.size(), WEBSOCKETENGINE_SWEEP_INTERVAL);
+      for (size_t i=0; n > 0 && i<pfds.size(); i++)
+        if (pfds[i].revents)
+          ready.push_back(std::make_pair(polled[i],
+                                         ((pfds[i].revents & POLLIN) ? WEBSOCKETENGINE_READ : 0)
+                                         | ((pfds[i].revents & POLLOUT) ? WEBSOCKETENGINE_WRITE : 0)
+                                         | ((pfds[i].revents & (POLLHUP | POLLERR | POLLNVAL)) ? WEBSOCKETENGINE_HANGUP : 0)));
+#endif
+
+      if (n < 0 && errno != EINTR)
+      {
+        NVJ_LOG->append(NVJ_ERROR, "WebSocketEngine: wait failed");
+        usleep(1000);
+      }
+
+      unsigned long long now = nvj_monotonic_ms();
+
+      for (size_t i=0; i<ready.size(); i++)
+      {
+        WebSocketClient *client = ready[i].first;
+
+        if (client == NULL)
+        {
+          u_int64_t count;
+          while (read(t->eventFd, &count, sizeof(count)) > 0) { }
+
+          pthread_mutex_lock(&t->mutex);
+          wakeups.swap(t->wakeups);
+          pthread_mutex_unlock(&t->mutex);
+
+          for (size_t j=0; j<wakeups.size(); j++)
+          {
+            processWakeup(t, wakeups[j], buffer, now, released);
+            released.push_back(wakeups[j]); // the reference of the wakeup
+          }
+          wakeups.clear();
+          continue;
+        }
+
+        // closed by a previous event
+        if (client->disconnected)
+          continue;
+
+        // a hang up or an error: the bytes left are read, up to the end of
+        // the stream; without reading (stopped), it is closed at once
+        u_int32_t ev = ready[i].second;
+        if (ev & WEBSOCKETENGINE_HANGUP)
+        {
+          if (!(client->events & WEBSOCKETENGINE_READ))
+          {
+            closeConnection(t, client, released);
+            continue;
+          }
+          ev |= WEBSOCKETENGINE_READ;
+        }
+
+        if ( ((ev & WEBSOCKETENGINE_READ) && !client->readInput(buffer, WEBSOCKETENGINE_BUFSIZE))
+          || ((ev & WEBSOCKETENGINE_WRITE) && !client->writeOutput(now, buffer, WEBSOCKETENGINE_BUFSIZE))
+          || client->mustClose()
+          || !updateEvents(t, client) )
+          closeConnection(t, client, released);
+      }
+
+      if (now - lastSweep >= WEBSOCKETENGINE_SWEEP_INTERVAL)
+      {
+        lastSweep = now;
+        for (std::unordered_set<WebSocketClient *>::iterator it = t->clients.begin(); it != t->clients.end(); it++)
+          if ((*it)->isSendingLate(now))
+            late.push_back(*it);
+        for (size_t i=0; i<late.size(); i++)
+        {
+          NVJ_LOG->append(NVJ_DEBUG, "WebSocket: the client doesn't read its messages, connection closed");
+          closeConnection(t, late[i], released);
+        }
+        late.clear();
+      }
+
+      for (size_t i=0; i<released.size(); i++)
+        released[i]->release();
+      released.clear();
+    }
+  }
+
+  /***********************************************************************/
+
+  void WebSocketEngine::workerThreadProcessing()
+  {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    pthread_mutex_lock(&engine_mutex);
+
+    for (;;)
+    {
+      while (readyClients.empty() && !exiting)
+        pthread_cond_wait(&workers_cond, &engine_mutex);
+
+      if (exiting) break;
+
+      WebSocketClient *client = readyClients.front();
+      readyClients.pop();
+      pthread_mutex_unlock(&engine_mutex);
+
+      try
+      {
+        client->dispatchMessages();
+      }
+      catch (std::exception& e)
+      {
+        NVJ_LOG->append(NVJ_ERROR, std::string("WebSocketEngine: a callback raised an exception: ") + e.what());
+      }
+      catch (...)
+      {
+        NVJ_LOG->append(NVJ_ERROR, "WebSocketEngine: a callback raised an unknown exception");
+      }
+      client->release();
+
+      pthread_mutex_lock(&engine_mutex);
+    }
+
+    pthread_mutex_unlock(&engine_mutex);
+  }
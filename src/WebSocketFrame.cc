@@ -0,0 +1,161 @@
+//********************************************************
+/**
+ * @file  WebSocketFrame.cc
+ *
+ * @brief A WebSocket frame encoded once and shared by the
+ *        sending queues of several clients
+ *
+ * @author T.Descombes (thierry.descombes@gmail.com)
+ *
+ * @version 1
+ * @date 18/10/26
+ */
+//********************************************************
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdexcept>
+#include <arpa/inet.h>
+
+#include "libnavajo/htonll.h"
+#include "libnavajo/nvjGzip.h"
+#include "libnavajo/nvjTime.h"
+#include "libnavajo/LogRecorder.hh"
+#include "libnavajo/WebSocketDeflate.hh"
+#include "libnavajo/WebSocketFrame.hh"
+
+#define WEBSOCKETFRAME_MAX_HEADER 10
+#define WEBSOCKETFRAME_DEFLATE_WINDOW_BITS 15  // the clients accepting shared frames use the largest window
+#define WEBSOCKETFRAME_DEFLATE_MEMLEVEL 8
+
+
+  /***********************************************************************/
+
+  WebSocketFrame::WebSocketFrame(): refCount(1), firstByte(0), data(NULL), length(0), headerLength(0),
+                                    zdata(NULL), zlength(0), zbuilt(false), date_ms(0)
+  {
+    pthread_mutex_init(&zmutex, NULL);
+  }
+
+  /***********************************************************************/
+
+  WebSocketFrame::~WebSocketFrame()
+  {
+    if (data != NULL) free(data);
+    if (zdata != NULL) free(zdata);
+    pthread_mutex_destroy(&zmutex);
+  }
+
+  /***********************************************************************/
+
+  void WebSocketFrame::release()
+  {
+    if (--refCount == 0)
+      delete this;
+  }
+
+  /***********************************************************************/
+  /**
+  * encodeHeader - write the frame header (server frames are not masked)
+  * \return the header length
+  */
+
+  size_t WebSocketFrame::encodeHeader(unsigned char *header, const u_int8_t firstByte, const size_t payloadLength)
+  {
+    header[0] = firstByte;
+    if (payloadLength < 126)
+    {
+      header[1] = payloadLength;
+      return 2;
+    }
+    if (payloadLength <= 0xFFFF)
+    {
+      header[1] = 126;
+      u_int16_t len = htons((u_int16_t)payloadLength);
+      memcpy(header+2, &len, 2);
+      return 4;
+    }
+    header[1] = 127;
+    u_int64_t len = htonll((u_int64_t)payloadLength);
+    memcpy(header+2, &len, 8);
+    return 10;
+  }
+
+  /***********************************************************************/
+
+  WebSocketFrame *WebSocketFrame::create(const u_int8_t opcode, const unsigned char *message, const size_t length, const bool fin)
+  {
+    WebSocketFrame *frame = new WebSocketFrame;
+    frame->firstByte = (fin ? 0x80 : 0x00) | (opcode & 0x0f);
+    frame->data = (unsigned char*) malloc ( WEBSOCKETFRAME_MAX_HEADER + length );
+    if (frame->data == NULL)
+    {
+      delete frame;
+      throw std::runtime_error("WebSocketFrame: allocation failed");
+    }
+    frame->headerLength = encodeHeader(frame->data, frame->firstByte, length);
+    if (length)
+      memcpy(frame->data + frame->headerLength, message, length);
+    frame->length = frame->headerLength + length;
+    frame->date_ms = nvj_monotonic_ms();
+    return frame;
+  }
+
+  /***********************************************************************/
+
+  const unsigned char *WebSocketFrame::getCompressedData(size_t& len)
+  {
+    if (!zbuilt)
+    {
+      pthread_mutex_lock(&zmutex);
+      // control frames and fragments are never compressed
+      size_t payloadLength = length - headerLength;
+      const size_t memoryCost = WebSocketDeflateParams::getDeflateMemoryCost(WEBSOCKETFRAME_DEFLATE_WINDOW_BITS,
+                                                                              WEBSOCKETFRAME_DEFLATE_MEMLEVEL);
+      if (!zbuilt && (firstByte & 0x80) && ((firstByte & 0x0f) == 0x1 || (firstByte & 0x0f) == 0x2) && payloadLength
+          && WebSocketDeflateParams::reserveMemory(memoryCost))
+      {
+        z_stream strm;
+        unsigned char *payload = NULL;
+        try
+        {
+          // a stream of its own: no context takeover
+          nvj_init_stream(&strm, true, Z_BEST_COMPRESSION, Z_DEFAULT_STRATEGY,
+                          WEBSOCKETFRAME_DEFLATE_WINDOW_BITS, WEBSOCKETFRAME_DEFLATE_MEMLEVEL);
+          size_t payloadLen = 0;
+          try
+          {
+            payloadLen = nvj_gzip_websocket_v2(&payload, data + headerLength, payloadLength, &strm);
+          }
+          catch(...)
+          {
+            payload = NULL; // freed by nvj_gzip_websocket_v2()
+            nvj_end_stream(&strm);
+            throw;
+          }
+          nvj_end_stream(&strm);
+
+          if ((zdata = (unsigned char*) malloc ( WEBSOCKETFRAME_MAX_HEADER + payloadLen )) != NULL)
+          {
+            zlength = encodeHeader(zdata, firstByte | 0x40, payloadLen); // Set RSV1
+            memcpy(zdata + zlength, payload, payloadLen);
+            zlength += payloadLen;
+          }
+        }
+        catch(...)
+        {
+          NVJ_LOG->append(NVJ_ERROR, " Websocket: nvj_gzip raised an exception, frame sent uncompressed");
+        }
+        if (payload != NULL) free(payload);
+        WebSocketDeflateParams::releaseMemory(memoryCost);
+      }
+      zbuilt = true;
+      pthread_mutex_unlock(&zmutex);
+    }
+
+    if (zdata == NULL)
+      return getData(len);
+
+    len = zlength;
+    return zdata;
+  }